@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+
+extern "C" {
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+#include "Cgroup.hpp"
+#include "fileUtil.h"
+#include "logger.h"
+
+// How long to wait for the kernel to finish freezing or thawing
+static const int FREEZE_TIMEOUT_MSEC = 10000;
+
+Cgroup::Cgroup(const std::string& name)
+{
+	path = getMountPoint() + "/" + name;
+}
+
+const std::string& Cgroup::getMountPoint()
+{
+	static std::string mountPoint;
+	static bool initialized = false;
+
+	if (!initialized) {
+		// Hybrid systems mount the unified hierarchy below the v1 controllers
+		for (const char *candidate : { "/sys/fs/cgroup", "/sys/fs/cgroup/unified" }) {
+			if (FileUtil::checkExists(std::string(candidate) + "/cgroup.controllers")) {
+				mountPoint = candidate;
+				break;
+			}
+		}
+		initialized = true;
+	}
+	return mountPoint;
+}
+
+bool Cgroup::exists()
+{
+	return FileUtil::checkExists(path + "/cgroup.procs");
+}
+
+std::string Cgroup::readFile(const std::string& file)
+{
+	std::string result;
+	char buf[4096];
+
+	std::string filePath = path + "/" + file;
+	int fd = open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		log_errno("open(2) of %s", filePath.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+	for (;;) {
+		ssize_t bytes = read(fd, buf, sizeof(buf));
+		if (bytes < 0) {
+			int saved_errno = errno;
+			(void) close(fd);
+			throw std::system_error(saved_errno, std::system_category());
+		}
+		if (bytes == 0) {
+			break;
+		}
+		result.append(buf, bytes);
+	}
+	(void) close(fd);
+	return result;
+}
+
+void Cgroup::writeFile(const std::string& file, const std::string& value)
+{
+	std::string filePath = path + "/" + file;
+	int fd = open(filePath.c_str(), O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		log_errno("open(2) of %s", filePath.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+	if (write(fd, value.data(), value.length()) < (ssize_t) value.length()) {
+		int saved_errno = errno;
+		log_errno("write(2) to %s", filePath.c_str());
+		(void) close(fd);
+		throw std::system_error(saved_errno, std::system_category());
+	}
+	(void) close(fd);
+}
+
+// Return the value of <key> in a file of "key value" lines
+static std::string lookupKey(const std::string& text, const std::string& key)
+{
+	std::istringstream iss(text);
+	std::string line;
+	while (std::getline(iss, line)) {
+		if (line.compare(0, key.length() + 1, key + " ") == 0) {
+			return line.substr(key.length() + 1);
+		}
+	}
+	return "";
+}
+
+void Cgroup::create()
+{
+	if (!isSupported()) {
+		throw std::runtime_error("cgroup v2 is not available");
+	}
+
+	size_t pos = getMountPoint().length();
+	while (pos != std::string::npos) {
+		pos = path.find('/', pos + 1);
+		std::string dir = path.substr(0, pos);
+		if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+			log_errno("mkdir(2) of %s", dir.c_str());
+			throw std::system_error(errno, std::system_category());
+		}
+	}
+}
+
+bool Cgroup::destroy()
+{
+	if (rmdir(path.c_str()) < 0) {
+		if (errno == ENOENT) {
+			return true;
+		}
+		if (errno == EBUSY) {
+			return false;
+		}
+		log_errno("rmdir(2) of %s", path.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+	return true;
+}
+
+void Cgroup::attach(pid_t pid)
+{
+	writeFile("cgroup.procs", std::to_string(pid));
+}
+
+bool Cgroup::isFrozen()
+{
+	return lookupKey(readFile("cgroup.events"), "frozen") == "1";
+}
+
+int64_t Cgroup::setFrozen(bool frozen)
+{
+	auto begin = std::chrono::steady_clock::now();
+	const char *want = frozen ? "1" : "0";
+
+	writeFile("cgroup.freeze", want);
+
+	// The kernel signals changes to cgroup.events with POLLPRI
+	std::string eventsPath = path + "/cgroup.events";
+	int fd = open(eventsPath.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		throw std::system_error(errno, std::system_category());
+	}
+	int waited = 0;
+	for (;;) {
+		char buf[512];
+		ssize_t bytes = pread(fd, buf, sizeof(buf) - 1, 0);
+		if (bytes < 0) {
+			int saved_errno = errno;
+			(void) close(fd);
+			throw std::system_error(saved_errno, std::system_category());
+		}
+		buf[bytes] = '\0';
+		if (lookupKey(buf, "frozen") == want) {
+			break;
+		}
+		if (waited >= FREEZE_TIMEOUT_MSEC) {
+			(void) close(fd);
+			throw std::runtime_error("timed out waiting for " + path + " to " + (frozen ? "freeze" : "thaw"));
+		}
+		struct pollfd pfd = { fd, POLLPRI, 0 };
+		(void) poll(&pfd, 1, 100);
+		waited += 100;
+	}
+	(void) close(fd);
+
+	auto elapsed = std::chrono::steady_clock::now() - begin;
+	return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+}
+
+int64_t Cgroup::freeze()
+{
+	return setFrozen(true);
+}
+
+int64_t Cgroup::thaw()
+{
+	return setFrozen(false);
+}
+
+uint64_t Cgroup::getCpuUsage()
+{
+	return std::strtoull(lookupKey(readFile("cpu.stat"), "usage_usec").c_str(), NULL, 10);
+}
+
+double Cgroup::getCpuPressure()
+{
+	// Format: "some avg10=0.00 avg60=0.00 avg300=0.00 total=0"
+	std::string some = lookupKey(readFile("cpu.pressure"), "some");
+	size_t pos = some.find("avg10=");
+	if (pos == std::string::npos) {
+		return 0;
+	}
+	return std::strtod(some.c_str() + pos + 6, NULL);
+}
+
+int Cgroup::openPressureTrigger(unsigned int stallUsec, unsigned int windowUsec)
+{
+	std::string pressurePath = path + "/cpu.pressure";
+	int fd = open(pressurePath.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		log_debug("pressure information not available for %s", path.c_str());
+		return -1;
+	}
+	std::string trigger = "some " + std::to_string(stallUsec) + " " + std::to_string(windowUsec);
+	if (write(fd, trigger.c_str(), trigger.length() + 1) < 0) {
+		log_errno("unable to set PSI trigger on %s", pressurePath.c_str());
+		(void) close(fd);
+		return -1;
+	}
+	return fd;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+extern "C" {
+#include <sys/types.h>
+}
+
+// A cgroup in the cgroup v2 (unified) hierarchy.
+//
+// Only core cgroup files are used (cgroup.procs, cgroup.freeze,
+// cgroup.events, cpu.stat and cpu.pressure), so no controllers need
+// to be enabled in the parent.
+class Cgroup {
+public:
+	// <name> is relative to the root of the unified hierarchy
+	Cgroup(const std::string& name);
+
+	// Find where the unified hierarchy is mounted. Returns "" if there
+	// is no cgroup v2 support on this host.
+	static const std::string& getMountPoint();
+
+	static bool isSupported() {
+		return getMountPoint() != "";
+	}
+
+	const std::string& getPath() const {
+		return path;
+	}
+
+	bool exists();
+
+	// Create the cgroup and any missing parents
+	void create();
+
+	// Remove the cgroup. Returns false if it still has processes.
+	bool destroy();
+
+	// Move a process into the cgroup
+	void attach(pid_t pid);
+
+	// Freeze or thaw every process in the cgroup, and wait until the
+	// kernel reports the change as complete. Returns the time this took,
+	// in microseconds.
+	int64_t freeze();
+	int64_t thaw();
+
+	bool isFrozen();
+
+	// Total CPU time used by the cgroup, in microseconds
+	uint64_t getCpuUsage();
+
+	// The percentage of the last 10 seconds in which some process in the
+	// cgroup was waiting for a CPU
+	double getCpuPressure();
+
+	// Open a PSI trigger that becomes readable (POLLPRI) whenever
+	// processes in the cgroup stall for <stallUsec> within <windowUsec>.
+	// Returns -1 if pressure information is not available.
+	int openPressureTrigger(unsigned int stallUsec, unsigned int windowUsec);
+
+private:
+	std::string path;
+
+	std::string readFile(const std::string& file);
+	void writeFile(const std::string& file, const std::string& value);
+	int64_t setFrozen(bool frozen);
+};
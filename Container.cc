@@ -14,9 +14,12 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <memory>
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <stdexcept>
+#include <system_error>
 
 #ifdef __linux__
 #include "LinuxJail.hpp"
@@ -33,18 +36,40 @@
 #include "logger.h"
 #include "MountUtil.hpp"
 
-Container* Container::create(const std::string& chrootDir)
+std::unique_ptr<Container> Container::create(const std::string& chrootDir)
 {
-	Container* c;
+	std::unique_ptr<Container> c;
 #ifdef __linux__
-	c = new LinuxJail;
+	c.reset(new LinuxJail);
 #elif __FreeBSD__
-	c = new FreeBSDJail;
+	c.reset(new FreeBSDJail);
 #else
 #error Unsupported OS
 #endif
 	c->chrootDir = chrootDir;
-	return (c);
+	return c;
+}
+
+void Container::suspend(const std::string& imageDir)
+{
+	(void) imageDir;
+	throw std::runtime_error("suspend is not supported on this platform");
+}
+
+void Container::resume(const std::string& imageDir)
+{
+	(void) imageDir;
+	throw std::runtime_error("resume is not supported on this platform");
+}
+
+int64_t Container::freeze()
+{
+	throw std::runtime_error("freeze is not supported on this platform");
+}
+
+int64_t Container::thaw()
+{
+	throw std::runtime_error("thaw is not supported on this platform");
 }
 
 void Container::runMainHook()
@@ -72,7 +97,10 @@ void Container::killInit()
 	SetuidHelper::raisePrivileges();
 	log_debug("sending SIGTERM to pid %zu", (unsigned long)pid);
 	if (kill(pid, SIGTERM) < 0) {
-		err(1, "kill of %zu", (unsigned long) pid);
+		int saved_errno = errno;
+		log_errno("kill of %zu", (unsigned long) pid);
+		SetuidHelper::lowerPrivileges();
+		throw std::system_error(saved_errno, std::system_category());
 	}
 	SetuidHelper::lowerPrivileges();
 }
@@ -94,7 +122,8 @@ bool Container::checkInitPidValid()
 		if (errno == ESRCH) {
 			return false;
 		} else {
-			err(1, "kill of %zu", (unsigned long) pid);
+			log_errno("kill of %zu", (unsigned long) pid);
+			throw std::system_error(errno, std::system_category());
 		}
 	}
 	// TODO: need to also verify this is a legit room init process,
@@ -104,16 +133,24 @@ bool Container::checkInitPidValid()
 
 void Container::mkdir_p(const string& path, mode_t mode, uid_t uid, gid_t gid)
 { 
+	log_flush();
 	pid_t pid = fork();
 
-	if (pid < 0)
-		err(1, "fork()");
+	if (pid < 0) {
+		log_errno("fork(2)");
+		throw std::system_error(errno, std::system_category());
+	}
 
 	if (pid > 0) {
 		int status;
-		wait(&status);
-		if (!WIFEXITED(status) || WEXITSTATUS(status)) 
-			errx(1, "mkdir_p of %s failed with status %d", path.c_str(), WEXITSTATUS(status));
+		if (waitpid(pid, &status, 0) < 0) {
+			log_errno("waitpid(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			throw std::runtime_error("mkdir_p of " + path + " failed with status " +
+					std::to_string(WEXITSTATUS(status)));
+		}
 	} else {
 
 		SetuidHelper::raisePrivileges();
@@ -164,7 +201,10 @@ void Container::mount_into(const string& src, const string& relativeTarget)
 	SetuidHelper::raisePrivileges();
 #ifdef __linux__
 	if (::mount(src.c_str(), target.c_str(), NULL, MS_BIND, NULL) < 0) {
-		err(1, "mount(2) of %s", src.c_str());
+		int saved_errno = errno;
+		log_errno("mount(2) of %s", src.c_str());
+		SetuidHelper::lowerPrivileges();
+		throw std::system_error(saved_errno, std::system_category());
 	}
 #elif defined(__FreeBSD__)
 	char *c_fspath = strdup(target.c_str());
@@ -182,7 +222,10 @@ void Container::mount_into(const string& src, const string& relativeTarget)
     free(c_src);
 
     if (rv < 0) {
-		err(1, "mount(2) of %s", src.c_str());
+		int saved_errno = errno;
+		log_errno("mount(2) of %s", src.c_str());
+		SetuidHelper::lowerPrivileges();
+		throw std::system_error(saved_errno, std::system_category());
 	}
 #else
 #error Unsupported OS
@@ -200,7 +243,10 @@ void Container::unmount(const string& relativePath) {
 #else
 	if (::unmount(path.c_str(), 0) < 0) {
 #endif
-		err(1, "unmount(2) of `%s'", path.c_str());
+		int saved_errno = errno;
+		log_errno("unmount(2) of `%s'", path.c_str());
+		SetuidHelper::lowerPrivileges();
+		throw std::system_error(saved_errno, std::system_category());
 	}
 	SetuidHelper::lowerPrivileges();
 }
@@ -16,6 +16,8 @@
 
 #pragma once
 
+#include <cstdint>
+#include <memory>
 #include <string>
 
 #include <sys/types.h>
@@ -31,13 +33,64 @@ public:
 	virtual void unmountAll() = 0;
 	virtual void mountAll() = 0;
 	virtual void unpack(const std::string& archivePath) = 0;
+
+	// Checkpoint the processes in the container to <imageDir> and stop
+	// them, or restore them from there. Not every platform supports this.
+	virtual void suspend(const std::string& imageDir);
+	virtual void resume(const std::string& imageDir);
+
+	// Freeze or thaw every process in the container, and return the time
+	// it took in microseconds. Not every platform supports this.
+	virtual int64_t freeze();
+	virtual int64_t thaw();
+	virtual bool isFrozen() {
+		return false;
+	}
+
+	// Move the calling process into the cgroup of the container. Call this
+	// after enter(), in the child process that will run a command.
+	virtual void joinCgroup() {}
+
+	// Give back anything reserved for the container, when it is destroyed.
+	// Must be called with privileges raised.
+	virtual void release() {}
+
+	// The uid_map and gid_map to give the init process, or "" if the
+	// platform has none. Must be called with privileges raised.
+	virtual std::string getIdMap(uid_t ownerUid) {
+		return "";
+	}
+
+	// Open a user namespace whose root is the room's root, as its files are
+	// stored on disk, for running tools such as tar(1) over them. Returns -1
+	// if the files already carry the room's own ids, as with idmapped rooms.
+	// Must be called with privileges raised.
+	virtual int openStorageNamespace(uid_t ownerUid) {
+		return -1;
+	}
+
+	// Use <idMap> instead of working it out again, e.g. from a launch plan
+	void setIdMap(const std::string& idMap) {
+		this->idMap = idMap;
+	}
 	static void runMainHook();
-	static Container* create(const std::string& chrootDir);
+	// Destroying the container object leaves the container itself alone
+	virtual ~Container() {}
+	static std::unique_ptr<Container> create(const std::string& chrootDir);
 
 	void setInitPidfilePath(const std::string& initPidfilePath) {
 		this->initPidfilePath = initPidfilePath;
 	}
 
+	void setCgroupName(const std::string& cgroupName) {
+		this->cgroupName = cgroupName;
+	}
+
+	// Give the container a network stack of its own, instead of the host's
+	void setPrivateNetwork(bool privateNetwork) {
+		this->privateNetwork = privateNetwork;
+	}
+
 	void setHostname(const std::string& hostname) {
 		// TODO: validation
 		this->hostname = hostname;
@@ -61,8 +114,14 @@ public:
 	// PID of the init(1) process
 	pid_t initPid = 0;
 
+	// cgroup holding the processes in the container, relative to
+	// the root of the cgroup hierarchy
+	std::string cgroupName;
+
 //TODO: once getters are created: 
 //private:
 	std::string hostname;
+	bool privateNetwork = false;
+	std::string idMap;
 
 };
@@ -0,0 +1,691 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#endif
+}
+
+#include "DiskUsage.hpp"
+#include "fileUtil.h"
+#include "logger.h"
+#include "MountUtil.hpp"
+#include "shell.h"
+
+std::string DiskUsage::formatBytes(uint64_t bytes)
+{
+	static const char units[] = "BKMGTPE";
+	double value = bytes;
+	unsigned int unit = 0;
+	while (value >= 1024 && unit < sizeof(units) - 2) {
+		value /= 1024;
+		unit++;
+	}
+
+	std::ostringstream oss;
+	oss.setf(std::ios::fixed);
+	oss.precision((unit > 0 && value < 10) ? 1 : 0);
+	oss << value << units[unit];
+	return oss.str();
+}
+
+std::map<std::string, std::vector<DiskUsage::Usage>> DiskUsage::measureZfs(const std::string& userDataset)
+{
+	std::map<std::string, std::vector<Usage>> result;
+
+	int status;
+	std::string output;
+	Shell::execute("/sbin/zfs", {
+			"list", "-H", "-p", "-r", "-t", "filesystem,snapshot",
+			"-o", "name,used,referenced,usedbydataset", userDataset }, status, output);
+	if (status != 0) {
+		throw std::runtime_error("unable to get the space used by " + userDataset);
+	}
+
+	// Each line is "<userDataset>/<room>[/share[@<snapshot>]]" and the values
+	std::istringstream lines(output);
+	std::string line;
+	while (std::getline(lines, line)) {
+		std::istringstream fields(line);
+		std::string name, used, referenced, usedByDataset;
+		if (!(fields >> name >> used >> referenced >> usedByDataset) ||
+				name.compare(0, userDataset.length() + 1, userDataset + "/") != 0) {
+			continue;
+		}
+		name = name.substr(userDataset.length() + 1);
+		std::string room = name.substr(0, name.find_first_of("/@"));
+		if (room.empty() || room[0] == '.') {
+			continue; // the trash
+		}
+
+		std::vector<Usage>& usage = result[room];
+		if (usage.empty()) {
+			usage.push_back(Usage());
+		}
+		if (name == room) {
+			usage[0].used = std::stoull(used);
+			usage[0].reclaimable = usage[0].used;
+		} else if (name == room + "/share") {
+			usage[0].referenced = std::stoull(referenced);
+			usage[0].unique = std::stoull(usedByDataset);
+		} else if (name.compare(0, room.length() + 7, room + "/share@") == 0) {
+			Usage snapshot;
+			snapshot.snapshot = name.substr(room.length() + 7);
+			snapshot.used = std::stoull(used);
+			snapshot.referenced = std::stoull(referenced);
+			snapshot.unique = snapshot.used;
+			snapshot.reclaimable = snapshot.used;
+			usage.push_back(snapshot);
+		}
+	}
+	return result;
+}
+
+#ifdef __linux__
+
+// Bump this whenever the format of du.cache changes
+static const uint32_t CACHE_VERSION = 1;
+static const char CACHE_MAGIC[4] = { 'R', 'M', 'D', 'U' };
+static const char CACHE_NAME[] = "du.cache";
+
+namespace {
+
+struct InodeKey {
+	uint64_t dev;
+	uint64_t ino;
+
+	bool operator<(const InodeKey& other) const {
+		return (dev < other.dev) || (dev == other.dev && ino < other.ino);
+	}
+};
+
+struct LinkedInode {
+	uint64_t allocated;
+	uint64_t exclusive;
+	uint32_t nlink;
+	uint32_t links; // how many were found
+};
+
+struct Extent {
+	uint64_t physical;
+	uint64_t length;
+};
+
+// What was found in the room's own files, or in one snapshot
+struct TreeUsage {
+	uint64_t allocated = 0; // by files with one link
+	uint64_t exclusive = 0; // the part of <allocated> that no other file shares
+	std::map<InodeKey, LinkedInode> linked; // files with more than one link
+	std::vector<Extent> shared; // extents that other files share
+
+	void merge(const TreeUsage& other) {
+		allocated += other.allocated;
+		exclusive += other.exclusive;
+		for (auto& it : other.linked) {
+			auto found = linked.find(it.first);
+			if (found == linked.end()) {
+				linked.insert(it);
+			} else {
+				found->second.links += it.second.links;
+			}
+		}
+		shared.insert(shared.end(), other.shared.begin(), other.shared.end());
+	}
+};
+
+// Identifies a snapshot directory in the cache
+struct TreeKey {
+	uint64_t dev = 0;
+	uint64_t ino = 0;
+	int64_t mtimeSec = 0;
+	uint64_t mtimeNsec = 0;
+
+	bool operator==(const TreeKey& other) const {
+		return dev == other.dev && ino == other.ino &&
+				mtimeSec == other.mtimeSec && mtimeNsec == other.mtimeNsec;
+	}
+};
+
+struct CacheEntry {
+	TreeKey key;
+	TreeUsage usage;
+};
+
+// The size of the extents of the file <name> that other files share,
+// which are added to <extents>
+uint64_t findSharedExtents(int dirfd, const char *name, std::vector<Extent>& extents)
+{
+	int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		return 0;
+	}
+
+	const unsigned int count = 128;
+	std::vector<char> buf(sizeof(struct fiemap) + count * sizeof(struct fiemap_extent));
+	struct fiemap *fm = reinterpret_cast<struct fiemap *>(buf.data());
+	uint64_t start = 0, shared = 0;
+	bool last = false;
+	while (!last) {
+		memset(buf.data(), 0, buf.size());
+		fm->fm_start = start;
+		fm->fm_length = FIEMAP_MAX_OFFSET - start;
+		fm->fm_extent_count = count;
+		if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0 || fm->fm_mapped_extents == 0) {
+			break;
+		}
+		for (unsigned int i = 0; i < fm->fm_mapped_extents; i++) {
+			const struct fiemap_extent& fe = fm->fm_extents[i];
+			if ((fe.fe_flags & FIEMAP_EXTENT_SHARED) && !(fe.fe_flags & FIEMAP_EXTENT_UNKNOWN)) {
+				shared += fe.fe_length;
+				extents.push_back({ fe.fe_physical, fe.fe_length });
+			}
+			if (fe.fe_flags & FIEMAP_EXTENT_LAST) {
+				last = true;
+			}
+			start = fe.fe_logical + fe.fe_length;
+		}
+	}
+	(void) close(fd);
+	return shared;
+}
+
+// The total size of <extents>, counting overlaps once
+uint64_t extentUnion(std::vector<Extent>& extents)
+{
+	std::sort(extents.begin(), extents.end(), [](const Extent& a, const Extent& b) {
+		return a.physical < b.physical;
+	});
+
+	uint64_t total = 0, end = 0;
+	for (auto& extent : extents) {
+		uint64_t extentEnd = extent.physical + extent.length;
+		if (extent.physical >= end) {
+			total += extent.length;
+		} else if (extentEnd > end) {
+			total += extentEnd - end;
+		}
+		end = std::max(end, extentEnd);
+	}
+	return total;
+}
+
+// Walks several trees below one directory, with a pool of threads that
+// take directories from a shared queue
+class TreeWalker {
+public:
+	// If <mountId> is not zero, don't go into anything mounted below <rootFd>
+	TreeWalker(int rootFd, bool findShared, uint64_t mountId)
+		: rootFd(rootFd), findShared(findShared), mountId(mountId) {}
+
+	// Returns the usage of each tree, in the order of <roots>
+	std::vector<TreeUsage> walk(const std::vector<std::string>& roots);
+
+private:
+	// A directory that stays open while its subdirectories are queued
+	struct Directory {
+		int fd;
+		~Directory() {
+			(void) close(fd);
+		}
+	};
+
+	struct Task {
+		size_t tree;
+		std::string path;
+		std::shared_ptr<Directory> parent; // null for the top of a tree
+		std::string name; // in <parent>
+	};
+
+	int rootFd;
+	bool findShared;
+	uint64_t mountId;
+	std::mutex mutex; // protects <queue> and <busy>
+	std::condition_variable cond;
+	std::deque<Task> queue;
+	unsigned int busy = 0;
+
+	void work(std::vector<TreeUsage>& usage);
+	void walkDirectory(const Task& task, std::vector<TreeUsage>& usage);
+};
+
+std::vector<TreeUsage> TreeWalker::walk(const std::vector<std::string>& roots)
+{
+	for (size_t i = 0; i < roots.size(); i++) {
+		queue.push_back({ i, roots[i], nullptr, "" });
+	}
+
+	unsigned int count = std::max(1U, std::thread::hardware_concurrency());
+	std::vector<std::vector<TreeUsage>> results(count, std::vector<TreeUsage>(roots.size()));
+	std::vector<std::thread> threads;
+	for (unsigned int i = 0; i < count; i++) {
+		threads.emplace_back(&TreeWalker::work, this, std::ref(results[i]));
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+
+	std::vector<TreeUsage> usage(roots.size());
+	for (auto& result : results) {
+		for (size_t i = 0; i < roots.size(); i++) {
+			usage[i].merge(result[i]);
+		}
+	}
+	return usage;
+}
+
+void TreeWalker::work(std::vector<TreeUsage>& usage)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;) {
+		cond.wait(lock, [this]() { return !queue.empty() || busy == 0; });
+		if (queue.empty()) {
+			return;
+		}
+		// Depth first, so that few parent directories are open at once
+		Task task = std::move(queue.back());
+		queue.pop_back();
+		busy++;
+
+		lock.unlock();
+		walkDirectory(task, usage);
+		task.parent.reset();
+		lock.lock();
+
+		busy--;
+		if (busy == 0 && queue.empty()) {
+			cond.notify_all();
+		}
+	}
+}
+
+void TreeWalker::walkDirectory(const Task& task, std::vector<TreeUsage>& usage)
+{
+	// Subdirectories are opened from their parent, so that no symlink is
+	// followed along the way
+	int dirfd;
+	if (task.parent) {
+		dirfd = openat(task.parent->fd, task.name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	} else {
+		dirfd = FileUtil::openBeneath(rootFd, task.path);
+	}
+	if (dirfd < 0) {
+		log_warning("unable to open %s: %s", task.path.c_str(), strerror(errno));
+		return;
+	}
+	auto self = std::make_shared<Directory>();
+	self->fd = dirfd;
+
+	// fdopendir() takes over the descriptor, and the subdirectories need it
+	int dupfd = fcntl(dirfd, F_DUPFD_CLOEXEC, 0);
+	DIR *dir = dupfd < 0 ? NULL : fdopendir(dupfd);
+	if (dir == NULL) {
+		log_warning("unable to read %s: %s", task.path.c_str(), strerror(errno));
+		if (dupfd >= 0) {
+			(void) close(dupfd);
+		}
+		return;
+	}
+
+	TreeUsage& tree = usage[task.tree];
+	std::vector<Task> subdirs;
+	struct dirent *dp;
+	while ((dp = readdir(dir)) != NULL) {
+		const char *name = dp->d_name;
+		if (!strcmp(name, ".") || !strcmp(name, "..")) {
+			continue;
+		}
+		// Snapshots are trees of their own
+		if (task.tree == 0 && task.path == "." && !strcmp(name, "tags")) {
+			continue;
+		}
+
+		struct statx stx;
+		if (statx(dirfd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+				STATX_TYPE | STATX_NLINK | STATX_INO | STATX_BLOCKS | STATX_MNT_ID, &stx) < 0) {
+			log_debug("unable to stat %s/%s: %s", task.path.c_str(), name, strerror(errno));
+			continue;
+		}
+		uint64_t allocated = stx.stx_blocks * 512;
+
+		if (S_ISDIR(stx.stx_mode)) {
+			if (mountId != 0 && (stx.stx_mask & STATX_MNT_ID) && stx.stx_mnt_id != mountId) {
+				continue;
+			}
+			tree.allocated += allocated;
+			tree.exclusive += allocated;
+			subdirs.push_back({ task.tree, task.path + "/" + name, self, name });
+			continue;
+		}
+
+		InodeKey key = { makedev(stx.stx_dev_major, stx.stx_dev_minor), stx.stx_ino };
+		if (stx.stx_nlink > 1) {
+			auto it = tree.linked.find(key);
+			if (it != tree.linked.end()) {
+				it->second.links++;
+				continue;
+			}
+		}
+
+		uint64_t exclusive = allocated;
+		if (findShared && S_ISREG(stx.stx_mode) && allocated > 0) {
+			exclusive -= std::min(allocated, findSharedExtents(dirfd, name, tree.shared));
+		}
+
+		if (stx.stx_nlink > 1) {
+			tree.linked[key] = { allocated, exclusive, stx.stx_nlink, 1 };
+		} else {
+			tree.allocated += allocated;
+			tree.exclusive += exclusive;
+		}
+	}
+	closedir(dir);
+
+	if (!subdirs.empty()) {
+		std::lock_guard<std::mutex> lock(mutex);
+		queue.insert(queue.end(), subdirs.begin(), subdirs.end());
+		cond.notify_all();
+	}
+}
+
+template <typename T>
+void put(std::string& buf, const T& val)
+{
+	buf.append(reinterpret_cast<const char *>(&val), sizeof(val));
+}
+
+// Reads back what put() wrote, and throws if the buffer ends too soon
+class CacheReader {
+public:
+	CacheReader(const std::string& buf) : buf(buf) {}
+
+	template <typename T>
+	T get() {
+		T val;
+		if (buf.length() - pos < sizeof(val)) {
+			throw std::runtime_error("truncated");
+		}
+		memcpy(&val, buf.data() + pos, sizeof(val));
+		pos += sizeof(val);
+		return val;
+	}
+
+	std::string getString(size_t len) {
+		if (buf.length() - pos < len) {
+			throw std::runtime_error("truncated");
+		}
+		std::string str = buf.substr(pos, len);
+		pos += len;
+		return str;
+	}
+
+	bool atEnd() const {
+		return pos == buf.length();
+	}
+
+private:
+	const std::string& buf;
+	size_t pos = 0;
+};
+
+// The cache is kept in etc/, which the room's owner controls, and is read
+// and written by root, so it is only reached through <etcFd> and never
+// through a symlink. O_NONBLOCK keeps a FIFO from blocking the open.
+std::map<std::string, CacheEntry> loadCache(int etcFd, const std::string& path)
+{
+	std::map<std::string, CacheEntry> cache;
+
+	int fd = openat(etcFd, CACHE_NAME, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+	if (fd < 0) {
+		return cache;
+	}
+	struct stat sb;
+	if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+		log_warning("ignoring %s: not a regular file", path.c_str());
+		(void) close(fd);
+		return cache;
+	}
+	std::string buf;
+	char chunk[65536];
+	ssize_t len;
+	while ((len = read(fd, chunk, sizeof(chunk))) > 0) {
+		buf.append(chunk, len);
+	}
+	(void) close(fd);
+
+	try {
+		CacheReader reader(buf);
+		if (reader.getString(sizeof(CACHE_MAGIC)) != std::string(CACHE_MAGIC, sizeof(CACHE_MAGIC)) ||
+				reader.get<uint32_t>() != CACHE_VERSION) {
+			return cache;
+		}
+		for (uint32_t i = reader.get<uint32_t>(); i > 0; i--) {
+			std::string name = reader.getString(reader.get<uint32_t>());
+			CacheEntry entry;
+			entry.key = reader.get<TreeKey>();
+			entry.usage.allocated = reader.get<uint64_t>();
+			entry.usage.exclusive = reader.get<uint64_t>();
+			for (uint64_t j = reader.get<uint64_t>(); j > 0; j--) {
+				InodeKey key = reader.get<InodeKey>();
+				entry.usage.linked[key] = reader.get<LinkedInode>();
+			}
+			for (uint64_t j = reader.get<uint64_t>(); j > 0; j--) {
+				entry.usage.shared.push_back(reader.get<Extent>());
+			}
+			cache[name] = entry;
+		}
+		if (!reader.atEnd()) {
+			throw std::runtime_error("trailing garbage");
+		}
+	} catch (const std::runtime_error& e) {
+		log_warning("ignoring %s: %s", path.c_str(), e.what());
+		cache.clear();
+	}
+	return cache;
+}
+
+void saveCache(int etcFd, const std::string& path, const std::map<std::string, CacheEntry>& cache)
+{
+	std::string buf(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	put(buf, CACHE_VERSION);
+	put(buf, (uint32_t) cache.size());
+	for (auto& it : cache) {
+		const TreeUsage& usage = it.second.usage;
+		put(buf, (uint32_t) it.first.length());
+		buf.append(it.first);
+		put(buf, it.second.key);
+		put(buf, usage.allocated);
+		put(buf, usage.exclusive);
+		put(buf, (uint64_t) usage.linked.size());
+		for (auto& linked : usage.linked) {
+			put(buf, linked.first);
+			put(buf, linked.second);
+		}
+		put(buf, (uint64_t) usage.shared.size());
+		for (auto& extent : usage.shared) {
+			put(buf, extent);
+		}
+	}
+
+	// It's only a cache, so failing to write it is not an error
+	std::string tmpName = std::string(CACHE_NAME) + ".new";
+	(void) unlinkat(etcFd, tmpName.c_str(), 0);
+	int fd = openat(etcFd, tmpName.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		log_warning("unable to create %s.new: %s", path.c_str(), strerror(errno));
+		return;
+	}
+	bool ok = (write(fd, buf.data(), buf.length()) == (ssize_t) buf.length());
+	ok = (close(fd) == 0) && ok;
+	if (!ok || renameat(etcFd, tmpName.c_str(), etcFd, CACHE_NAME) < 0) {
+		log_warning("unable to write %s", path.c_str());
+		(void) unlinkat(etcFd, tmpName.c_str(), 0);
+	}
+}
+
+} // namespace
+
+std::vector<DiskUsage::Usage> DiskUsage::measureDirectory(const std::string& roomDataDir,
+		const std::vector<std::string>& snapshots, bool findSharedExtents)
+{
+	uint64_t mountId;
+	int rootFd = MountUtil::openWithoutSubmounts(roomDataDir, mountId);
+
+	// Use the cached results for snapshots that have not changed
+	std::string cachePath = roomDataDir + "/etc/" + CACHE_NAME;
+	int etcFd = -1;
+	try {
+		etcFd = FileUtil::openDirectory(roomDataDir + "/etc");
+	} catch (const std::system_error& e) {
+		log_warning("not using %s: %s", cachePath.c_str(), e.what());
+	}
+	std::map<std::string, CacheEntry> cache;
+	if (etcFd >= 0) {
+		cache = loadCache(etcFd, cachePath);
+	}
+	std::map<std::string, CacheEntry> newCache;
+	std::vector<TreeUsage> trees(snapshots.size() + 1);
+	std::vector<std::string> roots = { "." };
+	std::vector<size_t> walked = { 0 };
+	for (size_t i = 0; i < snapshots.size(); i++) {
+		std::string path = "./tags/" + snapshots[i];
+		struct statx stx;
+		if (statx(rootFd, path.c_str(), AT_SYMLINK_NOFOLLOW, STATX_INO | STATX_MTIME, &stx) < 0) {
+			log_warning("unable to stat %s/%s: %s", roomDataDir.c_str(), path.c_str(), strerror(errno));
+			continue;
+		}
+		CacheEntry& entry = newCache[snapshots[i]];
+		entry.key.dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+		entry.key.ino = stx.stx_ino;
+		entry.key.mtimeSec = stx.stx_mtime.tv_sec;
+		entry.key.mtimeNsec = stx.stx_mtime.tv_nsec;
+
+		auto cached = cache.find(snapshots[i]);
+		if (cached != cache.end() && cached->second.key == entry.key) {
+			trees[i + 1] = cached->second.usage;
+		} else {
+			roots.push_back(path);
+			walked.push_back(i + 1);
+		}
+	}
+
+	std::vector<TreeUsage> results;
+	try {
+		results = TreeWalker(rootFd, findSharedExtents, mountId).walk(roots);
+	} catch (...) {
+		(void) close(rootFd);
+		if (etcFd >= 0) (void) close(etcFd);
+		throw;
+	}
+	(void) close(rootFd);
+	for (size_t i = 0; i < walked.size(); i++) {
+		trees[walked[i]] = results[i];
+	}
+
+	for (size_t i = 0; i < snapshots.size(); i++) {
+		auto it = newCache.find(snapshots[i]);
+		if (it != newCache.end()) {
+			it->second.usage = trees[i + 1];
+		}
+	}
+	if (etcFd >= 0) {
+		if (walked.size() > 1 || newCache.size() != cache.size()) {
+			saveCache(etcFd, cachePath, newCache);
+		}
+		(void) close(etcFd);
+	}
+
+	// Count the links to each file across the whole room
+	std::map<InodeKey, LinkedInode> roomLinked;
+	for (auto& tree : trees) {
+		for (auto& it : tree.linked) {
+			auto found = roomLinked.find(it.first);
+			if (found == roomLinked.end()) {
+				roomLinked.insert(it);
+			} else {
+				found->second.links += it.second.links;
+			}
+		}
+	}
+
+	std::vector<Usage> usage(trees.size());
+	uint64_t exclusive = 0, reclaimable = 0;
+	std::vector<Extent> shared;
+	for (size_t i = 0; i < trees.size(); i++) {
+		TreeUsage& tree = trees[i];
+		usage[i].referenced = tree.allocated;
+		usage[i].unique = tree.exclusive;
+		for (auto& it : tree.linked) {
+			usage[i].referenced += it.second.allocated;
+			if (it.second.links >= it.second.nlink) {
+				usage[i].unique += it.second.exclusive;
+			}
+		}
+		if (i > 0) {
+			usage[i].snapshot = snapshots[i - 1];
+			usage[i].used = usage[i].unique;
+			usage[i].reclaimable = usage[i].unique;
+		}
+		exclusive += tree.exclusive;
+		reclaimable += tree.exclusive;
+		shared.insert(shared.end(), tree.shared.begin(), tree.shared.end());
+	}
+	for (auto& it : roomLinked) {
+		exclusive += it.second.exclusive;
+		if (it.second.links >= it.second.nlink) {
+			reclaimable += it.second.exclusive;
+		}
+	}
+
+	// Shared extents are counted once in the space the room uses, but
+	// other rooms may share them, so they are not counted as reclaimable
+	usage[0].used = exclusive + extentUnion(shared);
+	usage[0].reclaimable = reclaimable;
+	return usage;
+}
+
+#else
+
+std::vector<DiskUsage::Usage> DiskUsage::measureDirectory(const std::string& roomDataDir,
+		const std::vector<std::string>& snapshots, bool findSharedExtents)
+{
+	(void) roomDataDir;
+	(void) snapshots;
+	(void) findSharedExtents;
+	throw std::runtime_error("measuring rooms that are not on ZFS is only supported on Linux");
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+// Works out how much space rooms and their snapshots use, for "room du".
+//
+// Rooms on ZFS are measured with one "zfs list" for all of a user's rooms.
+// Other rooms are measured by walking their files in parallel. Each inode
+// is counted once however many links it has, and on filesystems with
+// reflinks, extents that are shared with other files are counted once.
+// Snapshots don't change, so their results are cached in etc/du.cache,
+// keyed by the modification time of the snapshot directory.
+class DiskUsage {
+public:
+	struct Usage {
+		std::string snapshot; // empty for the room itself
+		uint64_t used = 0; // the room with its snapshots, or for a snapshot, the unique bytes
+		uint64_t referenced = 0; // the files that can be seen in the room or the snapshot
+		uint64_t unique = 0; // not shared with the room, other snapshots or other rooms
+		uint64_t reclaimable = 0; // freed by destroying it
+	};
+
+	// Measure the room in <roomDataDir>, whose snapshots are below tags/.
+	// Set <findSharedExtents> if snapshots are reflinked or btrfs
+	// snapshots. Privileges must be raised. The room comes first.
+	static std::vector<Usage> measureDirectory(const std::string& roomDataDir,
+			const std::vector<std::string>& snapshots, bool findSharedExtents);
+
+	// Measure every room below the ZFS dataset <userDataset>, by room name
+	static std::map<std::string, std::vector<Usage>> measureZfs(const std::string& userDataset);
+
+	// e.g. "1.5G"
+	static std::string formatBytes(uint64_t bytes);
+};
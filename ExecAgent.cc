@@ -0,0 +1,421 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+extern "C" {
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+}
+
+#include "ExecAgent.hpp"
+#include "ExecSupervisor.hpp"
+#include "logger.h"
+
+static const size_t MAX_REQUEST = 65536;
+static const int STDIO_FDS = 3;
+
+static int sigchldPipe[2] = { -1, -1 };
+
+static void sigchldHandler(int signo)
+{
+	int saved_errno = errno;
+	(void) signo;
+	(void) write(sigchldPipe[1], "", 1);
+	errno = saved_errno;
+}
+
+static void fillAddress(struct sockaddr_un& sun, const std::string& socketPath)
+{
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (socketPath.length() >= sizeof(sun.sun_path)) {
+		throw std::runtime_error("socket path too long: " + socketPath);
+	}
+	strncpy(sun.sun_path, socketPath.c_str(), sizeof(sun.sun_path) - 1);
+}
+
+static void sendStatus(int fd, int exitStatus)
+{
+	int32_t buf = exitStatus;
+	if (send(fd, &buf, sizeof(buf), MSG_NOSIGNAL) < 0) {
+		log_errno("send(2)");
+	}
+}
+
+static bool receiveStatus(int fd, int& exitStatus)
+{
+	int32_t buf;
+	ssize_t bytes;
+
+	do {
+		bytes = recv(fd, &buf, sizeof(buf), 0);
+	} while (bytes < 0 && errno == EINTR);
+	if (bytes != sizeof(buf)) {
+		return false;
+	}
+	exitStatus = buf;
+	return true;
+}
+
+ExecAgent::~ExecAgent()
+{
+	if (listenfd >= 0) {
+		(void) close(listenfd);
+	}
+}
+
+int ExecAgent::connectTo(const std::string& socketPath)
+{
+	struct sockaddr_un sun;
+
+	fillAddress(sun, socketPath);
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		throw std::system_error(errno, std::system_category());
+	}
+	if (connect(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
+		int saved_errno = errno;
+		(void) close(fd);
+		if (saved_errno == ENOENT || saved_errno == ECONNREFUSED) {
+			return -1;
+		}
+		throw std::system_error(saved_errno, std::system_category());
+	}
+	return fd;
+}
+
+void ExecAgent::listen(const std::string& socketPath)
+{
+	struct sockaddr_un sun;
+
+	// Remove the socket left behind by an agent that has gone away
+	int fd = connectTo(socketPath);
+	if (fd >= 0) {
+		(void) close(fd);
+		throw std::runtime_error("an exec agent is already running");
+	}
+	if (unlink(socketPath.c_str()) < 0 && errno != ENOENT) {
+		throw std::system_error(errno, std::system_category());
+	}
+
+	fillAddress(sun, socketPath);
+	listenfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (listenfd < 0) {
+		throw std::system_error(errno, std::system_category());
+	}
+	mode_t saved_umask = umask(0077);
+	int rv = bind(listenfd, (struct sockaddr *) &sun, sizeof(sun));
+	int saved_errno = errno;
+	umask(saved_umask);
+	if (rv < 0) {
+		throw std::system_error(saved_errno, std::system_category());
+	}
+	if (::listen(listenfd, SOMAXCONN) < 0) {
+		throw std::system_error(errno, std::system_category());
+	}
+	log_debug("exec agent listening on %s", socketPath.c_str());
+}
+
+void ExecAgent::acceptConnection()
+{
+	int fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd < 0) {
+		if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED) {
+			log_errno("accept4(2)");
+		}
+		return;
+	}
+
+	// The socket is mode 0600, but check the peer anyway
+	uid_t uid;
+#ifdef __linux__
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+		log_errno("getsockopt(2)");
+		(void) close(fd);
+		return;
+	}
+	uid = cred.uid;
+#else
+	gid_t gid;
+	if (getpeereid(fd, &uid, &gid) < 0) {
+		log_errno("getpeereid(3)");
+		(void) close(fd);
+		return;
+	}
+#endif
+	if (uid != geteuid() && uid != 0) {
+		log_warning("rejecting connection from uid %d", (int) uid);
+		(void) close(fd);
+		return;
+	}
+
+	connections.push_back({ fd, -1 });
+}
+
+// Returns false if the agent was asked to shut down
+bool ExecAgent::handleRequest(Connection& conn)
+{
+	char buf[MAX_REQUEST];
+	char cbuf[CMSG_SPACE(sizeof(int) * STDIO_FDS)];
+	struct iovec iov = { buf, sizeof(buf) - 1 };
+	struct msghdr msg;
+	std::vector<int> fds;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	ssize_t bytes = recvmsg(conn.fd, &msg, MSG_CMSG_CLOEXEC);
+	if (bytes < 0 && (errno == EINTR || errno == EAGAIN)) {
+		return true;
+	}
+
+	// A client that goes away takes its command with it
+	if (conn.pid > 0 || bytes <= 0) {
+		if (conn.pid > 0) {
+			log_debug("client went away; terminating pid %d", conn.pid);
+			(void) kill(-conn.pid, SIGTERM);
+		}
+		(void) close(conn.fd);
+		conn.fd = -1;
+		return true;
+	}
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			int *p = (int *) CMSG_DATA(cmsg);
+			fds.insert(fds.end(), p, p + count);
+		}
+	}
+
+	buf[bytes] = '\0';
+	std::vector<std::string> words;
+	for (char *p = buf; p < buf + bytes; p += strlen(p) + 1) {
+		words.push_back(p);
+	}
+
+	bool keepServing = true;
+	if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+		log_error("exec request was too large");
+		sendStatus(conn.fd, 126);
+	} else if (words.size() == 1 && words[0] == "stop") {
+		sendStatus(conn.fd, 0);
+		keepServing = false;
+	} else if (words.size() >= 2 && words[0] == "exec" && fds.size() == STDIO_FDS) {
+		std::vector<char*> argv;
+		for (size_t i = 1; i < words.size(); i++) {
+			argv.push_back(const_cast<char*>(words[i].c_str()));
+		}
+		argv.push_back(NULL);
+
+		log_flush();
+		pid_t pid = fork();
+		if (pid < 0) {
+			log_errno("fork(2)");
+			sendStatus(conn.fd, 126);
+		} else if (pid == 0) {
+			(void) setpgid(0, 0);
+			signal(SIGCHLD, SIG_DFL);
+			signal(SIGPIPE, SIG_DFL);
+			for (int i = 0; i < STDIO_FDS; i++) {
+				if (dup2(fds[i], i) < 0) {
+					_exit(126);
+				}
+			}
+			execvp(argv[0], argv.data());
+			dprintf(STDERR_FILENO, "%s: %s\n", argv[0], strerror(errno));
+			_exit(errno == ENOENT ? 127 : 126);
+		} else {
+			log_debug("exec agent started `%s' as pid %d", argv[0], pid);
+			conn.pid = pid;
+		}
+	} else {
+		log_error("malformed exec request");
+		sendStatus(conn.fd, 126);
+	}
+
+	for (int fd : fds) {
+		(void) close(fd);
+	}
+	if (conn.pid < 0) {
+		(void) close(conn.fd);
+		conn.fd = -1;
+	}
+	return keepServing;
+}
+
+void ExecAgent::reapChildren()
+{
+	pid_t pid;
+	int status;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (auto& conn : connections) {
+			if (conn.pid == pid) {
+				if (conn.fd >= 0) {
+					sendStatus(conn.fd, ExecSupervisor::exitCodeFromStatus(status));
+					(void) close(conn.fd);
+					conn.fd = -1;
+				}
+				conn.pid = -1;
+			}
+		}
+	}
+}
+
+void ExecAgent::serve()
+{
+	if (pipe2(sigchldPipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+		throw std::system_error(errno, std::system_category());
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigchldHandler;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGCHLD, &sa, NULL) < 0) {
+		throw std::system_error(errno, std::system_category());
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	bool keepServing = true;
+	std::vector<struct pollfd> pfds;
+	while (keepServing) {
+		pfds.clear();
+		pfds.push_back({ listenfd, POLLIN, 0 });
+		pfds.push_back({ sigchldPipe[0], POLLIN, 0 });
+		for (auto& conn : connections) {
+			pfds.push_back({ conn.fd, POLLIN, 0 });
+		}
+
+		if (poll(pfds.data(), pfds.size(), -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw std::system_error(errno, std::system_category());
+		}
+
+		if (pfds[1].revents) {
+			char junk[64];
+			while (read(sigchldPipe[0], junk, sizeof(junk)) > 0) {
+				;
+			}
+			reapChildren();
+		}
+
+		// Connections accepted below are polled on the next pass
+		for (size_t i = 2; i < pfds.size(); i++) {
+			Connection& conn = connections[i - 2];
+			if (pfds[i].revents && conn.fd >= 0) {
+				keepServing = handleRequest(conn) && keepServing;
+			}
+		}
+
+		auto it = connections.begin();
+		while (it != connections.end()) {
+			if (it->fd < 0 && it->pid < 0) {
+				it = connections.erase(it);
+			} else {
+				++it;
+			}
+		}
+
+		if (pfds[0].revents) {
+			acceptConnection();
+		}
+	}
+
+	log_debug("exec agent shutting down");
+	for (auto& conn : connections) {
+		if (conn.pid > 0) {
+			(void) kill(-conn.pid, SIGTERM);
+		}
+	}
+}
+
+bool ExecAgent::exec(const std::string& socketPath, const std::vector<std::string>& argv, int& exitStatus)
+{
+	int fd = connectTo(socketPath);
+	if (fd < 0) {
+		return false;
+	}
+
+	std::string request = "exec";
+	request.push_back('\0');
+	for (auto& arg : argv) {
+		request.append(arg);
+		request.push_back('\0');
+	}
+
+	int fds[STDIO_FDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	char cbuf[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = { const_cast<char*>(request.data()), request.length() };
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+		log_errno("sendmsg(2)");
+		(void) close(fd);
+		return false;
+	}
+
+	bool ok = receiveStatus(fd, exitStatus);
+	(void) close(fd);
+	if (!ok) {
+		throw std::runtime_error("exec agent exited before the command finished");
+	}
+	return true;
+}
+
+bool ExecAgent::shutdown(const std::string& socketPath)
+{
+	int fd = connectTo(socketPath);
+	if (fd < 0) {
+		return false;
+	}
+
+	int exitStatus;
+	bool ok = send(fd, "stop", 5, MSG_NOSIGNAL) == 5 && receiveStatus(fd, exitStatus);
+	(void) close(fd);
+	return ok;
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <sys/types.h>
+}
+
+// A long-running process that has already entered a room, and runs
+// commands on behalf of clients that connect to its Unix socket.
+//
+// Running a command through the agent costs a connect(2) and a fork(2),
+// instead of entering each namespace and chroot(2)'ing every time.
+//
+// Each request is a single SOCK_SEQPACKET message holding the argument
+// vector, with the client's stdin, stdout and stderr attached as
+// SCM_RIGHTS. The reply is the exit status of the command, using the
+// same convention as ExecSupervisor. If the client goes away first, the
+// command's process group is sent SIGTERM.
+class ExecAgent {
+public:
+	ExecAgent() {}
+	~ExecAgent();
+
+	// Create the listening socket. Only processes running with the same
+	// uid as the agent, or as root, may connect. Call this before entering
+	// the room.
+	void listen(const std::string& socketPath);
+
+	// Serve requests until told to shut down. Call this after entering
+	// the room, with the environment that commands should inherit.
+	void serve();
+
+	// Run a command through the agent listening on <socketPath>.
+	// Returns false if no agent is listening, so the caller can fall back
+	// to entering the room directly.
+	static bool exec(const std::string& socketPath, const std::vector<std::string>& argv, int& exitStatus);
+
+	// Ask the agent to exit. Returns false if no agent is listening.
+	static bool shutdown(const std::string& socketPath);
+
+private:
+	struct Connection {
+		int fd;
+		pid_t pid; // -1 until a command has been started
+	};
+
+	int listenfd = -1;
+	std::vector<Connection> connections;
+
+	static int connectTo(const std::string& socketPath);
+	void acceptConnection();
+	bool handleRequest(Connection& conn);
+	void reapChildren();
+};
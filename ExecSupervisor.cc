@@ -0,0 +1,471 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <stdexcept>
+#include <system_error>
+
+extern "C" {
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#endif
+}
+
+#include "ExecSupervisor.hpp"
+#include "logger.h"
+
+// Signals that are relayed to the command instead of acting on room(1)
+static const int forwardedSignals[] = { SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGUSR1, SIGUSR2 };
+
+static const size_t RELAY_CHUNK = 64 * 1024;
+
+ExecSupervisor::~ExecSupervisor()
+{
+	restoreTerminal();
+	if (ptyMaster >= 0) {
+		(void) close(ptyMaster);
+	}
+	if (ptySlave >= 0) {
+		(void) close(ptySlave);
+	}
+}
+
+void ExecSupervisor::openPty()
+{
+	ptyMaster = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (ptyMaster < 0) {
+		log_errno("posix_openpt(3)");
+		throw std::system_error(errno, std::system_category());
+	}
+	if (grantpt(ptyMaster) < 0 || unlockpt(ptyMaster) < 0) {
+		log_errno("grantpt(3)");
+		throw std::system_error(errno, std::system_category());
+	}
+	char *slaveName = ptsname(ptyMaster);
+	if (!slaveName) {
+		log_errno("ptsname(3)");
+		throw std::system_error(errno, std::system_category());
+	}
+	ptySlave = open(slaveName, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (ptySlave < 0) {
+		log_errno("open(2) of %s", slaveName);
+		throw std::system_error(errno, std::system_category());
+	}
+	log_debug("allocated pty %s", slaveName);
+}
+
+void ExecSupervisor::prepare()
+{
+	if (isatty(STDIN_FILENO)) {
+		openPty();
+		if (tcgetattr(STDIN_FILENO, &savedTermios) == 0) {
+			isTermiosSaved = true;
+			(void) tcsetattr(ptySlave, TCSANOW, &savedTermios);
+		}
+		copyWindowSize();
+	}
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	for (int signo : forwardedSignals) {
+		sigaddset(&mask, signo);
+	}
+	sigaddset(&mask, SIGWINCH);
+	sigaddset(&mask, SIGCHLD);
+	if (sigprocmask(SIG_BLOCK, &mask, &savedMask) < 0) {
+		log_errno("sigprocmask(2)");
+		throw std::system_error(errno, std::system_category());
+	}
+	isMaskSaved = true;
+}
+
+void ExecSupervisor::setupChild()
+{
+	if (isMaskSaved) {
+		(void) sigprocmask(SIG_SETMASK, &savedMask, NULL);
+	}
+	if (ptySlave < 0) {
+		return;
+	}
+	if (setsid() < 0) {
+		err(1, "setsid(2)");
+	}
+	if (ioctl(ptySlave, TIOCSCTTY, 0) < 0) {
+		err(1, "ioctl(2) TIOCSCTTY");
+	}
+	for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++) {
+		if (dup2(ptySlave, fd) < 0) {
+			err(1, "dup2(2)");
+		}
+	}
+	(void) close(ptySlave);
+	(void) close(ptyMaster);
+	ptySlave = ptyMaster = -1;
+	isTermiosSaved = false;
+}
+
+void ExecSupervisor::enterRawMode()
+{
+	if (!isTermiosSaved) {
+		return;
+	}
+	struct termios raw = savedTermios;
+	cfmakeraw(&raw);
+	if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) < 0) {
+		log_errno("tcsetattr(3)");
+	}
+}
+
+void ExecSupervisor::restoreTerminal()
+{
+	if (isTermiosSaved) {
+		(void) tcsetattr(STDIN_FILENO, TCSAFLUSH, &savedTermios);
+		isTermiosSaved = false;
+	}
+}
+
+void ExecSupervisor::copyWindowSize()
+{
+	struct winsize ws;
+	if (ptyMaster >= 0 && ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) == 0) {
+		(void) ioctl(ptyMaster, TIOCSWINSZ, &ws);
+	}
+}
+
+void ExecSupervisor::forwardSignal(pid_t pid, int signo)
+{
+	log_debug("forwarding signal %d to pid %d", signo, (int) pid);
+	if (kill(pid, signo) < 0 && errno != ESRCH) {
+		log_errno("kill(2)");
+	}
+}
+
+static void writeAll(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t bytes = write(fd, buf, len);
+		if (bytes < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			return;
+		}
+		buf += bytes;
+		len -= bytes;
+	}
+}
+
+// Copy whatever is available on <in> to <out> with read(2)/write(2).
+// Returns 0 on EOF, -1 if nothing was available, or the number of bytes.
+static ssize_t copyChunk(int in, int out)
+{
+	char buf[RELAY_CHUNK];
+	ssize_t bytes = read(in, buf, sizeof(buf));
+	if (bytes < 0) {
+		// EIO from a pty master means the slave side was closed
+		return (errno == EAGAIN || errno == EINTR) ? -1 : 0;
+	}
+	writeAll(out, buf, bytes);
+	return bytes;
+}
+
+#ifdef __linux__
+
+// Moves data from one descriptor to another through a pipe with
+// splice(2), so the bytes never pass through user space. Falls back to
+// read(2)/write(2) if either end does not support splicing.
+class SpliceRelay {
+public:
+	SpliceRelay(int in, int out) : in(in), out(out) {
+		if (pipe2(pd, O_CLOEXEC | O_NONBLOCK) < 0) {
+			useSplice = false;
+			pd[0] = pd[1] = -1;
+		}
+	}
+	~SpliceRelay() {
+		if (pd[0] >= 0) (void) close(pd[0]);
+		if (pd[1] >= 0) (void) close(pd[1]);
+	}
+
+	// Returns 0 on EOF, -1 if nothing was available, or the number of bytes
+	ssize_t transfer() {
+		if (!useSplice) {
+			return copyChunk(in, out);
+		}
+		ssize_t bytes = splice(in, NULL, pd[1], NULL, RELAY_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (bytes < 0) {
+			if (errno == EINVAL || errno == ENOSYS) {
+				useSplice = false;
+				return copyChunk(in, out);
+			}
+			return (errno == EAGAIN || errno == EINTR) ? -1 : 0;
+		}
+		drainPipe(bytes);
+		return bytes;
+	}
+
+private:
+	int in, out;
+	int pd[2];
+	bool useSplice = true;
+
+	void drainPipe(size_t len) {
+		while (len > 0) {
+			ssize_t bytes = splice(pd[0], NULL, out, NULL, len, SPLICE_F_MOVE);
+			if (bytes < 0) {
+				if (errno == EINTR || errno == EAGAIN) {
+					continue;
+				}
+				if (errno == EINVAL) {
+					// <out> cannot be spliced into; copy the rest by hand
+					char buf[RELAY_CHUNK];
+					while (len > 0) {
+						ssize_t n = read(pd[0], buf, std::min(len, sizeof(buf)));
+						if (n <= 0) break;
+						writeAll(out, buf, n);
+						len -= n;
+					}
+					useSplice = false;
+				}
+				return;
+			}
+			len -= bytes;
+		}
+	}
+};
+
+int ExecSupervisor::pidfdOpen(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	return (int) syscall(SYS_pidfd_open, pid, 0);
+#else
+	(void) pid;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+int ExecSupervisor::superviseLinux(pid_t pid)
+{
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		log_errno("epoll_create1(2)");
+		throw std::system_error(errno, std::system_category());
+	}
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	for (int signo : forwardedSignals) {
+		sigaddset(&mask, signo);
+	}
+	sigaddset(&mask, SIGWINCH);
+	sigaddset(&mask, SIGCHLD);
+	int sigfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (sigfd < 0) {
+		log_errno("signalfd(2)");
+		throw std::system_error(errno, std::system_category());
+	}
+
+	// Prefer a pidfd, which becomes readable exactly when this child exits;
+	// fall back to SIGCHLD on kernels older than 5.3.
+	int pidfd = pidfdOpen(pid);
+	if (pidfd < 0) {
+		log_debug("pidfd_open(2) unavailable; using SIGCHLD");
+	}
+
+	struct epoll_event ev;
+	auto watch = [&](int fd) {
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			log_errno("epoll_ctl(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+	};
+	watch(sigfd);
+	if (pidfd >= 0) {
+		watch(pidfd);
+	}
+
+	SpliceRelay *input = NULL, *output = NULL;
+	bool stdinOpen = false;
+	if (hasPty()) {
+		(void) fcntl(ptyMaster, F_SETFL, fcntl(ptyMaster, F_GETFL) | O_NONBLOCK);
+		input = new SpliceRelay(STDIN_FILENO, ptyMaster);
+		output = new SpliceRelay(ptyMaster, STDOUT_FILENO);
+		watch(STDIN_FILENO);
+		watch(ptyMaster);
+		stdinOpen = true;
+	}
+
+	int status = 0;
+	bool exited = false;
+	while (!exited) {
+		struct epoll_event events[8];
+		int nev = epoll_wait(epfd, events, 8, -1);
+		if (nev < 0) {
+			if (errno == EINTR) continue;
+			log_errno("epoll_wait(2)");
+			break;
+		}
+		for (int i = 0; i < nev; i++) {
+			int fd = events[i].data.fd;
+			if (fd == sigfd) {
+				struct signalfd_siginfo si;
+				while (read(sigfd, &si, sizeof(si)) == sizeof(si)) {
+					if (si.ssi_signo == SIGWINCH) {
+						copyWindowSize();
+					} else if (si.ssi_signo == SIGCHLD) {
+						if (pidfd < 0 && waitpid(pid, &status, WNOHANG) == pid) {
+							exited = true;
+						}
+					} else if (si.ssi_code != SI_KERNEL) {
+						// Terminal-generated signals already reach the
+						// command through its controlling terminal
+						forwardSignal(pid, si.ssi_signo);
+					}
+				}
+			} else if (fd == pidfd) {
+				if (waitpid(pid, &status, 0) == pid) {
+					exited = true;
+				}
+			} else if (fd == STDIN_FILENO && stdinOpen) {
+				if (input->transfer() == 0) {
+					(void) epoll_ctl(epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+					stdinOpen = false;
+				}
+			} else if (fd == ptyMaster) {
+				if (output->transfer() == 0) {
+					(void) epoll_ctl(epfd, EPOLL_CTL_DEL, ptyMaster, NULL);
+				}
+			}
+		}
+	}
+
+	if (hasPty()) {
+		// Flush output that the command wrote just before exiting
+		while (output->transfer() > 0)
+			;
+	}
+	delete input;
+	delete output;
+	if (pidfd >= 0) (void) close(pidfd);
+	(void) close(sigfd);
+	(void) close(epfd);
+	return status;
+}
+
+#endif /* __linux__ */
+
+int ExecSupervisor::supervisePortable(pid_t pid)
+{
+	int status = 0;
+	bool stdinOpen = hasPty();
+
+	if (hasPty()) {
+		(void) fcntl(ptyMaster, F_SETFL, fcntl(ptyMaster, F_GETFL) | O_NONBLOCK);
+	}
+	for (;;) {
+		sigset_t pending;
+		if (sigpending(&pending) == 0) {
+			for (int signo : forwardedSignals) {
+				if (sigismember(&pending, signo)) {
+					int sig;
+					sigset_t one;
+					sigemptyset(&one);
+					sigaddset(&one, signo);
+					(void) sigwait(&one, &sig);
+					forwardSignal(pid, sig);
+				}
+			}
+			if (sigismember(&pending, SIGWINCH)) {
+				int sig;
+				sigset_t one;
+				sigemptyset(&one);
+				sigaddset(&one, SIGWINCH);
+				(void) sigwait(&one, &sig);
+				copyWindowSize();
+			}
+		}
+
+		pid_t rv = waitpid(pid, &status, WNOHANG);
+		if (rv == pid) {
+			break;
+		} else if (rv < 0 && errno != EINTR) {
+			log_errno("waitpid(2)");
+			break;
+		}
+
+		if (!hasPty()) {
+			(void) poll(NULL, 0, 50);
+			continue;
+		}
+		struct pollfd pfd[2] = {
+			{ ptyMaster, POLLIN, 0 },
+			{ stdinOpen ? STDIN_FILENO : -1, POLLIN, 0 },
+		};
+		if (poll(pfd, 2, 50) > 0) {
+			if (pfd[0].revents) {
+				(void) copyChunk(ptyMaster, STDOUT_FILENO);
+			}
+			if (pfd[1].revents && copyChunk(STDIN_FILENO, ptyMaster) == 0) {
+				stdinOpen = false;
+			}
+		}
+	}
+	if (hasPty()) {
+		while (copyChunk(ptyMaster, STDOUT_FILENO) > 0)
+			;
+	}
+	return status;
+}
+
+int ExecSupervisor::supervise(pid_t pid)
+{
+	int status;
+
+	// The parent only needs the master side
+	if (ptySlave >= 0) {
+		(void) close(ptySlave);
+		ptySlave = -1;
+	}
+	enterRawMode();
+	try {
+#ifdef __linux__
+		status = superviseLinux(pid);
+#else
+		status = supervisePortable(pid);
+#endif
+	} catch (...) {
+		restoreTerminal();
+		throw;
+	}
+	restoreTerminal();
+
+	int exitCode = exitCodeFromStatus(status);
+	log_debug("pid %d exited with status %d", (int) pid, exitCode);
+	return exitCode;
+}
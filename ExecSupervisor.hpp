@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+extern "C" {
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <termios.h>
+}
+
+// Supervises a command executed inside a room.
+//
+// If stdin is a terminal, the command is given its own pseudo-terminal,
+// and the supervisor relays bytes between it and the real terminal while
+// forwarding window size changes and signals. Otherwise the command
+// inherits stdin/stdout/stderr directly, so output is not copied at all.
+//
+// Usage:
+//   ExecSupervisor sup;
+//   sup.prepare();         // before entering the room
+//   pid = fork();
+//   child:  sup.setupChild(); exec...
+//   parent: status = sup.supervise(pid);
+class ExecSupervisor {
+public:
+	ExecSupervisor() {}
+	~ExecSupervisor();
+
+	// Allocate a pty if needed, and block the signals that will be
+	// forwarded. Must be called before fork(2), and before entering
+	// the room so the pty comes from the host devpts instance.
+	void prepare();
+
+	// Connect the child to the pty and restore its signal mask.
+	// Call in the child after fork(2), before exec(2).
+	void setupChild();
+
+	// Relay I/O and signals until <pid> exits. Returns the exit status
+	// using the shell convention: the exit code, or 128 + signal number.
+	int supervise(pid_t pid);
+
+	bool hasPty() const {
+		return ptyMaster >= 0;
+	}
+
+	// Open a pidfd for <pid>. Returns -1 with errno set to ENOSYS if
+	// pidfd_open(2) is not available.
+	static int pidfdOpen(pid_t pid);
+
+	// Convert a wait(2) status into an exit code, shell-style
+	static int exitCodeFromStatus(int status) {
+		if (WIFEXITED(status)) {
+			return WEXITSTATUS(status);
+		} else if (WIFSIGNALED(status)) {
+			return 128 + WTERMSIG(status);
+		} else {
+			return 1;
+		}
+	}
+
+private:
+	int ptyMaster = -1;
+	int ptySlave = -1;
+	bool isTermiosSaved = false;
+	struct termios savedTermios;
+	bool isMaskSaved = false;
+	sigset_t savedMask;
+
+	void openPty();
+	void enterRawMode();
+	void restoreTerminal();
+	void copyWindowSize();
+	void forwardSignal(pid_t pid, int signo);
+	int superviseLinux(pid_t pid);
+	int supervisePortable(pid_t pid);
+};
@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cstdio>
+#include <iostream>
+#include <system_error>
+#include <utility>
+
+extern "C" {
+#include <err.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+}
+
+#include "ExecSupervisor.hpp"
+#include "FanoutExec.hpp"
+#include "logger.h"
+
+// Lines longer than this are split, so one job cannot use unbounded memory
+static const size_t MAX_LINE = 65536;
+
+// How often to check on jobs that closed their output, when there is no
+// pidfd to tell us that they exited
+static const int REAP_INTERVAL_MS = 100;
+
+FanoutExec::FanoutExec(unsigned int parallelism)
+{
+	if (parallelism == 0) {
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		parallelism = (ncpu > 0) ? ncpu : 1;
+	}
+	this->parallelism = parallelism;
+}
+
+void FanoutExec::add(const std::string& label, std::function<int()> job)
+{
+	Job j;
+	j.label = label;
+	j.func = job;
+	jobs.push_back(j);
+	if (label.length() > labelWidth) {
+		labelWidth = label.length();
+	}
+}
+
+void FanoutExec::spawn(Job& job)
+{
+	int outpipe[2], errpipe[2];
+
+	if (pipe2(outpipe, O_CLOEXEC) < 0 || pipe2(errpipe, O_CLOEXEC) < 0) {
+		throw std::system_error(errno, std::system_category());
+	}
+
+	std::cout.flush();
+	fflush(stdout);
+	fflush(stderr);
+	log_flush();
+	job.pid = fork();
+	if (job.pid < 0) {
+		throw std::system_error(errno, std::system_category());
+	}
+	if (job.pid == 0) {
+		int nullfd = open("/dev/null", O_RDONLY);
+		if (nullfd < 0 || dup2(nullfd, STDIN_FILENO) < 0 ||
+				dup2(outpipe[1], STDOUT_FILENO) < 0 ||
+				dup2(errpipe[1], STDERR_FILENO) < 0) {
+			err(1, "unable to redirect stdio");
+		}
+
+		int status;
+		try {
+			status = job.func();
+		} catch (const std::exception& e) {
+			std::cerr << "ERROR: " << e.what() << '\n';
+			status = 1;
+		}
+		std::cout.flush();
+		exit(status);
+	}
+
+	(void) close(outpipe[1]);
+	(void) close(errpipe[1]);
+	job.out.fd = outpipe[0];
+	job.err.fd = errpipe[0];
+	job.pidfd = ExecSupervisor::pidfdOpen(job.pid);
+	log_debug("started job `%s' as pid %d", job.label.c_str(), job.pid);
+}
+
+void FanoutExec::emit(const Job& job, const char *buf, size_t len, int destfd)
+{
+	std::string line = job.label;
+	line.append(labelWidth - job.label.length(), ' ');
+	line.append(" | ");
+	line.append(buf, len);
+	line.push_back('\n');
+
+	// One write(2) per line, so lines from different jobs never interleave
+	size_t offset = 0;
+	while (offset < line.length()) {
+		ssize_t bytes = write(destfd, line.data() + offset, line.length() - offset);
+		if (bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		offset += bytes;
+	}
+}
+
+// Read whatever is available on <stream>. Returns false at EOF.
+bool FanoutExec::drain(Job& job, Stream& stream, int destfd)
+{
+	char buf[MAX_LINE];
+	ssize_t bytes = read(stream.fd, buf, sizeof(buf));
+	if (bytes < 0 && (errno == EINTR || errno == EAGAIN)) {
+		return true;
+	}
+	if (bytes <= 0) {
+		if (!stream.partial.empty()) {
+			emit(job, stream.partial.data(), stream.partial.length(), destfd);
+			stream.partial.clear();
+		}
+		(void) close(stream.fd);
+		stream.fd = -1;
+		return false;
+	}
+
+	stream.partial.append(buf, bytes);
+	size_t start = 0;
+	for (;;) {
+		size_t eol = stream.partial.find('\n', start);
+		if (eol == std::string::npos) {
+			break;
+		}
+		emit(job, stream.partial.data() + start, eol - start, destfd);
+		start = eol + 1;
+	}
+	stream.partial.erase(0, start);
+	if (stream.partial.length() >= MAX_LINE) {
+		emit(job, stream.partial.data(), stream.partial.length(), destfd);
+		stream.partial.clear();
+	}
+	return true;
+}
+
+// Collect the exit status of <job>. Returns false if it is still running.
+bool FanoutExec::reap(Job& job)
+{
+	int status;
+	pid_t pid;
+
+	while ((pid = waitpid(job.pid, &status, WNOHANG)) < 0) {
+		if (errno != EINTR) {
+			throw std::system_error(errno, std::system_category());
+		}
+	}
+	if (pid == 0) {
+		return false;
+	}
+	if (job.pidfd >= 0) {
+		(void) close(job.pidfd);
+		job.pidfd = -1;
+	}
+	job.pid = -1;
+	job.exitStatus = ExecSupervisor::exitCodeFromStatus(status);
+	log_debug("job `%s' exited with status %d", job.label.c_str(), job.exitStatus);
+	return true;
+}
+
+void FanoutExec::printSummary()
+{
+	size_t failures = 0;
+
+	std::cerr << '\n';
+	for (auto& job : jobs) {
+		std::string label = job.label;
+		label.append(labelWidth - job.label.length(), ' ');
+		std::cerr << label << "   exit status " << job.exitStatus << '\n';
+		if (job.exitStatus != 0) {
+			failures++;
+		}
+	}
+	std::cerr << failures << " of " << jobs.size() << " failed\n";
+}
+
+int FanoutExec::run()
+{
+	size_t next = 0;
+	size_t running = 0;
+	std::vector<struct pollfd> pfds;
+	std::vector<std::pair<Job*, Stream*>> owners;
+
+	while (next < jobs.size() || running > 0) {
+		while (running < parallelism && next < jobs.size()) {
+			spawn(jobs[next++]);
+			running++;
+		}
+
+		pfds.clear();
+		owners.clear();
+		int timeout = -1;
+		for (auto& job : jobs) {
+			for (Stream* stream : { &job.out, &job.err }) {
+				if (stream->fd >= 0) {
+					pfds.push_back({ stream->fd, POLLIN, 0 });
+					owners.push_back({ &job, stream });
+				}
+			}
+
+			// A job can close its output and keep running, so wait for
+			// it to exit alongside the output of the others
+			if (job.pid > 0 && job.out.fd < 0 && job.err.fd < 0) {
+				if (job.pidfd >= 0) {
+					pfds.push_back({ job.pidfd, POLLIN, 0 });
+					owners.push_back({ &job, NULL });
+				} else {
+					timeout = REAP_INTERVAL_MS;
+				}
+			}
+		}
+
+		if (poll(pfds.data(), pfds.size(), timeout) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw std::system_error(errno, std::system_category());
+		}
+
+		for (size_t i = 0; i < pfds.size(); i++) {
+			if (pfds[i].revents == 0) {
+				continue;
+			}
+			Job& job = *owners[i].first;
+			Stream *stream = owners[i].second;
+			if (stream != NULL) {
+				int destfd = (stream == &job.out) ? STDOUT_FILENO : STDERR_FILENO;
+				(void) drain(job, *stream, destfd);
+			}
+		}
+
+		for (auto& job : jobs) {
+			if (job.pid > 0 && job.out.fd < 0 && job.err.fd < 0 && reap(job)) {
+				running--;
+			}
+		}
+	}
+
+	printSummary();
+
+	for (auto& job : jobs) {
+		if (job.exitStatus != 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <sys/types.h>
+}
+
+// Runs a set of jobs in child processes, at most <parallelism> at a time.
+//
+// The stdout and stderr of every job are read through pipes and copied
+// to our own stdout and stderr one line at a time, with each line prefixed
+// by the label of the job that wrote it. Jobs read from /dev/null.
+class FanoutExec {
+public:
+	// A parallelism of zero means "one job per online CPU"
+	FanoutExec(unsigned int parallelism = 0);
+
+	// Add a job. <job> runs in a forked child and returns its exit status.
+	void add(const std::string& label, std::function<int()> job);
+
+	bool empty() const {
+		return jobs.empty();
+	}
+
+	// Run all jobs, print a summary of exit statuses to stderr, and
+	// return 0 if every job succeeded or 1 otherwise.
+	int run();
+
+private:
+	struct Stream {
+		int fd = -1;
+		std::string partial; // bytes read after the last newline
+	};
+
+	struct Job {
+		std::string label;
+		std::function<int()> func;
+		pid_t pid = -1; // -1 before the job starts and after it is reaped
+		int pidfd = -1;
+		Stream out, err;
+		int exitStatus = -1;
+	};
+
+	std::vector<Job> jobs;
+	unsigned int parallelism;
+	size_t labelWidth = 0;
+
+	void spawn(Job& job);
+	bool drain(Job& job, Stream& stream, int destfd);
+	void emit(const Job& job, const char *buf, size_t len, int destfd);
+	bool reap(Job& job);
+	void printSummary();
+};
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <set>
+#include <system_error>
+
+extern "C" {
+#include <poll.h>
+#include <unistd.h>
+}
+
+#include "Cgroup.hpp"
+#include "IdleMonitor.hpp"
+#include "room.h"
+#include "setuidHelper.h"
+
+// Wake up if a room stalls for 100ms in any 2 second window
+static const unsigned int PSI_STALL_USEC = 100000;
+static const unsigned int PSI_WINDOW_USEC = 2000000;
+
+IdleMonitor::~IdleMonitor()
+{
+	for (auto& it : states) {
+		forget(it.second);
+	}
+}
+
+void IdleMonitor::forget(RoomState& state)
+{
+	if (state.triggerFd >= 0) {
+		(void) close(state.triggerFd);
+	}
+	state = RoomState();
+}
+
+void IdleMonitor::sample(Room& room, RoomState& state)
+{
+	const RoomOptions& options = room.getRoomOptions();
+	Cgroup cgroup(room.getCgroupName());
+	auto now = Clock::now();
+
+	if (!cgroup.exists()) {
+		return;
+	}
+
+	// A frozen room is not sampled; start over once something thaws it
+	if (cgroup.isFrozen()) {
+		forget(state);
+		return;
+	}
+
+	uint64_t usage = cgroup.getCpuUsage();
+	if (!state.sampled) {
+		{
+			PrivilegeGuard privileges;
+			state.triggerFd = cgroup.openPressureTrigger(PSI_STALL_USEC, PSI_WINDOW_USEC);
+		}
+		state.lastUsage = usage;
+		state.lastSample = now;
+		state.lastActive = now;
+		state.sampled = true;
+		return;
+	}
+
+	auto interval = std::chrono::duration_cast<std::chrono::microseconds>(now - state.lastSample).count();
+	double cpuPercent = (interval > 0) ? (100.0 * (usage - state.lastUsage) / interval) : 0;
+	if (cpuPercent >= options.idleCpuPercent || state.triggered || cgroup.getCpuPressure() > 0) {
+		state.lastActive = now;
+	}
+	state.lastUsage = usage;
+	state.lastSample = now;
+	state.triggered = false;
+
+	auto idle = std::chrono::duration_cast<std::chrono::seconds>(now - state.lastActive).count();
+	log_debug("room `%s': cpu=%.2f%% idle=%llds", room.getName().c_str(), cpuPercent, (long long) idle);
+	if (idle >= (long long) options.idleFreezeAfter) {
+		room.openLog(LOG_INFO);
+		if (room.freezeIfIdle()) {
+			forget(state);
+		} else {
+			state.lastActive = now;
+		}
+	}
+}
+
+void IdleMonitor::waitForNextSample()
+{
+	std::vector<struct pollfd> pfds;
+	std::vector<RoomState*> owners;
+
+	for (auto& it : states) {
+		if (it.second.triggerFd >= 0) {
+			pfds.push_back({ it.second.triggerFd, POLLPRI, 0 });
+			owners.push_back(&it.second);
+		}
+	}
+
+	int rv = poll(pfds.data(), pfds.size(), sampleInterval * 1000);
+	if (rv < 0 && errno != EINTR) {
+		throw std::system_error(errno, std::system_category());
+	}
+	for (size_t i = 0; rv > 0 && i < pfds.size(); i++) {
+		if (pfds[i].revents & POLLPRI) {
+			owners[i]->triggered = true;
+		}
+	}
+}
+
+void IdleMonitor::run(std::function<std::vector<Room*>()> getRooms)
+{
+	if (!Cgroup::isSupported()) {
+		throw std::runtime_error("the idle monitor requires cgroup v2");
+	}
+
+	for (;;) {
+		std::set<std::string> seen;
+		for (Room* room : getRooms()) {
+			seen.insert(room->getName());
+			try {
+				sample(*room, states[room->getName()]);
+			} catch (const std::exception& e) {
+				log_warning("unable to sample room `%s': %s", room->getName().c_str(), e.what());
+				forget(states[room->getName()]);
+			}
+		}
+
+		// Drop rooms that were stopped, destroyed, or lost their policy
+		auto it = states.begin();
+		while (it != states.end()) {
+			if (seen.count(it->first) == 0) {
+				forget(it->second);
+				it = states.erase(it);
+			} else {
+				++it;
+			}
+		}
+
+		waitForNextSample();
+	}
+}
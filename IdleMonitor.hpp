@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+class Room;
+
+// Freezes rooms that have been idle for longer than their idle policy
+// allows (see RoomOptions::idleFreezeAfter).
+//
+// A room is active during a sampling interval if it used at least
+// RoomOptions::idleCpuPercent of a CPU, or if any of its processes had
+// to wait for a CPU. A PSI trigger on each room's cgroup wakes the
+// monitor early when a room comes under pressure.
+class IdleMonitor {
+public:
+	IdleMonitor(unsigned int sampleInterval = 5) : sampleInterval(sampleInterval) {}
+	~IdleMonitor();
+
+	// Loop forever. <getRooms> is called before each pass, and returns
+	// the running rooms that have an idle policy.
+	void run(std::function<std::vector<Room*>()> getRooms);
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct RoomState {
+		bool sampled = false;
+		uint64_t lastUsage = 0; // CPU time used, in microseconds
+		Clock::time_point lastSample;
+		Clock::time_point lastActive;
+		int triggerFd = -1;
+		bool triggered = false;
+	};
+
+	unsigned int sampleInterval; // seconds
+	std::map<std::string, RoomState> states;
+
+	void sample(Room& room, RoomState& state);
+	void forget(RoomState& state);
+	void waitForNextSample();
+};
@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+#include "fileUtil.h"
+#include "LaunchPlan.hpp"
+#include "logger.h"
+#include "setuidHelper.h"
+
+// Bump this whenever the format or the meaning of a plan changes
+static const uint32_t PLAN_VERSION = 1;
+static const char PLAN_MAGIC[4] = { 'R', 'M', 'L', 'P' };
+
+// FNV-1a, which is plenty to tell one set of inputs from another
+static void hash_bytes(uint64_t& hash, const void *buf, size_t len)
+{
+	const unsigned char *p = static_cast<const unsigned char *>(buf);
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+}
+
+uint64_t LaunchPlan::hashInputs(const std::vector<std::string>& inputs)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	hash_bytes(hash, &PLAN_VERSION, sizeof(PLAN_VERSION));
+	for (auto& input : inputs) {
+		// Include the length, so that {"ab", "c"} and {"a", "bc"} differ
+		uint64_t len = input.length();
+		hash_bytes(hash, &len, sizeof(len));
+		hash_bytes(hash, input.data(), input.length());
+	}
+	return hash;
+}
+
+static void put_u32(std::string& buf, uint32_t val)
+{
+	buf.append(reinterpret_cast<const char *>(&val), sizeof(val));
+}
+
+static void put_string(std::string& buf, const std::string& str)
+{
+	put_u32(buf, str.length());
+	buf.append(str);
+}
+
+// Reads back what put_u32() and put_string() wrote, and throws if the
+// buffer ends too soon
+class PlanReader {
+public:
+	PlanReader(const std::string& buf) : buf(buf) {}
+
+	void get(void *dst, size_t len) {
+		if (buf.length() - pos < len) {
+			throw std::runtime_error("truncated launch plan");
+		}
+		memcpy(dst, buf.data() + pos, len);
+		pos += len;
+	}
+
+	uint32_t getU32() {
+		uint32_t val;
+		get(&val, sizeof(val));
+		return val;
+	}
+
+	std::string getString() {
+		uint32_t len = getU32();
+		if (buf.length() - pos < len) {
+			throw std::runtime_error("truncated launch plan");
+		}
+		std::string str = buf.substr(pos, len);
+		pos += len;
+		return str;
+	}
+
+	bool atEnd() const {
+		return pos == buf.length();
+	}
+
+private:
+	const std::string& buf;
+	size_t pos = 0;
+};
+
+static bool read_file(const std::string& path, std::string& buf)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			log_errno("open(2) of %s", path.c_str());
+		}
+		return false;
+	}
+	struct stat sb;
+	if (fstat(fd, &sb) < 0) {
+		log_errno("fstat(2) of %s", path.c_str());
+		(void) close(fd);
+		return false;
+	}
+	buf.resize(sb.st_size);
+	size_t done = 0;
+	while (done < buf.length()) {
+		ssize_t n = read(fd, &buf[done], buf.length() - done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			log_errno("read(2) of %s", path.c_str());
+			(void) close(fd);
+			return false;
+		}
+		done += n;
+	}
+	(void) close(fd);
+	return true;
+}
+
+bool LaunchPlan::load(uint64_t expectedHash)
+{
+	std::string buf;
+	PrivilegeGuard privileges;
+	bool found = read_file(path, buf);
+	privileges.lower();
+	if (!found) {
+		return false;
+	}
+
+	try {
+		PlanReader reader(buf);
+		char magic[sizeof(PLAN_MAGIC)];
+		reader.get(magic, sizeof(magic));
+		if (memcmp(magic, PLAN_MAGIC, sizeof(magic)) != 0 || reader.getU32() != PLAN_VERSION) {
+			log_debug("ignoring launch plan %s from another version", path.c_str());
+			return false;
+		}
+		reader.get(&inputHash, sizeof(inputHash));
+		if (inputHash != expectedHash) {
+			log_debug("launch plan %s is stale", path.c_str());
+			return false;
+		}
+		accountCreated = reader.getU32() != 0;
+		hostname = reader.getString();
+		idMap = reader.getString();
+		homeDir = reader.getString();
+		mounts.clear();
+		for (uint32_t i = reader.getU32(); i > 0; i--) {
+			Mount m;
+			m.source = reader.getString();
+			m.target = reader.getString();
+			m.flags = reader.getU32();
+			mounts.push_back(m);
+		}
+		environment.clear();
+		for (uint32_t i = reader.getU32(); i > 0; i--) {
+			environment.push_back(reader.getString());
+		}
+		if (!reader.atEnd()) {
+			throw std::runtime_error("trailing garbage");
+		}
+	} catch (const std::runtime_error& e) {
+		log_warning("ignoring launch plan %s: %s", path.c_str(), e.what());
+		return false;
+	}
+	return true;
+}
+
+// Write <path>, which is below the runtime directory, atomically. Any
+// missing directories between the two are made so that only root can
+// use them.
+static void write_file(const std::string& path, const std::string& buf)
+{
+	const std::string& runtimeDir = FileUtil::getRuntimeDir();
+	if (path.compare(0, runtimeDir.length() + 1, runtimeDir + "/") != 0) {
+		throw std::logic_error("not below " + runtimeDir + ": " + path);
+	}
+	FileUtil::createRuntimeDir();
+	size_t slash = runtimeDir.length();
+	while ((slash = path.find('/', slash + 1)) != std::string::npos) {
+		FileUtil::mkdir_idempotent(path.substr(0, slash), 0700, 0, 0);
+	}
+
+	std::string tmpPath = path + ".new";
+	int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		log_errno("open(2) of %s", tmpPath.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+	size_t done = 0;
+	while (done < buf.length()) {
+		ssize_t n = write(fd, buf.data() + done, buf.length() - done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			int saved_errno = errno;
+			log_errno("write(2) of %s", tmpPath.c_str());
+			(void) close(fd);
+			(void) unlink(tmpPath.c_str());
+			throw std::system_error(saved_errno, std::system_category());
+		}
+		done += n;
+	}
+	if (close(fd) < 0 || rename(tmpPath.c_str(), path.c_str()) < 0) {
+		int saved_errno = errno;
+		log_errno("unable to save %s", path.c_str());
+		(void) unlink(tmpPath.c_str());
+		throw std::system_error(saved_errno, std::system_category());
+	}
+}
+
+void LaunchPlan::save()
+{
+	std::string buf(PLAN_MAGIC, sizeof(PLAN_MAGIC));
+	put_u32(buf, PLAN_VERSION);
+	buf.append(reinterpret_cast<const char *>(&inputHash), sizeof(inputHash));
+	put_u32(buf, accountCreated ? 1 : 0);
+	put_string(buf, hostname);
+	put_string(buf, idMap);
+	put_string(buf, homeDir);
+	put_u32(buf, mounts.size());
+	for (auto& m : mounts) {
+		put_string(buf, m.source);
+		put_string(buf, m.target);
+		put_u32(buf, m.flags);
+	}
+	put_u32(buf, environment.size());
+	for (auto& var : environment) {
+		put_string(buf, var);
+	}
+
+	PrivilegeGuard privileges;
+	write_file(path, buf);
+}
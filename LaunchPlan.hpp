@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Everything Room::start and Room::mount need to know about a room, worked
+// out once from its options.json and the host, and cached in a compact
+// binary file below /run/room/plans. Root acts on the ID map and the
+// mounts in a plan, so plans are kept where only root can write, never in
+// the room's own directories. load() and save() raise privileges
+// themselves.
+//
+// A plan is only good for the inputs it was compiled from. Callers pass a
+// digest of those inputs to load(), which refuses a plan made from
+// different ones, or by a different version of this code.
+class LaunchPlan {
+public:
+	// Create the mountpoint inside the room before mounting on it
+	static const uint32_t MOUNT_MKDIR = 0x1;
+
+	struct Mount {
+		std::string source;  // path on the host
+		std::string target;  // path inside the room
+		uint32_t flags;
+	};
+
+	LaunchPlan(const std::string& path) : path(path) {}
+
+	// Digest of the inputs to a plan, for use as its <inputHash>
+	static uint64_t hashInputs(const std::vector<std::string>& inputs);
+
+	// Read the plan, if there is one compiled from inputs with the given
+	// digest. Returns false if it is missing or stale.
+	bool load(uint64_t inputHash);
+
+	// Write the plan, replacing the old one atomically
+	void save();
+
+	uint64_t inputHash = 0;
+	std::string hostname;
+	std::string idMap;      // uid_map and gid_map of the init process
+	std::string homeDir;    // home directory of the owner
+	std::vector<Mount> mounts;    // in the order they must be made
+	std::vector<std::string> environment; // NAME=value pairs for the owner
+	bool accountCreated = false; // the owner has an account in the room
+
+private:
+	std::string path;
+};
@@ -17,47 +17,114 @@
 
 #include <iostream>
 #include <fstream>
+#include <memory>
 
 extern "C" {
+#include <dirent.h>
 #include <err.h>
 #include <fcntl.h>
 #include <sched.h>
+#include <string.h>
 #include <signal.h>
 #include <unistd.h>
 #include <sys/prctl.h>
 #include <sys/stat.h>
 #include <sys/mount.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
+#ifdef SYS_clone3
+#include <linux/sched.h>
+#endif
 }
 
+#include "Cgroup.hpp"
 #include "LinuxJail.hpp"
 #include "MountUtil.hpp"
+#include "NetnsPool.hpp"
+#include "SubidAllocator.hpp"
 #include "fileUtil.h"
 #include "logger.h"
 #include "shell.h"
 
-static const size_t STACK_SIZE = (1024 * 1024);
-static char jail_stack[STACK_SIZE];
+static const char *criuPath = "/usr/sbin/criu";
+
+// Stack for the init process when clone3(2) is not available
+static const size_t STACK_SIZE = (64 * 1024);
+
+// Everything the init process needs, worked out before it is cloned. The
+// child of a multithreaded process must not allocate memory or touch
+// stdio, so it only makes system calls with these.
+struct InitArgs {
+	const char *hostname;
+	size_t hostnameLen;
+	const char *chrootDir;
+	const char *procPath;
+	int syncFd; // read end of a pipe; one byte means "go", EOF means "give up"
+};
+
+// Wait for one byte on a pipe. Returns false if the other end was closed
+// without writing, which means "give up".
+static bool sync_wait(int fd)
+{
+	char c;
+	ssize_t bytes;
+	do {
+		bytes = read(fd, &c, 1);
+	} while (bytes < 0 && errno == EINTR);
+	(void) close(fd);
+	return (bytes == 1);
+}
 
-/* Use pipe(2) to emulate a simple semaphore, so we don't have
-   to link with -lpthread */
-static int semfd[2];
+// Close every descriptor above stderr except <keepFd>
+static void close_inherited_fds(int keepFd)
+{
+#ifdef SYS_close_range
+	if ((keepFd <= 3 || syscall(SYS_close_range, 3, keepFd - 1, 0) == 0) &&
+		syscall(SYS_close_range, keepFd + 1, ~0U, 0) == 0) {
+		return;
+	}
+#endif
+	for (int fd = 3; fd < 1024; fd++) {
+		if (fd != keepFd) {
+			(void) close(fd);
+		}
+	}
+}
 
-static void update_map(pid_t pid, uid_t euid, const char* file)
+static void sync_post(int fd)
 {
-	std::string uid_map_path = "/proc/" + std::to_string(pid) + "/" + file;
-	std::string mapbuf = "0 " + std::to_string(euid) + " 1\n1 999999 60000\n";
+	if (write(fd, "", 1) < 1) err(1, "write(2)");
+	(void) close(fd);
+}
 
-	log_debug("updating %s: setting: %s", uid_map_path.c_str(), mapbuf.c_str());
-	int fd = open(uid_map_path.c_str(), O_RDWR);
-	if (fd < 0) err(1, "open(2)");
-	ssize_t bytes, len;
-	len = mapbuf.length();
-	bytes = write(fd, mapbuf.c_str(), len);
-	if (bytes < len) {
-		err(1, "write(2) returned %d", (int) bytes);
+// The uid_map and gid_map of rooms whose files are stored with shifted
+// ids, which must keep the range they were unpacked with
+static std::string get_legacy_id_map(uid_t euid)
+{
+	return "0 " + std::to_string(euid) + " 1\n1 999999 60000\n";
+}
+
+static void write_proc_file(pid_t pid, const char *file, const std::string& buf)
+{
+	std::string path = "/proc/" + std::to_string(pid) + "/" + file;
+
+	log_debug("updating %s: setting: %s", path.c_str(), buf.c_str());
+	int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		log_errno("open(2) of %s", path.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+	ssize_t bytes = write(fd, buf.c_str(), buf.length());
+	if (bytes < (ssize_t) buf.length()) {
+		int saved_errno = (bytes < 0) ? errno : EIO;
+		log_error("write(2) of %s returned %d", path.c_str(), (int) bytes);
+		(void) close(fd);
+		throw std::system_error(saved_errno, std::system_category());
+	}
+	if (close(fd) < 0) {
+		log_errno("close(2) of %s", path.c_str());
+		throw std::system_error(errno, std::system_category());
 	}
-	if (close(fd) < 0) err(1, "close(2)");
 }
 
 static void enter_ns(pid_t pid, const char* nstype)
@@ -73,89 +140,101 @@ static void enter_ns(pid_t pid, const char* nstype)
 	close(fd);
 }
 
-static void initialize_uid_map(pid_t initPid, uid_t ownerUid)
+static void initialize_uid_map(pid_t pid, const std::string& idMap)
 {
-	//std::ofstream uid_map;
-
-//	pid_t pid = fork();
-//	if (pid < 0) err(1, "fork");
-//	if (pid > 0) {
-	system("echo whee; id");
-//	enter_ns(initPid, "pid");
-
-	auto path = "/proc/" + std::to_string(initPid) + "/setgroups";
-	system(std::string("ls -l " + path).c_str());
-	int fd = open(path.c_str(), O_RDWR);
-	if (fd < 0) err(1, "open(2) of %s", path.c_str());
-	if (write(fd, "deny", 5) < 5) {
-		err(1, "write(2) of %s", path.c_str());
-	}
-	if (close(fd) < 0) err(1, "close(2)");
-
-	update_map(initPid, ownerUid, "uid_map");
-	update_map(initPid, ownerUid, "gid_map");
-//		int status;
- //               wait(&status);
-  //              if (!WIFEXITED(status) || WEXITSTATUS(status))
-   //                     errx(1, "unable to update uid_map");
-//		
-//	} else {
-//		sleep(5);
-//	exit(0);
-//	}
+	write_proc_file(pid, "setgroups", "deny");
+	write_proc_file(pid, "uid_map", idMap);
+	write_proc_file(pid, "gid_map", idMap);
 }
 
 static int jailMain(void *arg)
 {
-	LinuxJail* jail = static_cast<LinuxJail*>(arg);
-
-sleep(3); // wait for uid_map setup
+	const InitArgs *args = static_cast<const InitArgs*>(arg);
 
-	//std::cout << "going to " << jail->chrootDir << "\n";
-	//daemon(1, 0);
+	// Other threads of the parent may have had descriptors open when this
+	// process was cloned, such as locks and the pipes of other launches.
+	// Holding on to them would keep those locks taken.
+	close_inherited_fds(args->syncFd);
 
-//        SetuidHelper::raisePrivileges();
+	// The kernel drops signals sent to the init process of a PID namespace
+	// from outside it, unless they are blocked or handled. Block SIGTERM so
+	// stop() can reach it, and so sigwait(3) below can collect it.
+	sigset_t sigset;
+	int sig;
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGTERM);
+	(void) sigprocmask(SIG_BLOCK, &sigset, NULL);
 
-	if (sethostname(jail->hostname.c_str(), jail->hostname.length()) < 0) {
-		err(1, "sethostname(2)");
+	// The parent sets up uid_map and the root mount first
+	if (!sync_wait(args->syncFd)) {
+		_exit(1);
 	}
 
-	auto mountpoint = std::string(jail->chrootDir + "/proc");
-	if (mount("proc", mountpoint.c_str(), "proc", 0, NULL) < 0) {
-		err(1, "mount(2) of /proc");
+	if (sethostname(args->hostname, args->hostnameLen) < 0) {
+		_exit(1);
 	}
 
-        if (chdir(jail->chrootDir.c_str()) < 0) {
-		err(1, "chdir(2)");
-        }
+	if (mount("proc", args->procPath, "proc", 0, NULL) < 0) {
+		_exit(1);
+	}
 
-        if (chroot(jail->chrootDir.c_str()) < 0) {
-		err(1, "chroot(2)");
-        }
+	if (chdir(args->chrootDir) < 0) {
+		_exit(1);
+	}
 
-	// WORKAROUND: need a way to close inherited FDs more intelligently
-	for (int i = 3; i < 30; i++) {
-		(void) close(i);
+	if (chroot(args->chrootDir) < 0) {
+		_exit(1);
 	}
 
         //FIXME: WANT TO: SetuidHelper::dropPrivileges();
 
 	// Wait for the termination signal
-	sigset_t sigset;
-	int sig;	
-	sigemptyset(&sigset);
-	sigaddset(&sigset, SIGTERM);
 	sigwait(&sigset, &sig);
 
-	std::cout << "exiting init process\n";
+	static const char msg[] = "exiting init process\n";
+	(void) write(STDOUT_FILENO, msg, sizeof(msg) - 1);
 
 	return (0);
 }
 
+// Create the init process in new namespaces. Uses clone3(2) without a stack,
+// which works like fork(2), or clone(2) with a stack of its own, so no
+// state is shared between launches.
+static pid_t clone_init(InitArgs *args)
+{
+	const int flags = CLONE_NEWIPC | CLONE_NEWNS | CLONE_NEWPID | CLONE_NEWUSER | CLONE_NEWUTS;
+
+	log_flush();
+#ifdef SYS_clone3
+	struct clone_args cl_args;
+	memset(&cl_args, 0, sizeof(cl_args));
+	cl_args.flags = flags;
+	cl_args.exit_signal = SIGCHLD;
+	long pid = syscall(SYS_clone3, &cl_args, sizeof(cl_args));
+	if (pid == 0) {
+		_exit(jailMain(args));
+	}
+	if (pid > 0 || errno != ENOSYS) {
+		return pid;
+	}
+#endif
+
+	// The child gets a copy of the stack, so the parent can free it right away
+	std::unique_ptr<char[]> stack(new char[STACK_SIZE]);
+	return clone(jailMain, stack.get() + STACK_SIZE, flags | SIGCHLD, args);
+}
+
 LinuxJail::LinuxJail()
 {
 }
 
+LinuxJail::~LinuxJail()
+{
+	if (cgroupProcsFd >= 0) {
+		(void) close(cgroupProcsFd);
+	}
+}
+
 void LinuxJail::main_hook()
 {
 	if (prctl(PR_SET_KEEPCAPS, 1) < 0)
@@ -175,27 +254,234 @@ bool LinuxJail::isRunning()
 	}
 }
 
-void LinuxJail::mountAll()
+// Create a user namespace with the mapping <idMap>, for idmapping a mount
+// when the room itself is not running. Returns -1 if user namespaces are
+// not available.
+static int open_idmap_userns(const std::string& idMap)
 {
-        SetuidHelper::raisePrivileges();
+	int ready[2], done[2];
+	if (pipe2(ready, O_CLOEXEC) < 0) {
+		log_errno("pipe2(2)");
+		throw std::system_error(errno, std::system_category());
+	}
+	if (pipe2(done, O_CLOEXEC) < 0) {
+		int saved_errno = errno;
+		log_errno("pipe2(2)");
+		close(ready[0]);
+		close(ready[1]);
+		throw std::system_error(saved_errno, std::system_category());
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		int saved_errno = errno;
+		log_errno("fork(2)");
+		for (int fd : { ready[0], ready[1], done[0], done[1] }) {
+			close(fd);
+		}
+		throw std::system_error(saved_errno, std::system_category());
+	}
+	if (pid == 0) {
+		char c;
+		close(ready[0]);
+		close(done[1]);
+		if (unshare(CLONE_NEWUSER) < 0) _exit(1);
+		if (write(ready[1], "", 1) < 1) _exit(1);
+		(void) read(done[0], &c, 1);
+		_exit(0);
+	}
+	close(ready[1]);
+	close(done[0]);
+
+	char c;
+	if (read(ready[0], &c, 1) < 1) {
+		close(ready[0]);
+		close(done[1]);
+		(void) waitpid(pid, NULL, 0);
+		errno = EPERM;
+		return -1;
+	}
+	// Closing <done> lets the child exit, once its namespace is open
+	int fd = -1;
+	int saved_errno = 0;
+	try {
+		initialize_uid_map(pid, idMap);
+		auto path = "/proc/" + std::to_string(pid) + "/ns/user";
+		fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			saved_errno = errno;
+			log_errno("open(2) of %s", path.c_str());
+		}
+	} catch (const std::system_error& e) {
+		saved_errno = e.code().value();
+	}
+	close(ready[0]);
+	close(done[1]);
+	(void) waitpid(pid, NULL, 0);
+	if (fd < 0) {
+		throw std::system_error(saved_errno, std::system_category());
+	}
+
+	return fd;
+}
+
+// Make a detached copy of the mount at <path> that shows file ownership
+// through the mapping of <usernsFd>. Returns -1 if the kernel or the
+// filesystem does not support idmapped mounts.
+static int open_idmapped_tree(const std::string& path, int usernsFd)
+{
+#ifdef MOUNT_ATTR_IDMAP
+	int fd = open_tree(AT_FDCWD, path.c_str(), OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
 
-	if (::mount(chrootDir.c_str(), chrootDir.c_str(), "", MS_BIND, NULL) < 0) {
-		err(1, "mount(2) of %s", chrootDir.c_str());
+	struct mount_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.attr_set = MOUNT_ATTR_IDMAP;
+	attr.userns_fd = usernsFd;
+	if (mount_setattr(fd, "", AT_EMPTY_PATH, &attr, sizeof(attr)) < 0) {
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		return -1;
 	}
-	auto mountpoint = std::string(chrootDir + "/sys");
-	if (mount("/sys", mountpoint.c_str(), "", MS_BIND | MS_RDONLY, NULL) < 0) {
-		err(1, "mount(2) of %s", mountpoint.c_str());
+	return fd;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static void attach_tree(int treeFd, const std::string& path)
+{
+#ifdef MOUNT_ATTR_IDMAP
+	if (move_mount(treeFd, "", AT_FDCWD, path.c_str(), MOVE_MOUNT_F_EMPTY_PATH) < 0) {
+		log_errno("move_mount(2) to %s", path.c_str());
+		throw std::system_error(errno, std::system_category());
 	}
-	mountpoint = std::string(chrootDir + "/dev");
-	if (mount("/dev", mountpoint.c_str(), "", MS_BIND, NULL) < 0) {
-		err(1, "mount(2) of %s", mountpoint.c_str());
+#else
+	throw std::runtime_error("idmapped mounts are not supported");
+#endif
+}
+
+bool LinuxJail::checkIdmapSupported(const std::string& path)
+{
+	int usernsFd = open_idmap_userns(get_legacy_id_map(geteuid()));
+	int treeFd = -1;
+	if (usernsFd >= 0) {
+		treeFd = open_idmapped_tree(path, usernsFd);
+		close(usernsFd);
 	}
-	mountpoint = std::string(chrootDir + "/dev/pts");
-	if (mount("devpts", mountpoint.c_str(), "devpts", 0, NULL) < 0) {
-		err(1, "mount(2) of %s", mountpoint.c_str());
+	if (treeFd < 0) {
+		log_debug("idmapped mounts are not supported on %s: %s", path.c_str(), strerror(errno));
+		return false;
 	}
+	close(treeFd);
+	return true;
+}
 
-        SetuidHelper::lowerPrivileges();
+std::string LinuxJail::getIdmapMarkerPath()
+{
+	// Kept in share/ beside the root, so it travels with snapshots and clones
+	return chrootDir.substr(0, chrootDir.rfind('/')) + "/.idmapped";
+}
+
+bool LinuxJail::isIdmapped()
+{
+	// The marker only counts if the owner could not have made it, which
+	// also means they cannot reach the setuid files below share/.
+	// Called with privileges raised.
+	std::string marker = getIdmapMarkerPath();
+	struct stat shareSb, markerSb;
+	if (lstat(marker.substr(0, marker.rfind('/')).c_str(), &shareSb) < 0 ||
+			lstat(marker.c_str(), &markerSb) < 0) {
+		return false;
+	}
+	return S_ISDIR(shareSb.st_mode) && shareSb.st_uid == 0 && !(shareSb.st_mode & 077) &&
+		S_ISREG(markerSb.st_mode) && markerSb.st_uid == 0;
+}
+
+std::string LinuxJail::getIdMap(uid_t ownerUid)
+{
+	if (idMap != "") {
+		return idMap;
+	}
+	if (!isIdmapped()) {
+		return get_legacy_id_map(ownerUid);
+	}
+	if (cgroupName == "") {
+		throw std::logic_error("the container has no name");
+	}
+	return SubidAllocator::getIdMap(ownerUid, SubidAllocator().acquire(cgroupName));
+}
+
+int LinuxJail::openStorageNamespace(uid_t ownerUid)
+{
+	if (isIdmapped()) {
+		return -1;
+	}
+	int fd = open_idmap_userns(get_legacy_id_map(ownerUid));
+	if (fd < 0) {
+		log_errno("unable to create a user namespace");
+		throw std::system_error(errno, std::system_category());
+	}
+	return fd;
+}
+
+void LinuxJail::release()
+{
+	SubidAllocator().release(cgroupName);
+	if (privateNetwork) {
+		NetnsPool().release(cgroupName);
+	}
+}
+
+void LinuxJail::mountIdmappedRoot(int usernsFd)
+{
+	int treeFd = open_idmapped_tree(chrootDir, usernsFd);
+	if (treeFd < 0) {
+		log_errno("unable to create an idmapped mount of %s", chrootDir.c_str());
+		throw std::runtime_error("this room requires idmapped mounts, which are not supported here");
+	}
+	try {
+		attach_tree(treeFd, chrootDir);
+	} catch (...) {
+		close(treeFd);
+		throw;
+	}
+	close(treeFd);
+}
+
+static void mount_or_throw(const char *source, const std::string& target, const char *fstype,
+		unsigned long flags)
+{
+	if (mount(source, target.c_str(), fstype, flags, NULL) < 0) {
+		log_errno("mount(2) of %s", target.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+}
+
+void LinuxJail::mountAll()
+{
+	PrivilegeGuard privileges;
+	int usernsFd = -1;
+	try {
+		if (isIdmapped()) {
+			usernsFd = open_idmap_userns(getIdMap(SetuidHelper::getActualUid()));
+			mountIdmappedRoot(usernsFd);
+			close(usernsFd);
+			usernsFd = -1;
+		} else {
+			mount_or_throw(chrootDir.c_str(), chrootDir, "", MS_BIND);
+		}
+		mount_or_throw("/sys", chrootDir + "/sys", "", MS_BIND | MS_RDONLY);
+		mount_or_throw("/dev", chrootDir + "/dev", "", MS_BIND);
+		mount_or_throw("devpts", chrootDir + "/dev/pts", "devpts", 0);
+	} catch (...) {
+		if (usernsFd >= 0) close(usernsFd);
+		throw;
+	}
 }
 
 void LinuxJail::unmountAll()
@@ -218,33 +504,102 @@ void LinuxJail::unmountAll()
 	
 }
 
-void LinuxJail::start()
+void LinuxJail::launch(uid_t ownerUid)
 {
-	std::string mountpoint;
-
-	uid_t ownerUid = geteuid();
-
-        SetuidHelper::raisePrivileges();
+	int syncfd[2];
+	if (pipe2(syncfd, O_CLOEXEC) < 0) {
+		log_errno("pipe2(2)");
+		throw std::system_error(errno, std::system_category());
+	}
 
-	if (pipe(semfd) < 0)
-		err(1, "prctl(2)");
+	// init inherits the network namespace of the thread that clones it
+	int hostNetFd = -1;
+	if (privateNetwork) {
+		int netnsFd = -1;
+		try {
+			netnsFd = NetnsPool().claim(cgroupName);
+			hostNetFd = open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC);
+			if (hostNetFd < 0) {
+				log_errno("open(2) of /proc/thread-self/ns/net");
+				throw std::system_error(errno, std::system_category());
+			}
+			if (setns(netnsFd, CLONE_NEWNET) < 0) {
+				log_errno("setns(2)");
+				throw std::system_error(errno, std::system_category());
+			}
+		} catch (...) {
+			if (netnsFd >= 0) (void) close(netnsFd);
+			if (hostNetFd >= 0) (void) close(hostNetFd);
+			(void) close(syncfd[0]);
+			(void) close(syncfd[1]);
+			throw;
+		}
+		(void) close(netnsFd);
+	}
 
-	int flags = CLONE_NEWIPC | CLONE_NEWNS | CLONE_NEWPID | CLONE_NEWUSER | CLONE_NEWUTS;
-	//std::cout << "about 2 going to " << chrootDir << "\n";
-	initPid = clone(jailMain, jail_stack + STACK_SIZE, flags, this);
-	if (initPid < 0) {
-		err(1, "clone(2)");
+	std::string procPath = chrootDir + "/proc";
+	InitArgs args = {
+		hostname.c_str(), hostname.length(),
+		chrootDir.c_str(), procPath.c_str(),
+		syncfd[0],
+	};
+	pid_t pid = clone_init(&args);
+	int saved_errno = errno;
+	(void) close(syncfd[0]);
+	if (hostNetFd >= 0) {
+		if (setns(hostNetFd, CLONE_NEWNET) < 0) {
+			err(1, "setns(2) back to the host network namespace");
+		}
+		(void) close(hostNetFd);
+	}
+	if (pid < 0) {
+		(void) close(syncfd[1]);
+		log_errno("clone(2)");
+		throw std::system_error(saved_errno, std::system_category());
 	}
 
-	initialize_uid_map(initPid, ownerUid);
+	// Closing the pipe without writing to it makes init exit
+	try {
+		initialize_uid_map(pid, getIdMap(ownerUid));
+
+		// The host has no idmapped view of the root unless "room mount" made one,
+		// so make it inside the room's mount namespace before init chroots into it.
+		if (isIdmapped() && !MountUtil::checkIsMounted(chrootDir)) {
+			mountIdmappedRootInto(pid);
+		}
+	} catch (...) {
+		(void) close(syncfd[1]);
+		(void) waitpid(pid, NULL, 0);
+		throw;
+	}
+	sync_post(syncfd[1]);
+	initPid = pid;
 
 	std::ofstream pidfile;
 	pidfile.open (initPidfilePath);
 	pidfile << std::to_string(initPid);
 	pidfile.close();
 
+	// Everything forked by init inherits its cgroup
+	if (Cgroup::isSupported()) {
+		try {
+			Cgroup cgroup(cgroupName);
+			cgroup.create();
+			cgroup.attach(initPid);
+		} catch (const std::exception& e) {
+			log_warning("unable to create cgroup %s: %s", cgroupName.c_str(), e.what());
+		}
+	}
+}
 
-        SetuidHelper::lowerPrivileges();
+void LinuxJail::start()
+{
+	uid_t ownerUid = geteuid();
+
+	{
+		PrivilegeGuard privileges;
+		launch(ownerUid);
+	}
 
 #if 0
 //tries to keep a namespace alive
@@ -273,21 +628,98 @@ void LinuxJail::start()
 
 void LinuxJail::stop()
 {
+	Cgroup cgroup(cgroupName);
+	bool hasCgroup = Cgroup::isSupported() && cgroup.exists();
+
+	// Frozen processes would not see the SIGTERM
+	if (hasCgroup && cgroup.isFrozen()) {
+		thaw();
+	}
+
 	killInit();
 
+	if (privateNetwork) {
+		PrivilegeGuard privileges;
+		try {
+			NetnsPool().release(cgroupName);
+		} catch (const std::exception& e) {
+			log_warning("unable to release the network namespace: %s", e.what());
+		}
+	}
+
+	if (hasCgroup) {
+		PrivilegeGuard privileges;
+		if (!cgroup.destroy()) {
+			log_debug("cgroup %s is still in use; leaving it in place", cgroupName.c_str());
+		}
+	}
+
 	log_debug("stop complete");
 }
 
+int64_t LinuxJail::freeze()
+{
+	Cgroup cgroup(cgroupName);
+	if (!Cgroup::isSupported() || !cgroup.exists()) {
+		throw std::runtime_error("the room has no cgroup to freeze");
+	}
+	PrivilegeGuard privileges;
+	return cgroup.freeze();
+}
+
+int64_t LinuxJail::thaw()
+{
+	Cgroup cgroup(cgroupName);
+	if (!Cgroup::isSupported() || !cgroup.exists()) {
+		throw std::runtime_error("the room has no cgroup to thaw");
+	}
+	PrivilegeGuard privileges;
+	return cgroup.thaw();
+}
+
+bool LinuxJail::isFrozen()
+{
+	Cgroup cgroup(cgroupName);
+	return Cgroup::isSupported() && cgroup.exists() && cgroup.isFrozen();
+}
+
+void LinuxJail::joinCgroup()
+{
+	if (cgroupProcsFd < 0) {
+		return;
+	}
+	// "0" means the writing process
+	if (write(cgroupProcsFd, "0", 1) < 0) {
+		log_errno("unable to join cgroup %s", cgroupName.c_str());
+	}
+	(void) close(cgroupProcsFd);
+	cgroupProcsFd = -1;
+}
+
 void LinuxJail::enter()
 {
 	pid_t pid = getInitPid();
 
 	log_debug("entering PID namespace %zu", (size_t) pid);
+
+	// The cgroup hierarchy is not visible after chroot(2), so open it now
+	// for joinCgroup() to use later
+	Cgroup cgroup(cgroupName);
+	if (Cgroup::isSupported() && cgroup.exists()) {
+		std::string procsPath = cgroup.getPath() + "/cgroup.procs";
+		cgroupProcsFd = open(procsPath.c_str(), O_WRONLY | O_CLOEXEC);
+		if (cgroupProcsFd < 0) {
+			log_errno("open(2) of %s", procsPath.c_str());
+		}
+	}
 // FIXME: need this, but returns EPERM
 //	update_map(getpid(), "uid_map");
 	//update_map(getpid(), "gid_map");
 
 	enter_ns(pid, "ipc");
+	if (privateNetwork) {
+		enter_ns(pid, "net");
+	}
 	enter_ns(pid, "mnt");
 	enter_ns(pid, "uts");
 	enter_ns(pid, "pid");
@@ -296,7 +728,7 @@ void LinuxJail::enter()
 #else
 	enter_ns(pid, "user");
 #endif
-	//not entered: net
+	//not entered: net, unless the room has a private network
 
         if (chdir(chrootDir.c_str()) < 0) {
 		err(1, "chdir(2)");
@@ -307,18 +739,253 @@ void LinuxJail::enter()
         }
 }
 
+// Options shared by "criu dump" and "criu restore". The bind mounts of
+// /dev, /sys and /dev/pts come from the host, so CRIU is told to expect
+// mounts from outside the container.
+static const std::vector<std::string> criuCommonOptions = {
+	"--ext-mount-map", "auto",
+	"--enable-external-sharing",
+	"--enable-external-masters",
+	"--file-locks",
+	"--tcp-established",
+	"--ext-unix-sk",
+};
+
+void LinuxJail::suspend(const std::string& imageDir)
+{
+	int rv;
+	pid_t pid = getInitPid();
+
+	std::vector<std::string> args = { "dump", "--tree", std::to_string(pid), "--images-dir", imageDir,
+		"--log-file", "dump.log" };
+	args.insert(args.end(), criuCommonOptions.begin(), criuCommonOptions.end());
+
+	log_debug("checkpointing init process %d to %s", (int) pid, imageDir.c_str());
+	{
+		PrivilegeGuard privileges;
+		Shell::execute(criuPath, args, rv);
+	}
+	if (rv != 0) {
+		log_error("criu(8) dump failed; rv=%d, see %s/dump.log", rv, imageDir.c_str());
+		throw std::runtime_error("criu dump failed");
+	}
+
+	// CRIU kills the process tree once the checkpoint is written
+	FileUtil::unlink(initPidfilePath);
+}
+
+void LinuxJail::resume(const std::string& imageDir)
+{
+	int rv;
+
+	std::vector<std::string> args = { "restore", "--images-dir", imageDir, "--restore-detached",
+		"--pidfile", initPidfilePath, "--log-file", "restore.log" };
+	args.insert(args.end(), criuCommonOptions.begin(), criuCommonOptions.end());
+
+	log_debug("restoring init process from %s", imageDir.c_str());
+	{
+		PrivilegeGuard privileges;
+		Shell::execute(criuPath, args, rv);
+	}
+	if (rv != 0) {
+		log_error("criu(8) restore failed; rv=%d, see %s/restore.log", rv, imageDir.c_str());
+		throw std::runtime_error("criu restore failed");
+	}
+
+	initPid = getInitPid();
+}
+
+void LinuxJail::mountIdmappedRootInto(pid_t pid)
+{
+	auto nsdir = "/proc/" + std::to_string(pid) + "/ns";
+	int usernsFd = open(std::string(nsdir + "/user").c_str(), O_RDONLY | O_CLOEXEC);
+	if (usernsFd < 0) {
+		log_errno("open(2) of %s/user", nsdir.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+	int treeFd = open_idmapped_tree(chrootDir, usernsFd);
+	close(usernsFd);
+	if (treeFd < 0) {
+		log_errno("unable to create an idmapped mount of %s", chrootDir.c_str());
+		throw std::runtime_error("this room requires idmapped mounts, which are not supported here");
+	}
+
+	// The room's mounts are slaves of the host's, so this does not propagate back
+	log_flush();
+	pid_t child = fork();
+	if (child < 0) {
+		int saved_errno = errno;
+		log_errno("fork(2)");
+		close(treeFd);
+		throw std::system_error(saved_errno, std::system_category());
+	}
+	if (child == 0) {
+		enter_ns(pid, "mnt");
+		try {
+			attach_tree(treeFd, chrootDir);
+		} catch (...) {
+			_exit(1);
+		}
+		_exit(0);
+	}
+	close(treeFd);
+
+	int status;
+	if (waitpid(child, &status, 0) < 0) {
+		log_errno("waitpid(2)");
+		throw std::system_error(errno, std::system_category());
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		throw std::runtime_error("unable to mount the root of the room");
+	}
+}
+
+// True if <fd> is a directory with nothing in it. Consumes <fd>.
+static bool is_empty_directory(int fd)
+{
+	DIR *dir = fdopendir(fd);
+	if (!dir) {
+		int saved_errno = errno;
+		(void) close(fd);
+		throw std::system_error(saved_errno, std::system_category());
+	}
+	bool empty = true;
+	struct dirent *ent;
+	while ((ent = readdir(dir)) != NULL) {
+		if (strcmp(ent->d_name, ".") && strcmp(ent->d_name, "..")) {
+			empty = false;
+			break;
+		}
+	}
+	(void) closedir(dir);
+	return empty;
+}
+
+// Unpack as real root into a share/ that only root can reach. This keeps
+// the archive's owners, modes and setuid bits, so it is only done for
+// archives provided by the administrator.
+static void unpack_as_root(const std::string& chrootDir, int archiveFd)
+{
+	std::string shareDir = chrootDir.substr(0, chrootDir.rfind('/'));
+	int shareFd = FileUtil::openDirectory(shareDir, O_RDONLY);
+	int rootFd = -1;
+	try {
+		if (fchown(shareFd, 0, 0) < 0 || fchmod(shareFd, 0700) < 0) {
+			log_errno("unable to make %s private to root", shareDir.c_str());
+			throw std::system_error(errno, std::system_category());
+		}
+		rootFd = openat(shareFd, "root", O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (rootFd < 0) {
+			log_errno("open(2) of %s", chrootDir.c_str());
+			throw std::system_error(errno, std::system_category());
+		}
+		int dirFd = dup(rootFd);
+		if (dirFd < 0 || !is_empty_directory(dirFd)) {
+			throw std::runtime_error("the root of the room is not empty");
+		}
+		if (fchown(rootFd, 0, 0) < 0) {
+			log_errno("fchown(2) of %s", chrootDir.c_str());
+			throw std::system_error(errno, std::system_category());
+		}
+
+		// tar(1) inherits both descriptors, so no path is resolved again
+		Shell::execute("/bin/tar", {
+			"-C", "/proc/self/fd/" + std::to_string(rootFd),
+			"--numeric-owner", "--same-owner", "--same-permissions",
+			"--exclude=./dev/*",
+			"-Jxf", "/proc/self/fd/" + std::to_string(archiveFd) });
+
+		int markerFd = openat(shareFd, ".idmapped",
+				O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+		if (markerFd < 0) {
+			log_errno("unable to create the idmapped marker");
+			throw std::system_error(errno, std::system_category());
+		}
+		(void) close(markerFd);
+	} catch (...) {
+		if (rootFd >= 0) (void) close(rootFd);
+		(void) close(shareFd);
+		throw;
+	}
+	(void) close(rootFd);
+	(void) close(shareFd);
+}
+
 void LinuxJail::unpack(const std::string& archivePath) 
 {
 	log_debug("unpacking %s", archivePath.c_str());
+	log_flush();
+
+	// Opened as the owner, so they cannot name a file they could not read.
+	// Not close-on-exec, so that tar(1) can read it from /proc/self/fd.
+	int archiveFd = open(archivePath.c_str(), O_RDONLY);
+	if (archiveFd < 0) {
+		log_errno("open(2) of %s", archivePath.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+	struct stat sb;
+	if (fstat(archiveFd, &sb) < 0) {
+		int saved_errno = errno;
+		(void) close(archiveFd);
+		throw std::system_error(saved_errno, std::system_category());
+	}
+	bool trusted = S_ISREG(sb.st_mode) && sb.st_uid == 0 && !(sb.st_mode & (S_IWGRP | S_IWOTH));
+
+	// With idmapped mounts, files are stored with the ids they have inside
+	// the room, and the mapping to the owner's ids happens at mount time.
+	// Anything else is unpacked inside a user namespace, where setuid bits
+	// and ownership can only refer to the room's own ids.
+	if (trusted) {
+		PrivilegeGuard privileges;
+		try {
+			if (checkIdmapSupported(chrootDir)) {
+				unpack_as_root(chrootDir, archiveFd);
+				privileges.lower();
+				(void) close(archiveFd);
+				log_debug("unpack complete");
+				return;
+			}
+		} catch (...) {
+			privileges.lower();
+			(void) close(archiveFd);
+			throw std::runtime_error("unable to unpack archive");
+		}
+	} else {
+		log_debug("%s is not owned by root; unpacking without idmapped mounts", archivePath.c_str());
+	}
+	(void) close(archiveFd);
+
+	int ready[2], go[2];
+	if (pipe2(ready, O_CLOEXEC) < 0) {
+		log_errno("pipe2(2)");
+		throw std::system_error(errno, std::system_category());
+	}
+	if (pipe2(go, O_CLOEXEC) < 0) {
+		int saved_errno = errno;
+		log_errno("pipe2(2)");
+		close(ready[0]);
+		close(ready[1]);
+		throw std::system_error(saved_errno, std::system_category());
+	}
+
+	log_flush();
 	pid_t pid = fork();
 	if (pid < 0) {
-		err(1, "fork(2)");
+		int saved_errno = errno;
+		log_errno("fork(2)");
+		for (int fd : { ready[0], ready[1], go[0], go[1] }) {
+			close(fd);
+		}
+		throw std::system_error(saved_errno, std::system_category());
 	}
 	if (pid == 0) {
-		sleep(3);
+		close(ready[0]);
+		close(go[1]);
 		auto tmprootDir = chrootDir;
 		log_debug("switching to new namespaces");
 		if (unshare(CLONE_NEWUSER) < 0) err(1, "unshare");
+		sync_post(ready[1]);
+		if (!sync_wait(go[0])) _exit(1);
 		if (unshare(CLONE_NEWNS) < 0) err(1, "unshare");
 		if (mount(chrootDir.c_str(), tmprootDir.c_str(), "", MS_BIND, NULL) < 0) err(1, "mount");
         	Subprocess proc;
@@ -327,11 +994,27 @@ void LinuxJail::unpack(const std::string& archivePath)
 			"-Jxf", archivePath });
 		err(1, "execve(2))");
 	} else {
-		initialize_uid_map(pid, geteuid());
+		close(ready[1]);
+		close(go[0]);
+		bool isReady = sync_wait(ready[0]);
+		if (isReady) {
+			try {
+				initialize_uid_map(pid, get_legacy_id_map(geteuid()));
+			} catch (...) {
+				isReady = false;
+			}
+		}
+		if (!isReady) {
+			// Closing <go> without writing to it makes the child exit
+			close(go[1]);
+			(void) waitpid(pid, NULL, 0);
+			throw std::runtime_error("unable to unpack archive");
+		}
+		sync_post(go[1]);
 		int status;
-		wait(&status);
-		if (!WIFEXITED(status) || WEXITSTATUS(status))
-			errx(1, "unable to unpack archive");
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+			throw std::runtime_error("unable to unpack archive");
+		}
 	}
 	log_debug("unpack complete");
 }
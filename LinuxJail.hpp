@@ -20,13 +20,43 @@ class LinuxJail : public Container
 {
 public:
 	LinuxJail();
+	~LinuxJail();
 
 	bool isRunning();
 	void enter();
 	void start();
+	// The privileged part of start(), which expects privileges to be raised.
+	// Launches from different threads run one at a time, since the caller
+	// holds raised privileges for the whole launch.
+	void launch(uid_t ownerUid);
 	void stop();
 	void mountAll();
 	void unmountAll();
 	void unpack(const std::string& archivePath);
+	void suspend(const std::string& imageDir);
+	void resume(const std::string& imageDir);
+	int64_t freeze();
+	int64_t thaw();
+	bool isFrozen();
+	void joinCgroup();
+	void release();
+	// The uid_map and gid_map for the room: a range of its own if it is
+	// idmapped, or the shared legacy range its files were unpacked with
+	std::string getIdMap(uid_t ownerUid);
+	int openStorageNamespace(uid_t ownerUid);
 	static void main_hook();
+
+	// True if <path> can be mounted through an idmapped mount
+	static bool checkIdmapSupported(const std::string& path);
+
+private:
+	// Rooms unpacked with idmapped mounts available keep canonical ownership
+	// on disk, and have a marker file that says so
+	std::string getIdmapMarkerPath();
+	bool isIdmapped();
+	void mountIdmappedRoot(int usernsFd);
+	void mountIdmappedRootInto(pid_t pid);
+
+	// cgroup.procs of the container, opened by enter() while still on the host
+	int cgroupProcsFd = -1;
 };
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdexcept>
+#include <system_error>
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+#include "fileUtil.h"
+#include "LockManager.hpp"
+#include "logger.h"
+#include "setuidHelper.h"
+
+LockManager::Lock& LockManager::Lock::operator=(Lock&& other)
+{
+	if (this != &other) {
+		release();
+		fd = other.fd;
+		other.fd = -1;
+	}
+	return *this;
+}
+
+void LockManager::Lock::release()
+{
+	if (fd >= 0) {
+		(void) close(fd);
+		fd = -1;
+	}
+}
+
+LockManager::Lock LockManager::lockRoom(const std::string& owner, const std::string& name, Mode mode)
+{
+	return lockPath(lockDir + "/" + owner, name, "room `" + name + "'", mode);
+}
+
+LockManager::Lock LockManager::lockGlobal()
+{
+	return lockPath(lockDir, ".global", "the global lock", EXCLUSIVE);
+}
+
+LockManager::Lock LockManager::lockPath(const std::string& dir, const std::string& file,
+		const std::string& what, Mode mode)
+{
+	std::string path = dir + "/" + file;
+
+	int fd;
+	{
+		PrivilegeGuard privileges;
+		FileUtil::createRuntimeDir();
+		FileUtil::mkdir_idempotent(lockDir, 0700, 0, 0);
+		FileUtil::mkdir_idempotent(dir, 0700, 0, 0);
+		fd = open(path.c_str(), O_RDONLY | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+		if (fd < 0) {
+			log_errno("open(2) of %s", path.c_str());
+			throw std::system_error(errno, std::system_category());
+		}
+	}
+
+	Lock lock(fd);
+	if (flock(fd, mode | LOCK_NB) == 0) {
+		return lock;
+	}
+	if (errno != EWOULDBLOCK) {
+		log_errno("flock(2) of %s", path.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+	log_debug("waiting for %s", what.c_str());
+	while (flock(fd, mode) < 0) {
+		if (errno != EINTR) {
+			log_errno("flock(2) of %s", path.c_str());
+			throw std::system_error(errno, std::system_category());
+		}
+	}
+	return lock;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <string>
+
+extern "C" {
+#include <sys/file.h>
+}
+
+// Keeps concurrent room(1) commands from stepping on each other.
+//
+// Each room has a reader/writer lock, which is a flock(2) on a file named
+// after the room. Commands that change the state of a room hold it
+// exclusively, and commands that only use the room hold it shared, so
+// unrelated rooms can be worked on in parallel. A separate global lock
+// covers the one-time setup of /room and of each user's room directory.
+//
+// Lock files live below /run/room/locks, so they go away when the host
+// reboots. They are never removed otherwise, because removing a lock file
+// that someone is waiting on would let two commands in at once.
+//
+// All functions expect privileges to be lowered.
+class LockManager {
+public:
+	enum Mode {
+		SHARED = LOCK_SH,
+		EXCLUSIVE = LOCK_EX,
+	};
+
+	// A lock that is held until this object goes away
+	class Lock {
+	public:
+		Lock() {}
+		explicit Lock(int fd) : fd(fd) {}
+		Lock(Lock&& other) : fd(other.fd) {
+			other.fd = -1;
+		}
+		Lock& operator=(Lock&& other);
+		Lock(const Lock&) = delete;
+		Lock& operator=(const Lock&) = delete;
+		~Lock() {
+			release();
+		}
+
+		bool isHeld() const {
+			return fd >= 0;
+		}
+
+		void release();
+
+	private:
+		int fd = -1;
+	};
+
+	LockManager(const std::string& lockDir = "/run/room/locks") : lockDir(lockDir) {}
+
+	// Lock the room named <name> that belongs to <owner>. The room does not
+	// have to exist yet, so this also keeps two commands from creating it.
+	Lock lockRoom(const std::string& owner, const std::string& name, Mode mode);
+
+	// Lock out everything else that sets up /room
+	Lock lockGlobal();
+
+private:
+	std::string lockDir;
+
+	Lock lockPath(const std::string& dir, const std::string& file, const std::string& what, Mode mode);
+};
@@ -18,7 +18,10 @@
 
 extern "C" {
 #ifdef __linux__
+#include <fcntl.h>
 #include <mntent.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
 #endif
 
 #ifdef __FreeBSD__
@@ -31,10 +34,44 @@ extern "C" {
 }
 
 #include "fileUtil.h"
+#include "setuidHelper.h"
 
 class MountUtil {
 public:
 
+#ifdef __linux__
+	// Open the directory <path> without anything that is mounted below
+	// it, such as the filesystems of a running room, by making a detached
+	// copy of its mount. Where that can't be done, <path> itself is opened
+	// and <mountId> is set, so that callers can stay out of other mounts by
+	// comparing it with stx_mnt_id. Privileges must be raised. Like
+	// FileUtil::openDirectory(), no symlink the owner made is followed.
+	static int openWithoutSubmounts(const std::string& path, uint64_t& mountId) {
+		mountId = 0;
+		int pathFd = FileUtil::openDirectory(path, O_PATH | O_CLOEXEC);
+		int fd = -1;
+#ifdef OPEN_TREE_CLONE
+		fd = open_tree(pathFd, "", OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | AT_EMPTY_PATH);
+#endif
+		if (fd >= 0) {
+			(void) close(pathFd);
+			return fd;
+		}
+
+		fd = openat(pathFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		(void) close(pathFd);
+		if (fd < 0) {
+			log_errno("open(2) of %s", path.c_str());
+			throw std::system_error(errno, std::system_category());
+		}
+		struct statx stx;
+		if (statx(fd, "", AT_EMPTY_PATH, STATX_MNT_ID, &stx) == 0 && (stx.stx_mask & STATX_MNT_ID)) {
+			mountId = stx.stx_mnt_id;
+		}
+		return fd;
+	}
+#endif
+
 	static bool checkIsMounted(const std::string& path) {
 #ifdef __linux__
 		FILE* f;
@@ -96,9 +133,8 @@ public:
 		if (string(ent->mnt_dir).compare(0, query.length(), query) == 0) {
 		//std::cout << ent->mnt_fsname << " -- " << ent->mnt_dir << "\n";
 		log_debug("unmounting %s", ent->mnt_dir);
-SetuidHelper::raisePrivileges();
+		PrivilegeGuard privileges;
 		FileUtil::unmount(ent->mnt_dir, MNT_FORCE);
-SetuidHelper::lowerPrivileges();
 		}
 	}
 	endmntent(f);
@@ -0,0 +1,421 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <system_error>
+
+extern "C" {
+#include <dirent.h>
+#include <err.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/file.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+}
+
+#include "fileUtil.h"
+#include "logger.h"
+#include "NetnsPool.hpp"
+
+// Each namespace gets the <index>th /30 of this /16
+static const unsigned int MAX_ENTRIES = 16384;
+
+// The owner of entries that are still being set up
+static const char *CREATING = "(creating)";
+
+static std::string get_address(unsigned int index, unsigned int host)
+{
+	unsigned int offset = index * 4 + host;
+	return "10.213." + std::to_string(offset / 256) + "." + std::to_string(offset % 256);
+}
+
+std::string NetnsPool::getHostAddress(unsigned int index)
+{
+	return get_address(index, 1);
+}
+
+std::string NetnsPool::getRoomAddress(unsigned int index)
+{
+	return get_address(index, 2);
+}
+
+static std::string find_ip()
+{
+	for (const char *path : { "/sbin/ip", "/usr/sbin/ip", "/bin/ip", "/usr/bin/ip" }) {
+		if (FileUtil::checkExists(path)) {
+			return path;
+		}
+	}
+	throw std::runtime_error("ip(8) is not installed");
+}
+
+// Run ip(8) with <args>, inside the network namespace <netnsFd> unless it is -1
+static void run_ip(int netnsFd, const std::vector<std::string>& args)
+{
+	std::string path = find_ip();
+	std::vector<char*> argv;
+	argv.push_back(const_cast<char*>(path.c_str()));
+	for (auto& arg : args) {
+		argv.push_back(const_cast<char*>(arg.c_str()));
+	}
+	argv.push_back(NULL);
+
+	log_flush();
+	pid_t pid = fork();
+	if (pid < 0) {
+		log_errno("fork(2)");
+		throw std::system_error(errno, std::system_category());
+	}
+	if (pid == 0) {
+		if (netnsFd >= 0 && setns(netnsFd, CLONE_NEWNET) < 0) {
+			err(1, "setns(2)");
+		}
+		execv(argv[0], argv.data());
+		err(1, "execv(2) of %s", argv[0]);
+	}
+
+	int status;
+	if (waitpid(pid, &status, 0) < 0) {
+		log_errno("waitpid(2)");
+		throw std::system_error(errno, std::system_category());
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		std::string cmdline = "ip";
+		for (auto& arg : args) {
+			cmdline += " " + arg;
+		}
+		throw std::runtime_error("command failed: " + cmdline);
+	}
+}
+
+std::string NetnsPool::getEntryPath(unsigned int index)
+{
+	return poolDir + "/" + std::to_string(index);
+}
+
+// Keys are paths like room/<login>/<room>, and login and room names may
+// contain dots, so escape '/' in a way that no other key can produce.
+std::string NetnsPool::getClaimPath(const std::string& key)
+{
+	std::string name;
+	for (char c : key) {
+		if (c == '%') {
+			name += "%25";
+		} else if (c == '/') {
+			name += "%2F";
+		} else {
+			name += c;
+		}
+	}
+	return poolDir + "/claims/" + name;
+}
+
+void NetnsPool::createPool()
+{
+	FileUtil::createRuntimeDir();
+	for (const std::string& path : { poolDir, poolDir + "/claims" }) {
+		if (::mkdir(path.c_str(), 0700) < 0 && errno != EEXIST) {
+			log_errno("mkdir(2) of %s", path.c_str());
+			throw std::system_error(errno, std::system_category());
+		}
+	}
+}
+
+int NetnsPool::lockPool()
+{
+	createPool();
+	std::string lockPath = poolDir + "/.lock";
+	int fd = open(lockPath.c_str(), O_RDONLY | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		log_errno("open(2) of %s", lockPath.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+	if (flock(fd, LOCK_EX) < 0) {
+		int saved_errno = errno;
+		(void) close(fd);
+		log_errno("flock(2) of %s", lockPath.c_str());
+		throw std::system_error(saved_errno, std::system_category());
+	}
+	return fd;
+}
+
+std::vector<unsigned int> NetnsPool::listIndexes()
+{
+	std::vector<unsigned int> result;
+
+	DIR *dir = opendir(poolDir.c_str());
+	if (!dir) {
+		if (errno == ENOENT) {
+			return result;
+		}
+		log_errno("opendir(3) of %s", poolDir.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+	struct dirent *dp;
+	while ((dp = readdir(dir)) != NULL) {
+		std::string name = dp->d_name;
+		if (name.empty() || name.find_first_not_of("0123456789") != std::string::npos) {
+			continue;
+		}
+		result.push_back(std::stoul(name));
+	}
+	closedir(dir);
+	std::sort(result.begin(), result.end());
+	return result;
+}
+
+std::vector<NetnsPool::Entry> NetnsPool::list()
+{
+	std::vector<Entry> result;
+	for (unsigned int index : listIndexes()) {
+		Entry entry = { index, "" };
+		std::ifstream ifs(getEntryPath(index) + ".owner");
+		if (ifs.is_open()) {
+			std::getline(ifs, entry.owner);
+			if (entry.owner == "") {
+				entry.owner = "?";
+			}
+		}
+		result.push_back(entry);
+	}
+	return result;
+}
+
+unsigned int NetnsPool::createEntry()
+{
+	// Reuse the lowest free index, so addresses stay dense
+	auto indexes = listIndexes();
+	unsigned int index = 0;
+	for (unsigned int used : indexes) {
+		if (used != index) {
+			break;
+		}
+		index++;
+	}
+	if (index >= MAX_ENTRIES) {
+		throw std::runtime_error("the network namespace pool is full");
+	}
+
+	std::string path = getEntryPath(index);
+	std::string vethName = "room" + std::to_string(index);
+	log_debug("creating network namespace %s", path.c_str());
+
+	// Hold the entry while it is being set up, so claim() passes it by
+	if (!tryClaim(index, CREATING)) {
+		throw std::runtime_error("network namespace " + std::to_string(index) + " is already claimed");
+	}
+	int fd = open(path.c_str(), O_RDONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		log_errno("open(2) of %s", path.c_str());
+		int saved_errno = errno;
+		release(CREATING);
+		throw std::system_error(saved_errno, std::system_category());
+	}
+	(void) close(fd);
+
+	// Bind mount the namespace of a short-lived child to keep it alive
+	int ready[2], done[2];
+	if (pipe2(ready, O_CLOEXEC) < 0 || pipe2(done, O_CLOEXEC) < 0) {
+		log_errno("pipe2(2)");
+		throw std::system_error(errno, std::system_category());
+	}
+	log_flush();
+	pid_t pid = fork();
+	if (pid < 0) {
+		log_errno("fork(2)");
+		throw std::system_error(errno, std::system_category());
+	}
+	if (pid == 0) {
+		char c;
+		close(ready[0]);
+		close(done[1]);
+		if (unshare(CLONE_NEWNET) < 0) _exit(1);
+		if (write(ready[1], "", 1) < 1) _exit(1);
+		(void) read(done[0], &c, 1);
+		_exit(0);
+	}
+	close(ready[1]);
+	close(done[0]);
+
+	char c;
+	bool ok = (read(ready[0], &c, 1) == 1);
+	std::string nsPath = "/proc/" + std::to_string(pid) + "/ns/net";
+	if (ok && mount(nsPath.c_str(), path.c_str(), NULL, MS_BIND, NULL) < 0) {
+		log_errno("mount(2) of %s", nsPath.c_str());
+		ok = false;
+	}
+	close(ready[0]);
+	close(done[1]);
+	(void) waitpid(pid, NULL, 0);
+	if (!ok) {
+		(void) unlink(path.c_str());
+		release(CREATING);
+		throw std::runtime_error("unable to create a network namespace");
+	}
+
+	int netnsFd = -1;
+	try {
+		netnsFd = openEntry(index);
+
+		// Clean up after a previous pool that was torn down halfway
+		if (FileUtil::checkExists("/sys/class/net/" + vethName)) {
+			run_ip(-1, { "link", "del", vethName });
+		}
+
+		run_ip(-1, { "link", "add", vethName, "type", "veth", "peer", "name", "eth0",
+				"netns", path });
+		run_ip(-1, { "addr", "add", getHostAddress(index) + "/30", "dev", vethName });
+		run_ip(-1, { "link", "set", vethName, "up" });
+		run_ip(netnsFd, { "link", "set", "lo", "up" });
+		run_ip(netnsFd, { "addr", "add", getRoomAddress(index) + "/30", "dev", "eth0" });
+		run_ip(netnsFd, { "link", "set", "eth0", "up" });
+		run_ip(netnsFd, { "route", "add", "default", "via", getHostAddress(index) });
+	} catch (...) {
+		if (netnsFd >= 0) {
+			(void) close(netnsFd);
+		}
+		(void) umount2(path.c_str(), MNT_DETACH);
+		(void) unlink(path.c_str());
+		release(CREATING);
+		throw;
+	}
+	(void) close(netnsFd);
+
+	release(CREATING);
+	return index;
+}
+
+int NetnsPool::openEntry(unsigned int index)
+{
+	std::string path = getEntryPath(index);
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		log_errno("open(2) of %s", path.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+	return fd;
+}
+
+bool NetnsPool::tryClaim(unsigned int index, const std::string& key)
+{
+	std::string ownerPath = getEntryPath(index) + ".owner";
+	int fd = open(ownerPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		if (errno == EEXIST) {
+			return false;
+		}
+		log_errno("open(2) of %s", ownerPath.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+	std::string buf = key + "\n";
+	bool ok = (write(fd, buf.c_str(), buf.length()) == (ssize_t) buf.length());
+	(void) close(fd);
+
+	std::string claimPath = getClaimPath(key);
+	if (!ok || symlink(std::to_string(index).c_str(), claimPath.c_str()) < 0) {
+		int saved_errno = errno;
+		(void) unlink(ownerPath.c_str());
+		log_errno("symlink(2) of %s", claimPath.c_str());
+		throw std::system_error(saved_errno, std::system_category());
+	}
+	return true;
+}
+
+int NetnsPool::claim(const std::string& key)
+{
+	createPool();
+
+	// A room that was not stopped cleanly still owns its namespace
+	char buf[32];
+	ssize_t len = readlink(getClaimPath(key).c_str(), buf, sizeof(buf) - 1);
+	if (len > 0) {
+		buf[len] = '\0';
+		return openEntry(std::stoul(buf));
+	}
+
+	// Claiming is lock-free; a racing claim just moves on to the next entry
+	for (unsigned int index : listIndexes()) {
+		if (tryClaim(index, key)) {
+			log_debug("claimed network namespace %u for %s", index, key.c_str());
+			return openEntry(index);
+		}
+	}
+
+	log_warning("the network namespace pool is empty; see \"room netpool\"");
+	for (;;) {
+		int lockfd = lockPool();
+		unsigned int index;
+		try {
+			index = createEntry();
+		} catch (...) {
+			(void) close(lockfd);
+			throw;
+		}
+		(void) close(lockfd);
+
+		// Another room may have claimed it first
+		if (tryClaim(index, key)) {
+			return openEntry(index);
+		}
+	}
+}
+
+void NetnsPool::release(const std::string& key)
+{
+	std::string claimPath = getClaimPath(key);
+	char buf[32];
+	ssize_t len = readlink(claimPath.c_str(), buf, sizeof(buf) - 1);
+	if (len <= 0) {
+		return;
+	}
+	buf[len] = '\0';
+
+	// Nothing can have changed inside: the room's root user has no
+	// privileges over a namespace owned by the host
+	std::string ownerPath = poolDir + "/" + buf + ".owner";
+	if (unlink(ownerPath.c_str()) < 0 && errno != ENOENT) {
+		log_errno("unlink(2) of %s", ownerPath.c_str());
+	}
+	if (unlink(claimPath.c_str()) < 0) {
+		log_errno("unlink(2) of %s", claimPath.c_str());
+	}
+	log_debug("released network namespace %s from %s", buf, key.c_str());
+}
+
+void NetnsPool::fill(unsigned int size)
+{
+	int lockfd = lockPool();
+	try {
+		unsigned int available = 0;
+		for (auto& entry : list()) {
+			if (entry.owner == "") {
+				available++;
+			}
+		}
+		for (; available < size; available++) {
+			createEntry();
+		}
+	} catch (...) {
+		(void) close(lockfd);
+		throw;
+	}
+	(void) close(lockfd);
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+// A pool of network namespaces, created ahead of time, for rooms that
+// should not share the network stack of the host.
+//
+// Each namespace has its loopback interface up and one end of a veth pair
+// named eth0, with an address in 10.213.0.0/16 and a default route to the
+// other end, which stays on the host. Setting all this up takes several
+// netlink round trips, so fill() does it in advance, and starting a room
+// only has to claim() a namespace that is ready.
+//
+// The namespaces are bind mounted below /run/room/netns, so they go away
+// when the host reboots. All functions expect privileges to be raised.
+class NetnsPool {
+public:
+	struct Entry {
+		unsigned int index;
+		std::string owner; // the key that claimed it, or "" if it is free
+	};
+
+	NetnsPool(const std::string& poolDir = "/run/room/netns") : poolDir(poolDir) {}
+
+	// Return a descriptor for the namespace claimed by <key>, claiming a free
+	// one if it has none. Creates a namespace if the pool is empty.
+	int claim(const std::string& key);
+
+	// Return the namespace claimed by <key> to the pool
+	void release(const std::string& key);
+
+	// Create namespaces until <size> of them are free
+	void fill(unsigned int size);
+
+	std::vector<Entry> list();
+
+	// The addresses of the host and room ends of the veth pair of a namespace
+	static std::string getHostAddress(unsigned int index);
+	static std::string getRoomAddress(unsigned int index);
+
+private:
+	std::string poolDir;
+
+	void createPool();
+	int lockPool();
+	unsigned int createEntry();
+	bool tryClaim(unsigned int index, const std::string& key);
+	int openEntry(unsigned int index);
+	std::string getEntryPath(unsigned int index);
+	std::string getClaimPath(const std::string& key);
+	std::vector<unsigned int> listIndexes();
+};
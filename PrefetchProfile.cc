@@ -0,0 +1,434 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+extern "C" {
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/openat2.h>
+#include <sys/fanotify.h>
+#endif
+}
+
+#include "fileUtil.h"
+#include "logger.h"
+#include "PrefetchProfile.hpp"
+
+PrefetchProfile::~PrefetchProfile()
+{
+	if (fanotifyFd >= 0) {
+		(void) close(fanotifyFd);
+	}
+	if (rootFd >= 0) {
+		(void) close(rootFd);
+	}
+}
+
+// Open the file <path>, which starts with "/", as if <rootFd> was the root
+// directory. Returns -1 and sets errno on failure.
+static int open_in_root(int rootFd, const std::string& path)
+{
+	int flags = O_RDONLY | O_NOFOLLOW | O_NOCTTY | O_NONBLOCK | O_CLOEXEC;
+#ifdef SYS_openat2
+	// Symlinks are resolved inside the root, and mounts like the room's
+	// /dev are not crossed
+	struct open_how how;
+	memset(&how, 0, sizeof(how));
+	how.flags = flags;
+	how.resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS | RESOLVE_NO_XDEV;
+	int fd = syscall(SYS_openat2, rootFd, path.c_str(), &how, sizeof(how));
+	if (fd >= 0 || errno != ENOSYS) {
+		return fd;
+	}
+#endif
+
+	// Without openat2(2), at least keep ".." from leading out
+	if (path.empty() || path[0] != '/' || (path + "/").find("/../") != std::string::npos) {
+		errno = EACCES;
+		return -1;
+	}
+	return openat(rootFd, path.c_str() + 1, flags);
+}
+
+void PrefetchProfile::startRecording(const std::string& rootPath)
+{
+#ifdef __linux__
+	this->rootPath = rootPath;
+
+	// The files are looked at again when recording is done, which may be
+	// after privileges are dropped, and share/ is only open to root
+	rootFd = open(rootPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (rootFd < 0) {
+		log_errno("open(2) of %s", rootPath.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+
+	fanotifyFd = fanotify_init(FAN_CLASS_NOTIF | FAN_NONBLOCK | FAN_CLOEXEC,
+			O_RDONLY | O_LARGEFILE | O_NOATIME | O_CLOEXEC);
+	if (fanotifyFd < 0) {
+		log_errno("fanotify_init(2)");
+		throw std::system_error(errno, std::system_category());
+	}
+
+	// Watching the whole filesystem also sees the files that are opened
+	// through the mount that the room makes of its root directory
+	int rv = -1;
+#ifdef FAN_MARK_FILESYSTEM
+	rv = fanotify_mark(fanotifyFd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FAN_OPEN, AT_FDCWD, rootPath.c_str());
+#endif
+	if (rv < 0) {
+		rv = fanotify_mark(fanotifyFd, FAN_MARK_ADD | FAN_MARK_MOUNT, FAN_OPEN, AT_FDCWD, rootPath.c_str());
+	}
+	if (rv < 0) {
+		log_errno("fanotify_mark(2) of %s", rootPath.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+#else
+	(void) rootPath;
+	throw std::runtime_error("recording a prefetch profile is only supported on Linux");
+#endif
+}
+
+void PrefetchProfile::finishRecording(unsigned int seconds)
+{
+#ifdef __linux__
+	if (fanotifyFd < 0) {
+		throw std::logic_error("not recording");
+	}
+
+	// Files are kept in the order they were first opened
+	std::vector<std::string> paths;
+	std::set<std::string> seen;
+	std::string prefix = rootPath + "/";
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	time_t deadline = now.tv_sec + seconds;
+	alignas(struct fanotify_event_metadata) char buf[8192];
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec >= deadline) {
+			break;
+		}
+		struct pollfd pfd = { fanotifyFd, POLLIN, 0 };
+		int rv = poll(&pfd, 1, (deadline - now.tv_sec) * 1000 - now.tv_nsec / 1000000);
+		if (rv < 0 && errno != EINTR) {
+			throw std::system_error(errno, std::system_category());
+		}
+		if (rv <= 0) {
+			continue;
+		}
+
+		ssize_t len = read(fanotifyFd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				continue;
+			}
+			throw std::system_error(errno, std::system_category());
+		}
+		struct fanotify_event_metadata *event = (struct fanotify_event_metadata *) buf;
+		for (; FAN_EVENT_OK(event, len); event = FAN_EVENT_NEXT(event, len)) {
+			if (event->vers != FANOTIFY_METADATA_VERSION) {
+				throw std::runtime_error("unsupported fanotify version");
+			}
+			if (event->mask & FAN_Q_OVERFLOW) {
+				log_warning("too many files were opened at once; some were left out of the profile");
+			}
+			if (event->fd < 0) {
+				continue;
+			}
+
+			char target[PATH_MAX];
+			std::string link = "/proc/self/fd/" + std::to_string(event->fd);
+			ssize_t targetLen = readlink(link.c_str(), target, sizeof(target));
+			(void) close(event->fd);
+			if (targetLen <= 0 || (size_t) targetLen >= sizeof(target)) {
+				continue;
+			}
+			std::string path(target, targetLen);
+			if (path.compare(0, prefix.length(), prefix) != 0) {
+				continue; // opened outside of the room
+			}
+			path = path.substr(rootPath.length());
+			if (seen.insert(path).second) {
+				paths.push_back(path);
+			}
+		}
+	}
+
+	(void) close(fanotifyFd);
+	fanotifyFd = -1;
+	log_debug("%zu files were opened", paths.size());
+
+	findCachedRanges(paths);
+#else
+	(void) seconds;
+	throw std::logic_error("not recording");
+#endif
+}
+
+// Replace the profile with the pages of <paths> that are in the page cache
+void PrefetchProfile::findCachedRanges(const std::vector<std::string>& paths)
+{
+	ranges.clear();
+#ifdef __linux__
+	uint64_t pageSize = sysconf(_SC_PAGESIZE);
+	for (auto& path : paths) {
+		int fd = open_in_root(rootFd, path);
+		if (fd < 0) {
+			continue; // e.g. removed since
+		}
+		struct stat sb;
+		if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode) || sb.st_size == 0) {
+			(void) close(fd);
+			continue;
+		}
+
+		void *addr = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		(void) close(fd);
+		if (addr == MAP_FAILED) {
+			continue;
+		}
+		uint64_t size = sb.st_size;
+		std::vector<unsigned char> resident((size + pageSize - 1) / pageSize);
+		if (mincore(addr, size, resident.data()) == 0) {
+			for (size_t page = 0; page < resident.size(); ) {
+				if (!(resident[page] & 1)) {
+					page++;
+					continue;
+				}
+				size_t first = page;
+				while (page < resident.size() && (resident[page] & 1)) {
+					page++;
+				}
+				uint64_t offset = first * pageSize;
+				ranges.push_back({ path, offset, std::min(page * pageSize, size) - offset });
+			}
+		}
+		(void) munmap(addr, size);
+	}
+	(void) close(rootFd);
+	rootFd = -1;
+#else
+	(void) paths;
+#endif
+}
+
+// Open the directory that holds <path>, and set <name> to the last
+// component. Profiles are read and written by root in directories the
+// room's owner controls, so no symlink the owner made is followed.
+static int open_parent(const std::string& path, std::string& name)
+{
+	size_t slash = path.rfind('/');
+	if (slash == std::string::npos) {
+		throw std::logic_error("not an absolute path: " + path);
+	}
+	name = path.substr(slash + 1);
+	return FileUtil::openDirectory(slash == 0 ? "/" : path.substr(0, slash));
+}
+
+bool PrefetchProfile::load(const std::string& path)
+{
+	std::string name;
+	int dirFd;
+	try {
+		dirFd = open_parent(path, name);
+	} catch (const std::system_error&) {
+		return false;
+	}
+	// O_NONBLOCK keeps a FIFO from blocking the open
+	int fd = openat(dirFd, name.c_str(), O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+	(void) close(dirFd);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat sb;
+	if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+		(void) close(fd);
+		return false;
+	}
+	std::string buf;
+	char chunk[65536];
+	ssize_t bytes;
+	while ((bytes = read(fd, chunk, sizeof(chunk))) != 0) {
+		if (bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			(void) close(fd);
+			return false;
+		}
+		buf.append(chunk, bytes);
+	}
+	(void) close(fd);
+
+	ranges.clear();
+	std::istringstream in(buf);
+	std::string line;
+	while (std::getline(in, line)) {
+		// "<offset> <length> <path>"
+		size_t space1 = line.find(' ');
+		size_t space2 = (space1 == std::string::npos) ? space1 : line.find(' ', space1 + 1);
+		if (space2 == std::string::npos || line.compare(space2 + 1, 1, "/") != 0) {
+			continue;
+		}
+		try {
+			ranges.push_back({
+				line.substr(space2 + 1),
+				std::stoull(line.substr(0, space1)),
+				std::stoull(line.substr(space1 + 1, space2 - space1 - 1)),
+			});
+		} catch (const std::logic_error&) {
+			continue;
+		}
+	}
+	return true;
+}
+
+void PrefetchProfile::save(const std::string& path)
+{
+	std::ostringstream out;
+	for (auto& range : ranges) {
+		if (range.path.find('\n') != std::string::npos) {
+			continue;
+		}
+		out << range.offset << ' ' << range.length << ' ' << range.path << '\n';
+	}
+	std::string buf = out.str();
+
+	// Write a new file and rename it over the old one, so a profile is
+	// never read half-written
+	std::string name;
+	int dirFd = open_parent(path, name);
+	std::string tmpName = name + ".tmp";
+	(void) unlinkat(dirFd, tmpName.c_str(), 0);
+	int fd = openat(dirFd, tmpName.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		int saved_errno = errno;
+		log_errno("open(2) of %s.tmp", path.c_str());
+		(void) close(dirFd);
+		throw std::system_error(saved_errno, std::system_category());
+	}
+	size_t offset = 0;
+	while (offset < buf.length()) {
+		ssize_t bytes = write(fd, buf.data() + offset, buf.length() - offset);
+		if (bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		offset += bytes;
+	}
+	if (close(fd) < 0 || offset < buf.length()) {
+		(void) unlinkat(dirFd, tmpName.c_str(), 0);
+		(void) close(dirFd);
+		throw std::runtime_error("unable to write " + path + ".tmp");
+	}
+	if (renameat(dirFd, tmpName.c_str(), dirFd, name.c_str()) < 0) {
+		int saved_errno = errno;
+		log_errno("rename(2) of %s.tmp to %s", path.c_str(), path.c_str());
+		(void) unlinkat(dirFd, tmpName.c_str(), 0);
+		(void) close(dirFd);
+		throw std::system_error(saved_errno, std::system_category());
+	}
+	(void) close(dirFd);
+}
+
+void PrefetchProfile::remove(const std::string& path)
+{
+	std::string name;
+	int dirFd;
+	try {
+		dirFd = open_parent(path, name);
+	} catch (const std::system_error&) {
+		return;
+	}
+	if (unlinkat(dirFd, name.c_str(), 0) < 0 && errno != ENOENT) {
+		log_errno("unlink(2) of %s", path.c_str());
+	}
+	(void) close(dirFd);
+}
+
+uint64_t PrefetchProfile::prefetch(const std::string& rootPath, unsigned int threads)
+{
+	int rootFd = open(rootPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (rootFd < 0) {
+		log_errno("open(2) of %s", rootPath.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+
+	// Each thread takes the next file in the profile, with all of its
+	// ranges, so files are still read roughly in the order they were opened
+	std::vector<size_t> files;
+	for (size_t i = 0; i < ranges.size(); i++) {
+		if (i == 0 || ranges[i].path != ranges[i - 1].path) {
+			files.push_back(i);
+		}
+	}
+	files.push_back(ranges.size());
+
+	std::atomic<size_t> next(0);
+	std::atomic<uint64_t> total(0);
+	auto work = [&]() {
+		for (size_t file = next++; file + 1 < files.size(); file = next++) {
+			const std::string& path = ranges[files[file]].path;
+			int fd = open_in_root(rootFd, path);
+			if (fd < 0) {
+				log_debug("unable to open %s: %s", path.c_str(), strerror(errno));
+				continue;
+			}
+			struct stat sb;
+			if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode)) {
+				for (size_t i = files[file]; i < files[file + 1]; i++) {
+					if (posix_fadvise(fd, ranges[i].offset, ranges[i].length, POSIX_FADV_WILLNEED) == 0) {
+						total += ranges[i].length;
+					}
+				}
+			}
+			(void) close(fd);
+		}
+	};
+
+	if (threads == 0) {
+		threads = std::max(1U, std::thread::hardware_concurrency());
+	}
+	std::vector<std::thread> workers;
+	for (unsigned int i = 0; i < threads && i + 1 < files.size(); i++) {
+		workers.emplace_back(work);
+	}
+	for (auto& worker : workers) {
+		worker.join();
+	}
+	(void) close(rootFd);
+	return total;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// The parts of files that a room reads while it starts, so later starts
+// can read them into the page cache ahead of time, with several threads,
+// instead of waiting for each one as init gets to it. This matters most on
+// the first start after the host reboots.
+//
+// Recording watches the files opened below the room's root directory with
+// fanotify(7), and when it is done, keeps the pages of each one that are in
+// the page cache. A profile is a text file with a line for each range,
+// "<offset> <length> <path>", with <path> relative to the root directory.
+class PrefetchProfile {
+public:
+	// The longest that a recording may last
+	static const unsigned int MAX_RECORDING_SECONDS = 600;
+
+	struct Range {
+		std::string path;
+		uint64_t offset;
+		uint64_t length;
+	};
+
+	PrefetchProfile() {}
+	~PrefetchProfile();
+	PrefetchProfile(const PrefetchProfile&) = delete;
+	PrefetchProfile& operator=(const PrefetchProfile&) = delete;
+
+	// Start watching for files opened below <rootPath>. Privileges must be
+	// raised. Only supported on Linux.
+	void startRecording(const std::string& rootPath);
+
+	// Collect the files that are opened for <seconds>, and replace the
+	// profile with the parts of them that are in the page cache. This
+	// needs no privileges once recording has started, but files that only
+	// root can read are left out without them.
+	void finishRecording(unsigned int seconds);
+
+	// Returns false if there is no profile at <path>. These run as root
+	// in directories the room's owner controls, so none of them follows
+	// a symlink the owner could have made.
+	bool load(const std::string& path);
+	void save(const std::string& path);
+	static void remove(const std::string& path);
+
+	// Ask the kernel to read every range below <rootPath> into the page
+	// cache, using <threads> threads (0 means one per CPU). Paths cannot
+	// lead out of <rootPath>. Returns the number of bytes asked for.
+	uint64_t prefetch(const std::string& rootPath, unsigned int threads = 0);
+
+	const std::vector<Range>& getRanges() const {
+		return ranges;
+	}
+
+private:
+	std::vector<Range> ranges;
+	std::string rootPath; // while recording
+	int rootFd = -1;
+	int fanotifyFd = -1;
+
+	void findCachedRanges(const std::vector<std::string>& paths);
+};
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+#include "RecordWriter.hpp"
+
+RecordWriter::Format RecordWriter::parseFormat(const std::string& name)
+{
+	if (name == "text") {
+		return FORMAT_TEXT;
+	} else if (name == "json") {
+		return FORMAT_JSON;
+	} else if (name == "ndjson") {
+		return FORMAT_NDJSON;
+	} else {
+		throw std::runtime_error("unknown output format: " + name +
+				" (expected text, json or ndjson)");
+	}
+}
+
+RecordWriter::RecordWriter(std::ostream& out, Format format,
+		const std::vector<std::string>& allFields,
+		const std::vector<std::string>& textFields)
+	: out(out), format(format), allFields(allFields)
+{
+	fields = (format == FORMAT_TEXT) ? textFields : allFields;
+}
+
+void RecordWriter::selectFields(const std::string& list)
+{
+	std::vector<std::string> selected;
+	std::istringstream iss(list);
+	std::string field;
+
+	while (std::getline(iss, field, ',')) {
+		if (field.empty()) {
+			continue;
+		}
+		if (std::find(allFields.begin(), allFields.end(), field) == allFields.end()) {
+			std::string valid;
+			for (auto& name : allFields) {
+				valid += (valid.empty() ? "" : ", ") + name;
+			}
+			throw std::runtime_error("unknown field: " + field + " (valid fields are: " + valid + ")");
+		}
+		selected.push_back(field);
+	}
+	if (selected.empty()) {
+		throw std::runtime_error("no fields were selected");
+	}
+	fields = selected;
+}
+
+bool RecordWriter::wants(const std::string& field) const
+{
+	return std::find(fields.begin(), fields.end(), field) != fields.end();
+}
+
+void RecordWriter::write(const Record& record)
+{
+	if (format == FORMAT_TEXT) {
+		// Tab separated values, with strings written as-is
+		for (size_t i = 0; i < fields.size(); i++) {
+			if (i > 0) {
+				out << '\t';
+			}
+			auto it = record.find(fields[i]);
+			if (it == record.end() || it->second.is_null()) {
+				out << '-';
+			} else if (it->second.is_string()) {
+				out << it->second.get<std::string>();
+			} else {
+				out << it->second.dump();
+			}
+		}
+		out << '\n';
+	} else {
+		if (format == FORMAT_JSON) {
+			out << (count == 0 ? "[\n" : ",\n");
+		}
+
+		// Keys are written in the order they were selected, which
+		// nlohmann::json objects would not preserve.
+		out << '{';
+		for (size_t i = 0; i < fields.size(); i++) {
+			if (i > 0) {
+				out << ',';
+			}
+			auto it = record.find(fields[i]);
+			out << nlohmann::json(fields[i]).dump() << ':';
+			out << (it == record.end() ? nlohmann::json().dump() : it->second.dump());
+		}
+		out << '}';
+
+		if (format == FORMAT_NDJSON) {
+			out << '\n';
+		}
+	}
+	out.flush();
+	count++;
+}
+
+void RecordWriter::finish()
+{
+	if (finished) {
+		return;
+	}
+	finished = true;
+	if (format == FORMAT_JSON) {
+		out << (count == 0 ? "[]\n" : "\n]\n");
+		out.flush();
+	}
+}
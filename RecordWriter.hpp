@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+
+// Writes the output of commands like "room list" as plain text, as a JSON
+// array, or as newline-delimited JSON (one object per line).
+//
+// Each record is written and flushed as soon as it is added, so a caller
+// can stream records as it produces them. The user can pick which fields
+// are written, and in what order, with selectFields().
+class RecordWriter {
+public:
+	enum Format {
+		FORMAT_TEXT,
+		FORMAT_JSON,
+		FORMAT_NDJSON,
+	};
+
+	// Fields that are not in a record are written as null
+	typedef std::map<std::string, nlohmann::json> Record;
+
+	// Convert "text", "json" or "ndjson" to a Format
+	static Format parseFormat(const std::string& name);
+
+	// <allFields> are written by default in the JSON formats, and
+	// <textFields> in the text format.
+	RecordWriter(std::ostream& out, Format format,
+			const std::vector<std::string>& allFields,
+			const std::vector<std::string>& textFields);
+
+	// Write only the fields in the comma separated list <fields>
+	void selectFields(const std::string& fields);
+
+	// Returns true if <field> will be written, so callers can skip
+	// working out the ones that won't be
+	bool wants(const std::string& field) const;
+
+	Format getFormat() const {
+		return format;
+	}
+
+	void write(const Record& record);
+
+	// Close the JSON array, once all records have been written
+	void finish();
+
+private:
+	std::ostream& out;
+	Format format;
+	std::vector<std::string> allFields;
+	std::vector<std::string> fields;
+	unsigned long count = 0;
+	bool finished = false;
+};
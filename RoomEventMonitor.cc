@@ -0,0 +1,513 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+extern "C" {
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+#include "ExecSupervisor.hpp"
+#include "fileUtil.h"
+#include "logger.h"
+#include "RoomEventMonitor.hpp"
+#include "setuidHelper.h"
+#include "SnapshotStore.hpp"
+
+namespace pt = boost::property_tree;
+
+static const uint32_t USER_DIR_MASK = IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR;
+static const uint32_t ROOM_DIR_MASK = IN_CREATE | IN_MOVED_TO | IN_ONLYDIR;
+static const uint32_t ETC_DIR_MASK = IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR;
+
+// Open the etc directory of the room <name> with privileges raised,
+// without following any symlink the owner could have made. Returns -1 if
+// it does not exist (yet).
+static int openRoomEtc(const std::string& userRoomDir, const std::string& name)
+{
+	PrivilegeGuard privileges;
+	int userFd = FileUtil::openDirectory(userRoomDir);
+	int etcFd = -1;
+	int roomFd = openat(userFd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	int saved_errno = errno;
+	(void) close(userFd);
+	if (roomFd >= 0) {
+		etcFd = openat(roomFd, "etc", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		saved_errno = errno;
+		(void) close(roomFd);
+	}
+	privileges.lower();
+
+	if (etcFd < 0) {
+		if (saved_errno == ENOENT || saved_errno == ENOTDIR) {
+			return -1;
+		}
+		if (saved_errno == ELOOP) {
+			log_warning("ignoring `%s': a symlink is in the way", name.c_str());
+			return -1;
+		}
+		log_error("unable to open %s/%s/etc: %s", userRoomDir.c_str(), name.c_str(), strerror(saved_errno));
+		throw std::system_error(saved_errno, std::system_category());
+	}
+	return etcFd;
+}
+
+// Read the file <name> in a room's etc directory with privileges raised.
+// Returns false if it does not exist, or is not a regular file.
+static bool readRoomFile(int etcFd, const std::string& name, std::string& contents)
+{
+	PrivilegeGuard privileges;
+	int fd = openat(etcFd, name.c_str(), O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+	int saved_errno = errno;
+	privileges.lower();
+	if (fd < 0) {
+		if (saved_errno == ENOENT) {
+			return false;
+		}
+		if (saved_errno == ELOOP) {
+			log_warning("ignoring etc/%s: it is a symlink", name.c_str());
+			return false;
+		}
+		log_error("unable to open etc/%s: %s", name.c_str(), strerror(saved_errno));
+		throw std::system_error(saved_errno, std::system_category());
+	}
+
+	struct stat sb;
+	if (fstat(fd, &sb) < 0) {
+		saved_errno = errno;
+		(void) close(fd);
+		log_error("unable to stat etc/%s: %s", name.c_str(), strerror(saved_errno));
+		throw std::system_error(saved_errno, std::system_category());
+	}
+	if (!S_ISREG(sb.st_mode)) {
+		(void) close(fd);
+		log_warning("ignoring etc/%s: it is not a regular file", name.c_str());
+		return false;
+	}
+
+	contents.clear();
+	char buf[4096];
+	ssize_t len;
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		contents.append(buf, len);
+	}
+	saved_errno = errno;
+	(void) close(fd);
+	if (len < 0) {
+		log_error("unable to read etc/%s: %s", name.c_str(), strerror(saved_errno));
+		throw std::system_error(saved_errno, std::system_category());
+	}
+	return true;
+}
+
+RoomEventMonitor::RoomEventMonitor(const std::string& userRoomDir) : userRoomDir(userRoomDir)
+{
+	try {
+		inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (inotifyFd < 0) {
+			log_errno("inotify_init1(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (epfd < 0) {
+			log_errno("epoll_create1(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = inotifyFd;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, inotifyFd, &ev) < 0) {
+			log_errno("epoll_ctl(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+
+		// Watch for new rooms before looking for the existing ones, so
+		// that none are missed
+		userWatch = addWatch(userRoomDir, USER_DIR_MASK);
+		if (userWatch < 0) {
+			throw std::runtime_error("no such directory: " + userRoomDir);
+		}
+		scan(nullptr, true);
+	} catch (...) {
+		closeDescriptors();
+		throw;
+	}
+}
+
+RoomEventMonitor::~RoomEventMonitor()
+{
+	closeDescriptors();
+}
+
+void RoomEventMonitor::closeDescriptors()
+{
+	for (auto& it : pidfds) {
+		(void) close(it.first);
+	}
+	pidfds.clear();
+	if (inotifyFd >= 0) {
+		(void) close(inotifyFd);
+		inotifyFd = -1;
+	}
+	if (epfd >= 0) {
+		(void) close(epfd);
+		epfd = -1;
+	}
+}
+
+// Returns -1 if <path> does not exist (yet)
+int RoomEventMonitor::addWatch(const std::string& path, uint32_t mask)
+{
+	PrivilegeGuard privileges;
+	int wd = inotify_add_watch(inotifyFd, path.c_str(), mask | IN_DONT_FOLLOW);
+	int saved_errno = errno;
+	privileges.lower();
+	if (wd < 0 && saved_errno != ENOENT && saved_errno != ENOTDIR) {
+		log_error("unable to watch %s: %s", path.c_str(), strerror(saved_errno));
+		throw std::system_error(saved_errno, std::system_category());
+	}
+	return wd;
+}
+
+// Catch up with every room, e.g. after the inotify queue overflowed
+void RoomEventMonitor::scan(Callback callback, bool quiet)
+{
+	PrivilegeGuard privileges;
+	DIR* dir = opendir(userRoomDir.c_str());
+	int saved_errno = errno;
+	privileges.lower();
+	if (dir == NULL) {
+		log_error("unable to open %s: %s", userRoomDir.c_str(), strerror(saved_errno));
+		throw std::system_error(saved_errno, std::system_category());
+	}
+
+	std::set<std::string> found;
+	struct dirent* dp;
+	while ((dp = readdir(dir)) != NULL) {
+		if (dp->d_name[0] != '.') {
+			found.insert(dp->d_name);
+		}
+	}
+	closedir(dir);
+
+	for (auto it = rooms.begin(); it != rooms.end(); ) {
+		std::string name = (it++)->first;
+		if (found.count(name) == 0) {
+			removeRoom(name, callback);
+		}
+	}
+	for (auto& name : found) {
+		if (rooms.count(name) == 0) {
+			addRoom(name, callback, quiet);
+		} else {
+			refresh(name, callback, quiet);
+		}
+	}
+}
+
+void RoomEventMonitor::addRoom(const std::string& name, Callback callback, bool quiet)
+{
+	RoomState& state = rooms[name];
+	state.dirWatch = addWatch(userRoomDir + "/" + name, ROOM_DIR_MASK);
+	if (state.dirWatch >= 0) {
+		watches[state.dirWatch] = name;
+	}
+	refresh(name, callback, quiet);
+}
+
+void RoomEventMonitor::removeRoom(const std::string& name, Callback callback)
+{
+	auto it = rooms.find(name);
+	if (it == rooms.end()) {
+		return;
+	}
+
+	RoomState& state = it->second;
+	forgetInit(state);
+	for (int wd : { state.dirWatch, state.etcWatch }) {
+		if (wd >= 0) {
+			watches.erase(wd);
+			(void) inotify_rm_watch(inotifyFd, wd); // already gone, usually
+		}
+	}
+	bool announced = state.announced;
+	rooms.erase(it);
+
+	if (announced && callback) {
+		callback({ time(NULL), "destroyed", name, "" });
+	}
+}
+
+void RoomEventMonitor::forgetInit(RoomState& state)
+{
+	if (state.pidfd >= 0) {
+		(void) epoll_ctl(epfd, EPOLL_CTL_DEL, state.pidfd, NULL);
+		(void) close(state.pidfd);
+		pidfds.erase(state.pidfd);
+		state.pidfd = -1;
+	}
+	state.pid = 0;
+}
+
+bool RoomEventMonitor::isInitAlive(const RoomState& state)
+{
+	if (state.pidfd >= 0) {
+		struct pollfd pfd = { state.pidfd, POLLIN, 0 };
+		return poll(&pfd, 1, 0) == 0;
+	} else {
+		return kill(state.pid, 0) == 0 || errno == EPERM;
+	}
+}
+
+// Compare the room's files with what was seen last time, and report
+// the differences
+void RoomEventMonitor::refresh(const std::string& name, Callback callback, bool quiet)
+{
+	RoomState& state = rooms[name];
+	std::string etcPath = userRoomDir + "/" + name + "/etc";
+	auto report = [&](const std::string& type, const std::string& snapshot) {
+		if (!quiet && callback) {
+			callback({ time(NULL), type, name, snapshot });
+		}
+	};
+
+	if (state.etcWatch < 0) {
+		state.etcWatch = addWatch(etcPath, ETC_DIR_MASK);
+		if (state.etcWatch < 0) {
+			return; // still being created
+		}
+		watches[state.etcWatch] = name;
+	}
+
+	int etcFd = openRoomEtc(userRoomDir, name);
+	if (etcFd < 0) {
+		return;
+	}
+	std::string options, pidstr, catalog;
+	bool hasOptions, hasPid, hasCatalog;
+	try {
+		hasOptions = readRoomFile(etcFd, "options.json", options);
+		hasPid = readRoomFile(etcFd, "init.pid", pidstr);
+		hasCatalog = readRoomFile(etcFd, "snapshots.json", catalog);
+	} catch (...) {
+		(void) close(etcFd);
+		throw;
+	}
+	(void) close(etcFd);
+
+	// The room is complete once it has options. These are rewritten in
+	// place, so ignore them until they can be parsed.
+	pt::ptree tree;
+	if (hasOptions && options != state.options) {
+		try {
+			std::istringstream iss(options);
+			pt::read_json(iss, tree);
+			if (!state.announced) {
+				state.announced = true;
+				bool isClone = tree.get("template.uri", "") != "" || tree.get("template.snapshot", "") != "";
+				report(isClone ? "cloned" : "created", "");
+			} else {
+				report("options-changed", "");
+			}
+			state.options = options;
+		} catch (const pt::json_parser_error&) {
+			log_debug("options for `%s' are incomplete", name.c_str());
+		}
+	}
+	if (!state.announced) {
+		return;
+	}
+
+	pid_t pid = 0;
+	if (hasPid) {
+		pid = atoi(pidstr.c_str());
+	}
+	if (state.pid > 0 && (pid != state.pid || !isInitAlive(state))) {
+		forgetInit(state);
+		report("stopped", "");
+	}
+	if (pid > 0 && state.pid == 0) {
+		int pidfd = ExecSupervisor::pidfdOpen(pid);
+		if (pidfd >= 0 || errno == ENOSYS) {
+			state.pid = pid;
+			state.pidfd = pidfd;
+		}
+		if (pidfd >= 0) {
+			struct epoll_event ev;
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN;
+			ev.data.fd = pidfd;
+			if (epoll_ctl(epfd, EPOLL_CTL_ADD, pidfd, &ev) < 0) {
+				log_errno("epoll_ctl(2)");
+				throw std::system_error(errno, std::system_category());
+			}
+			pidfds[pidfd] = name;
+		}
+		if (state.pid > 0 && isInitAlive(state)) {
+			report("started", "");
+		} else {
+			forgetInit(state); // a stale pidfile
+		}
+	}
+
+	std::set<std::string> snapshots;
+	if (hasCatalog) {
+		try {
+			std::istringstream iss(catalog);
+			for (auto& snapshot : SnapshotStore::parseCatalog(iss)) {
+				snapshots.insert(snapshot.name);
+			}
+		} catch (const pt::json_parser_error&) {
+			return;
+		}
+	}
+	for (auto& snapshot : snapshots) {
+		if (state.snapshots.count(snapshot) == 0) {
+			report("snapshot-created", snapshot);
+		}
+	}
+	for (auto& snapshot : state.snapshots) {
+		if (snapshots.count(snapshot) == 0) {
+			report("snapshot-destroyed", snapshot);
+		}
+	}
+	state.snapshots = snapshots;
+}
+
+void RoomEventMonitor::readInotify(Callback callback)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	for (;;) {
+		ssize_t len = read(inotifyFd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EAGAIN) {
+				return;
+			} else if (errno == EINTR) {
+				continue;
+			}
+			log_errno("read(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+
+		// Several events for one room are handled with one refresh
+		std::set<std::string> changed;
+		bool overflow = false;
+		for (char* p = buf; p < buf + len; ) {
+			struct inotify_event* ev = (struct inotify_event*) p;
+			p += sizeof(*ev) + ev->len;
+			std::string entry = (ev->len > 0) ? ev->name : "";
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				overflow = true;
+			} else if (ev->wd == userWatch) {
+				if (entry == "" || entry[0] == '.') {
+					continue;
+				}
+				if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+					removeRoom(entry, callback);
+					changed.erase(entry);
+				} else if ((ev->mask & IN_ISDIR) && rooms.count(entry) == 0) {
+					addRoom(entry, callback, false);
+				}
+			} else {
+				auto it = watches.find(ev->wd);
+				if (it == watches.end()) {
+					continue;
+				}
+				if (ev->mask & IN_IGNORED) {
+					auto room = rooms.find(it->second);
+					if (room != rooms.end() && room->second.dirWatch == ev->wd) {
+						room->second.dirWatch = -1;
+					}
+					if (room != rooms.end() && room->second.etcWatch == ev->wd) {
+						room->second.etcWatch = -1;
+					}
+					watches.erase(it);
+				} else if (entry == "etc" || entry == "options.json" ||
+						entry == "init.pid" || entry == "snapshots.json") {
+					changed.insert(it->second);
+				}
+			}
+		}
+
+		for (auto& name : changed) {
+			if (rooms.count(name) > 0) {
+				refresh(name, callback, false);
+			}
+		}
+		if (overflow) {
+			log_warning("inotify queue overflowed; rescanning rooms");
+			scan(callback, false);
+		}
+	}
+}
+
+void RoomEventMonitor::dispatch(Callback callback)
+{
+	struct epoll_event events[16];
+	int count = epoll_wait(epfd, events, 16, 0);
+	if (count < 0) {
+		if (errno == EINTR) {
+			return;
+		}
+		log_errno("epoll_wait(2)");
+		throw std::system_error(errno, std::system_category());
+	}
+
+	for (int i = 0; i < count; i++) {
+		int fd = events[i].data.fd;
+		if (fd == inotifyFd) {
+			readInotify(callback);
+		} else {
+			// The init process of a room exited
+			auto it = pidfds.find(fd);
+			if (it != pidfds.end()) {
+				std::string name = it->second;
+				refresh(name, callback, false);
+			}
+		}
+	}
+}
+
+void RoomEventMonitor::run(Callback callback)
+{
+	for (;;) {
+		struct pollfd pfd = { epfd, POLLIN, 0 };
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+			log_errno("poll(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+		dispatch(callback);
+	}
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+
+extern "C" {
+#include <sys/types.h>
+}
+
+// Reports changes to a user's rooms as they happen, so programs don't have
+// to poll "room list" and pidfiles.
+//
+// The user's room directory and each room's etc directory are watched
+// with inotify(7). Whenever something relevant changes, the room's files
+// are compared with what was last seen:
+//
+//   created, cloned    etc/options.json appeared; clones record their
+//                      template in it
+//   options-changed    the contents of etc/options.json changed
+//   started, stopped   etc/init.pid was written or removed, or the init
+//                      process exited (seen through a pidfd)
+//   snapshot-created,  a snapshot was added to or removed from
+//   snapshot-destroyed etc/snapshots.json, so rooms on ZFS don't have these
+//   destroyed          the room directory went away
+//
+// Rooms that exist when the monitor is created are not reported.
+// Privileges are raised to read the room directories, so only one thread
+// should use a monitor.
+class RoomEventMonitor {
+public:
+	struct Event {
+		time_t time;
+		std::string type;
+		std::string room;
+		std::string snapshot; // for the snapshot events
+	};
+
+	typedef std::function<void(const Event&)> Callback;
+
+	RoomEventMonitor(const std::string& userRoomDir);
+	~RoomEventMonitor();
+
+	// Becomes readable when dispatch() has something to do, for use in
+	// another program's event loop
+	int getDescriptor() const {
+		return epfd;
+	}
+
+	// Report whatever has happened, without blocking
+	void dispatch(Callback callback);
+
+	// Report events as they happen. Does not return.
+	void run(Callback callback);
+
+private:
+	struct RoomState {
+		int dirWatch = -1;
+		int etcWatch = -1;
+		pid_t pid = 0; // of init, while the room is running
+		int pidfd = -1; // for <pid>, if pidfds are supported
+		bool announced = false; // created or cloned was reported
+		std::string options; // the contents of etc/options.json
+		std::set<std::string> snapshots;
+	};
+
+	std::string userRoomDir;
+	int epfd = -1;
+	int inotifyFd = -1;
+	int userWatch = -1; // on <userRoomDir>
+	std::map<std::string, RoomState> rooms;
+	std::map<int, std::string> watches; // watch descriptor -> room
+	std::map<int, std::string> pidfds; // pidfd -> room
+
+	void scan(Callback callback, bool quiet);
+	void addRoom(const std::string& name, Callback callback, bool quiet);
+	void removeRoom(const std::string& name, Callback callback);
+	void refresh(const std::string& name, Callback callback, bool quiet);
+	void forgetInit(RoomState& state);
+	bool isInitAlive(const RoomState& state);
+	void readInotify(Callback callback);
+	int addWatch(const std::string& path, uint32_t mask);
+	void closeDescriptors();
+};
@@ -0,0 +1,529 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+}
+
+#include "fileUtil.h"
+#include "logger.h"
+#include "MountUtil.hpp"
+#include "shell.h"
+#include "SnapshotDiff.hpp"
+
+std::string SnapshotDiff::getChangeName(Change change)
+{
+	switch (change) {
+	case ADDED:
+		return "added";
+	case MODIFIED:
+		return "modified";
+	default:
+		return "deleted";
+	}
+}
+
+// Undo the escaping of unusual characters in "zfs diff" paths, which
+// look like "\0040" for a space
+static std::string zfs_unescape(const std::string& str)
+{
+	std::string result;
+	for (size_t i = 0; i < str.length(); i++) {
+		std::string digits = str.substr(i + 1, 4);
+		if (str[i] == '\\' && digits.length() == 4 && digits.find_first_not_of("01234567") == std::string::npos) {
+			result += (char) std::stoi(digits, nullptr, 8);
+			i += 4;
+		} else {
+			result += str[i];
+		}
+	}
+	return result;
+}
+
+static std::string zfs_type_name(char type)
+{
+	switch (type) {
+	case 'F':
+		return "file";
+	case '/':
+		return "directory";
+	case '@':
+		return "symlink";
+	case 'B':
+		return "block-device";
+	case 'C':
+		return "char-device";
+	case '|':
+		return "fifo";
+	case '=':
+		return "socket";
+	default:
+		return "other";
+	}
+}
+
+void SnapshotDiff::compareZfs(const std::string& dataset, const std::string& mountpoint,
+		const std::string& fromSnapshot, const std::string& toSnapshot, Callback callback)
+{
+	int status;
+	std::string output;
+	Shell::execute("/sbin/zfs", { "diff", "-H", "-F", dataset + "@" + fromSnapshot,
+			(toSnapshot == "") ? dataset : dataset + "@" + toSnapshot }, status, output);
+	if (status != 0) {
+		throw std::runtime_error("zfs diff failed");
+	}
+
+	// Sizes come from the snapshot, or the dataset, that has the file
+	std::string fromRoot = mountpoint + "/.zfs/snapshot/" + fromSnapshot;
+	std::string toRoot = (toSnapshot == "") ? mountpoint : mountpoint + "/.zfs/snapshot/" + toSnapshot;
+	auto report = [&](Change change, const std::string& type, const std::string& path) {
+		struct stat sb;
+		std::string root = (change == DELETED) ? fromRoot : toRoot;
+		uint64_t size = 0;
+		if (type != "directory" && lstat((root + path).c_str(), &sb) == 0) {
+			size = sb.st_size;
+		}
+		callback({ change, type, path, size });
+	};
+
+	// Each line is "<change> <type> <path> [<new path>]", separated by tabs,
+	// with paths below <mountpoint>
+	std::istringstream lines(output);
+	std::string line;
+	while (std::getline(lines, line)) {
+		std::vector<std::string> fields;
+		std::istringstream iss(line);
+		std::string field;
+		while (std::getline(iss, field, '\t')) {
+			fields.push_back(field);
+		}
+		if (fields.size() < 3 || fields[1].empty()) {
+			continue;
+		}
+
+		std::string type = zfs_type_name(fields[1][0]);
+		std::vector<std::string> paths;
+		for (size_t i = 2; i < fields.size(); i++) {
+			std::string path = zfs_unescape(fields[i]);
+			if (path.compare(0, mountpoint.length(), mountpoint) == 0) {
+				path = path.substr(mountpoint.length());
+			}
+			paths.push_back(path.empty() ? "/" : path);
+		}
+
+		if (fields[0] == "+") {
+			report(ADDED, type, paths[0]);
+		} else if (fields[0] == "-") {
+			report(DELETED, type, paths[0]);
+		} else if (fields[0] == "M") {
+			report(MODIFIED, type, paths[0]);
+		} else if (fields[0] == "R" && paths.size() > 1) {
+			report(DELETED, type, paths[0]);
+			report(ADDED, type, paths[1]);
+		}
+	}
+}
+
+#ifdef __linux__
+
+static std::string type_name(mode_t mode)
+{
+	if (S_ISREG(mode)) {
+		return "file";
+	} else if (S_ISDIR(mode)) {
+		return "directory";
+	} else if (S_ISLNK(mode)) {
+		return "symlink";
+	} else if (S_ISBLK(mode)) {
+		return "block-device";
+	} else if (S_ISCHR(mode)) {
+		return "char-device";
+	} else if (S_ISFIFO(mode)) {
+		return "fifo";
+	} else if (S_ISSOCK(mode)) {
+		return "socket";
+	} else {
+		return "other";
+	}
+}
+
+namespace {
+
+// Compares two trees with a pool of threads that take directories from a
+// shared queue
+class TreeComparer {
+public:
+	TreeComparer(int fromFd, int toFd, uint64_t fromMountId, uint64_t toMountId,
+			SnapshotDiff::Callback callback)
+		: fromFd(fromFd), toFd(toFd), fromMountId(fromMountId), toMountId(toMountId),
+		  callback(callback) {}
+
+	void run();
+
+private:
+	enum Kind {
+		COMPARE, // a directory that is in both trees
+		ADDED, // everything in here was added
+		DELETED, // everything in here was deleted
+	};
+
+	struct Task {
+		Kind kind;
+		std::string path; // "" for the top
+	};
+
+	typedef std::map<std::string, struct statx> Listing;
+
+	int fromFd, toFd;
+	uint64_t fromMountId, toMountId;
+	SnapshotDiff::Callback callback;
+	std::mutex callbackMutex;
+	std::mutex mutex; // protects <queue> and <busy>
+	std::condition_variable cond;
+	std::deque<Task> queue;
+	unsigned int busy = 0;
+	bool failed = false;
+	std::string error;
+
+	void work();
+	void process(const Task& task, std::vector<Task>& subdirs);
+	void compare(const Task& task, int fromDir, int toDir, std::vector<Task>& subdirs);
+	bool list(int dirfd, uint64_t mountId, const std::string& path, Listing& listing);
+	bool isModified(int fromDir, int toDir, const std::string& name,
+			const struct statx& from, const struct statx& to);
+	bool compareContents(int fromDir, int toDir, const std::string& name);
+	bool compareLinks(int fromDir, int toDir, const std::string& name);
+	void report(SnapshotDiff::Change change, const std::string& path, const struct statx& stx);
+};
+
+void TreeComparer::run()
+{
+	queue.push_back({ COMPARE, "" });
+
+	std::vector<std::thread> threads;
+	unsigned int count = std::max(1U, std::thread::hardware_concurrency());
+	for (unsigned int i = 0; i < count; i++) {
+		threads.emplace_back(&TreeComparer::work, this);
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+
+	if (failed) {
+		throw std::runtime_error(error);
+	}
+}
+
+void TreeComparer::work()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;) {
+		cond.wait(lock, [this]() { return !queue.empty() || busy == 0 || failed; });
+		if (queue.empty() || failed) {
+			cond.notify_all();
+			return;
+		}
+		Task task = queue.front();
+		queue.pop_front();
+		busy++;
+
+		lock.unlock();
+		std::vector<Task> subdirs;
+		try {
+			process(task, subdirs);
+		} catch (const std::exception& e) {
+			// e.g. the callback could not write its output
+			lock.lock();
+			failed = true;
+			error = e.what();
+			busy--;
+			cond.notify_all();
+			return;
+		}
+		lock.lock();
+
+		queue.insert(queue.end(), subdirs.begin(), subdirs.end());
+		busy--;
+		cond.notify_all();
+	}
+}
+
+static std::string join_path(const std::string& dir, const std::string& name)
+{
+	return dir.empty() ? name : dir + "/" + name;
+}
+
+// Read the entries of the directory <dirfd>, which is <path>
+bool TreeComparer::list(int dirfd, uint64_t mountId, const std::string& path, Listing& listing)
+{
+	// fdopendir() takes over the descriptor, and the caller still needs it
+	int dupfd = fcntl(dirfd, F_DUPFD_CLOEXEC, 0);
+	if (dupfd < 0) {
+		log_warning("unable to read /%s: %s", path.c_str(), strerror(errno));
+		return false;
+	}
+	DIR *dir = fdopendir(dupfd);
+	if (dir == NULL) {
+		log_warning("unable to read /%s: %s", path.c_str(), strerror(errno));
+		(void) close(dupfd);
+		return false;
+	}
+
+	struct dirent *dp;
+	while ((dp = readdir(dir)) != NULL) {
+		if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, "..")) {
+			continue;
+		}
+		struct statx stx;
+		if (statx(dirfd, dp->d_name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+				STATX_BASIC_STATS | STATX_MNT_ID, &stx) < 0) {
+			log_debug("unable to stat /%s: %s", join_path(path, dp->d_name).c_str(), strerror(errno));
+			continue;
+		}
+		// Something mounted inside a running room is not part of it
+		if (mountId != 0 && (stx.stx_mask & STATX_MNT_ID) && stx.stx_mnt_id != mountId) {
+			continue;
+		}
+		listing[dp->d_name] = stx;
+	}
+	closedir(dir);
+	return true;
+}
+
+void TreeComparer::report(SnapshotDiff::Change change, const std::string& path, const struct statx& stx)
+{
+	uint64_t size = S_ISDIR(stx.stx_mode) ? 0 : stx.stx_size;
+	std::lock_guard<std::mutex> lock(callbackMutex);
+	callback({ change, type_name(stx.stx_mode), "/" + path, size });
+}
+
+void TreeComparer::process(const Task& task, std::vector<Task>& subdirs)
+{
+	// A symlink anywhere along the way is not followed
+	int fromDir = -1, toDir = -1;
+	if (task.kind != ADDED && (fromDir = FileUtil::openBeneath(fromFd, task.path)) < 0) {
+		log_warning("unable to open /%s: %s", task.path.c_str(), strerror(errno));
+		return;
+	}
+	if (task.kind != DELETED && (toDir = FileUtil::openBeneath(toFd, task.path)) < 0) {
+		log_warning("unable to open /%s: %s", task.path.c_str(), strerror(errno));
+		if (fromDir >= 0) {
+			(void) close(fromDir);
+		}
+		return;
+	}
+
+	try {
+		compare(task, fromDir, toDir, subdirs);
+	} catch (...) {
+		for (int fd : { fromDir, toDir }) {
+			if (fd >= 0) {
+				(void) close(fd);
+			}
+		}
+		throw;
+	}
+	for (int fd : { fromDir, toDir }) {
+		if (fd >= 0) {
+			(void) close(fd);
+		}
+	}
+}
+
+// Compare the entries of the directory <task.path>, open as <fromDir> and
+// <toDir> in the two trees
+void TreeComparer::compare(const Task& task, int fromDir, int toDir, std::vector<Task>& subdirs)
+{
+	Listing from, to;
+	if (fromDir >= 0 && !list(fromDir, fromMountId, task.path, from)) {
+		return;
+	}
+	if (toDir >= 0 && !list(toDir, toMountId, task.path, to)) {
+		return;
+	}
+
+	auto added = [&](const std::string& path, const struct statx& stx) {
+		report(SnapshotDiff::ADDED, path, stx);
+		if (S_ISDIR(stx.stx_mode)) {
+			subdirs.push_back({ ADDED, path });
+		}
+	};
+	auto deleted = [&](const std::string& path, const struct statx& stx) {
+		report(SnapshotDiff::DELETED, path, stx);
+		if (S_ISDIR(stx.stx_mode)) {
+			subdirs.push_back({ DELETED, path });
+		}
+	};
+
+	// Walk both listings in name order
+	auto f = from.begin();
+	auto t = to.begin();
+	while (f != from.end() || t != to.end()) {
+		if (t == to.end() || (f != from.end() && f->first < t->first)) {
+			deleted(join_path(task.path, f->first), f->second);
+			++f;
+		} else if (f == from.end() || t->first < f->first) {
+			added(join_path(task.path, t->first), t->second);
+			++t;
+		} else {
+			std::string path = join_path(task.path, f->first);
+			if ((f->second.stx_mode & S_IFMT) != (t->second.stx_mode & S_IFMT)) {
+				deleted(path, f->second);
+				added(path, t->second);
+			} else {
+				if (isModified(fromDir, toDir, f->first, f->second, t->second)) {
+					report(SnapshotDiff::MODIFIED, path, t->second);
+				}
+				if (S_ISDIR(t->second.stx_mode)) {
+					subdirs.push_back({ COMPARE, path });
+				}
+			}
+			++f;
+			++t;
+		}
+	}
+}
+
+bool TreeComparer::isModified(int fromDir, int toDir, const std::string& name,
+		const struct statx& from, const struct statx& to)
+{
+	if (from.stx_mode != to.stx_mode || from.stx_uid != to.stx_uid || from.stx_gid != to.stx_gid) {
+		return true;
+	}
+	if (S_ISDIR(to.stx_mode)) {
+		return false; // changes to the entries are reported separately
+	}
+	if (S_ISBLK(to.stx_mode) || S_ISCHR(to.stx_mode)) {
+		return from.stx_rdev_major != to.stx_rdev_major || from.stx_rdev_minor != to.stx_rdev_minor;
+	}
+	if (!S_ISREG(to.stx_mode) && !S_ISLNK(to.stx_mode)) {
+		return false;
+	}
+
+	// The same inode, e.g. a hard link, is the same file
+	if (from.stx_dev_major == to.stx_dev_major && from.stx_dev_minor == to.stx_dev_minor &&
+			from.stx_ino == to.stx_ino) {
+		return false;
+	}
+	if (from.stx_size != to.stx_size) {
+		return true;
+	}
+	if (from.stx_mtime.tv_sec == to.stx_mtime.tv_sec && from.stx_mtime.tv_nsec == to.stx_mtime.tv_nsec) {
+		return false;
+	}
+
+	// Same size, different time: only the contents can tell
+	return S_ISREG(to.stx_mode) ? !compareContents(fromDir, toDir, name) : !compareLinks(fromDir, toDir, name);
+}
+
+// Returns true if the file <name> has the same contents in both trees
+bool TreeComparer::compareContents(int fromDir, int toDir, const std::string& name)
+{
+	int fromFile = openat(fromDir, name.c_str(), O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+	int toFile = openat(toDir, name.c_str(), O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+	bool same = (fromFile >= 0 && toFile >= 0);
+
+	std::vector<char> fromBuf(65536), toBuf(65536);
+	while (same) {
+		ssize_t fromLen = read(fromFile, fromBuf.data(), fromBuf.size());
+		if (fromLen <= 0) {
+			same = (fromLen == 0) && (read(toFile, toBuf.data(), 1) == 0);
+			break;
+		}
+		ssize_t done = 0;
+		while (done < fromLen) {
+			ssize_t len = read(toFile, toBuf.data() + done, fromLen - done);
+			if (len <= 0) {
+				break;
+			}
+			done += len;
+		}
+		same = (done == fromLen) && memcmp(fromBuf.data(), toBuf.data(), fromLen) == 0;
+	}
+
+	if (fromFile >= 0) {
+		(void) close(fromFile);
+	}
+	if (toFile >= 0) {
+		(void) close(toFile);
+	}
+	return same;
+}
+
+// Returns true if the symlink <name> has the same target in both trees
+bool TreeComparer::compareLinks(int fromDir, int toDir, const std::string& name)
+{
+	char fromTarget[PATH_MAX], toTarget[PATH_MAX];
+	ssize_t fromLen = readlinkat(fromDir, name.c_str(), fromTarget, sizeof(fromTarget));
+	ssize_t toLen = readlinkat(toDir, name.c_str(), toTarget, sizeof(toTarget));
+	return fromLen >= 0 && fromLen == toLen && memcmp(fromTarget, toTarget, fromLen) == 0;
+}
+
+} // namespace
+
+void SnapshotDiff::compareDirectories(const std::string& fromPath, const std::string& toPath,
+		Callback callback)
+{
+	uint64_t fromMountId, toMountId;
+	int fromFd = MountUtil::openWithoutSubmounts(fromPath, fromMountId);
+	int toFd;
+	try {
+		toFd = MountUtil::openWithoutSubmounts(toPath, toMountId);
+	} catch (...) {
+		(void) close(fromFd);
+		throw;
+	}
+
+	try {
+		TreeComparer(fromFd, toFd, fromMountId, toMountId, callback).run();
+	} catch (...) {
+		(void) close(fromFd);
+		(void) close(toFd);
+		throw;
+	}
+	(void) close(fromFd);
+	(void) close(toFd);
+}
+
+#else
+
+void SnapshotDiff::compareDirectories(const std::string& fromPath, const std::string& toPath,
+		Callback callback)
+{
+	(void) fromPath;
+	(void) toPath;
+	(void) callback;
+	throw std::runtime_error("comparing rooms that are not on ZFS is only supported on Linux");
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+// Finds the files that changed between two snapshots of a room, or between
+// a snapshot and the room itself.
+//
+// On ZFS this comes from "zfs diff". Otherwise both trees are walked in
+// parallel. A file is unchanged if both sides are the same inode, or have
+// the same size, mode, owner and mtime; only files with the same size and a
+// different mtime have their contents compared.
+class SnapshotDiff {
+public:
+	enum Change {
+		ADDED,
+		MODIFIED,
+		DELETED,
+	};
+
+	struct Entry {
+		Change change;
+		std::string type; // "file", "directory", "symlink", ...
+		std::string path; // relative to the root of the room, e.g. "/etc/passwd"
+		uint64_t size; // of the new file, or of the deleted one
+	};
+
+	// Called once for each change, as it is found. The calls may come from
+	// several threads, but never at the same time.
+	typedef std::function<void(const Entry&)> Callback;
+
+	static std::string getChangeName(Change change);
+
+	// Compare the directories <fromPath> and <toPath>. Privileges must be raised.
+	static void compareDirectories(const std::string& fromPath, const std::string& toPath,
+			Callback callback);
+
+	// Compare <dataset>@<fromSnapshot> with <dataset>@<toSnapshot>, or with
+	// <dataset> if <toSnapshot> is empty. <dataset> is mounted on <mountpoint>.
+	// Privileges must be raised.
+	static void compareZfs(const std::string& dataset, const std::string& mountpoint,
+			const std::string& fromSnapshot, const std::string& toSnapshot, Callback callback);
+};
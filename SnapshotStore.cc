@@ -0,0 +1,471 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <system_error>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+extern "C" {
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/btrfs.h>
+#include <linux/fs.h>
+#include <linux/magic.h>
+#include <sys/vfs.h>
+#endif
+}
+
+#include "fileUtil.h"
+#include "logger.h"
+#include "setuidHelper.h"
+#include "shell.h"
+#include "SnapshotStore.hpp"
+#include "Trash.hpp"
+
+namespace pt = boost::property_tree;
+
+// The inode number of the root directory of every btrfs subvolume
+static const ino_t BTRFS_SUBVOLUME_INO = 256;
+
+SnapshotStore::SnapshotStore(const std::string& roomDataDir, Method method) : method(method)
+{
+	sharePath = roomDataDir + "/share";
+	tagsPath = roomDataDir + "/tags";
+	catalogPath = roomDataDir + "/etc/snapshots.json";
+	loadCatalog();
+}
+
+std::string SnapshotStore::getMethodName(Method method)
+{
+	switch (method) {
+	case METHOD_BTRFS:
+		return "btrfs";
+	case METHOD_REFLINK:
+		return "reflink";
+	default:
+		return "copy";
+	}
+}
+
+static SnapshotStore::Method parseMethodName(const std::string& name)
+{
+	if (name == "btrfs") {
+		return SnapshotStore::METHOD_BTRFS;
+	} else if (name == "copy") {
+		return SnapshotStore::METHOD_COPY;
+	} else {
+		return SnapshotStore::METHOD_REFLINK;
+	}
+}
+
+SnapshotStore::Method SnapshotStore::probe(const std::string& dir)
+{
+#ifdef __linux__
+	struct statfs sfs;
+	if (statfs(dir.c_str(), &sfs) < 0) {
+		log_errno("statfs(2) of %s", dir.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+	if (sfs.f_type == BTRFS_SUPER_MAGIC) {
+		return METHOD_BTRFS;
+	}
+
+	// Try to clone a file, which works on xfs (with reflink=1) and a few others
+	std::string srcPath = dir + "/.reflink-probe.XXXXXX";
+	std::string destPath = srcPath;
+	int srcfd = mkstemp(&srcPath[0]);
+	if (srcfd < 0) {
+		log_errno("mkstemp(3) in %s", dir.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+	int destfd = mkstemp(&destPath[0]);
+	if (destfd < 0) {
+		int saved_errno = errno;
+		(void) close(srcfd);
+		(void) unlink(srcPath.c_str());
+		throw std::system_error(saved_errno, std::system_category());
+	}
+	Method result = METHOD_COPY;
+	if (write(srcfd, "x", 1) == 1 && ioctl(destfd, FICLONE, srcfd) == 0) {
+		result = METHOD_REFLINK;
+	}
+	(void) close(srcfd);
+	(void) close(destfd);
+	(void) unlink(srcPath.c_str());
+	(void) unlink(destPath.c_str());
+	return result;
+#else
+	return METHOD_COPY;
+#endif
+}
+
+SnapshotStore::Method SnapshotStore::loadMethod(const std::string& roomDir)
+{
+	std::ifstream ifs(roomDir + "/.snapshot-method");
+	std::string name;
+	if (!ifs || !std::getline(ifs, name)) {
+		return METHOD_REFLINK;
+	}
+	return parseMethodName(name);
+}
+
+void SnapshotStore::saveMethod(const std::string& roomDir, Method method)
+{
+	std::ofstream ofs(roomDir + "/.snapshot-method");
+	ofs << getMethodName(method) << std::endl;
+	if (!ofs) {
+		throw std::runtime_error("unable to write " + roomDir + "/.snapshot-method");
+	}
+}
+
+bool SnapshotStore::isSubvolume(const std::string& path)
+{
+#ifdef __linux__
+	struct statfs sfs;
+	struct stat sb;
+	if (statfs(path.c_str(), &sfs) < 0 || stat(path.c_str(), &sb) < 0) {
+		return false;
+	}
+	return sfs.f_type == BTRFS_SUPER_MAGIC && sb.st_ino == BTRFS_SUBVOLUME_INO;
+#else
+	return false;
+#endif
+}
+
+bool SnapshotStore::isSubvolume(int fd)
+{
+#ifdef __linux__
+	struct statfs sfs;
+	struct stat sb;
+	if (fstatfs(fd, &sfs) < 0 || fstat(fd, &sb) < 0) {
+		return false;
+	}
+	return sfs.f_type == BTRFS_SUPER_MAGIC && sb.st_ino == BTRFS_SUBVOLUME_INO;
+#else
+	return false;
+#endif
+}
+
+#ifdef __linux__
+// Run a btrfs ioctl(2) that takes the name of an entry in the directory <dirFd>
+template <class T>
+static void btrfsVolumeIoctlAt(int dirFd, const std::string& name, unsigned long request, T& args)
+{
+	if (name.length() >= sizeof(args.name)) {
+		throw std::runtime_error("name is too long: " + name);
+	}
+	strncpy(args.name, name.c_str(), sizeof(args.name) - 1);
+
+	if (ioctl(dirFd, request, &args) < 0) {
+		int saved_errno = errno;
+		log_errno("btrfs ioctl(2) on %s", name.c_str());
+		throw std::system_error(saved_errno, std::system_category());
+	}
+}
+
+// Run a btrfs ioctl(2) that takes the name of an entry in the parent of <path>
+template <class T>
+static void btrfsVolumeIoctl(const std::string& path, unsigned long request, T& args)
+{
+	std::string buf = path;
+	std::string parent = dirname(&buf[0]);
+	buf = path;
+	std::string name = basename(&buf[0]);
+
+	int fd = open(parent.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		log_errno("open(2) of %s", parent.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+	try {
+		btrfsVolumeIoctlAt(fd, name, request, args);
+	} catch (...) {
+		(void) close(fd);
+		throw;
+	}
+	(void) close(fd);
+}
+#endif
+
+void SnapshotStore::destroySubvolumeAt(int dirFd, const std::string& name)
+{
+#ifdef __linux__
+	struct btrfs_ioctl_vol_args args;
+	memset(&args, 0, sizeof(args));
+	btrfsVolumeIoctlAt(dirFd, name, BTRFS_IOC_SNAP_DESTROY, args);
+#else
+	(void) dirFd;
+	throw std::runtime_error("subvolumes are not supported on this platform: " + name);
+#endif
+}
+
+void SnapshotStore::createVolume(const std::string& path, Method method, uid_t uid, gid_t gid)
+{
+#ifdef __linux__
+	if (method == METHOD_BTRFS) {
+		struct btrfs_ioctl_vol_args args;
+		memset(&args, 0, sizeof(args));
+		btrfsVolumeIoctl(path, BTRFS_IOC_SUBVOL_CREATE, args);
+		if (chown(path.c_str(), uid, gid) < 0 || chmod(path.c_str(), 0700) < 0) {
+			log_errno("unable to set the owner of %s", path.c_str());
+			throw std::system_error(errno, std::system_category());
+		}
+		return;
+	}
+#endif
+	FileUtil::mkdir_idempotent(path, 0700, uid, gid);
+}
+
+void SnapshotStore::destroyVolume(const std::string& path)
+{
+	if (!FileUtil::checkExists(path)) {
+		return;
+	}
+#ifdef __linux__
+	// Walks the tree by descriptor, and destroys btrfs subvolumes whole
+	Trash::removeTree(path);
+#else
+	Shell::execute("/bin/rm", { "-rf", path });
+#endif
+}
+
+// Split <path> into a descriptor for its parent directory and its last component
+static int open_parent(const std::string& path, std::string& name)
+{
+	size_t slash = path.rfind('/');
+	if (slash == std::string::npos || slash == 0 || slash == path.length() - 1) {
+		throw std::logic_error("bad path: " + path);
+	}
+	name = path.substr(slash + 1);
+	return FileUtil::openDirectory(path.substr(0, slash));
+}
+
+SnapshotStore::Method SnapshotStore::copyTree(const std::string& src, const std::string& dest, Method method, bool readOnly)
+{
+#ifdef __linux__
+	// Both ends are in directories that the room's owner can change, so
+	// they are opened without following symlinks, and cp(1) only ever
+	// sees them through /proc/self/fd
+	std::string destName;
+	int srcFd = FileUtil::openDirectory(src, O_RDONLY);
+	int destParentFd = -1;
+	int destFd = -1;
+	Method result;
+	try {
+		destParentFd = open_parent(dest, destName);
+
+		if (method == METHOD_BTRFS && isSubvolume(srcFd)) {
+			struct btrfs_ioctl_vol_args_v2 args;
+			memset(&args, 0, sizeof(args));
+			args.fd = srcFd;
+			args.flags = readOnly ? BTRFS_SUBVOL_RDONLY : 0;
+			btrfsVolumeIoctlAt(destParentFd, destName, BTRFS_IOC_SNAP_CREATE_V2, args);
+			result = METHOD_BTRFS;
+		} else {
+			// A new directory that only root can change, which cp(1) fills in
+			// and then gives the owner and mode of <src>
+			if (mkdirat(destParentFd, destName.c_str(), 0700) < 0) {
+				log_errno("mkdir(2) of %s", dest.c_str());
+				throw std::system_error(errno, std::system_category());
+			}
+			destFd = openat(destParentFd, destName.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			if (destFd < 0) {
+				log_errno("open(2) of %s", dest.c_str());
+				throw std::system_error(errno, std::system_category());
+			}
+			if (fchown(destFd, 0, 0) < 0) {
+				log_errno("fchown(2) of %s", dest.c_str());
+				throw std::system_error(errno, std::system_category());
+			}
+
+			// cp(1) uses FICLONE where it can, and copies the data where it cannot
+			Shell::execute("/bin/cp", { "-a", "--reflink=auto",
+					"/proc/self/fd/" + std::to_string(srcFd) + "/.",
+					"/proc/self/fd/" + std::to_string(destFd) });
+			result = (method == METHOD_COPY) ? METHOD_COPY : METHOD_REFLINK;
+		}
+	} catch (...) {
+		if (destFd >= 0) (void) close(destFd);
+		if (destParentFd >= 0) (void) close(destParentFd);
+		(void) close(srcFd);
+		throw;
+	}
+	if (destFd >= 0) (void) close(destFd);
+	(void) close(destParentFd);
+	(void) close(srcFd);
+	return result;
+#else
+	Shell::execute("/bin/cp", { "-Rp", src, dest });
+	return METHOD_COPY;
+#endif
+}
+
+bool SnapshotStore::isValidName(const std::string& name)
+{
+	if (name.empty() || name.length() > 72 || name[0] == '.' || name[0] == '_') {
+		return false;
+	}
+	for (char c : name) {
+		if (!isalnum((unsigned char) c) && !strchr("-_.", c)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void SnapshotStore::loadCatalog()
+{
+	snapshots.clear();
+	if (!FileUtil::checkExists(catalogPath)) {
+		return;
+	}
+
+	std::ifstream in(catalogPath);
+	snapshots = parseCatalog(in);
+}
+
+std::vector<SnapshotStore::Snapshot> SnapshotStore::parseCatalog(std::istream& in)
+{
+	std::vector<Snapshot> result;
+	pt::ptree tree;
+	pt::read_json(in, tree);
+	auto list = tree.get_child_optional("snapshots");
+	if (!list) {
+		return result;
+	}
+	for (auto& it : *list) {
+		Snapshot snapshot;
+		snapshot.name = it.second.get("name", "");
+		// The catalog is the owner's to edit, and root uses these names as paths
+		if (!isValidName(snapshot.name)) {
+			log_warning("ignoring a snapshot with an invalid name in the catalog");
+			continue;
+		}
+		snapshot.created = it.second.get("created", (time_t) 0);
+		snapshot.method = parseMethodName(it.second.get("method", "copy"));
+		result.push_back(snapshot);
+	}
+	std::stable_sort(result.begin(), result.end(), [](const Snapshot& a, const Snapshot& b) {
+		return a.created < b.created;
+	});
+	return result;
+}
+
+void SnapshotStore::saveCatalog()
+{
+	pt::ptree tree, list;
+
+	for (auto& snapshot : snapshots) {
+		pt::ptree entry;
+		entry.put("name", snapshot.name);
+		entry.put("created", snapshot.created);
+		entry.put("method", getMethodName(snapshot.method));
+		list.push_back(std::make_pair("", entry));
+	}
+	tree.put("api.version", "0");
+	tree.add_child("snapshots", list);
+
+	// Replace the catalog atomically, so a crash never leaves it half-written
+	std::string tmpPath = catalogPath + ".new";
+	pt::write_json(tmpPath, tree);
+	if (rename(tmpPath.c_str(), catalogPath.c_str()) < 0) {
+		log_errno("rename(2) of %s", tmpPath.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+}
+
+bool SnapshotStore::exists(const std::string& name)
+{
+	for (auto& snapshot : snapshots) {
+		if (snapshot.name == name) {
+			return true;
+		}
+	}
+	return false;
+}
+
+std::string SnapshotStore::getLatest()
+{
+	return snapshots.empty() ? "" : snapshots.back().name;
+}
+
+void SnapshotStore::create(const std::string& name)
+{
+	if (!isValidName(name)) {
+		throw std::runtime_error("invalid snapshot name: " + name);
+	}
+	if (exists(name)) {
+		throw std::runtime_error("snapshot already exists: " + name);
+	}
+
+	Snapshot snapshot;
+	snapshot.name = name;
+	snapshot.created = time(NULL);
+
+	{
+		PrivilegeGuard privileges;
+		snapshot.method = copyTree(sharePath, tagsPath + "/" + name, method, true);
+	}
+
+	snapshots.push_back(snapshot);
+	saveCatalog();
+	log_event(LOG_INFO, "snapshot created", {"snapshot", name}, {"method", getMethodName(snapshot.method)});
+}
+
+void SnapshotStore::destroy(const std::string& name)
+{
+	if (!isValidName(name)) {
+		throw std::runtime_error("invalid snapshot name: " + name);
+	}
+	if (!exists(name)) {
+		throw std::runtime_error("no such snapshot: " + name);
+	}
+
+	{
+		PrivilegeGuard privileges;
+		destroyVolume(tagsPath + "/" + name);
+	}
+
+	snapshots.erase(std::remove_if(snapshots.begin(), snapshots.end(), [&](const Snapshot& s) {
+		return s.name == name;
+	}), snapshots.end());
+	saveCatalog();
+}
+
+void SnapshotStore::cloneTo(const std::string& name, const std::string& destPath)
+{
+	if (!isValidName(name)) {
+		throw std::runtime_error("invalid snapshot name: " + name);
+	}
+	if (!exists(name)) {
+		throw std::runtime_error("no such snapshot: " + name);
+	}
+
+	PrivilegeGuard privileges;
+	Method used = copyTree(tagsPath + "/" + name, destPath, method, false);
+	log_debug("cloned snapshot %s to %s using %s", name.c_str(), destPath.c_str(),
+			getMethodName(used).c_str());
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <ctime>
+#include <istream>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <sys/types.h>
+}
+
+// Snapshots of a room's share/ directory for rooms that are not on ZFS.
+//
+// Each snapshot is a copy of share/ below tags/, and the list of snapshots
+// is kept in etc/snapshots.json. The copy is as cheap as the filesystem
+// allows: a btrfs snapshot if share/ is a subvolume, reflinked files on
+// filesystems with FICLONE (xfs, btrfs), and a plain copy otherwise.
+class SnapshotStore {
+public:
+	enum Method {
+		METHOD_COPY,
+		METHOD_REFLINK,
+		METHOD_BTRFS,
+	};
+
+	struct Snapshot {
+		std::string name;
+		time_t created;
+		Method method;
+	};
+
+	SnapshotStore(const std::string& roomDataDir, Method method);
+
+	// Find the cheapest way to copy files within <dir>
+	static Method probe(const std::string& dir);
+
+	// The method recorded by RoomManager::bootstrap(), or METHOD_REFLINK
+	// (which falls back to copying) if nothing was recorded
+	static Method loadMethod(const std::string& roomDir);
+	static void saveMethod(const std::string& roomDir, Method method);
+
+	static std::string getMethodName(Method method);
+
+	// Read the snapshots from the contents of an etc/snapshots.json file.
+	// Entries whose names are not valid are left out.
+	static std::vector<Snapshot> parseCatalog(std::istream& in);
+
+	// True if <name> can be used as a snapshot name, with the same rules as
+	// room names. Root uses it as a path below tags/.
+	static bool isValidName(const std::string& name);
+
+	// Create or destroy a directory that can be snapshotted. These must be
+	// called with privileges raised; the other functions raise privileges
+	// themselves.
+	static void createVolume(const std::string& path, Method method, uid_t uid, gid_t gid);
+	static void destroyVolume(const std::string& path);
+
+	// True if <path> is the top of a btrfs subvolume
+	static bool isSubvolume(const std::string& path);
+	static bool isSubvolume(int fd);
+
+	// Destroy the btrfs subvolume <name> in the directory <dirFd>
+	static void destroySubvolumeAt(int dirFd, const std::string& name);
+
+	void create(const std::string& name);
+	void destroy(const std::string& name);
+	// Make a writable copy of a snapshot at <destPath>, which must not exist
+	void cloneTo(const std::string& name, const std::string& destPath);
+
+	bool exists(const std::string& name);
+	const std::vector<Snapshot>& list() {
+		return snapshots;
+	}
+	// The name of the newest snapshot, or "" if there are none
+	std::string getLatest();
+
+private:
+	std::string sharePath;
+	std::string tagsPath;
+	std::string catalogPath;
+	Method method;
+	std::vector<Snapshot> snapshots;
+
+	void loadCatalog();
+	void saveCatalog();
+	static Method copyTree(const std::string& src, const std::string& dest, Method method, bool readOnly);
+};
@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+extern "C" {
+#include <err.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+}
+
+#include "fileUtil.h"
+#include "logger.h"
+#include "setuidHelper.h"
+#include "StreamPipeline.hpp"
+
+static const size_t PUMP_CHUNK = 1024 * 1024;
+
+std::string StreamPipeline::findZstd()
+{
+	for (const char *path : { "/usr/bin/zstd", "/usr/local/bin/zstd" }) {
+		if (FileUtil::checkExists(path)) {
+			return path;
+		}
+	}
+	throw std::runtime_error("zstd(1) is not installed");
+}
+
+std::string StreamPipeline::findTar()
+{
+	for (const char *path : { "/bin/tar", "/usr/bin/tar" }) {
+		if (FileUtil::checkExists(path)) {
+			return path;
+		}
+	}
+	throw std::runtime_error("tar(1) is not installed");
+}
+
+void StreamPipeline::addCommand(const std::string& path, const std::vector<std::string>& args, bool privileged)
+{
+	stages.push_back({ false, path, args, privileged, -1, -1 });
+}
+
+void StreamPipeline::addNamespacedCommand(const std::string& path, const std::vector<std::string>& args,
+		int usernsFd)
+{
+	stages.push_back({ false, path, args, true, usernsFd, -1 });
+}
+
+void StreamPipeline::addMeter()
+{
+	stages.push_back({ true, "", {}, false, -1, -1 });
+}
+
+void StreamPipeline::spawn(Stage& stage, int infd, int outfd)
+{
+	std::vector<char*> argv;
+	argv.push_back(const_cast<char*>(stage.path.c_str()));
+	for (auto& arg : stage.args) {
+		argv.push_back(const_cast<char*>(arg.c_str()));
+	}
+	argv.push_back(NULL);
+
+	char* const envp[] = {
+			(char*)"HOME=/",
+			(char*)"PATH=/sbin:/usr/sbin:/bin:/usr/bin",
+			(char*)"LANG=C",
+			(char*)"LC_ALL=C",
+			NULL
+	};
+
+	log_debug("%s: starting %s", label.c_str(), stage.path.c_str());
+	log_flush();
+	stage.pid = fork();
+	if (stage.pid < 0) {
+		throw std::system_error(errno, std::system_category());
+	}
+	if (stage.pid > 0) {
+		return;
+	}
+
+	// The pipes are close-on-exec, so only these two copies survive
+	if (dup2(infd, STDIN_FILENO) < 0 || dup2(outfd, STDOUT_FILENO) < 0) {
+		err(1, "dup2(2)");
+	}
+	signal(SIGPIPE, SIG_DFL);
+	if (stage.privileged) {
+		SetuidHelper::raisePrivileges();
+#ifdef __linux__
+		if (stage.usernsFd >= 0) {
+			if (setns(stage.usernsFd, CLONE_NEWUSER) < 0) {
+				err(1, "setns(2)");
+			}
+			if (setresgid(0, 0, 0) < 0 || setresuid(0, 0, 0) < 0) {
+				err(1, "unable to become root in the user namespace");
+			}
+		}
+#endif
+	} else {
+		SetuidHelper::dropPrivileges();
+	}
+	::execve(argv[0], argv.data(), envp);
+	err(127, "execve(2) of %s", argv[0]);
+}
+
+void StreamPipeline::reportProgress(double elapsed, bool isFinal)
+{
+	double mib = byteCount / (1024.0 * 1024.0);
+	double rate = (elapsed > 0) ? (mib / elapsed) : 0;
+
+	fprintf(stderr, "\r%s: %.1f MiB in %.1fs, %.1f MiB/s%s", label.c_str(), mib, elapsed, rate,
+			isFinal ? "\n" : "   ");
+	fflush(stderr);
+}
+
+// Copy from <infd> to <outfd>, using splice(2) when both ends allow it
+void StreamPipeline::pump(int infd, int outfd)
+{
+	auto begin = std::chrono::steady_clock::now();
+	auto lastReport = begin;
+	std::vector<char> buf;
+
+	// Send anything that was read ahead of time first
+	size_t offset = 0;
+	while (offset < inputPrefix.length()) {
+		ssize_t bytes = write(outfd, inputPrefix.data() + offset, inputPrefix.length() - offset);
+		if (bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw std::system_error(errno, std::system_category());
+		}
+		offset += bytes;
+	}
+	byteCount += inputPrefix.length();
+
+#ifdef __linux__
+	bool useSplice = true;
+#else
+	bool useSplice = false;
+#endif
+	for (;;) {
+		ssize_t bytes;
+#ifdef __linux__
+		if (useSplice) {
+			bytes = splice(infd, NULL, outfd, NULL, PUMP_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (bytes < 0 && errno == EINVAL) {
+				// Neither end is a pipe; copy the slow way
+				useSplice = false;
+				continue;
+			}
+		} else
+#endif
+		{
+			if (buf.empty()) {
+				buf.resize(PUMP_CHUNK);
+			}
+			bytes = read(infd, buf.data(), buf.size());
+			if (bytes > 0) {
+				ssize_t written = 0;
+				while (written < bytes) {
+					ssize_t rv = write(outfd, buf.data() + written, bytes - written);
+					if (rv < 0) {
+						if (errno == EINTR) {
+							continue;
+						}
+						throw std::system_error(errno, std::system_category());
+					}
+					written += rv;
+				}
+			}
+		}
+		if (bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw std::system_error(errno, std::system_category());
+		}
+		if (bytes == 0) {
+			break;
+		}
+		byteCount += bytes;
+
+		if (showProgress) {
+			auto now = std::chrono::steady_clock::now();
+			if (now - lastReport >= std::chrono::seconds(1)) {
+				reportProgress(std::chrono::duration<double>(now - begin).count(), false);
+				lastReport = now;
+			}
+		}
+	}
+
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	if (showProgress) {
+		reportProgress(elapsed, true);
+	}
+	log_event(LOG_INFO, "stream complete", {"operation", label}, {"bytes", std::to_string(byteCount)},
+			{"elapsed_ms", std::to_string((int64_t) (elapsed * 1000))});
+}
+
+void StreamPipeline::run()
+{
+	size_t meters = 0;
+	for (auto& stage : stages) {
+		if (stage.isMeter) {
+			meters++;
+		}
+	}
+	if (meters != 1) {
+		throw std::logic_error("a pipeline needs exactly one meter");
+	}
+
+	// Connect each stage to the next with a pipe
+	std::vector<int> readEnds, writeEnds;
+	readEnds.push_back(inputFd);
+	for (size_t i = 0; i + 1 < stages.size(); i++) {
+		int pd[2];
+		if (pipe2(pd, O_CLOEXEC) < 0) {
+			throw std::system_error(errno, std::system_category());
+		}
+		writeEnds.push_back(pd[1]);
+		readEnds.push_back(pd[0]);
+	}
+	writeEnds.push_back(outputFd);
+
+	std::vector<int> pipeFds;
+	for (size_t i = 1; i < readEnds.size(); i++) {
+		pipeFds.push_back(readEnds[i]);
+		pipeFds.push_back(writeEnds[i - 1]);
+	}
+
+	int meterIn = -1, meterOut = -1;
+	for (size_t i = 0; i < stages.size(); i++) {
+		if (stages[i].isMeter) {
+			meterIn = readEnds[i];
+			meterOut = writeEnds[i];
+		} else {
+			spawn(stages[i], readEnds[i], writeEnds[i]);
+		}
+	}
+
+	// Only the meter's ends of the pipes stay open here, so every stage
+	// sees EOF as soon as the stage before it exits
+	for (int fd : pipeFds) {
+		if (fd != meterIn && fd != meterOut) {
+			(void) close(fd);
+		}
+	}
+
+	// A failed consumer shows up as EPIPE, and is reported via its exit status
+	void (*savedHandler)(int) = signal(SIGPIPE, SIG_IGN);
+	std::string pumpError;
+	try {
+		pump(meterIn, meterOut);
+	} catch (const std::system_error& e) {
+		pumpError = e.what();
+	}
+	signal(SIGPIPE, savedHandler);
+	if (meterIn != inputFd) {
+		(void) close(meterIn);
+	}
+	if (meterOut != outputFd) {
+		(void) close(meterOut);
+	}
+
+	std::string failure;
+	for (auto& stage : stages) {
+		if (stage.isMeter) {
+			continue;
+		}
+		int status;
+		while (waitpid(stage.pid, &status, 0) < 0) {
+			if (errno != EINTR) {
+				throw std::system_error(errno, std::system_category());
+			}
+		}
+		if ((!WIFEXITED(status) || WEXITSTATUS(status) != 0) && failure == "") {
+			failure = stage.path + " " + (WIFEXITED(status) ?
+					"exited with status " + std::to_string(WEXITSTATUS(status)) :
+					"was killed by signal " + std::to_string(WTERMSIG(status)));
+		}
+	}
+	if (failure != "") {
+		log_error("%s: %s", label.c_str(), failure.c_str());
+		throw std::runtime_error(label + " failed: " + failure);
+	}
+	if (pumpError != "") {
+		throw std::runtime_error(label + " failed: " + pumpError);
+	}
+}
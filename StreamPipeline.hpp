@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <sys/types.h>
+}
+
+// A shell-style pipeline of commands, with a byte counter ("meter")
+// spliced in at one point so progress and throughput can be reported.
+//
+// Usage:
+//   StreamPipeline p("export");
+//   p.addCommand("/sbin/zfs", { "send", snap }, true);
+//   p.addMeter();
+//   p.addCommand(StreamPipeline::findZstd(), { "-T0", "-c" });
+//   p.setOutput(fd);
+//   p.run();
+class StreamPipeline {
+public:
+	StreamPipeline(const std::string& label) : label(label) {}
+
+	// Append a command. If <privileged> is false, the command runs with
+	// the privileges of the real user.
+	void addCommand(const std::string& path, const std::vector<std::string>& args, bool privileged = false);
+
+	// Append a command that runs as root inside the user namespace
+	// <usernsFd>, so it can only act on ids mapped there. The descriptor
+	// must stay open until run() returns.
+	void addNamespacedCommand(const std::string& path, const std::vector<std::string>& args, int usernsFd);
+
+	// Append the byte counter. There must be exactly one.
+	void addMeter();
+
+	// Where the first stage reads from, and the last stage writes to.
+	// The default is stdin and stdout.
+	void setInput(int fd) {
+		inputFd = fd;
+	}
+
+	void setOutput(int fd) {
+		outputFd = fd;
+	}
+
+	// Bytes that were already read from the input (e.g. to sniff the
+	// format), which are sent ahead of the rest of it.
+	void setInputPrefix(const std::string& prefix) {
+		inputPrefix = prefix;
+	}
+
+	// Print the byte count and throughput to stderr once a second
+	void setShowProgress(bool showProgress) {
+		this->showProgress = showProgress;
+	}
+
+	// Run the pipeline to completion. Throws if any command fails.
+	void run();
+
+	// The number of bytes that passed through the meter
+	uint64_t getByteCount() const {
+		return byteCount;
+	}
+
+	// Find zstd(1), or throw if it is not installed
+	static std::string findZstd();
+
+	// Find tar(1), or throw if it is not installed
+	static std::string findTar();
+
+private:
+	struct Stage {
+		bool isMeter;
+		std::string path;
+		std::vector<std::string> args;
+		bool privileged;
+		int usernsFd;
+		pid_t pid;
+	};
+
+	std::string label;
+	std::vector<Stage> stages;
+	int inputFd = 0;
+	int outputFd = 1;
+	std::string inputPrefix;
+	bool showProgress = false;
+	uint64_t byteCount = 0;
+
+	void spawn(Stage& stage, int infd, int outfd);
+	void pump(int infd, int outfd);
+	void reportProgress(double elapsed, bool isFinal);
+};
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cerrno>
+#include <fstream>
+#include <set>
+#include <stdexcept>
+#include <system_error>
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+}
+
+#include "fileUtil.h"
+#include "logger.h"
+#include "SubidAllocator.hpp"
+
+// Stay well above the ids handed out by useradd(8) and /etc/subuid, and
+// below the top of the id space, which holds (uid_t) -1 and friends.
+static const uid_t FIRST_ID = 1U << 30;
+static const uid_t LAST_ID = 0xffff0000U;
+
+std::string SubidAllocator::getIdMap(uid_t ownerId, const Range& range)
+{
+	// Id <n> in the room is <range.start> + <n> on the host
+	return "0 " + std::to_string(ownerId) + " 1\n" +
+		"1 " + std::to_string(range.start + 1) + " " + std::to_string(range.count - 1) + "\n";
+}
+
+SubidAllocator::Range SubidAllocator::acquire(const std::string& key)
+{
+	int fd = lock();
+	try {
+		load();
+		auto it = ranges.find(key);
+		if (it != ranges.end()) {
+			(void) close(fd);
+			return it->second;
+		}
+
+		// First fit, so released ranges are reused before the space grows
+		std::set<uid_t> used;
+		for (auto& it : ranges) {
+			used.insert(it.second.start);
+		}
+		uid_t start = FIRST_ID;
+		for (uid_t taken : used) {
+			if (taken > start) {
+				break;
+			}
+			if (taken == start) {
+				start += RANGE_SIZE;
+			}
+		}
+		if (start > LAST_ID - RANGE_SIZE) {
+			throw std::runtime_error("no subordinate id ranges are left");
+		}
+
+		Range range = { start, RANGE_SIZE };
+		ranges[key] = range;
+		save();
+		(void) close(fd);
+		log_debug("allocated ids %u-%u to %s", range.start, range.start + range.count - 1, key.c_str());
+		return range;
+	} catch (...) {
+		(void) close(fd);
+		throw;
+	}
+}
+
+void SubidAllocator::release(const std::string& key)
+{
+	int fd = lock();
+	try {
+		load();
+		if (ranges.erase(key) > 0) {
+			save();
+			log_debug("released the ids of %s", key.c_str());
+		}
+	} catch (...) {
+		(void) close(fd);
+		throw;
+	}
+	(void) close(fd);
+}
+
+int SubidAllocator::lock()
+{
+	int fd = open(lockPath.c_str(), O_RDONLY | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		log_errno("open(2) of %s", lockPath.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+	if (flock(fd, LOCK_EX) < 0) {
+		int saved_errno = errno;
+		(void) close(fd);
+		log_errno("flock(2) of %s", lockPath.c_str());
+		throw std::system_error(saved_errno, std::system_category());
+	}
+	return fd;
+}
+
+// The state file has one line per range: "<start> <count> <key>"
+void SubidAllocator::load()
+{
+	ranges.clear();
+
+	std::ifstream in(statePath);
+	if (!in.is_open()) {
+		if (errno == ENOENT) {
+			return;
+		}
+		log_errno("unable to open %s", statePath.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+	Range range;
+	std::string key;
+	while (in >> range.start >> range.count && std::getline(in >> std::ws, key)) {
+		ranges[key] = range;
+	}
+	if (!in.eof()) {
+		throw std::runtime_error("unable to parse " + statePath);
+	}
+}
+
+void SubidAllocator::save()
+{
+	std::string tmpPath = statePath + ".new";
+	std::ofstream out(tmpPath, std::ios::trunc);
+	for (auto& it : ranges) {
+		out << it.second.start << " " << it.second.count << " " << it.first << "\n";
+	}
+	out.close();
+	if (out.fail()) {
+		throw std::runtime_error("unable to write " + tmpPath);
+	}
+	if (rename(tmpPath.c_str(), statePath.c_str()) < 0) {
+		log_errno("rename(2) of %s", tmpPath.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <map>
+#include <string>
+
+extern "C" {
+#include <sys/types.h>
+}
+
+// Hands out a distinct range of subordinate uids and gids to each room,
+// so rooms do not share ids with each other or with the host.
+//
+// Ranges are recorded in a small text file, keyed by an arbitrary string
+// that names the room. Every update happens under an exclusive lock on
+// a separate lock file, and replaces the state file atomically.
+//
+// All functions expect privileges to be raised.
+class SubidAllocator {
+public:
+	struct Range {
+		uid_t start;
+		uid_t count;
+	};
+
+	// Ranges are this big, enough for the usual 16-bit ids
+	static const uid_t RANGE_SIZE = 65536;
+
+	SubidAllocator(const std::string& statePath = "/room/.subids")
+		: statePath(statePath), lockPath(statePath + ".lock") {}
+
+	// Return the range owned by <key>, allocating one if it has none
+	Range acquire(const std::string& key);
+
+	// Give back the range owned by <key>, if any
+	void release(const std::string& key);
+
+	// Build a uid_map or gid_map that maps root to <ownerId> and the other
+	// ids of the room into <range>
+	static std::string getIdMap(uid_t ownerId, const Range& range);
+
+private:
+	std::string statePath;
+	std::string lockPath;
+	std::map<std::string, Range> ranges;
+
+	int lock();
+	void load();
+	void save();
+};
@@ -0,0 +1,504 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+extern "C" {
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+}
+
+#include "fileUtil.h"
+#include "logger.h"
+#include "setuidHelper.h"
+#include "shell.h"
+#include "SnapshotStore.hpp"
+#include "Trash.hpp"
+
+namespace {
+
+// Deletes a directory tree with a pool of threads. Each directory is a unit
+// of work: a thread unlinks the files in it and queues its subdirectories.
+// Every thread has its own queue, and steals from the others when it runs out.
+// A directory is removed once it has been scanned and all of its
+// subdirectories are gone.
+//
+// The tree usually belongs to someone else, so every directory is opened
+// relative to its parent's descriptor and no symlink is ever followed. A
+// directory stays open until it has been removed, which with the newest
+// work taken first keeps about one directory per level per thread open.
+class TreeRemover {
+public:
+	TreeRemover(unsigned int threads) : queues(threads) {}
+
+	void run(const std::string& root)
+	{
+		size_t slash = root.rfind('/');
+		if (slash == std::string::npos || slash == root.length() - 1) {
+			throw std::logic_error("bad path: " + root);
+		}
+		topFd = FileUtil::openDirectory(slash == 0 ? "/" : root.substr(0, slash));
+
+		outstanding = 1;
+		queued = 1;
+		queues[0].items.push_back(new Node(root.substr(slash + 1), root, NULL));
+
+		std::vector<std::thread> workers;
+		for (size_t i = 1; i < queues.size(); i++) {
+			workers.emplace_back(&TreeRemover::work, this, i);
+		}
+		work(0);
+		for (auto& worker : workers) {
+			worker.join();
+		}
+		(void) close(topFd);
+
+		if (errors > 0) {
+			throw std::runtime_error("unable to remove " + std::to_string(errors) +
+					" entries below " + root);
+		}
+	}
+
+private:
+	struct Node {
+		Node(const std::string& name, const std::string& path, Node* parent)
+			: name(name), path(path), parent(parent) {}
+		std::string name;
+		std::string path; // only for messages
+		Node* parent;
+		int fd = -1;
+		// One for the scan of this directory, plus one per live subdirectory
+		std::atomic<long> pending{1};
+		bool removed = false;
+	};
+
+	struct Queue {
+		std::mutex lock;
+		std::deque<Node*> items;
+	};
+
+	std::vector<Queue> queues;
+	std::atomic<long> outstanding{0}; // directories not yet removed
+	std::atomic<long> queued{0}; // directories waiting to be scanned
+	std::atomic<long> errors{0};
+	int topFd = -1; // the directory that holds the root of the tree
+
+	// Idle threads sleep here until there is work, or everything is done
+	std::mutex idleLock;
+	std::condition_variable idle;
+
+	int parentFd(Node* node)
+	{
+		return node->parent ? node->parent->fd : topFd;
+	}
+
+	void wakeIdle(bool all)
+	{
+		// Taking the lock orders this with a thread that is about to wait
+		{
+			std::lock_guard<std::mutex> guard(idleLock);
+		}
+		if (all) {
+			idle.notify_all();
+		} else {
+			idle.notify_one();
+		}
+	}
+
+	void push(size_t self, Node* node)
+	{
+		{
+			std::lock_guard<std::mutex> guard(queues[self].lock);
+			queues[self].items.push_back(node);
+		}
+		queued++;
+		wakeIdle(false);
+	}
+
+	// Take the newest work from our own queue, or the oldest from another
+	Node* pop(size_t self)
+	{
+		{
+			std::lock_guard<std::mutex> guard(queues[self].lock);
+			if (!queues[self].items.empty()) {
+				Node* node = queues[self].items.back();
+				queues[self].items.pop_back();
+				queued--;
+				return node;
+			}
+		}
+		for (size_t i = 1; i < queues.size(); i++) {
+			Queue& victim = queues[(self + i) % queues.size()];
+			std::lock_guard<std::mutex> guard(victim.lock);
+			if (!victim.items.empty()) {
+				Node* node = victim.items.front();
+				victim.items.pop_front();
+				queued--;
+				return node;
+			}
+		}
+		return NULL;
+	}
+
+	void work(size_t self)
+	{
+		while (outstanding > 0) {
+			Node* node = pop(self);
+			if (node) {
+				scan(self, node);
+				continue;
+			}
+			std::unique_lock<std::mutex> guard(idleLock);
+			idle.wait(guard, [this] { return queued > 0 || outstanding == 0; });
+		}
+	}
+
+	void fail(const std::string& path)
+	{
+		log_errno("unable to remove %s", path.c_str());
+		errors++;
+	}
+
+	void scan(size_t self, Node* node)
+	{
+		int fd = openat(parentFd(node), node->name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd < 0) {
+			if (errno != ENOENT) {
+				fail(node->path);
+			}
+			node->removed = true;
+			release(node);
+			return;
+		}
+		node->fd = fd;
+
+		// Read-only btrfs snapshots cannot be emptied, but can be deleted whole
+		struct stat sb;
+		if (fstat(fd, &sb) == 0 && sb.st_ino == 256 && SnapshotStore::isSubvolume(fd)) {
+			try {
+				SnapshotStore::destroySubvolumeAt(parentFd(node), node->name);
+				node->removed = true;
+			} catch (...) {
+				errors++;
+			}
+			release(node);
+			return;
+		}
+
+		int dirFd = dup(fd);
+		DIR* dir = (dirFd < 0) ? NULL : fdopendir(dirFd);
+		if (!dir) {
+			fail(node->path);
+			if (dirFd >= 0) (void) close(dirFd);
+			release(node);
+			return;
+		}
+		struct dirent* ent;
+		while ((ent = readdir(dir)) != NULL) {
+			if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+				continue;
+			}
+			bool isDir = (ent->d_type == DT_DIR);
+			if (ent->d_type == DT_UNKNOWN) {
+				struct stat esb;
+				isDir = (fstatat(fd, ent->d_name, &esb, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(esb.st_mode));
+			}
+			if (isDir) {
+				node->pending++;
+				outstanding++;
+				push(self, new Node(ent->d_name, node->path + "/" + ent->d_name, node));
+			} else if (unlinkat(fd, ent->d_name, 0) < 0 && errno != ENOENT) {
+				fail(node->path + "/" + ent->d_name);
+			}
+		}
+		(void) closedir(dir);
+		release(node);
+	}
+
+	// Called when a scan or a subdirectory finishes
+	void release(Node* node)
+	{
+		while (node && --node->pending == 0) {
+			if (!node->removed && unlinkat(parentFd(node), node->name.c_str(), AT_REMOVEDIR) < 0 &&
+					errno != ENOENT) {
+				fail(node->path);
+			}
+			if (node->fd >= 0) {
+				(void) close(node->fd);
+			}
+			Node* parent = node->parent;
+			delete node;
+			if (--outstanding == 0) {
+				wakeIdle(true);
+			}
+			node = parent;
+		}
+	}
+};
+
+} // namespace
+
+void Trash::removeTree(const std::string& path, unsigned int threads)
+{
+	if (threads == 0) {
+		threads = std::max(1U, std::thread::hardware_concurrency());
+	}
+	TreeRemover(threads).run(path);
+}
+
+void Trash::createTrash()
+{
+	if (dataset != "") {
+		Shell::execute("/sbin/zfs", { "create", "-p", dataset });
+	} else {
+		FileUtil::mkdir_idempotent(trashDir, 0700, 0, 0);
+	}
+}
+
+void Trash::add(const std::string& roomName, const std::string& source)
+{
+	createTrash();
+
+	std::string name = roomName + "." + std::to_string(time(NULL)) + "." + std::to_string(getpid());
+	if (dataset != "") {
+		Shell::execute("/sbin/zfs", { "rename", "-u", source, dataset + "/" + name });
+	} else {
+		std::string dest = trashDir + "/" + name;
+		if (rename(source.c_str(), dest.c_str()) < 0) {
+			log_errno("rename(2) of %s to %s", source.c_str(), dest.c_str());
+			throw std::system_error(errno, std::system_category());
+		}
+	}
+	log_event(LOG_INFO, "room moved to the trash", {"room", roomName}, {"entry", name});
+}
+
+// Entries are named <room>.<time>.<pid>
+static bool parseEntry(const std::string& name, Trash::Entry& entry)
+{
+	size_t pidPos = name.rfind('.');
+	if (pidPos == std::string::npos || pidPos == 0) {
+		return false;
+	}
+	size_t timePos = name.rfind('.', pidPos - 1);
+	if (timePos == std::string::npos || timePos == 0) {
+		return false;
+	}
+	entry.name = name;
+	entry.roomName = name.substr(0, timePos);
+	entry.destroyedAt = std::strtoll(name.substr(timePos + 1, pidPos - timePos - 1).c_str(), NULL, 10);
+	return true;
+}
+
+std::vector<Trash::Entry> Trash::list()
+{
+	std::vector<Entry> result;
+	std::vector<std::string> names;
+
+	if (dataset != "") {
+		std::string cmd = "/sbin/zfs list -H -o name -d 1 " + dataset + " 2>/dev/null";
+		FILE* fp = popen(cmd.c_str(), "r");
+		if (!fp) {
+			throw std::system_error(errno, std::system_category());
+		}
+		char buf[1024];
+		while (fgets(buf, sizeof(buf), fp)) {
+			std::string line(buf);
+			line.erase(line.find_last_not_of("\n") + 1);
+			if (line.compare(0, dataset.length() + 1, dataset + "/") == 0) {
+				names.push_back(line.substr(dataset.length() + 1));
+			}
+		}
+		(void) pclose(fp);
+	} else {
+		DIR* dir = opendir(trashDir.c_str());
+		if (!dir) {
+			if (errno == ENOENT) {
+				return result;
+			}
+			log_errno("opendir(3) of %s", trashDir.c_str());
+			throw std::system_error(errno, std::system_category());
+		}
+		struct dirent* ent;
+		while ((ent = readdir(dir)) != NULL) {
+			if (ent->d_name[0] != '.') {
+				names.push_back(ent->d_name);
+			}
+		}
+		(void) closedir(dir);
+	}
+
+	for (auto& name : names) {
+		Entry entry;
+		if (parseEntry(name, entry)) {
+			result.push_back(entry);
+		}
+	}
+	std::sort(result.begin(), result.end(), [](const Entry& a, const Entry& b) {
+		return a.destroyedAt < b.destroyedAt;
+	});
+	return result;
+}
+
+int Trash::lockTrash(int operation)
+{
+	std::string lockPath = trashDir + "/.lock";
+	int fd = open(lockPath.c_str(), O_RDONLY | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		if (errno == ENOENT) {
+			return -1;
+		}
+		log_errno("open(2) of %s", lockPath.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+	if (flock(fd, operation) < 0) {
+		(void) close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+bool Trash::isReclaiming()
+{
+	int fd = lockTrash(LOCK_SH | LOCK_NB);
+	if (fd < 0) {
+		return FileUtil::checkExists(trashDir);
+	}
+	(void) close(fd);
+	return false;
+}
+
+void Trash::reclaimEntry(const Entry& entry, unsigned int threads)
+{
+	auto begin = std::chrono::steady_clock::now();
+
+	try {
+		if (dataset != "") {
+			Shell::execute("/sbin/zfs", { "destroy", "-r", dataset + "/" + entry.name });
+		} else {
+			std::string path = trashDir + "/" + entry.name;
+#ifdef __FreeBSD__
+			Shell::execute("/bin/chflags", { "-R", "noschg", path });
+#endif
+			removeTree(path, threads);
+		}
+	} catch (const std::exception& e) {
+		log_warning("unable to reclaim %s; will try again later: %s", entry.name.c_str(), e.what());
+		return;
+	}
+
+	auto elapsed = std::chrono::steady_clock::now() - begin;
+	log_event(LOG_INFO, "room reclaimed", {"room", entry.roomName}, {"entry", entry.name},
+			{"elapsed_ms", std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count())});
+}
+
+bool Trash::reclaim(unsigned int threads)
+{
+	std::set<std::string> attempted;
+	bool acquired = false;
+
+	if (!FileUtil::checkExists(trashDir)) {
+		return true;
+	}
+	for (;;) {
+		int fd = lockTrash(LOCK_EX | LOCK_NB);
+		if (fd < 0) {
+			return acquired;
+		}
+		acquired = true;
+
+		bool progress;
+		do {
+			progress = false;
+			for (auto& entry : list()) {
+				if (attempted.insert(entry.name).second) {
+					reclaimEntry(entry, threads);
+					progress = true;
+				}
+			}
+		} while (progress);
+		(void) close(fd);
+
+		// Another reclaimer may have given up on a new entry while we held the lock
+		bool pending = false;
+		for (auto& entry : list()) {
+			if (attempted.count(entry.name) == 0) {
+				pending = true;
+			}
+		}
+		if (!pending) {
+			return true;
+		}
+	}
+}
+
+void Trash::reclaimInBackground()
+{
+	log_flush();
+	pid_t pid = fork();
+	if (pid < 0) {
+		log_errno("fork(2)");
+		log_warning("unable to start the reclaimer; run `room gc' to free the space");
+		return;
+	}
+	if (pid > 0) {
+		// The intermediate child exits right away, so nobody has to reap the reclaimer
+		int status;
+		while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+		return;
+	}
+
+	(void) setsid();
+	if (fork() != 0) {
+		_exit(0);
+	}
+
+	int nullfd = open("/dev/null", O_RDWR);
+	if (nullfd >= 0) {
+		(void) dup2(nullfd, STDIN_FILENO);
+		(void) dup2(nullfd, STDOUT_FILENO);
+		(void) dup2(nullfd, STDERR_FILENO);
+		if (nullfd > STDERR_FILENO) {
+			(void) close(nullfd);
+		}
+	}
+	try {
+		SetuidHelper::raisePrivileges();
+		(void) reclaim();
+	} catch (const std::exception& e) {
+		log_error("reclaimer failed: %s", e.what());
+		log_flush();
+		_exit(1);
+	}
+	log_flush();
+	_exit(0);
+}
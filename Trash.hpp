@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <ctime>
+#include <string>
+#include <vector>
+
+// A per-user holding area for destroyed rooms.
+//
+// Destroying a room only renames it into the trash, which is instant.
+// The space is given back later by reclaim(), usually running in the
+// background. Rooms on ZFS are renamed below a ".trash" dataset and
+// reclaimed with "zfs destroy"; other rooms are renamed into a ".trash"
+// directory and deleted by several threads at once.
+//
+// All functions except reclaimInBackground() expect privileges to be raised.
+class Trash {
+public:
+	struct Entry {
+		std::string name;     // the name of the entry in the trash
+		std::string roomName; // the name of the room that was destroyed
+		time_t destroyedAt;
+	};
+
+	// <dataset> is the ZFS dataset that holds the trash, or "" if ZFS is not used
+	Trash(const std::string& trashDir, const std::string& dataset = "")
+		: trashDir(trashDir), dataset(dataset) {}
+
+	// Move a room directory or dataset into the trash
+	void add(const std::string& roomName, const std::string& source);
+
+	std::vector<Entry> list();
+
+	// Delete everything in the trash. Returns false without doing anything
+	// if another process is already reclaiming it.
+	bool reclaim(unsigned int threads = 0);
+
+	// Run reclaim() in a detached child process. Must be called with
+	// privileges lowered.
+	void reclaimInBackground();
+
+	// True if some process is running reclaim()
+	bool isReclaiming();
+
+	// Delete a directory tree using <threads> threads (0 means one per CPU)
+	static void removeTree(const std::string& path, unsigned int threads = 0);
+
+private:
+	std::string trashDir;
+	std::string dataset;
+
+	void createTrash();
+	void reclaimEntry(const Entry& entry, unsigned int threads);
+	int lockTrash(int operation);
+};
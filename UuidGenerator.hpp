@@ -21,6 +21,7 @@
 #include <boost/uuid/uuid_generators.hpp>
 #include <iostream>
 #include <sstream>
+#include <vector>
 
 class UuidGenerator {
 public:
@@ -34,6 +35,17 @@ public:
 		this->uuid = gen();
 	}
 
+	// Generate <count> UUIDs, seeding the random number generator only once
+	static std::vector<std::string> generateBatch(size_t count) {
+		boost::uuids::random_generator gen;
+		std::vector<std::string> result;
+		result.reserve(count);
+		for (size_t i = 0; i < count; i++) {
+			result.push_back(to_string(gen()));
+		}
+		return result;
+	}
+
 	std::string getValue() const {
 		return to_string(uuid);
 	}
@@ -27,6 +27,7 @@
 #include <unordered_set>
 
 extern "C" {
+#include <fcntl.h>
 #include <getopt.h>
 #include <pwd.h>
 #include <sys/param.h>
@@ -107,6 +108,125 @@ public:
 		}
 	}
 
+	// The directory for state that goes away when the host reboots
+	static const string& getRuntimeDir() {
+		static const string path = "/run/room";
+		return path;
+	}
+
+	// Create getRuntimeDir() owned by root with mode 0755, or put that
+	// owner and mode back on it, so it is the same whichever subsystem
+	// gets there first. Expects privileges to be raised.
+	static void createRuntimeDir() {
+		const string& path = getRuntimeDir();
+		if (::mkdir(path.c_str(), 0755) < 0 && errno != EEXIST) {
+			log_errno("mkdir(2) of `%s'", path.c_str());
+			throw std::system_error(errno, std::system_category());
+		}
+		int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd < 0) {
+			log_errno("open(2) of `%s'", path.c_str());
+			throw std::system_error(errno, std::system_category());
+		}
+		struct stat sb;
+		if (fstat(fd, &sb) < 0 ||
+				((sb.st_uid != 0 || sb.st_gid != 0) && fchown(fd, 0, 0) < 0) ||
+				((sb.st_mode & 07777) != 0755 && fchmod(fd, 0755) < 0)) {
+			int saved_errno = errno;
+			log_errno("unable to set the owner and mode of `%s'", path.c_str());
+			(void) close(fd);
+			throw std::system_error(saved_errno, std::system_category());
+		}
+		(void) close(fd);
+	}
+
+	// Open the directory <path> below <dirFd> one component at a time,
+	// without following any symlink. Returns -1 and sets errno if that
+	// fails. <flags> are added to O_DIRECTORY | O_NOFOLLOW.
+	static int openBeneath(int dirFd, const string& path, int flags = O_RDONLY | O_CLOEXEC) {
+		int fd = ::openat(dirFd, ".", O_DIRECTORY | flags);
+		size_t start = 0;
+		while (fd >= 0 && start < path.length()) {
+			size_t end = path.find('/', start);
+			if (end == string::npos) {
+				end = path.length();
+			}
+			string name = path.substr(start, end - start);
+			start = end + 1;
+			if (name == "" || name == ".") {
+				continue;
+			}
+
+			int next = ::openat(fd, name.c_str(), O_DIRECTORY | O_NOFOLLOW | flags);
+			int saved_errno = errno;
+			(void) close(fd);
+			errno = saved_errno;
+			fd = next;
+		}
+		return fd;
+	}
+
+	// Open the directory <path> for a process running as root, without
+	// following any symlink that someone else could have made along the
+	// way. Only symlinks owned by root, in directories owned by root, are
+	// followed. <flags> are added to O_DIRECTORY | O_NOFOLLOW.
+	static int openDirectory(const string& path, int flags = O_RDONLY | O_CLOEXEC) {
+		if (path.empty() || path[0] != '/') {
+			throw std::logic_error("not an absolute path: " + path);
+		}
+		int fd = ::open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0) {
+			log_errno("open(2) of /");
+			throw std::system_error(errno, std::system_category());
+		}
+
+		size_t start = 1;
+		while (start <= path.length()) {
+			size_t end = path.find('/', start);
+			if (end == string::npos) {
+				end = path.length();
+			}
+			string name = path.substr(start, end - start);
+			start = end + 1;
+			if (name == "" || name == ".") {
+				continue;
+			}
+			bool last = (path.find_first_not_of('/', end) == string::npos);
+			int openFlags = O_DIRECTORY | O_NOFOLLOW | (last ? flags : O_RDONLY | O_CLOEXEC);
+
+			int next = ::openat(fd, name.c_str(), openFlags);
+			if (next < 0 && (errno == ELOOP || errno == ENOTDIR) && name != "..") {
+				struct stat dirSb, linkSb;
+				if (fstat(fd, &dirSb) == 0 && dirSb.st_uid == 0 &&
+						fstatat(fd, name.c_str(), &linkSb, AT_SYMLINK_NOFOLLOW) == 0 &&
+						S_ISLNK(linkSb.st_mode) && linkSb.st_uid == 0) {
+					next = ::openat(fd, name.c_str(), openFlags & ~O_NOFOLLOW);
+				} else {
+					errno = ELOOP;
+				}
+			}
+			if (next < 0) {
+				int saved_errno = errno;
+				log_errno("open(2) of `%s' in `%s'", name.c_str(), path.c_str());
+				(void) close(fd);
+				throw std::system_error(saved_errno, std::system_category());
+			}
+			(void) close(fd);
+			fd = next;
+		}
+
+		// "/" itself was asked for
+		if (path.find_first_not_of('/') == string::npos) {
+			int next = ::openat(fd, ".", O_DIRECTORY | flags);
+			(void) close(fd);
+			if (next < 0) {
+				throw std::system_error(errno, std::system_category());
+			}
+			fd = next;
+		}
+		return fd;
+	}
+
 	static void unmount(const string& path, int flags) {
 #ifdef __linux__
 		if (::umount2(path.c_str(), flags) < 0) {
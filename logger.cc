@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <atomic>
+#include <cstdarg>
+#include <cstdint>
+#include <ctime>
+#include <string>
+
+extern "C" {
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+#include "logger.h"
+
+/*
+ * Records are formatted into a fixed ring of slots and written out in
+ * batches. The ring is a bounded multi-producer queue: each slot carries
+ * a sequence number that tells producers and the drainer whose turn it is,
+ * so enqueueing a record never takes a lock.
+ *
+ * There is no background thread; room(1) forks and execs too often for
+ * that to be safe. Instead the ring is drained when it fills up, when an
+ * error is logged, when log_flush() is called, and at exit(3).
+ */
+
+static const size_t LOG_RING_SLOTS = 256;
+static const size_t LOG_RECORD_MAX = 1024;
+// A room log bigger than this is moved aside to <path>.old when it is opened
+static const off_t ROOM_LOG_MAX = 1024 * 1024;
+
+struct LogSlot {
+	std::atomic<size_t> sequence;
+	int level;
+	time_t timestamp;
+	size_t len;
+	char buf[LOG_RECORD_MAX];
+};
+
+static LogSlot ring[LOG_RING_SLOTS];
+static std::atomic<size_t> enqueuePos(0);
+static std::atomic<size_t> dequeuePos(0);
+static std::atomic_flag draining = ATOMIC_FLAG_INIT;
+
+static int consoleThreshold = LOG_DEBUG;
+static int roomThreshold = -1;
+static int roomLogFd = -1;
+
+int log_threshold = LOG_DEBUG;
+FILE *logfile = NULL;
+
+static void updateThreshold()
+{
+	log_threshold = (consoleThreshold > roomThreshold) ? consoleThreshold : roomThreshold;
+}
+
+static struct LogRingInit {
+	LogRingInit() {
+		for (size_t i = 0; i < LOG_RING_SLOTS; i++) {
+			ring[i].sequence.store(i, std::memory_order_relaxed);
+		}
+		atexit(log_flush);
+	}
+} logRingInit;
+
+static void writeAll(int fd, const std::string& buf)
+{
+	size_t offset = 0;
+	while (offset < buf.length()) {
+		ssize_t bytes = write(fd, buf.data() + offset, buf.length() - offset);
+		if (bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		offset += bytes;
+	}
+}
+
+void log_flush()
+{
+	int saved_errno = errno;
+	std::string consoleBuf, roomBuf;
+
+	// Only one drainer at a time; anyone else will find the ring drained
+	if (draining.test_and_set(std::memory_order_acquire)) {
+		return;
+	}
+
+	size_t pos = dequeuePos.load(std::memory_order_relaxed);
+	for (;;) {
+		LogSlot& slot = ring[pos % LOG_RING_SLOTS];
+		if (slot.sequence.load(std::memory_order_acquire) != pos + 1) {
+			break;
+		}
+
+		if (slot.level <= consoleThreshold) {
+			if (logfile != NULL) {
+				consoleBuf.append(slot.buf, slot.len);
+				consoleBuf.push_back('\n');
+			} else {
+				syslog(slot.level, "%s", slot.buf);
+			}
+		}
+		if (roomLogFd >= 0 && slot.level <= roomThreshold) {
+			char stamp[32];
+			struct tm tm;
+			if (strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S ",
+					localtime_r(&slot.timestamp, &tm)) == 0) {
+				stamp[0] = '\0';
+			}
+			roomBuf.append(stamp);
+			roomBuf.append("pid=" + std::to_string(getpid()) + " ");
+			roomBuf.append(slot.buf, slot.len);
+			roomBuf.push_back('\n');
+		}
+
+		slot.sequence.store(pos + LOG_RING_SLOTS, std::memory_order_release);
+		pos++;
+	}
+	dequeuePos.store(pos, std::memory_order_relaxed);
+
+	if (!consoleBuf.empty()) {
+		fwrite(consoleBuf.data(), 1, consoleBuf.length(), logfile);
+		fflush(logfile);
+	}
+	if (!roomBuf.empty()) {
+		writeAll(roomLogFd, roomBuf);
+	}
+
+	draining.clear(std::memory_order_release);
+	errno = saved_errno;
+}
+
+// Claim a free slot, draining the ring if it is full.
+static LogSlot& claimSlot(size_t& pos)
+{
+	pos = enqueuePos.load(std::memory_order_relaxed);
+	for (;;) {
+		LogSlot& slot = ring[pos % LOG_RING_SLOTS];
+		size_t seq = slot.sequence.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+		if (diff == 0) {
+			if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				return slot;
+			}
+		} else if (diff < 0) {
+			log_flush();
+			sched_yield();
+			pos = enqueuePos.load(std::memory_order_relaxed);
+		} else {
+			pos = enqueuePos.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+static void publishSlot(LogSlot& slot, size_t pos, int level)
+{
+	slot.sequence.store(pos + 1, std::memory_order_release);
+	if (level <= LOG_ERR) {
+		log_flush();
+	}
+}
+
+static size_t formatPrefix(LogSlot& slot, int level, const char *file, int line, const char *func)
+{
+	slot.level = level;
+	slot.timestamp = time(NULL);
+	int len = snprintf(slot.buf, sizeof(slot.buf), "%14s:%-4d  %-30s ", file, line, func);
+	if (len < 0) {
+		len = 0;
+	} else if ((size_t) len >= sizeof(slot.buf)) {
+		len = sizeof(slot.buf) - 1;
+	}
+	return len;
+}
+
+void _log_record(int level, const char *file, int line, const char *func, const char *format, ...)
+{
+	int saved_errno = errno;
+	size_t pos;
+	LogSlot& slot = claimSlot(pos);
+
+	size_t len = formatPrefix(slot, level, file, line, func);
+	va_list args;
+	va_start(args, format);
+	int rv = vsnprintf(slot.buf + len, sizeof(slot.buf) - len, format, args);
+	va_end(args);
+	if (rv > 0) {
+		len += rv;
+	}
+	if (len >= sizeof(slot.buf)) {
+		len = sizeof(slot.buf) - 1;
+	}
+	slot.len = len;
+
+	publishSlot(slot, pos, level);
+	errno = saved_errno;
+}
+
+void _log_event(int level, const char *file, int line, const char *func,
+		const char *message, std::initializer_list<log_field_t> fields)
+{
+	int saved_errno = errno;
+	std::string buf = message;
+
+	for (auto& field : fields) {
+		buf.push_back(' ');
+		buf.append(field.first);
+		buf.push_back('=');
+		if (field.second.find_first_of(" \t\"=") == std::string::npos && !field.second.empty()) {
+			buf.append(field.second);
+		} else {
+			buf.push_back('"');
+			for (char c : field.second) {
+				if (c == '"' || c == '\\') {
+					buf.push_back('\\');
+				}
+				buf.push_back(c);
+			}
+			buf.push_back('"');
+		}
+	}
+
+	size_t pos;
+	LogSlot& slot = claimSlot(pos);
+	size_t len = formatPrefix(slot, level, file, line, func);
+	len += snprintf(slot.buf + len, sizeof(slot.buf) - len, "%s", buf.c_str());
+	if (len >= sizeof(slot.buf)) {
+		len = sizeof(slot.buf) - 1;
+	}
+	slot.len = len;
+
+	publishSlot(slot, pos, level);
+	errno = saved_errno;
+}
+
+void log_set_console(FILE *new_logfile, int threshold)
+{
+	log_flush();
+	logfile = new_logfile;
+	consoleThreshold = threshold;
+	updateThreshold();
+}
+
+void log_freopen(FILE *new_logfile)
+{
+	log_set_console(new_logfile, consoleThreshold);
+}
+
+void log_open_room(const std::string& path, int threshold)
+{
+	log_close_room();
+
+	int fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+	if (fd < 0) {
+		log_errno("open(2) of %s", path.c_str());
+		return;
+	}
+
+	// Keep one old log, replacing whatever was there. Another process that
+	// still has the log open goes on writing to the old one.
+	struct stat sb;
+	if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size >= ROOM_LOG_MAX) {
+		std::string oldPath = path + ".old";
+		if (rename(path.c_str(), oldPath.c_str()) == 0) {
+			(void) close(fd);
+			fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+			if (fd < 0) {
+				log_errno("open(2) of %s", path.c_str());
+				return;
+			}
+		} else {
+			log_errno("rename(2) of %s", path.c_str());
+		}
+	}
+	roomLogFd = fd;
+	roomThreshold = threshold;
+	updateThreshold();
+}
+
+void log_close_room()
+{
+	log_flush();
+	if (roomLogFd >= 0) {
+		(void) close(roomLogFd);
+		roomLogFd = -1;
+	}
+	roomThreshold = -1;
+	updateThreshold();
+}
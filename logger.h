@@ -16,6 +16,10 @@
 
 #pragma once
 
+#include <initializer_list>
+#include <string>
+#include <utility>
+
 extern "C" {
 #include <err.h>
 #include <errno.h>
@@ -25,17 +29,26 @@ extern "C" {
 }
 
 /* Logging */
+
+/* Console sink. If NULL, console records are sent to syslog(3) instead. */
 extern FILE *logfile;
 
-#define _log_all_format "%14s:%-4d  %-30s "
+/* The least severe syslog(3) level accepted by any sink. This is checked
+   before a record is formatted, so a disabled level costs one comparison. */
+extern int log_threshold;
+
+/* A structured key=value field attached to a record by log_event() */
+typedef std::pair<const char *, std::string> log_field_t;
+
+void _log_record(int level, const char *file, int line, const char *func,
+		const char *format, ...) __attribute__((format(printf, 5, 6)));
+void _log_event(int level, const char *file, int line, const char *func,
+		const char *message, std::initializer_list<log_field_t> fields);
 
 #define _log_all(level, format,...) do {				\
-	if (logfile != NULL) {						\
-		fprintf(logfile, "" _log_all_format "" format "\n",		\
-				 __FILE__, __LINE__, __PRETTY_FUNCTION__, ## __VA_ARGS__);	\
-	} else {							\
-		syslog(level, "" _log_all_format "" format "\n",			\
-				 __FILE__, __LINE__,__PRETTY_FUNCTION__, ## __VA_ARGS__);	\
+	if ((level) <= log_threshold) {					\
+		_log_record(level, __FILE__, __LINE__, __PRETTY_FUNCTION__,	\
+				"" format "", ## __VA_ARGS__);		\
 	}								\
 } while (0)
 
@@ -50,5 +63,28 @@ extern FILE *logfile;
 #endif
 #define log_errno(format,...) _log_all(LOG_ERR, format ": errno=%d (%s)", ## __VA_ARGS__, errno, strerror(errno))
 
+/* Log a message followed by structured fields, e.g.:
+     log_event(LOG_INFO, "room started", {"room", name}, {"pid", std::to_string(pid)});
+ */
+#define log_event(level, message, ...) do {				\
+	if ((level) <= log_threshold) {					\
+		_log_event(level, __FILE__, __LINE__, __PRETTY_FUNCTION__,	\
+				message, { __VA_ARGS__ });		\
+	}								\
+} while (0)
+
+/* Records are buffered, and written out when the buffer fills, when an
+   error is logged, and when the process exits. Call log_flush() before
+   fork(2) or exec(2) so that buffered records are neither duplicated
+   nor lost. */
+void log_flush();
+
+/* Send console records to <new_logfile> at or above <threshold>.
+   A negative threshold disables the console sink. */
+void log_set_console(FILE *new_logfile, int threshold);
 void log_freopen(FILE *new_logfile);
 
+/* Append records at or above <threshold> to a per-room log file. If the
+   file has grown past 1 MiB, it is renamed to <path>.old first. */
+void log_open_room(const std::string& path, int threshold);
+void log_close_room();
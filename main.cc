@@ -29,6 +29,8 @@
 #include "jail_getid.h"
 
 extern "C" {
+#include <err.h>
+#include <fcntl.h>
 #include <pwd.h>
 #include <sys/param.h>
 #include <sys/mount.h>
@@ -42,11 +44,11 @@ extern "C" {
 #include "namespaceImport.h"
 #include "shell.h"
 #include "fileUtil.h"
+#include "RecordWriter.hpp"
 #include "room.h"
 #include "roomManager.h"
 #include "setuidHelper.h"
 
-FILE *logfile = NULL;
 #include "logger.h"
 
 RoomManager* globalMgr;
@@ -72,7 +74,15 @@ static void get_options(int argc, char *argv[])
 	bool isVerbose, isEmpty;
 
 	string popt0, popt1, popt2, popt3;
-	string runAsUser, upstreamUri;
+	string runAsUser, upstreamUri, roomPattern;
+	unsigned int parallelism;
+	string archivePath;
+	bool compressArchive, showProgress;
+	bool gcStatus;
+	unsigned int cloneCount;
+	unsigned int netpoolSize;
+	unsigned int profileSeconds;
+	string outputFormat, outputFields;
 
 	po::options_description desc("Miscellaneous options");
 	desc.add_options()
@@ -93,6 +103,9 @@ static void get_options(int argc, char *argv[])
 	po::options_description exec_opts("Options when using exec");
 	exec_opts.add_options()
 	    ("user,u", po::value<string>(&runAsUser), "the user to run the command as")
+	    ("rooms", po::value<string>(&roomPattern), "run the command in every room matching this glob")
+	    ("parallel,j", po::value<unsigned int>(&parallelism)->default_value(0),
+	    		"with --rooms, the number of rooms to run in at once (default: one per CPU)")
 	;
 
 	po::options_description push_opts("Options when using push");
@@ -100,15 +113,51 @@ static void get_options(int argc, char *argv[])
 	    ("set-upstream,u", po::value<string>(&upstreamUri), "the remote URI to push to ")
 	;
 
+	po::options_description archive_opts("Options when exporting or importing");
+	archive_opts.add_options()
+	    ("file,f", po::value<string>(&archivePath), "the archive to write to or read from (default: stdout or stdin)")
+	    ("compress", po::bool_switch(&compressArchive)->default_value(false), "compress the archive with zstd(1)")
+	    ("progress", po::bool_switch(&showProgress)->default_value(false), "show the progress and throughput")
+	;
+
+	po::options_description start_opts("Options when using start");
+	start_opts.add_options()
+	    ("record-profile", po::value<unsigned int>(&profileSeconds)->default_value(0)->implicit_value(30),
+	    		"record the files the room opens in this many seconds (default: 30), to read them ahead of time on later starts")
+	;
+
+	po::options_description flatten_opts("Options when using flatten");
+	flatten_opts.add_options()
+	    ("progress", po::bool_switch(&showProgress)->default_value(false), "show the progress and throughput")
+	;
+
+	po::options_description gc_opts("Options when using gc");
+	gc_opts.add_options()
+	    ("status", po::bool_switch(&gcStatus)->default_value(false), "list the destroyed rooms that have not been reclaimed yet")
+	;
+
+	po::options_description netpool_opts("Options when using netpool");
+	netpool_opts.add_options()
+	    ("size", po::value<unsigned int>(&netpoolSize)->default_value(0), "create network namespaces until this many are free")
+	;
+
+	po::options_description output_opts("Options when using list, status, du, diff or events");
+	output_opts.add_options()
+	    ("format", po::value<string>(&outputFormat)->default_value("text"), "\"text\", \"json\" for a JSON array, or \"ndjson\" for one JSON object per line")
+	    ("fields", po::value<string>(&outputFields), "a comma separated list of the fields to show")
+	;
+
 	po::options_description create_opts("Options when creating");
 	create_opts.add_options()
 	    ("archive", po::value<string>(&baseArchiveUri), "the path to the tar(1) archive to install from")
 	    ("clone", po::value<string>(&roomOpt.templateUri), "the action to perform")
+	    ("count", po::value<unsigned int>(&cloneCount)->default_value(0), "with --clone, create this many rooms, numbered from NAME-1 (zero-padded to the width of COUNT)")
 		("tag", po::value<string>(&roomOpt.templateSnapshot), "the tag to clone from")
 	    ("empty", po::bool_switch(&isEmpty)->default_value(false), "create an empty room")
 	    ("allow-x11", po::bool_switch(&roomOpt.allowX11Clients), "allow running X11 clients")
 	    ("share-tempdir", po::bool_switch(&roomOpt.shareTempDir), "mount the global /tmp and /var/tmp inside the room")
 		("share-home", po::bool_switch(&roomOpt.shareHomeDir), "mount the $HOME directory inside the room")
+	    ("network", po::value<string>(&roomOpt.network)->default_value("host"), "\"host\" to share the host's network, or \"private\" for a network namespace of its own")
 	;
 
 /*
@@ -124,6 +173,12 @@ static void get_options(int argc, char *argv[])
 	// Add context-sensitive options
 	bool found_create = false;
 	bool found_push = false;
+	bool found_archive = false;
+	bool found_flatten = false;
+	bool found_start = false;
+	bool found_gc = false;
+	bool found_netpool = false;
+	bool found_output = false;
 	for (int i = 0; i < argc; i++) {
 		if (!strcmp(argv[i], "create")) {
 			if (!found_create) {
@@ -135,6 +190,38 @@ static void get_options(int argc, char *argv[])
 				all.add(push_opts);
 				found_push = true;
 			}
+		} else if (!strcmp(argv[i], "export") || !strcmp(argv[i], "import")) {
+			if (!found_archive) {
+				all.add(archive_opts);
+				found_archive = true;
+			}
+		} else if (!strcmp(argv[i], "start")) {
+			if (!found_start) {
+				all.add(start_opts);
+				found_start = true;
+			}
+		} else if (!strcmp(argv[i], "flatten")) {
+			if (!found_flatten) {
+				all.add(flatten_opts);
+				found_flatten = true;
+			}
+		} else if (!strcmp(argv[i], "gc")) {
+			if (!found_gc) {
+				all.add(gc_opts);
+				found_gc = true;
+			}
+		} else if (!strcmp(argv[i], "netpool")) {
+			if (!found_netpool) {
+				all.add(netpool_opts);
+				found_netpool = true;
+			}
+		} else if (!strcmp(argv[i], "list") || !strcmp(argv[i], "status") ||
+				!strcmp(argv[i], "du") || !strcmp(argv[i], "diff") ||
+				!strcmp(argv[i], "events")) {
+			if (!found_output) {
+				all.add(output_opts);
+				found_output = true;
+			}
 		} else if (!strcmp(argv[i], "--")) {
 			break;
 		}
@@ -178,10 +265,23 @@ static void get_options(int argc, char *argv[])
 		po::options_description helpinfo;
 		if (popt1 == "create") {
 			helpinfo.add(create_opts);
-		} else if (popt1 == "exec") {
+		} else if (popt0 == "exec" || popt1 == "exec") {
 			helpinfo.add(exec_opts);
 		} else if (popt1 == "push") {
 			helpinfo.add(push_opts);
+		} else if (popt0 == "import" || popt1 == "export") {
+			helpinfo.add(archive_opts);
+		} else if (popt1 == "start") {
+			helpinfo.add(start_opts);
+		} else if (popt1 == "flatten") {
+			helpinfo.add(flatten_opts);
+		} else if (popt0 == "gc") {
+			helpinfo.add(gc_opts);
+		} else if (popt0 == "netpool") {
+			helpinfo.add(netpool_opts);
+		} else if (popt0 == "list" || popt0 == "du" || popt0 == "events" || popt1 == "status" ||
+				popt1 == "diff" || popt2 == "list") {
+			helpinfo.add(output_opts);
 		}
 		helpinfo.add(desc);
 		printUsage(helpinfo);
@@ -208,11 +308,69 @@ static void get_options(int argc, char *argv[])
 	mgr.initUserRoomSpace();
 
 	if (popt0 == "list") {
-		mgr.listRooms();
+		RecordWriter writer(cout, RecordWriter::parseFormat(outputFormat),
+				Room::statusFields, { "name" });
+		if (outputFields != "") {
+			writer.selectFields(outputFields);
+		}
+		mgr.listRooms(writer);
+		writer.finish();
+	} else if (popt0 == "gc") {
+		mgr.collectGarbage(gcStatus);
+	} else if (popt0 == "netpool") {
+		mgr.manageNetworkPool(netpoolSize);
+	} else if (popt0 == "idle-monitor") {
+		mgr.monitorIdleRooms();
+	} else if (popt0 == "du") {
+		const std::vector<string> fields = { "room", "snapshot", "used", "referenced", "unique", "reclaimable" };
+		RecordWriter writer(cout, RecordWriter::parseFormat(outputFormat), fields, fields);
+		if (outputFields != "") {
+			writer.selectFields(outputFields);
+		}
+		bool humanReadable = (writer.getFormat() == RecordWriter::FORMAT_TEXT);
+		mgr.measureDiskUsage(popt1, [&](const string& room, const DiskUsage::Usage& usage) {
+			auto bytes = [&](uint64_t value) -> nlohmann::json {
+				if (humanReadable) {
+					return DiskUsage::formatBytes(value);
+				} else {
+					return value;
+				}
+			};
+			RecordWriter::Record record = {
+				{ "room", room },
+				{ "used", bytes(usage.used) },
+				{ "referenced", bytes(usage.referenced) },
+				{ "unique", bytes(usage.unique) },
+				{ "reclaimable", bytes(usage.reclaimable) },
+			};
+			if (usage.snapshot != "") {
+				record["snapshot"] = usage.snapshot;
+			}
+			writer.write(record);
+		});
+		writer.finish();
+	} else if (popt0 == "events") {
+		const std::vector<string> fields = { "time", "event", "room", "snapshot" };
+		RecordWriter writer(cout, RecordWriter::parseFormat(outputFormat), fields, fields);
+		if (outputFields != "") {
+			writer.selectFields(outputFields);
+		}
+		mgr.watchEvents([&writer](const RoomEventMonitor::Event& event) {
+			RecordWriter::Record record = {
+				{ "time", (long long) event.time },
+				{ "event", event.type },
+				{ "room", event.room },
+			};
+			if (event.snapshot != "") {
+				record["snapshot"] = event.snapshot;
+			}
+			writer.write(record);
+		});
 	} else if (popt0 == "clone") {
 		string uri = popt1;
 		roomName = popt2;
 		SetuidHelper::dropPrivileges();
+		log_flush();
 		execl("/usr/local/bin/ruby", "/usr/local/bin/ruby", "/usr/local/libexec/rooms/room-clone.rb",
 				uri.c_str(), roomName.c_str(), roomOpt.templateSnapshot.c_str(), NULL);
 		//mgr.cloneRoomFromRemote(roomName, uri);
@@ -222,6 +380,19 @@ static void get_options(int argc, char *argv[])
 			cout << "Error: cannot clone and install from a tarball at the same time\n";
 			exit(1);
 		}
+		if (roomOpt.network != "host" && roomOpt.network != "private") {
+			cout << "Error: --network must be \"host\" or \"private\"\n";
+			exit(1);
+		}
+
+		if (cloneCount > 0) {
+			if (roomOpt.templateUri == "") {
+				cout << "Error: --count requires --clone\n";
+				exit(1);
+			}
+			mgr.cloneRooms(roomName, cloneCount, roomOpt);
+			return;
+		}
 
 		if (isEmpty) {
 			mgr.installRoom(roomName, "", roomOpt);
@@ -239,27 +410,53 @@ static void get_options(int argc, char *argv[])
 #endif
 			mgr.cloneRoom(roomName, roomOpt);
 		}
-		Room room = mgr.getRoomByName(roomName);
+		(void) mgr.getRoomByName(roomName);
 	} else if (popt0 == "build") {
 		SetuidHelper::dropPrivileges();
+		log_flush();
 		execl("/usr/local/bin/ruby", "/usr/local/bin/ruby", "/usr/local/libexec/rooms/room-build.rb", popt1.c_str(), NULL);
 	} else if (popt1 == "configure") {
-		Room room = mgr.getRoomByName(popt0);
+		Room& room = mgr.getRoomByName(popt0);
 		room.editConfiguration();
 	} else if (popt0 == "init") {
 		cout << "ERROR: the rooms subsystem has already been initialized\n";
 		exit(1);
 	} else if (popt1 == "destroy") {
 		mgr.getRoomByName(popt0).destroy();
-#if 0
-		// not ready for prime time
-	} else if (action == "import") {
-		mgr.importRoom(roomName);
-	} else if (action == "export") {
-		mgr.getRoomByName(roomName).exportArchive();
-#endif
+	} else if (popt0 == "import") {
+		int fd = STDIN_FILENO;
+		if (archivePath != "") {
+			fd = open(archivePath.c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd < 0) {
+				err(1, "unable to open %s", archivePath.c_str());
+			}
+		}
+		mgr.importRoom(popt1, fd, showProgress);
+	} else if (popt1 == "export") {
+		Room& room = mgr.getRoomByName(popt0);
+		int fd = STDOUT_FILENO;
+		if (archivePath != "") {
+			fd = open(archivePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+			if (fd < 0) {
+				err(1, "unable to create %s", archivePath.c_str());
+			}
+		} else if (isatty(STDOUT_FILENO)) {
+			cout << "ERROR: refusing to write an archive to a terminal; use --file or redirect stdout\n";
+			exit(1);
+		}
+		room.exportArchive(fd, compressArchive, showProgress);
 	} else if (popt1 == "enter") {
-		mgr.getRoomByName(popt0).enter();
+		exit(mgr.getRoomByName(popt0).enter());
+	} else if (popt0 == "exec" && roomPattern != "") {
+		std::vector<std::string> execVec;
+		for (int i = argc_before_exec; i < argc; i++) {
+			execVec.push_back(argv[i]);
+		}
+		if (execVec.size() == 0) {
+			cout << "ERROR: must specify a command to execute\n";
+			exit(1);
+		}
+		exit(mgr.execInRooms(roomPattern, execVec, runAsUser, parallelism));
 	} else if (popt1 == "exec") {
 		std::vector<std::string> execVec;
 		for (int i = argc_before_exec; i < argc; i++) {
@@ -269,26 +466,43 @@ static void get_options(int argc, char *argv[])
 			cout << "ERROR: must specify a command to execute\n";
 			exit(1);
 		}
-		mgr.getRoomByName(popt0).exec(execVec, runAsUser);
+		exit(mgr.getRoomByName(popt0).exec(execVec, runAsUser));
+	} else if (popt1 == "agent") {
+		if (popt2 == "start") {
+			mgr.getRoomByName(popt0).startAgent();
+		} else if (popt2 == "stop") {
+			mgr.getRoomByName(popt0).stopAgent();
+		} else {
+			cout << "ERROR: invalid syntax\n";
+			exit(1);
+		}
 	} else if (popt1 == "push") {
-		auto room = mgr.getRoomByName(popt0);
+		auto& room = mgr.getRoomByName(popt0);
 		if (upstreamUri != "") {
 			room.setOriginUri(upstreamUri);
 		}
 		//room.pushToOrigin();
 		SetuidHelper::dropPrivileges();
+		log_flush();
 		execl("/usr/local/bin/ruby", "/usr/local/bin/ruby", "/usr/local/libexec/rooms/room-push.rb", popt0.c_str(), upstreamUri.c_str(), NULL);
 	} else if (popt1 == "pull") {
-		auto room = mgr.getRoomByName(popt0);
+		(void) mgr.getRoomByName(popt0);
 		SetuidHelper::dropPrivileges();
+		log_flush();
 		execl("/usr/local/bin/ruby", "/usr/local/bin/ruby", "/usr/local/libexec/rooms/room-pull.rb", popt0.c_str(), NULL);
 	} else if (popt1 == "receive" || popt1 == "recv") {
 		mgr.receiveRoom(popt0);
 	} else if ((popt1 == "snapshot") or (popt1 == "tag")) { //TODO: rename everything to use 'tag'
 		if (popt2 == "list") {
-			mgr.getRoomByName(popt0).printSnapshotList();
+			RecordWriter writer(cout, RecordWriter::parseFormat(outputFormat),
+					Room::snapshotFields, { "name" });
+			if (outputFields != "") {
+				writer.selectFields(outputFields);
+			}
+			mgr.getRoomByName(popt0).printSnapshotList(writer);
+			writer.finish();
 		} else {
-			Room room = mgr.getRoomByName(popt0);
+			Room& room = mgr.getRoomByName(popt0);
 
 			string snapName = popt2;
 			string action = popt3;
@@ -303,14 +517,67 @@ static void get_options(int argc, char *argv[])
 				exit(1);
 			}
 		}
-	} else if (popt1 == "__promote") {
-		mgr.getRoomByName(popt0).promoteClone(popt2);
+	} else if (popt1 == "promote") {
+		mgr.getRoomByName(popt0).promoteClone();
+	} else if (popt1 == "flatten") {
+		mgr.getRoomByName(popt0).flatten(showProgress);
 	} else if (popt1 == "send") {
 		mgr.getRoomByName(popt0).send();
+	} else if (popt1 == "status") {
+		RecordWriter writer(cout, RecordWriter::parseFormat(outputFormat),
+				Room::statusFields, { "name", "state" });
+		if (outputFields != "") {
+			writer.selectFields(outputFields);
+		}
+		mgr.getRoomByName(popt0).printStatus(writer);
+		writer.finish();
+	} else if (popt1 == "diff") {
+		const std::vector<string> fields = { "change", "type", "path", "size" };
+		RecordWriter writer(cout, RecordWriter::parseFormat(outputFormat), fields, fields);
+		if (outputFields != "") {
+			writer.selectFields(outputFields);
+		}
+		bool humanReadable = (writer.getFormat() == RecordWriter::FORMAT_TEXT);
+		auto bytes = [&](uint64_t value) -> nlohmann::json {
+			if (humanReadable) {
+				return DiskUsage::formatBytes(value);
+			} else {
+				return value;
+			}
+		};
+		std::map<SnapshotDiff::Change, uint64_t> totals = {
+			{ SnapshotDiff::ADDED, 0 }, { SnapshotDiff::MODIFIED, 0 }, { SnapshotDiff::DELETED, 0 },
+		};
+		mgr.getRoomByName(popt0).diff(popt2, popt3, [&](const SnapshotDiff::Entry& entry) {
+			totals[entry.change] += entry.size;
+			writer.write({
+				{ "change", SnapshotDiff::getChangeName(entry.change) },
+				{ "type", entry.type },
+				{ "path", entry.path },
+				{ "size", bytes(entry.size) },
+			});
+		});
+		// The bytes added, modified and deleted, with no path
+		for (auto& total : totals) {
+			writer.write({
+				{ "change", SnapshotDiff::getChangeName(total.first) },
+				{ "type", "total" },
+				{ "size", bytes(total.second) },
+			});
+		}
+		writer.finish();
 	} else if (popt1 == "start") {
-		mgr.getRoomByName(popt0).start();
+		mgr.getRoomByName(popt0).start(profileSeconds);
 	} else if (popt1 == "stop") {
 		mgr.getRoomByName(popt0).stop();
+	} else if (popt1 == "freeze") {
+		mgr.getRoomByName(popt0).freeze();
+	} else if (popt1 == "thaw") {
+		mgr.getRoomByName(popt0).thaw();
+	} else if (popt1 == "suspend") {
+		mgr.getRoomByName(popt0).suspend();
+	} else if (popt1 == "resume") {
+		mgr.getRoomByName(popt0).resume();
 	} else if (popt1 == "mount") {
 		mgr.getRoomByName(popt0).mount();
 	} else if ((popt1 == "unmount") || (popt1 == "umount")) {
@@ -329,7 +596,7 @@ main(int argc, char *argv[])
 	try {
 		SetuidHelper::checkPrivileges();
 		Container::runMainHook();
-		logfile = fopen("/dev/null", "w");
+		log_set_console(NULL, -1);
 		get_options(argc, argv);
 	} catch(const std::system_error& e) {
 		std::cout << "Caught system_error with code " << e.code()
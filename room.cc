@@ -14,12 +14,14 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <locale>
 #include <regex>
+#include <sstream>
 #include <string>
 #include <streambuf>
 #include <unordered_set>
@@ -28,8 +30,10 @@
 
 extern "C" {
 #include <err.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <pwd.h>
+#include <sys/file.h>
 #include <sys/param.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
@@ -39,12 +43,19 @@ extern "C" {
 }
 
 #include "namespaceImport.h"
+#include "Cgroup.hpp"
 #include "Container.hpp"
+#include "ExecAgent.hpp"
+#include "ExecSupervisor.hpp"
 #include "shell.h"
+#include "SnapshotStore.hpp"
+#include "Trash.hpp"
+#include "StreamPipeline.hpp"
 #include "fileUtil.h"
 #include "jail_getid.h"
 #include "MountUtil.hpp"
 #include "passwdEntry.h"
+#include "RecordWriter.hpp"
 #include "room.h"
 #include "setuidHelper.h"
 #include "zfsDataset.h"
@@ -68,34 +79,49 @@ Room::Room(const string& managerRoomDir, const string& name)
 
 	roomDataDir = roomDir + "/" + ownerLogin + "/" + name;
 	chrootDir = roomDataDir + "/share/root";
+	agentSocketPath = roomDataDir + "/etc/exec-agent.sock";
+	// CRIU runs as root over the images, so they are kept where only root can write
+	checkpointDir = "/var/lib/room/" + std::to_string(ownerUid) + "/" + name;
+	execLockPath = roomDataDir + "/etc/exec.lock";
 	useZfs = false; //TODO: change to ZfsPool::detectZfs();
 	if (useZfs) {
 		zpoolName = ZfsPool::getNameByPath(roomDir);
 		//FIXME: these are two names for the same thing now..
 		parentDataset = zpoolName + "/room/" + ownerLogin;
 		roomDataset = zpoolName + "/room/" + ownerLogin;
+	} else {
+		snapshotMethod = SnapshotStore::loadMethod(roomDir);
 	}
 	roomOptionsPath = roomDataDir + "/etc/options.json";
 	if (FileUtil::checkExists(roomOptionsPath)) {
 		loadRoomOptions();
 	}
-	container = Container::create(chrootDir); //XXX-FIXME: WILL LEAK, NEED UNIQUE_PTR
+	container = Container::create(chrootDir);
+	container->setCgroupName("room/" + ownerLogin + "/" + roomName);
 	container->setInitPidfilePath(roomDataDir + "/etc/init.pid"); // TODO: move to a /var/run directory instead
 	container->setHostname(roomName + ".room");
+	container->setPrivateNetwork(roomOptions.network == "private");
 	determineInitialState();
 }
 
+void Room::openLog(int threshold)
+{
+	if (FileUtil::checkExists(roomDataDir + "/etc")) {
+		log_open_room(roomDataDir + "/etc/room.log", threshold);
+	}
+}
+
 void Room::enterJail(const string& runAsUser)
 {
-	PasswdEntry pwent(ownerUid);
+	const string& homeDir = getLaunchPlan().homeDir;
 
 	SetuidHelper::raisePrivileges();
 
 	container->enter();
 
 	if (runAsUser == ownerLogin) {
-		if (chdir(pwent.getHome()) < 0) {
-			log_errno("ERROR: unable to chdir(2) to %s", pwent.getHome());
+		if (chdir(homeDir.c_str()) < 0) {
+			log_errno("ERROR: unable to chdir(2) to %s", homeDir.c_str());
 		}
 
 #ifdef __linux__
@@ -115,14 +141,14 @@ void Room::enterJail(const string& runAsUser)
 }
 
 int Room::forkAndExec(std::vector<std::string> execVec, const string& runAsUser) {
+	log_flush();
 	pid_t pid = fork();
 	if (pid < 0) {
 		log_errno("fork(2)");
 		throw std::runtime_error("fork failed");
 	}
 	if (pid == 0) {
-		exec(execVec, runAsUser);
-		exit(1);
+		exit(exec(execVec, runAsUser));
 	}
 
 	int status;
@@ -137,10 +163,48 @@ int Room::forkAndExec(std::vector<std::string> execVec, const string& runAsUser)
 	return exitStatus;
 }
 
-void Room::exec(std::vector<std::string> execVec, const string& runAsUser)
+#if defined(__linux__)
+static const string login_shell = "/bin/bash";
+static const string login_shell_proctitle = "bash";
+#elif defined(__FreeBSD__)
+static const string login_shell = "/bin/csh";
+static const string login_shell_proctitle = "-csh";
+#else
+static const string login_shell = "/bin/sh";
+static const string login_shell_proctitle = "sh";
+#endif
+
+// Replace the environment with the one that commands in the room should see
+void Room::setupExecEnvironment(const string& loginName, const string& homeDir)
 {
-	PasswdEntry pwent(ownerUid);
 	static char *clean_environment = NULL;
+
+	char *env_display;
+	char *env_xauthority;
+	char *env_dbus;
+	if (roomOptions.allowX11Clients) {
+		env_display = getenv("DISPLAY");
+		env_xauthority = getenv("XAUTHORITY");
+		env_dbus = getenv("DBUS_SESSION_BUS_ADDRESS");
+	}
+
+	environ = &clean_environment;
+	for (auto& var : getLaunchPlan().environment) {
+		putenv(strdup(var.c_str()));
+	}
+	setenv("HOME", homeDir.c_str(), 1);
+	setenv("USER", loginName.c_str(), 1);
+
+	if (roomOptions.allowX11Clients) {
+		if (env_display) setenv("DISPLAY", env_display, 1);
+		if (env_xauthority) setenv("XAUTHORITY", env_xauthority, 1);
+		if (env_dbus) setenv("DBUS_SESSION_BUS_ADDRESS", env_dbus, 1);
+	}
+}
+
+int Room::exec(std::vector<std::string> execVec, const string& runAsUser)
+{
+	ExecSupervisor supervisor;
 	string loginName;
 	string homeDir;
 	char *path = NULL;
@@ -153,33 +217,55 @@ void Room::exec(std::vector<std::string> execVec, const string& runAsUser)
 	if (loginName == "root") {
 		homeDir = "/root";
 	} else {
-		homeDir = pwent.getHome();
+		homeDir = getLaunchPlan().homeDir;
+	}
+
+	// Keep the idle monitor from freezing the room while the command runs
+	int execLockFd = open(execLockPath.c_str(), O_RDONLY | O_CREAT | O_CLOEXEC, 0600);
+	if (execLockFd < 0 || flock(execLockFd, LOCK_SH) < 0) {
+		log_errno("unable to lock %s", execLockPath.c_str());
+	}
+	if (isFrozen()) {
+		thaw();
+	}
+
+	// Non-interactive commands can skip entering the room if an agent is running
+	if (loginName == ownerLogin && execVec.size() > 0 && !isatty(STDIN_FILENO)) {
+		int exitStatus;
+		if (ExecAgent::exec(agentSocketPath, execVec, exitStatus)) {
+			(void) close(execLockFd);
+			return exitStatus;
+		}
 	}
 
 	if (!container->isRunning()) {
-		log_debug("container `%s' not running; will start it now", jailName.c_str());
-		container->start();
+		LockGuard guard(*this, LockManager::EXCLUSIVE);
+		if (!container->isRunning()) {
+			log_debug("container `%s' not running; will start it now", jailName.c_str());
+			container->start();
+		}
 	}
 
+	// Keep the room from being stopped while the command joins it, but not
+	// for as long as the command runs
+	LockGuard guard(*this, LockManager::SHARED);
+
+	// Allocate the pty before entering the room, so it comes from the host devpts
+	supervisor.prepare();
+
 	enterJail(loginName);
 
+	log_flush();
 	pid_t pid = fork();
 
-	if (pid < 0) err(1, "fork(2)");
+	if (pid < 0) {
+		log_errno("fork(2)");
+		throw std::system_error(errno, std::system_category());
+	}
+	guard.release();
 	if (pid == 0) {
-
-	string jail_username = loginName;
-
-#if defined(__linux__)
-	string login_shell = "/bin/bash";
-	string login_shell_proctitle = "bash";
-#elif defined(__FreeBSD__)
-	string login_shell = "/bin/csh";
-	string login_shell_proctitle = "-csh";
-#else
-	string login_shell = "/bin/sh";
-	string login_shell_proctitle = "sh";
-#endif
+	supervisor.setupChild();
+	container->joinCgroup();
 
 	std::vector<char*> argsVec;
 	if (execVec.size() == 0) {
@@ -194,43 +280,76 @@ void Room::exec(std::vector<std::string> execVec, const string& runAsUser)
 	}
 	argsVec.push_back(NULL);
 
-	char *env_display;
-	char *env_xauthority;
-	char *env_dbus;
-	if (roomOptions.allowX11Clients) {
-		env_display = getenv("DISPLAY");
-		env_xauthority = getenv("XAUTHORITY");
-		env_dbus = getenv("DBUS_SESSION_BUS_ADDRESS");
+	setupExecEnvironment(loginName, homeDir);
+
+	if (execvp(path, argsVec.data()) < 0) {
+		log_errno("execvp(2)");
+		exit(errno == ENOENT ? 127 : 126);
+	}
 	}
 
-	environ = &clean_environment;
-	setenv("HOME", homeDir.c_str(), 1);
-	setenv("SHELL", login_shell.c_str(), 1); //FIXME: should consult PasswdEntry
-	setenv("PATH", "/sbin:/usr/sbin:/usr/local/sbin:/bin:/usr/bin:/usr/local/bin", 1);
-	setenv("TERM", "xterm", 1);
-	setenv("USER", loginName.c_str(), 1);
+	int exitStatus = supervisor.supervise(pid);
+	(void) close(execLockFd);
+	return exitStatus;
+}
 
-	if (roomOptions.allowX11Clients) {
-		if (env_display) setenv("DISPLAY", env_display, 1);
-		if (env_xauthority) setenv("XAUTHORITY", env_xauthority, 1);
-		if (env_dbus) setenv("DBUS_SESSION_BUS_ADDRESS", env_dbus, 1);
+void Room::startAgent()
+{
+	ExecAgent agent;
+	PasswdEntry pwent(ownerUid);
+	LockGuard guard(*this, LockManager::EXCLUSIVE);
+
+	if (!container->isRunning()) {
+		log_debug("container `%s' not running; will start it now", jailName.c_str());
+		container->start();
 	}
 
-	if (execvp(path, argsVec.data()) < 0) {
-		log_errno("execvp(2)");
+	// Bind the socket on the host side, where clients will look for it
+	agent.listen(agentSocketPath);
+
+	log_flush();
+	pid_t pid = fork();
+	if (pid < 0) {
 		throw std::system_error(errno, std::system_category());
 	}
-	} else {
-	//parent
-		int status;
-		wait(&status);
-		exit(0);
+	guard.release();
+	if (pid > 0) {
+		log_event(LOG_INFO, "exec agent started", {"room", roomName}, {"pid", std::to_string(pid)});
+		return;
+	}
+
+	if (setsid() < 0) err(1, "setsid(2)");
+	int fd = open("/dev/null", O_RDWR);
+	if (fd < 0) err(1, "open(2) of /dev/null");
+	for (int i = 0; i < 3; i++) {
+		if (dup2(fd, i) < 0) err(1, "dup2(2)");
+	}
+
+	enterJail(ownerLogin);
+	container->joinCgroup();
+	setupExecEnvironment(ownerLogin, pwent.getHome());
+	try {
+		agent.serve();
+	} catch (const std::exception& e) {
+		log_error("exec agent failed: %s", e.what());
+		exit(1);
+	}
+	exit(0);
+}
+
+void Room::stopAgent()
+{
+	if (ExecAgent::shutdown(agentSocketPath)) {
+		log_event(LOG_INFO, "exec agent stopped", {"room", roomName});
+	}
+	if (unlink(agentSocketPath.c_str()) < 0 && errno != ENOENT) {
+		log_errno("unlink(2) of %s", agentSocketPath.c_str());
 	}
 }
 
-void Room::enter() {
+int Room::enter() {
 	std::vector<std::string> argsVec;
-	Room::exec(argsVec, ownerLogin);
+	return Room::exec(argsVec, ownerLogin);
 }
 
 bool Room::jailExists()
@@ -283,56 +402,164 @@ void Room::validateName(const string& name)
 	}
 }
 
+string Room::getSnapshotPrefetchProfilePath(const string& snapshot) const
+{
+	if (useZfs) {
+		// etc/ is part of the room's dataset, so it is in the snapshot
+		return roomDataDir + "/.zfs/snapshot/" + snapshot + "/etc/prefetch.profile";
+	} else {
+		return roomDataDir + "/tags/" + snapshot + ".prefetch";
+	}
+}
+
+// Copy the prefetch profile at <src>, if there is one, to <dest>
+static void copy_prefetch_profile(const string& src, const string& dest)
+{
+	PrefetchProfile profile;
+	PrivilegeGuard privileges;
+	try {
+		if (profile.load(src)) {
+			profile.save(dest);
+		}
+	} catch (const std::exception& e) {
+		log_warning("unable to copy the prefetch profile to %s: %s", dest.c_str(), e.what());
+	}
+}
+
 void Room::clone(const string& snapshot, const string& destRoom, const RoomOptions& roomOpt)
 {
+	LockGuard guard(*this, LockManager::SHARED);
 	log_debug("cloning room");
 
+	if (!useZfs) {
+		validateName(snapshot);
+		if (!getSnapshotStore().exists(snapshot)) {
+			throw std::runtime_error("no such snapshot: " + snapshot);
+		}
+	}
+
 	Room cloneRoom(roomDir, destRoom);
+	LockGuard cloneGuard(cloneRoom, LockManager::EXCLUSIVE);
 	cloneRoom.createEmpty();
 
 	// Replace the empty "share" dataset with a clone of the original
-	string src = roomDataset + "/" + roomName + "/share@" + snapshot;
-	string dest = zpoolName + "/room/" + ownerLogin + "/" + destRoom + "/share";
-	SetuidHelper::raisePrivileges();
-	Shell::execute("/sbin/zfs", { "destroy", dest });
-	Shell::execute("/sbin/zfs", { "clone", src, dest });
-	Shell::execute("/sbin/zfs", {"allow", "-u", ownerLogin, "hold,send", zpoolName + "/room/" + ownerLogin + "/" + destRoom });
-	SetuidHelper::lowerPrivileges();
+	if (useZfs) {
+		string src = roomDataset + "/" + roomName + "/share@" + snapshot;
+		string dest = zpoolName + "/room/" + ownerLogin + "/" + destRoom + "/share";
+		PrivilegeGuard privileges;
+		Shell::execute("/sbin/zfs", { "destroy", dest });
+		Shell::execute("/sbin/zfs", { "clone", src, dest });
+		Shell::execute("/sbin/zfs", {"allow", "-u", ownerLogin, "hold,send", zpoolName + "/room/" + ownerLogin + "/" + destRoom });
+	} else {
+		string dest = cloneRoom.roomDataDir + "/share";
+		{
+			PrivilegeGuard privileges;
+			SnapshotStore::destroyVolume(dest);
+		}
+		getSnapshotStore().cloneTo(snapshot, dest);
+	}
 
-	// Copy the options.json file
-	Shell::execute("/bin/cp", { roomOptionsPath, cloneRoom.roomOptionsPath});
-	cloneRoom.loadRoomOptions();
+	// Start from the template's options, keeping the UUID that
+	// createEmpty() generated, and record where the clone came from.
+	// The options are written once, when the clone is complete.
+	RoomOptions options;
+	options.load(roomOptionsPath);
+	options.merge(roomOpt);
+	options.isHidden = false;
+	options.uuid = cloneRoom.roomOptions.uuid;
+	options.templateUri = roomName;
+	options.templateSnapshot = snapshot;
+	cloneRoom.roomOptions = options;
+	cloneRoom.areRoomOptionsLoaded = true;
+	cloneRoom.syncRoomOptions();
+	copy_prefetch_profile(getSnapshotPrefetchProfilePath(snapshot), cloneRoom.getPrefetchProfilePath());
+	log_debug("clone complete");
+}
 
-	// Merge options from the CLI
-	cloneRoom.roomOptions.merge(roomOpt);
+void Room::cloneBatch(const string& snapshot, const std::vector<string>& destRooms, const RoomOptions& roomOpt)
+{
+	LockGuard guard(*this, LockManager::SHARED);
+	if (!useZfs) {
+		validateName(snapshot);
+		if (!getSnapshotStore().exists(snapshot)) {
+			throw std::runtime_error("no such snapshot: " + snapshot);
+		}
+	}
 
-	auto new_options = cloneRoom.getRoomOptions();
+	// Every clone starts with the same options, apart from its UUID
+	RoomOptions options = roomOptions;
+	options.merge(roomOpt);
+	options.isHidden = false;
+	options.templateUri = roomName;
+	options.templateSnapshot = snapshot;
+	std::vector<string> uuids = UuidGenerator::generateBatch(destRooms.size());
+
+	// Every clone starts with the snapshot's prefetch profile, too
+	PrefetchProfile profile;
+	{
+		PrivilegeGuard privileges;
+		profile.load(getSnapshotPrefetchProfilePath(snapshot));
+	}
 
-	// Assume that newly cloned rooms should not be hidden.
-	new_options.isHidden = false;
+	// Delegated permissions are inherited, so one "zfs allow" covers every clone
+	if (useZfs) {
+		PrivilegeGuard privileges;
+		Shell::execute("/sbin/zfs", {"allow", "-u", ownerLogin, "hold,send", roomDataset });
+	}
 
-#if 0
-    //DEADWOOD -- handled in Ruby now
+	for (size_t i = 0; i < destRooms.size(); i++) {
+		string destDataDir = roomDir + "/" + ownerLogin + "/" + destRooms[i];
 
-	// Generate a new UUID
-    UuidGenerator ug;
-    ug.generate();
-    new_options.uuid = ug.getValue();
+		// Nothing else may touch the new room until it is complete
+		LockManager::Lock destLock = LockManager().lockRoom(ownerLogin, destRooms[i], LockManager::EXCLUSIVE);
+		if (FileUtil::checkExists(destDataDir)) {
+			throw std::runtime_error("room already exists: " + destRooms[i]);
+		}
 
-    // Update the origin/clone URIs
-	new_options.templateUri = roomOptions.originUri;
-	new_options.originUri = "";
-	new_options.templateSnapshot = snapshot;
-#endif
+		{
+			PrivilegeGuard privileges;
+			if (useZfs) {
+				Shell::execute("/sbin/zfs", { "create", roomDataset + "/" + destRooms[i] });
+				Shell::execute("/sbin/zfs", { "clone", roomDataset + "/" + roomName + "/share@" + snapshot,
+						roomDataset + "/" + destRooms[i] + "/share" });
+			} else {
+				FileUtil::mkdir_idempotent(destDataDir, 0700, ownerUid, ownerGid);
+			}
+		}
 
-	cloneRoom.syncRoomOptions();
-	//cloneRoom.snapshotCreate(snapshot);
-	log_debug("clone complete");
+		if (!useZfs) {
+			getSnapshotStore().cloneTo(snapshot, destDataDir + "/share");
+		}
+
+		{
+			PrivilegeGuard privileges;
+			for (const char* subdir : { "/etc", "/local", "/local/home", "/local/tmp", "/tags" }) {
+				FileUtil::mkdir_idempotent(destDataDir + subdir, 0700, ownerUid, ownerGid);
+			}
+		}
+
+		options.uuid = uuids[i];
+		options.save(destDataDir + "/etc/options.json");
+		if (!profile.getRanges().empty()) {
+			PrivilegeGuard privileges;
+			try {
+				profile.save(destDataDir + "/etc/prefetch.profile");
+			} catch (const std::exception& e) {
+				log_warning("unable to copy the prefetch profile: %s", e.what());
+			}
+		}
+		log_debug("cloned `%s' from `%s@%s'", destRooms[i].c_str(), roomName.c_str(), snapshot.c_str());
+	}
 }
 
 // Create an empty room, ready for share/ to be populated
 void Room::createEmpty()
 {
+	LockGuard guard(*this, LockManager::EXCLUSIVE);
+	if (FileUtil::checkExists(roomDataDir)) {
+		throw std::runtime_error("room already exists: " + roomName);
+	}
+
 	log_debug("creating an empty room");
 
 	// Generate a UUID
@@ -340,7 +567,7 @@ void Room::createEmpty()
     ug.generate();
     roomOptions.uuid = ug.getValue();
 
-	SetuidHelper::raisePrivileges();
+	PrivilegeGuard privileges;
 
 	if (useZfs) {
 		Shell::execute("/sbin/zfs", {"create", roomDataset + "/" + roomName });
@@ -351,7 +578,7 @@ void Room::createEmpty()
 		Shell::execute("/sbin/zfs", {"allow", "-u", ownerLogin, "hold,send", roomDataset + "/" + roomName });
 	} else {
 		FileUtil::mkdir_idempotent(roomDataDir, 0700, ownerUid, ownerGid);
-		FileUtil::mkdir_idempotent(std::string(roomDataDir + "/share"), 0700, ownerUid, ownerGid);
+		SnapshotStore::createVolume(roomDataDir + "/share", snapshotMethod, ownerUid, ownerGid);
 	}
 
 	FileUtil::mkdir_idempotent(chrootDir, 0700, ownerUid, ownerGid);
@@ -362,7 +589,6 @@ void Room::createEmpty()
 	FileUtil::mkdir_idempotent(roomDataDir + "/local/home", 0700, ownerUid, ownerGid);
 	FileUtil::mkdir_idempotent(roomDataDir + "/local/tmp", 0700, ownerUid, ownerGid);
 	FileUtil::mkdir_idempotent(roomDataDir + "/tags", 0700, ownerUid, ownerGid);
-	SetuidHelper::lowerPrivileges();
 }
 
 void Room::extractTarball(const string& baseTarball)
@@ -388,84 +614,529 @@ void Room::extractTarball(const string& baseTarball)
 	log_debug("room %s created", roomName.c_str());
 }
 
-void Room::syncRoomOptions()
-{
-	roomOptions.save(roomOptionsPath);
+void Room::syncRoomOptions()
+{
+	roomOptions.save(roomOptionsPath);
+}
+
+void Room::send() {
+	SetuidHelper::raisePrivileges();
+
+	Subprocess proc;
+	proc.execve("/sbin/zfs", { "send", "-R",
+			string(roomDataset + "/" + roomName + "@" + getLatestSnapshot()),
+	});
+}
+
+void Room::snapshotCreate(const string& name)
+{
+	LockGuard guard(*this, LockManager::EXCLUSIVE);
+
+	if (!useZfs) {
+		validateName(name);
+
+		// Copying is not atomic, so keep the room from changing underneath it
+		bool wasFrozen = isFrozen();
+		if (isRunning() && !wasFrozen && Cgroup::isSupported()) {
+			freeze();
+		}
+		try {
+			getSnapshotStore().create(name);
+		} catch (...) {
+			if (!wasFrozen && isFrozen()) {
+				thaw();
+			}
+			throw;
+		}
+		if (!wasFrozen && isFrozen()) {
+			thaw();
+		}
+		copy_prefetch_profile(getPrefetchProfilePath(), getSnapshotPrefetchProfilePath(name));
+		return;
+	}
+
+	PrivilegeGuard privileges;
+	Shell::execute("/sbin/zfs", {
+		"snapshot", "-r",
+		roomDataset + "/" + roomName + "@" + name,
+	});
+}
+
+void Room::snapshotDestroy(const string& name)
+{
+	LockGuard guard(*this, LockManager::EXCLUSIVE);
+
+	if (!useZfs) {
+		validateName(name);
+		getSnapshotStore().destroy(name);
+		{
+			PrivilegeGuard privileges;
+			PrefetchProfile::remove(getSnapshotPrefetchProfilePath(name));
+		}
+		return;
+	}
+
+	PrivilegeGuard privileges;
+	Shell::execute("/sbin/zfs", {
+		"destroy", "-r",
+		roomDataset + "/" + roomName + "@" + name,
+	});
+}
+
+// The snapshot that a ZFS dataset was cloned from, or "" if it is not a clone
+static string get_zfs_origin(const string& dataset)
+{
+	int status;
+	string output;
+	Shell::execute("/sbin/zfs", { "get", "-H", "-o", "value", "origin", dataset }, status, output);
+	if (status != 0) {
+		throw std::runtime_error("unable to get the origin of " + dataset);
+	}
+	output.erase(output.find_last_not_of("\n") + 1);
+	return (output == "-") ? "" : output;
+}
+
+void Room::promoteClone()
+{
+	LockGuard guard(*this, LockManager::EXCLUSIVE);
+
+	if (!useZfs) {
+		log_notice("rooms that are not on ZFS never depend on their template");
+		return;
+	}
+
+	string dataset = roomDataset + "/" + roomName + "/share";
+	if (get_zfs_origin(dataset) == "") {
+		log_notice("room is not a clone");
+		return;
+	}
+
+	int result;
+	{
+		PrivilegeGuard privileges;
+		Shell::execute("/sbin/zfs", { "promote", dataset }, result);
+	}
+	if (result != 0) {
+		throw std::runtime_error("command failed: zfs promote");
+	}
+}
+
+void Room::flatten(bool showProgress)
+{
+	LockGuard guard(*this, LockManager::EXCLUSIVE);
+
+	if (!useZfs) {
+		log_notice("rooms that are not on ZFS never depend on their template");
+		return;
+	}
+	if (isRunning()) {
+		throw std::runtime_error("the room must be stopped before it can be flattened");
+	}
+
+	string dataset = roomDataset + "/" + roomName + "/share";
+	if (get_zfs_origin(dataset) == "") {
+		log_notice("room is not a clone");
+		return;
+	}
+
+	// The copy would leave clones of this room's snapshots behind
+	int status;
+	string output;
+	Shell::execute("/sbin/zfs", {
+			"list", "-H", "-r", "-d", "1", "-t", "snapshot",
+			"-o", "name,clones", "-s", "creation", dataset }, status, output);
+	if (status != 0) {
+		throw std::runtime_error("unable to list snapshots");
+	}
+	std::vector<string> snapshots;
+	std::istringstream iss(output);
+	string line;
+	while (std::getline(iss, line)) {
+		// Each line is "<dataset>@<snapshot>\t<clones>"
+		size_t at = line.find('@');
+		size_t tab = line.find('\t');
+		if (at == string::npos || tab == string::npos || tab < at) {
+			continue;
+		}
+		string clones = line.substr(tab + 1);
+		if (clones != "" && clones != "-") {
+			throw std::runtime_error("the snapshot " + line.substr(0, tab) + " has clones: " + clones);
+		}
+		snapshots.push_back(line.substr(at + 1, tab - at - 1));
+	}
+
+	string snapName = "flatten-" + std::to_string(time(NULL));
+	string tmpDataset = roomDataset + "/" + roomName + "/.flatten";
+	int result;
+	{
+		PrivilegeGuard privileges;
+		Shell::execute("/sbin/zfs", { "snapshot", dataset + "@" + snapName }, result);
+	}
+	if (result != 0) {
+		throw std::runtime_error("command failed: zfs snapshot");
+	}
+
+	// The oldest snapshot is sent as a full stream, which is what drops the
+	// link to the origin, and the rest as one incremental stream, which
+	// keeps all of the room's snapshots
+	try {
+		string first = snapshots.empty() ? snapName : snapshots.front();
+		StreamPipeline full("flatten");
+		full.addCommand("/sbin/zfs", { "send", dataset + "@" + first }, true);
+		full.addMeter();
+		full.addCommand("/sbin/zfs", { "receive", "-u", "-F", tmpDataset }, true);
+		full.setShowProgress(showProgress);
+		full.run();
+
+		if (first != snapName) {
+			StreamPipeline rest("flatten");
+			rest.addCommand("/sbin/zfs", { "send", "-I", "@" + first, dataset + "@" + snapName }, true);
+			rest.addMeter();
+			rest.addCommand("/sbin/zfs", { "receive", "-u", "-F", tmpDataset }, true);
+			rest.setShowProgress(showProgress);
+			rest.run();
+		}
+	} catch (...) {
+		{
+			PrivilegeGuard privileges;
+			Shell::execute("/sbin/zfs", { "destroy", "-r", tmpDataset }, result);
+			Shell::execute("/sbin/zfs", { "destroy", dataset + "@" + snapName }, result);
+		}
+		throw;
+	}
+
+	// Swap the copy in. The clone is only moved aside until the copy is in
+	// place, so that a failure can put it back, and then the trash destroys
+	// it in the background.
+	string oldDataset = roomDataset + "/" + roomName + "/.flatten-old";
+	Trash trash = getTrash();
+	{
+		PrivilegeGuard privileges;
+		auto rollback = [&]() {
+			Shell::execute("/sbin/zfs", { "mount", dataset }, result);
+			Shell::execute("/sbin/zfs", { "destroy", "-r", tmpDataset }, result);
+			Shell::execute("/sbin/zfs", { "destroy", dataset + "@" + snapName }, result);
+		};
+		try {
+			FileUtil::unmount(roomDataDir + "/share", 0);
+		} catch (...) {
+			rollback();
+			throw;
+		}
+		Shell::execute("/sbin/zfs", { "rename", "-u", dataset, oldDataset }, result);
+		if (result != 0) {
+			rollback();
+			throw std::runtime_error("unable to move " + dataset + " aside");
+		}
+		Shell::execute("/sbin/zfs", { "rename", "-u", tmpDataset, dataset }, result);
+		if (result == 0) {
+			Shell::execute("/sbin/zfs", { "mount", dataset }, result);
+			if (result != 0) {
+				Shell::execute("/sbin/zfs", { "rename", "-u", dataset, tmpDataset }, result);
+				result = 1;
+			}
+		}
+		if (result != 0) {
+			Shell::execute("/sbin/zfs", { "rename", "-u", oldDataset, dataset }, result);
+			if (result != 0) {
+				log_error("the room's data was left in %s", oldDataset.c_str());
+			} else {
+				rollback();
+			}
+			throw std::runtime_error("unable to move the flattened dataset " + tmpDataset + " into place");
+		}
+
+		try {
+			trash.add(roomName, oldDataset);
+		} catch (const std::exception& e) {
+			log_warning("unable to move %s to the trash: %s", oldDataset.c_str(), e.what());
+		}
+	}
+
+	{
+		PrivilegeGuard privileges;
+		Shell::execute("/sbin/zfs", { "destroy", dataset + "@" + snapName }, result);
+	}
+	if (result != 0) {
+		log_warning("unable to destroy the snapshot %s@%s", dataset.c_str(), snapName.c_str());
+	}
+
+	trash.reclaimInBackground();
+	log_notice("room has been flattened");
+}
+
+std::map<string, string> Room::getDatasetOrigins()
+{
+	std::map<string, string> origins;
+	if (!useZfs) {
+		return origins;
+	}
+
+	int status;
+	string output;
+	Shell::execute("/sbin/zfs", { "list", "-H", "-r", "-t", "filesystem",
+			"-o", "name,origin", roomDataset }, status, output);
+	if (status != 0) {
+		throw std::runtime_error("unable to list datasets");
+	}
+	std::istringstream iss(output);
+	string line;
+	while (std::getline(iss, line)) {
+		size_t tab = line.find('\t');
+		if (tab != string::npos) {
+			string origin = line.substr(tab + 1);
+			origins[line.substr(0, tab)] = (origin == "-") ? "" : origin;
+		}
+	}
+	return origins;
+}
+
+unsigned int Room::getCloneDepth()
+{
+	if (!useZfs) {
+		return 0;
+	}
+	return getCloneDepth(getDatasetOrigins());
+}
+
+unsigned int Room::getCloneDepth(const std::map<string, string>& origins)
+{
+	if (!useZfs) {
+		return 0;
+	}
+
+	// Datasets outside of the owner's rooms are asked about one at a time
+	unsigned int depth = 0;
+	string dataset = roomDataset + "/" + roomName + "/share";
+	for (;;) {
+		auto it = origins.find(dataset);
+		string origin = (it == origins.end()) ? get_zfs_origin(dataset) : it->second;
+		if (origin == "") {
+			return depth;
+		}
+		depth++;
+		dataset = origin.substr(0, origin.find('@'));
+	}
+}
+
+void Room::snapshotReceive(const string& name)
+{
+	Subprocess proc;
+
+	SetuidHelper::raisePrivileges();
+	proc.execve("/sbin/zfs", { "receive", "-Fv",
+			roomDataset + "/" + roomName, "/share",
+	});
+}
+
+const std::vector<string> Room::snapshotFields = { "name", "created", "method" };
+
+void Room::printSnapshotList(RecordWriter& writer)
+{
+	if (!useZfs) {
+		string method = SnapshotStore::getMethodName(snapshotMethod);
+		for (auto& snapshot : getSnapshotStore().list()) {
+			writer.write({
+				{ "name", snapshot.name },
+				{ "created", (long long) snapshot.created },
+				{ "method", method },
+			});
+		}
+		return;
+	}
+
+	int status;
+	string output;
+	Shell::execute("/sbin/zfs", {
+			"list", "-H", "-p", "-r", "-d", "1", "-t", "snapshot",
+			"-o", "name,creation", "-s", "creation",
+			roomDataset + "/" + roomName + "/share" }, status, output);
+	if (status != 0) {
+		throw std::runtime_error("unable to list snapshots");
+	}
+
+	std::istringstream iss(output);
+	string line;
+	while (std::getline(iss, line)) {
+		// Each line is "<dataset>@<snapshot>\t<creation time>"
+		size_t at = line.find('@');
+		size_t tab = line.find('\t');
+		if (at == string::npos || tab == string::npos || tab < at) {
+			continue;
+		}
+		writer.write({
+			{ "name", line.substr(at + 1, tab - at - 1) },
+			{ "created", std::stoll(line.substr(tab + 1)) },
+			{ "method", "zfs" },
+		});
+	}
+}
+
+std::vector<DiskUsage::Usage> Room::measureDiskUsage()
+{
+	if (useZfs) {
+		throw std::logic_error("use DiskUsage::measureZfs() for rooms on ZFS");
+	}
+
+	std::vector<string> snapshots;
+	for (auto& snapshot : getSnapshotStore().list()) {
+		snapshots.push_back(snapshot.name);
+	}
+
+	// Copies never share extents, so don't bother looking for them
+	bool findSharedExtents = (snapshotMethod != SnapshotStore::METHOD_COPY);
+
+	std::vector<DiskUsage::Usage> result;
+	{
+		PrivilegeGuard privileges;
+		result = DiskUsage::measureDirectory(roomDataDir, snapshots, findSharedExtents);
+	}
+	return result;
+}
+
+void Room::diff(const string& from, const string& to, SnapshotDiff::Callback callback)
+{
+	// Keep the snapshots from being destroyed while they are compared
+	LockGuard guard(*this, LockManager::SHARED);
+
+	string fromSnapshot = from.empty() ? getLatestSnapshot() : from;
+	if (fromSnapshot.empty()) {
+		throw std::runtime_error("room has no snapshots to compare with");
+	}
+	if (!useZfs) {
+		for (auto& name : { fromSnapshot, to }) {
+			if (name.empty()) {
+				continue;
+			}
+			// The names become paths that root opens below tags/
+			validateName(name);
+			if (!getSnapshotStore().exists(name)) {
+				throw std::runtime_error("snapshot does not exist: " + name);
+			}
+		}
+	}
+
+	PrivilegeGuard privileges;
+	if (useZfs) {
+		SnapshotDiff::compareZfs(roomDataset + "/" + roomName + "/share",
+				roomDataDir + "/share", fromSnapshot, to, callback);
+	} else {
+		SnapshotDiff::compareDirectories(roomDataDir + "/tags/" + fromSnapshot,
+				to.empty() ? roomDataDir + "/share" : roomDataDir + "/tags/" + to,
+				callback);
+	}
 }
 
-void Room::send() {
-	SetuidHelper::raisePrivileges();
-
-	Subprocess proc;
-	proc.execve("/sbin/zfs", { "send", "-R",
-			string(roomDataset + "/" + roomName + "@" + getLatestSnapshot()),
-	});
-}
+const std::vector<string> Room::statusFields = {
+	"name", "uuid", "state", "hidden", "network", "template", "tag", "origin", "depth",
+};
 
-void Room::snapshotCreate(const string& name)
+string Room::getStateName()
 {
-	SetuidHelper::raisePrivileges();
-	Shell::execute("/sbin/zfs", {
-		"snapshot", "-r",
-		roomDataset + "/" + roomName + "@" + name,
-	});
-	SetuidHelper::lowerPrivileges();
+	if (isSuspended()) {
+		return "suspended";
+	} else if (!isRunning()) {
+		return "stopped";
+	} else if (isFrozen()) {
+		return "frozen";
+	} else {
+		return "running";
+	}
 }
 
-void Room::snapshotDestroy(const string& name)
+void Room::printStatus(RecordWriter& writer)
 {
-	SetuidHelper::raisePrivileges();
-	Shell::execute("/sbin/zfs", {
-		"destroy", "-r",
-		roomDataset + "/" + roomName + "@" + name,
-	});
-	SetuidHelper::lowerPrivileges();
+	printStatus(writer, writer.wants("depth") ? getDatasetOrigins() : std::map<string, string>());
 }
 
-// TODO: Move this into ZfsDataset::
-void Room::promoteClone(const string& cloneDataset) {
-	string msg;
-
-	// FIXME: does not like full dataset paths like tank/foo/whatever
-/*	if (!ZfsDataset::validateName(cloneDataset, msg)) {
-		log_error("bad name: %s", msg.c_str());
-		throw std::runtime_error("bad dataset name");
-	}*/
-
-	// XXX-SECURITY need to verify dataset is mounted at /room/$USER; otherwise this allows
-	// promoting arbitrary datasets, such as /var
+void Room::printStatus(RecordWriter& writer, const std::map<string, string>& origins)
+{
+	const RoomOptions& options = getRoomOptions();
+	RecordWriter::Record record = {
+		{ "name", roomName },
+		{ "uuid", options.uuid },
+		{ "hidden", options.isHidden },
+		{ "network", options.network },
+		{ "template", options.templateUri },
+		{ "tag", options.templateSnapshot },
+		{ "origin", options.originUri },
+	};
+
+	// Finding the state means looking at the container, so skip it
+	// unless it was asked for
+	if (writer.wants("state")) {
+		record["state"] = getStateName();
+	}
+	if (writer.wants("depth")) {
+		record["depth"] = getCloneDepth(origins);
+	}
 
-//	SetuidHelper::raisePrivileges();
-//	Shell::execute("/sbin/zfs", { "promote", cloneDataset });
-	throw; // DEADWOOD
+	writer.write(record);
 }
 
-void Room::snapshotReceive(const string& name)
+#ifdef __linux__
+// Returns true if <uid> has an entry in /etc/passwd below <chrootDir>. The
+// file belongs to the room, so no symlink is followed on the way to it.
+static bool has_passwd_entry(const string& chrootDir, uid_t uid)
 {
-	Subprocess proc;
+	int fd = -1;
+	{
+		PrivilegeGuard privileges;
+		int rootFd = FileUtil::openDirectory(chrootDir);
+		int etcFd = FileUtil::openBeneath(rootFd, "etc");
+		(void) close(rootFd);
+		if (etcFd >= 0) {
+			fd = openat(etcFd, "passwd", O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+			(void) close(etcFd);
+		}
+	}
+	struct stat sb;
+	if (fd < 0 || fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+		if (fd >= 0) {
+			(void) close(fd);
+		}
+		return false;
+	}
 
-	SetuidHelper::raisePrivileges();
-	proc.execve("/sbin/zfs", { "receive", "-Fv",
-			roomDataset + "/" + roomName, "/share",
-	});
+	FILE *fp = fdopen(fd, "r");
+	if (fp == NULL) {
+		(void) close(fd);
+		return false;
+	}
+	bool found = false;
+	char *line = NULL;
+	size_t len = 0;
+	string uidField = ":" + std::to_string(uid) + ":";
+	while (!found && getline(&line, &len, fp) > 0) {
+		// Each line is "<login>:<password>:<uid>:..."
+		char *p = strchr(line, ':');
+		found = p != NULL && (p = strchr(p + 1, ':')) != NULL &&
+			strncmp(p, uidField.c_str(), uidField.length()) == 0;
+	}
+	free(line);
+	fclose(fp);
+	return found;
 }
+#endif
 
-void Room::printSnapshotList()
-{
-	// FIXME: would like to avoid this popen, for better security
-	string cmd = "zfs list -H -r -d 1 -t snapshot -o name -s creation " +
-			roomDataset + "/" + roomName + "/share | sed 's/.*@//'";
+void Room::start(unsigned int profileSeconds) {
+	if (profileSeconds > PrefetchProfile::MAX_RECORDING_SECONDS) {
+		throw std::runtime_error("a profile can be recorded for at most " +
+				std::to_string(PrefetchProfile::MAX_RECORDING_SECONDS) + " seconds");
+	}
 
-	Subprocess proc;
-	proc.execve("/bin/sh", { "-c", cmd });
-}
+	LockGuard guard(*this, LockManager::EXCLUSIVE);
 
-void Room::start() {
 	if (container->isRunning()) {
 		log_debug("room already started");
 		return;
 	}
 
+	if (isSuspended()) {
+		resume();
+		return;
+	}
+
 
 	log_debug("booting room: %s", roomName.c_str());
 
@@ -496,34 +1167,256 @@ void Room::start() {
 		log_warning("unable to create user account");
 	}
 #else
+	// The account only needs to be made once, unless the owner's passwd
+	// entry changes, which makes a new plan, or someone deletes it in the
+	// room, which is checked for here.
 	//XXX-SECURITY need to do this after chroot
-	try {
-		log_debug("updating /etc/passwd");
-		PasswdEntry pwent(ownerUid);
-		Shell::execute("/usr/sbin/useradd", {
-				"-R",  chrootDir,
-				"-u", std::to_string(ownerUid),
-//				"-g", std::to_string(ownerGid),
-				"-c", pwent.getGecos(),
-				"-s", pwent.getShell(),
-				"-m",
-				pwent.getLogin(),
-		});
-	} catch(...) {
-		log_warning("unable to create user account");
+	LaunchPlan& plan = getLaunchPlan();
+	if (plan.accountCreated && !has_passwd_entry(chrootDir, ownerUid)) {
+		log_debug("the account is gone from the room's /etc/passwd");
+		plan.accountCreated = false;
+	}
+	if (!plan.accountCreated) {
+		try {
+			log_debug("updating /etc/passwd");
+			PasswdEntry pwent(ownerUid);
+			int status;
+			Shell::execute("/usr/sbin/useradd", {
+					"-R",  chrootDir,
+					"-u", std::to_string(ownerUid),
+//					"-g", std::to_string(ownerGid),
+					"-c", pwent.getGecos(),
+					"-s", pwent.getShell(),
+					"-m",
+					pwent.getLogin(),
+			}, status);
+			// useradd(8) exits with 9 if the account already exists
+			if (status == 0 || status == 9) {
+				plan.accountCreated = true;
+				plan.save();
+			} else {
+				log_warning("unable to create user account");
+			}
+		} catch(...) {
+			log_warning("unable to create user account");
+		}
 	}
 #endif
 
 	pushResolvConf();
 
+	// Either watch what the room opens from the moment init starts, or
+	// read what it opened last time, so init doesn't wait for the disk
+	PrefetchProfile profile;
+	{
+		PrivilegeGuard privileges;
+		try {
+			if (profileSeconds > 0) {
+				profile.startRecording(chrootDir);
+			} else if (profile.load(getPrefetchProfilePath())) {
+				uint64_t bytes = profile.prefetch(chrootDir);
+				log_debug("prefetching %llu bytes", (unsigned long long) bytes);
+			}
+		} catch (const std::exception& e) {
+			if (profileSeconds > 0) {
+				throw;
+			}
+			log_warning("unable to prefetch: %s", e.what());
+		}
+	}
+
 	container->start();
+
+	log_event(LOG_INFO, "room started", {"room", roomName}, {"init_pid", std::to_string(container->initPid)});
+
+	if (profileSeconds > 0) {
+		// The recorder must not keep the room locked
+		guard.release();
+		recordPrefetchProfile(profile, profileSeconds);
+	}
+}
+
+void Room::recordPrefetchProfile(PrefetchProfile& profile, unsigned int seconds)
+{
+	log_flush();
+	pid_t pid = fork();
+	if (pid < 0) {
+		log_errno("fork(2)");
+		throw std::system_error(errno, std::system_category());
+	}
+	if (pid > 0) {
+		// The intermediate child exits right away, so nobody has to reap the recorder
+		int status;
+		while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+		return;
+	}
+
+	(void) setsid();
+	if (fork() != 0) {
+		_exit(0);
+	}
+
+	int nullfd = open("/dev/null", O_RDWR);
+	if (nullfd >= 0) {
+		(void) dup2(nullfd, STDIN_FILENO);
+		(void) dup2(nullfd, STDOUT_FILENO);
+		(void) dup2(nullfd, STDERR_FILENO);
+		if (nullfd > STDERR_FILENO) {
+			(void) close(nullfd);
+		}
+	}
+	// The fanotify descriptor is already open, so the recorder can run
+	// as the owner for as long as it takes
+	try {
+		SetuidHelper::dropPrivileges();
+		profile.finishRecording(seconds);
+		profile.save(getPrefetchProfilePath());
+	} catch (const std::exception& e) {
+		log_error("unable to record the prefetch profile: %s", e.what());
+		log_flush();
+		_exit(1);
+	}
+	log_event(LOG_INFO, "prefetch profile recorded", {"room", roomName},
+			{"ranges", std::to_string(profile.getRanges().size())});
+	log_flush();
+	_exit(0);
+}
+
+bool Room::isSuspended()
+{
+	PrivilegeGuard privileges;
+	return FileUtil::checkExists(checkpointDir + "/inventory.img");
+}
+
+void Room::discardCheckpoint()
+{
+	PrivilegeGuard privileges;
+	if (FileUtil::checkExists(checkpointDir)) {
+		Trash::removeTree(checkpointDir, 1);
+	}
+}
+
+void Room::suspend()
+{
+	LockGuard guard(*this, LockManager::EXCLUSIVE);
+
+	if (!container->isRunning()) {
+		throw std::runtime_error("room is not running");
+	}
+
+	// The agent's commands are not part of the init process tree
+	stopAgent();
+
+	if (isFrozen()) {
+		thaw();
+	}
+
+	log_event(LOG_INFO, "suspending room", {"room", roomName});
+	auto begin = std::chrono::steady_clock::now();
+
+	discardCheckpoint();
+	{
+		PrivilegeGuard privileges;
+		string parent = checkpointDir.substr(0, checkpointDir.rfind('/'));
+		FileUtil::mkdir_idempotent(parent.substr(0, parent.rfind('/')), 0700, 0, 0);
+		FileUtil::mkdir_idempotent(parent, 0700, 0, 0);
+		FileUtil::mkdir_idempotent(checkpointDir, 0700, 0, 0);
+	}
+	container->suspend(checkpointDir);
+
+	auto elapsed = std::chrono::steady_clock::now() - begin;
+	log_event(LOG_INFO, "room suspended", {"room", roomName},
+			{"elapsed_ms", std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count())});
+}
+
+void Room::resume()
+{
+	LockGuard guard(*this, LockManager::EXCLUSIVE);
+
+	if (container->isRunning()) {
+		throw std::runtime_error("room is already running");
+	}
+	if (!isSuspended()) {
+		throw std::runtime_error("room is not suspended");
+	}
+
+	log_event(LOG_INFO, "resuming room", {"room", roomName});
+	auto begin = std::chrono::steady_clock::now();
+
+	container->resume(checkpointDir);
+
+	// A checkpoint can only be restored once
+	discardCheckpoint();
+
+	auto elapsed = std::chrono::steady_clock::now() - begin;
+	log_event(LOG_INFO, "room resumed", {"room", roomName}, {"init_pid", std::to_string(container->initPid)},
+			{"elapsed_ms", std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count())});
+}
+
+bool Room::isRunning()
+{
+	return container->isRunning();
+}
+
+bool Room::isFrozen()
+{
+	return container->isFrozen();
+}
+
+void Room::freeze()
+{
+	if (!container->isRunning()) {
+		throw std::runtime_error("room is not running");
+	}
+	if (container->isFrozen()) {
+		return;
+	}
+	int64_t elapsed = container->freeze();
+	log_event(LOG_INFO, "room frozen", {"room", roomName}, {"freeze_us", std::to_string(elapsed)});
+}
+
+void Room::thaw()
+{
+	if (!container->isFrozen()) {
+		return;
+	}
+	int64_t elapsed = container->thaw();
+	log_event(LOG_INFO, "room thawed", {"room", roomName}, {"thaw_us", std::to_string(elapsed)});
+}
+
+bool Room::freezeIfIdle()
+{
+	int fd = open(execLockPath.c_str(), O_RDONLY | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		log_errno("open(2) of %s", execLockPath.c_str());
+		return false;
+	}
+	if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+		log_debug("not freezing `%s'; a command is running in it", roomName.c_str());
+		(void) close(fd);
+		return false;
+	}
+	freeze();
+	(void) close(fd);
+	return true;
 }
 
 void Room::stop()
 {
+	LockGuard guard(*this, LockManager::EXCLUSIVE);
 	PasswdEntry pwent(ownerUid);
 	string cmd;
 
+	log_event(LOG_INFO, "stopping room", {"room", roomName});
+
+	stopAgent();
+
+	// A suspended room has no processes; stopping it throws away the checkpoint
+	if (isSuspended()) {
+		discardCheckpoint();
+		return;
+	}
+
 #ifdef __linux__
 	container->stop();
 	return;
@@ -580,74 +1473,58 @@ void Room::destroy(const string& name)
 
 void Room::destroy()
 {
+	LockGuard guard(*this, LockManager::EXCLUSIVE);
 	string cmd;
 
 	log_debug("destroying room at %s", chrootDir.c_str());
 
 	transitionState(ROOM_STATE_DEFINED);
-
-	SetuidHelper::raisePrivileges();
-	if (useZfs) {
-
-		log_debug("unmounting root filesystem");
-		FileUtil::unmount(roomDataDir + "/share", MNT_FORCE);
-		FileUtil::unmount(roomDataDir, MNT_FORCE);
-
-		// this used to race with "jail -r", but doesn't anymore
-		bool success = false;
-		for (int i = 0; i < 2; i++) {
-			sleep(1);
-			int result;
-			Shell::execute("/sbin/zfs", { "destroy", "-r", roomDataset + "/" + roomName}, result);
-			if (result == 0) {
-				success = true;
-				break;
-			}
-		}
-		if (!success) {
-			log_error("unable to destroy the ZFS dataset");
-			throw std::runtime_error("unable to destroy the ZFS dataset");
+	discardCheckpoint();
+
+	// Move the room out of the way, and free the space in the background
+	Trash trash = getTrash();
+	{
+		PrivilegeGuard privileges;
+		container->release();
+		if (useZfs) {
+			log_debug("unmounting root filesystem");
+			FileUtil::unmount(roomDataDir + "/share", MNT_FORCE);
+			FileUtil::unmount(roomDataDir, MNT_FORCE);
+			trash.add(roomName, roomDataset + "/" + roomName);
+		} else {
+			trash.add(roomName, roomDataDir);
 		}
-	} else {
-#ifdef __FreeBSD__
-		Shell::execute("/bin/chflags", { "-R", "noschg", roomDataDir });
-#endif
-		Shell::execute("/bin/rm", { "-rf", roomDataDir });
 	}
 
-	log_notice("room has been destroyed");
+	trash.reclaimInBackground();
 
-	SetuidHelper::lowerPrivileges();
+	log_notice("room has been destroyed");
 }
 
-void Room::mount() {
-	container->mountAll();
-
-	PasswdEntry pwent(ownerUid);
-	container->mkdir_p("/data", 0755, 0, 0);
-	container->mount_into(roomDataDir + "/local", "/data");
-
-	if (roomOptions.shareTempDir) {
-		log_debug("using a shared /tmp");
-		container->mount_into("/tmp", "/tmp");
-		container->mount_into("/var/tmp", "/var/tmp");
+Trash Room::getTrash()
+{
+	if (useZfs) {
+		return Trash(roomDir + "/" + ownerLogin + "/.trash", roomDataset + "/.trash");
 	} else {
-		log_debug("using a private /tmp");
-		container->mount_into(chrootDir + "/data/tmp", "/tmp");
-		container->mount_into(chrootDir + "/data/tmp", "/var/tmp");
+		return Trash(roomDir + "/" + ownerLogin + "/.trash");
 	}
+}
 
-	container->mkdir_p(pwent.getHome(), 0755, 0, 0);
-	if (roomOptions.shareHomeDir) {
-		log_debug("using a shared /home");
-		container->mount_into(pwent.getHome(), pwent.getHome());
-	} else {
-		log_debug("using a private /home");
-		container->mount_into(roomDataDir + "/local/home", pwent.getHome());
+void Room::mount() {
+	LockGuard guard(*this, LockManager::EXCLUSIVE);
+	LaunchPlan& plan = getLaunchPlan();
+
+	container->mountAll();
+	for (auto& m : plan.mounts) {
+		if (m.flags & LaunchPlan::MOUNT_MKDIR) {
+			container->mkdir_p(m.target, 0755, 0, 0);
+		}
+		container->mount_into(m.source, m.target);
 	}
 }
 
 void Room::unmount() {
+	LockGuard guard(*this, LockManager::EXCLUSIVE);
 	container->unmountAll();
 	container->unmount_idempotent("/data");
 	container->unmount_idempotent("/home");
@@ -688,7 +1565,7 @@ void Room::transitionState(enum e_RoomState targetState)
 		break;
 
 	default:
-		errx(1, "FIXME - finish this function");
+		throw std::logic_error("FIXME - unsupported state transition");
 	}
 }
 
@@ -715,40 +1592,123 @@ void Room::killAllProcesses()
 #endif
 }
 
-void Room::exportArchive()
+void Room::exportArchive(int outfd, bool compress, bool showProgress)
 {
-	const string snapName = "tmp_export";
-	int result;
+	LockGuard guard(*this, LockManager::SHARED);
 
 	if (!useZfs) {
-		throw std::runtime_error("TODO -- not implemented yet");
+		exportDirectory(outfd, compress, showProgress);
+		return;
 	}
 
-	string snapPath = roomDataset + "/" + roomName + "@" + snapName;
+	// Unique names, so concurrent exports of the same room do not collide
+	string suffix = std::to_string(getpid()) + "-" + std::to_string(time(NULL));
+	string snapPath = roomDataset + "/" + roomName + "@export-" + suffix;
+	string holdTag = "room-export-" + suffix;
 
-	Shell::execute("/sbin/zfs", { "snapshot", "-r", snapPath }, result);
+	int result;
+	{
+		PrivilegeGuard privileges;
+		Shell::execute("/sbin/zfs", { "snapshot", "-r", snapPath }, result);
+	}
 	if (result != 0) {
 		throw std::runtime_error("command failed: zfs snapshot");
 	}
 
-	Subprocess p;
-	p.execute("/sbin/zfs", { "send", snapPath });
-	result = p.waitForExit();
+	// The hold pins the snapshot while it is being sent; once it is released,
+	// the deferred destroy takes effect without waiting for "zfs send" to let go.
+	try {
+		{
+			PrivilegeGuard privileges;
+			Shell::execute("/sbin/zfs", { "hold", "-r", holdTag, snapPath }, result);
+		}
+		if (result != 0) {
+			throw std::runtime_error("command failed: zfs hold");
+		}
+
+		StreamPipeline pipeline("export");
+		pipeline.addCommand("/sbin/zfs", { "send", "-R", snapPath }, true);
+		pipeline.addMeter();
+		if (compress) {
+			pipeline.addCommand(StreamPipeline::findZstd(), { "-T0", "-q", "-c" });
+		}
+		pipeline.setOutput(outfd);
+		pipeline.setShowProgress(showProgress);
+		pipeline.run();
+	} catch (...) {
+		{
+			PrivilegeGuard privileges;
+			int ignored;
+			Shell::execute("/sbin/zfs", { "release", "-r", holdTag, snapPath }, ignored);
+			Shell::execute("/sbin/zfs", { "destroy", "-d", "-r", snapPath }, ignored);
+		}
+		throw;
+	}
+
+	{
+		PrivilegeGuard privileges;
+		Shell::execute("/sbin/zfs", { "release", "-r", holdTag, snapPath }, result);
+		if (result == 0) {
+			Shell::execute("/sbin/zfs", { "destroy", "-d", "-r", snapPath }, result);
+		}
+	}
 	if (result != 0) {
-		sleep(2); // horrible way to avoid "snapshot is busy" error
+		log_warning("unable to clean up the export snapshot %s", snapPath.c_str());
+	}
+}
 
-		int ignored;
-		Shell::execute("/sbin/zfs", { "destroy", snapPath }, ignored);
-		std::cerr << "ZFS send failed with exit code " << result << "\n";
-		throw std::runtime_error("command failed: zfs send");
+void Room::exportDirectory(int outfd, bool compress, bool showProgress)
+{
+	// The archive stores the ids that files have inside the room, so that
+	// it can be imported by anyone without trusting the ids in it
+	int usernsFd;
+	{
+		PrivilegeGuard privileges;
+		usernsFd = container->openStorageNamespace(ownerUid);
 	}
 
-	sleep(2); // horrible way to avoid "snapshot is busy" error
+	// Without a snapshot, the only way to get a consistent copy of a running
+	// room is to keep its processes from running while it is archived
+	bool wasFrozen = isFrozen();
+	if (isRunning() && !wasFrozen) {
+		if (!Cgroup::isSupported()) {
+			if (usernsFd >= 0) (void) close(usernsFd);
+			throw std::runtime_error("the room must be stopped before it can be exported");
+		}
+		freeze();
+	}
 
-	Shell::execute("/sbin/zfs", { "destroy", snapPath }, result);
-	if (result != 0) {
-		std::cerr << "Failed 2\n";
-		throw std::runtime_error("command failed: zfs destroy");
+	StreamPipeline pipeline("export");
+	std::vector<string> tarArgs = {
+			"-C", roomDataDir,
+			"--create", "--file=-",
+			"--one-file-system", "--numeric-owner", "--sparse",
+			"--acls", "--xattrs", "--xattrs-include=*",
+			"--exclude=./etc/exec-agent.sock", "--exclude=./etc/exec.lock", "--exclude=./etc/init.pid",
+			"." };
+	if (usernsFd >= 0) {
+		pipeline.addNamespacedCommand(StreamPipeline::findTar(), tarArgs, usernsFd);
+	} else {
+		pipeline.addCommand(StreamPipeline::findTar(), tarArgs, true);
+	}
+	pipeline.addMeter();
+	if (compress) {
+		pipeline.addCommand(StreamPipeline::findZstd(), { "-T0", "-q", "-c" });
+	}
+	pipeline.setOutput(outfd);
+	pipeline.setShowProgress(showProgress);
+	try {
+		pipeline.run();
+	} catch (...) {
+		if (usernsFd >= 0) (void) close(usernsFd);
+		if (!wasFrozen && isFrozen()) {
+			thaw();
+		}
+		throw;
+	}
+	if (usernsFd >= 0) (void) close(usernsFd);
+	if (!wasFrozen && isFrozen()) {
+		thaw();
 	}
 }
 
@@ -778,6 +1738,7 @@ void Room::setOriginUri(const string& uri)
 void Room::install(const struct RoomInstallParams& rip)
 {
 	Room room(rip.roomDir, rip.name);
+	LockGuard guard(room, LockManager::EXCLUSIVE);
 	room.roomOptions = rip.options;
 	room.createEmpty();
 	room.syncRoomOptions();
@@ -799,6 +1760,7 @@ void Room::editConfiguration()
 	string options_file = roomDataDir + "/etc/options.json";
 	char *oarg = strdup(options_file.c_str());
 	char *args[] = { editor, oarg, NULL };
+	log_flush();
 	if (execvp(editor, args) < 0) {
 		cout << editor << " " << options_file;
 		throw std::system_error(errno, std::system_category());
@@ -827,8 +1789,119 @@ string Room::generateSnapshotName()
 	return string(buf) + "_P" + std::to_string(getpid());
 }
 
+SnapshotStore& Room::getSnapshotStore()
+{
+	if (!snapshotStore) {
+		snapshotStore.reset(new SnapshotStore(roomDataDir, snapshotMethod));
+	}
+	return *snapshotStore;
+}
+
+Room::LockGuard::LockGuard(Room& room, LockManager::Mode mode) : room(room)
+{
+	if (room.lockDepth == 0) {
+		room.lock = std::make_shared<LockManager::Lock>(
+				LockManager().lockRoom(room.ownerLogin, room.roomName, mode));
+		room.lockMode = mode;
+	} else if (mode == LockManager::EXCLUSIVE && room.lockMode == LockManager::SHARED) {
+		throw std::logic_error("cannot upgrade a shared lock on room " + room.roomName);
+	}
+	room.lockDepth++;
+}
+
+void Room::LockGuard::release()
+{
+	if (held) {
+		held = false;
+		if (--room.lockDepth == 0) {
+			room.lock.reset();
+		}
+	}
+}
+
+LaunchPlan& Room::getLaunchPlan()
+{
+	if (launchPlan) {
+		return *launchPlan;
+	}
+
+	// Anything the plan is compiled from must be one of its inputs. The
+	// passwd database is too slow to read every time, so go by its inode.
+	string options, passwdFacts;
+	std::ifstream ifs(roomOptionsPath);
+	if (ifs) {
+		options.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+	}
+	struct stat sb;
+	if (stat("/etc/passwd", &sb) == 0) {
+		passwdFacts = std::to_string(sb.st_ino) + ":" + std::to_string(sb.st_size) + ":" +
+			std::to_string(sb.st_mtim.tv_sec) + "." + std::to_string(sb.st_mtim.tv_nsec);
+	}
+	uint64_t inputHash = LaunchPlan::hashInputs({
+		options, passwdFacts, std::to_string(ownerUid), roomName, roomDataDir,
+	});
+
+	// Root trusts the plan, so it is kept where the owner cannot change it
+	launchPlan.reset(new LaunchPlan(FileUtil::getRuntimeDir() + "/plans/" + std::to_string(ownerUid) + "/" + roomName));
+	if (!launchPlan->load(inputHash)) {
+		log_debug("compiling the launch plan");
+		compileLaunchPlan(*launchPlan);
+		launchPlan->inputHash = inputHash;
+		try {
+			launchPlan->save();
+		} catch (const std::exception& e) {
+			log_warning("unable to save the launch plan: %s", e.what());
+		}
+	}
+	container->setHostname(launchPlan->hostname);
+	container->setIdMap(launchPlan->idMap);
+	return *launchPlan;
+}
+
+void Room::compileLaunchPlan(LaunchPlan& plan)
+{
+	PasswdEntry pwent(ownerUid);
+	string homeDir = pwent.getHome();
+
+	plan.hostname = roomName + ".room";
+	plan.homeDir = homeDir;
+	plan.accountCreated = false;
+
+	{
+		PrivilegeGuard privileges;
+		plan.idMap = container->getIdMap(ownerUid);
+	}
+
+	plan.mounts.clear();
+	plan.mounts.push_back({ roomDataDir + "/local", "/data", LaunchPlan::MOUNT_MKDIR });
+	if (roomOptions.shareTempDir) {
+		plan.mounts.push_back({ "/tmp", "/tmp", 0 });
+		plan.mounts.push_back({ "/var/tmp", "/var/tmp", 0 });
+	} else {
+		plan.mounts.push_back({ chrootDir + "/data/tmp", "/tmp", 0 });
+		plan.mounts.push_back({ chrootDir + "/data/tmp", "/var/tmp", 0 });
+	}
+	if (roomOptions.shareHomeDir) {
+		plan.mounts.push_back({ homeDir, homeDir, LaunchPlan::MOUNT_MKDIR });
+	} else {
+		plan.mounts.push_back({ roomDataDir + "/local/home", homeDir, LaunchPlan::MOUNT_MKDIR });
+	}
+
+	plan.environment = {
+		"HOME=" + homeDir,
+		"SHELL=" + login_shell, //FIXME: should consult PasswdEntry
+		"PATH=/sbin:/usr/sbin:/usr/local/sbin:/bin:/usr/bin:/usr/local/bin",
+		"TERM=xterm",
+		"USER=" + ownerLogin,
+	};
+}
+
 string Room::getLatestSnapshot()
 {
+	if (!useZfs) {
+		return getSnapshotStore().getLatest();
+	}
+
 	// FIXME: would like to avoid this popen, for better security
 	string cmd = "zfs list -H -r -d 1 -t snapshot -o name -s creation " +
 			roomDataset + "/" + roomName + "/share | tail -1 | sed 's/.*@//'";
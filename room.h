@@ -14,15 +14,25 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <map>
 #include <memory>
 
 #include "namespaceImport.h"
 #include "Container.hpp"
+#include "DiskUsage.hpp"
+#include "LaunchPlan.hpp"
+#include "LockManager.hpp"
+#include "PrefetchProfile.hpp"
 #include "roomOptions.h"
+#include "SnapshotDiff.hpp"
+#include "SnapshotStore.hpp"
+#include "Trash.hpp"
 
 extern FILE *logfile;
 #include "logger.h"
 
+class RecordWriter;
+
 struct RoomInstallParams {
 	string name;
 	string roomDir;
@@ -42,26 +52,67 @@ class Room {
 public:
 	Room(const string& managerRoomDir, const string& name);
 	static void install(const struct RoomInstallParams& rip);
+	static void validateName(const string& name);
 	void createEmpty();
 	void editConfiguration();
 	void extractTarball(const string& baseTarball);
 	int forkAndExec(std::vector<std::string> execVec, const string& runAsUser);
 	void clone(const string& snapshot, const string& destRoom, const RoomOptions& roomOpt);
+	// Clone many rooms from the same snapshot, which is faster than calling clone() for each
+	void cloneBatch(const string& snapshot, const std::vector<string>& destRooms, const RoomOptions& roomOpt);
 	void killAllProcesses();
 	void snapshotCreate(const string& name);
 	void snapshotDestroy(const string& name);
 	void snapshotReceive(const string& name);
-	void start();
+	// Start the room, reading the files in its prefetch profile into the page
+	// cache first. If <profileSeconds> is not 0, record a new profile of the
+	// files it opens in that many seconds instead, in the background.
+	void start(unsigned int profileSeconds = 0);
 	void stop();
+	// Checkpoint the processes in the room to disk and stop them, or
+	// restore them. Starting a suspended room also resumes it.
+	void suspend();
+	void resume();
+	bool isSuspended();
+	// Freeze or thaw every process in the room. Running a command in
+	// the room thaws it automatically.
+	void freeze();
+	void thaw();
+	bool isFrozen();
+	bool isRunning();
+	// Freeze the room unless a command is running in it via exec or
+	// enter. Returns true if the room was frozen.
+	bool freezeIfIdle();
 	void destroy();
 	static void destroy(const string& name);
-	void enter();
+	int enter();
 	void send();
 	void mount();
 	void unmount();
-	void exec(std::vector<std::string> execVec, const string& runAsUser);
-	void exportArchive();
-	void printSnapshotList();
+	// Run a command inside the room, and return its exit status
+	int exec(std::vector<std::string> execVec, const string& runAsUser);
+	// Start or stop an agent that runs commands from inside the room
+	void startAgent();
+	void stopAgent();
+	// Write an archive of the room to <outfd>, optionally zstd-compressed.
+	// ZFS rooms are archived as a "zfs send" stream, and others as a tar(1) archive.
+	void exportArchive(int outfd, bool compress, bool showProgress);
+	// Write one record per snapshot, oldest first
+	void printSnapshotList(RecordWriter& writer);
+	static const std::vector<string> snapshotFields;
+	// Write a record describing the room, e.g. for "room list"
+	void printStatus(RecordWriter& writer);
+	// The same, using <origins> from getDatasetOrigins() to find the
+	// clone depth, so that listing many rooms reads them only once
+	void printStatus(RecordWriter& writer, const std::map<string, string>& origins);
+	static const std::vector<string> statusFields;
+	// "running", "frozen", "suspended" or "stopped"
+	string getStateName();
+	// The space used by a room that is not on ZFS, and by its snapshots
+	std::vector<DiskUsage::Usage> measureDiskUsage();
+	// Report what changed between the snapshots <from> and <to>. An empty
+	// <from> means the latest snapshot, and an empty <to> the live room.
+	void diff(const string& from, const string& to, SnapshotDiff::Callback callback);
 	void transitionState(enum e_RoomState targetState);
 
 	// Remote push/pull functions
@@ -69,8 +120,18 @@ public:
 	//void pushToOrigin();
 	void setOriginUri(const string& uri);
 
-	// Cloned datasets need to use "zfs promote" in conjunction with "zfs receive"
-	void promoteClone(const string& cloneDataset);
+	// Reverse the dependency between a clone on ZFS and its template, so
+	// the template can be destroyed
+	void promoteClone();
+	// Replace a clone on ZFS with a copy that does not depend on its
+	// template. The old dataset is destroyed in the background.
+	void flatten(bool showProgress);
+	// The origin of every dataset of the owner's rooms, or "" for those
+	// that are not clones. Empty if rooms are not on ZFS.
+	std::map<string, string> getDatasetOrigins();
+	// The number of datasets that the room depends on through "zfs clone"
+	unsigned int getCloneDepth();
+	unsigned int getCloneDepth(const std::map<string, string>& origins);
 
 	static bool isValidName(const string& name)
 	{
@@ -99,11 +160,21 @@ public:
 
 	void syncRoomOptions();
 
+	// Send log records for this room to $roomDataDir/etc/room.log
+	void openLog(int threshold);
+
 	string getLatestSnapshot();
 
+	const string& getName() const {
+		return roomName;
+	}
+
+	const string& getCgroupName() const {
+		return container->cgroupName;
+	}
+
 private:
-	//std::unique_ptr<Container> container = std::make_unique<Container>(Container::create());
-	Container* container;
+	std::unique_ptr<Container> container;
 	bool areRoomOptionsLoaded = false;
 	RoomOptions roomOptions;
 	string roomDir;   // copy of RoomManager::roomDir
@@ -118,22 +189,60 @@ private:
 	string roomDataset; // the name of the ZFS dataset for the room
 	string zpoolName; // the ZFS pool the room lives in
 	string roomOptionsPath; // The path to the room options.json file
+	string agentSocketPath; // The Unix socket of the exec agent
+	string checkpointDir; // The CRIU images of a suspended room
+	string execLockPath; // Held in shared mode while a command runs via exec
 	bool useZfs; // if true, create ZFS rooms
+	SnapshotStore::Method snapshotMethod = SnapshotStore::METHOD_REFLINK; // for rooms not on ZFS
+	std::shared_ptr<SnapshotStore> snapshotStore; // loaded on first use
+	std::shared_ptr<LaunchPlan> launchPlan; // loaded on first use
+	std::shared_ptr<LockManager::Lock> lock; // held while a LockGuard exists
+	LockManager::Mode lockMode = LockManager::SHARED;
+	unsigned int lockDepth = 0;
 	enum e_RoomState state = ROOM_STATE_UNKNOWN;
 
 /*	struct {
 		string tarballUri; // URI to the tarball for the root fs
 	} installOpts;*/
 
+	// Holds the lock on the room for as long as it exists. Guards nest, so
+	// lifecycle methods can call each other; the outermost one picks the mode.
+	class LockGuard {
+	public:
+		LockGuard(Room& room, LockManager::Mode mode);
+		~LockGuard() {
+			release();
+		}
+		// Let go of the lock early, e.g. before waiting on a command
+		void release();
+
+	private:
+		Room& room;
+		bool held = true;
+	};
+
+	string getPrefetchProfilePath() const {
+		return roomDataDir + "/etc/prefetch.profile";
+	}
+	// The profile that was current when the snapshot was made
+	string getSnapshotPrefetchProfilePath(const string& snapshot) const;
+	void recordPrefetchProfile(PrefetchProfile& profile, unsigned int seconds);
+
 	bool isClone() const {
 		return (roomOptions.templateSnapshot != "");
 	}
 
 	void determineInitialState();
 	void enterJail(const string& runAsUser);
+	void setupExecEnvironment(const string& loginName, const string& homeDir);
+	void discardCheckpoint();
+	SnapshotStore& getSnapshotStore();
+	LaunchPlan& getLaunchPlan();
+	void compileLaunchPlan(LaunchPlan& plan);
+	Trash getTrash();
+	void exportDirectory(int outfd, bool compress, bool showProgress);
 	bool jailExists();
 	void customizeWithoutRoot();
-	static void validateName(const string& name);
 	void pushResolvConf();
 	void getJailName();
 	static void parseRemoteUri(const string& uri, string& scheme, string& host, string& path);
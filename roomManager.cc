@@ -14,14 +14,18 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <locale>
 #include <regex>
+#include <set>
 #include <string>
+#include <sstream>
 #include <streambuf>
 #include <unordered_set>
 
@@ -31,6 +35,8 @@
 extern "C" {
 #include <err.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <getopt.h>
 #include <pwd.h>
 #include <sys/file.h>
@@ -46,9 +52,19 @@ extern "C" {
 #include "logger.h"
 #include "namespaceImport.h"
 #include "shell.h"
+#include "SnapshotStore.hpp"
+#include "StreamPipeline.hpp"
 #include "fileUtil.h"
+#include "FanoutExec.hpp"
+#ifdef __linux__
+#include "NetnsPool.hpp"
+#endif
+#include "IdleMonitor.hpp"
+#include "LockManager.hpp"
+#include "RecordWriter.hpp"
 #include "room.h"
 #include "roomManager.h"
+#include "setuidHelper.h"
 #include "zfsPool.h"
 
 string RoomManager::getUserRoomDir() {
@@ -69,11 +85,20 @@ bool RoomManager::doesBaseTemplateExist() {
 void RoomManager::bootstrap() {
 	string zpool;
 
+	// Only the first of several commands run at the same time does the work
+	auto lock = LockManager().lockGlobal();
+	if (isBootstrapComplete()) {
+		return;
+	}
+
 	if (!useZfs) {
-		SetuidHelper::raisePrivileges();
+		PrivilegeGuard privileges;
 		FileUtil::mkdir_idempotent(roomDir, 0755, 0, 0);
-		SetuidHelper::lowerPrivileges();
 
+		// Remember how cheaply this filesystem can snapshot and clone rooms
+		SnapshotStore::Method method = SnapshotStore::probe(roomDir);
+		SnapshotStore::saveMethod(roomDir, method);
+		log_notice("rooms will be snapshotted using: %s", SnapshotStore::getMethodName(method).c_str());
 		return;
 	}
 	// ZFS handling after this point
@@ -122,51 +147,57 @@ void RoomManager::bootstrap() {
 
 void RoomManager::initUserRoomSpace()
 {
-	if (FileUtil::checkExists(getUserRoomDir())) {
+	// .tmp is made last, so if it exists there is nothing to do
+	if (FileUtil::checkExists(getUserRoomDir() + "/.tmp")) {
 		return;
 	}
 
-	// TODO: simplify this. I think it was due to wanting the
-	// user to own /room/$LOGNAME, but if root owns it, the dance
-	// of changing the mointpoint may not be needed
-	if (useZfs) {
-		string tempdir = getTempdir() + "/user." + ownerLogin;
-
-		string zpool = ZfsPool::getNameByPath(roomDir);
-		SetuidHelper::raisePrivileges();
-
-		Shell::execute("/sbin/zfs",	{
-				"create",
-				"-o", "mountpoint=" + tempdir,
-				zpool + "/room/" + ownerLogin
-		});
-
-		FileUtil::chmod(tempdir, 0750);
-		FileUtil::chgrp(tempdir, ownerGid);
-
-		string path = "/room/" + ownerLogin;
-		Shell::execute("/sbin/zfs",	{
-				"set", "mountpoint=" + path,
-				zpool + "/room/" + ownerLogin
-		});
-		FileUtil::rmdir(tempdir);
-	} else {
-		SetuidHelper::raisePrivileges();
-		FileUtil::mkdir_idempotent("/room/" + ownerLogin, 0755, 0, 0);
-		SetuidHelper::lowerPrivileges();
+	// Another command may be setting up the same directory right now
+	auto lock = LockManager().lockGlobal();
+
+	if (!FileUtil::checkExists(getUserRoomDir())) {
+		// TODO: simplify this. I think it was due to wanting the
+		// user to own /room/$LOGNAME, but if root owns it, the dance
+		// of changing the mointpoint may not be needed
+		if (useZfs) {
+			string tempdir = getTempdir() + "/user." + ownerLogin;
+
+			string zpool = ZfsPool::getNameByPath(roomDir);
+			SetuidHelper::raisePrivileges();
+
+			Shell::execute("/sbin/zfs",	{
+					"create",
+					"-o", "mountpoint=" + tempdir,
+					zpool + "/room/" + ownerLogin
+			});
+
+			FileUtil::chmod(tempdir, 0750);
+			FileUtil::chgrp(tempdir, ownerGid);
+
+			string path = "/room/" + ownerLogin;
+			Shell::execute("/sbin/zfs",	{
+					"set", "mountpoint=" + path,
+					zpool + "/room/" + ownerLogin
+			});
+			FileUtil::rmdir(tempdir);
+		} else {
+			PrivilegeGuard privileges;
+			FileUtil::mkdir_idempotent("/room/" + ownerLogin, 0755, 0, 0);
+		}
 	}
 
-	SetuidHelper::raisePrivileges();
+	PrivilegeGuard privileges;
 	FileUtil::mkdir_idempotent("/room/" + ownerLogin + "/.tmp", 0700, ownerUid, ownerGid);
-	SetuidHelper::lowerPrivileges();
 }
 
 Room& RoomManager::getRoomByName(const string& name) {
+	std::lock_guard<std::recursive_mutex> guard(roomsMutex);
 	enumerateRooms();
 	auto it = rooms.find(name);
 	if (it != rooms.end()) {
-	    Room* r = rooms[name];
+	    Room* r = it->second.get();
 	    r->loadRoomOptions();
+	    r->openLog(verbose ? LOG_DEBUG : LOG_INFO);
 	    return *r;
 	} else {
 		throw std::runtime_error("Room " + name + " does not exist");
@@ -183,7 +214,6 @@ void RoomManager::createRoom(const string& name) {
 
 void RoomManager::cloneRoom(const string& dest, const RoomOptions& roomOpt)
 {
-	Room* srcRoom;
 	string uri;
 
 	if (roomOpt.templateUri == "" && userOptions.defaultRoom == "") {
@@ -197,9 +227,44 @@ void RoomManager::cloneRoom(const string& dest, const RoomOptions& roomOpt)
 	}
 
 	log_debug("cloning `%s' from `%s'", dest.c_str(), uri.c_str());
-	srcRoom = new Room(roomDir, uri);
-	srcRoom->clone(srcRoom->getLatestSnapshot(), dest, roomOpt);
-	delete srcRoom;
+	Room srcRoom(roomDir, uri);
+	srcRoom.clone(srcRoom.getLatestSnapshot(), dest, roomOpt);
+	enumerateRooms();
+}
+
+void RoomManager::cloneRooms(const string& prefix, unsigned int count, const RoomOptions& roomOpt)
+{
+	string uri = (roomOpt.templateUri == "") ? userOptions.defaultRoom : roomOpt.templateUri;
+	if (uri == "") {
+		throw std::runtime_error("cloneUri and defaultRoom not set");
+	}
+
+	// Name the rooms <prefix>-001, <prefix>-002, ...
+	std::vector<string> names;
+	int width = std::to_string(count).length();
+	for (unsigned int i = 1; i <= count; i++) {
+		std::ostringstream oss;
+		oss << prefix << "-" << std::setw(width) << std::setfill('0') << i;
+		Room::validateName(oss.str());
+		if (checkRoomExists(oss.str())) {
+			throw std::runtime_error("room already exists: " + oss.str());
+		}
+		names.push_back(oss.str());
+	}
+
+	auto begin = std::chrono::steady_clock::now();
+	Room srcRoom(roomDir, uri);
+	string snapshot = srcRoom.getLatestSnapshot();
+	if (snapshot == "") {
+		throw std::runtime_error("the template room `" + uri + "' has no snapshots");
+	}
+	srcRoom.cloneBatch(snapshot, names, roomOpt);
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	log_event(LOG_INFO, "rooms cloned", {"template", uri}, {"count", std::to_string(count)},
+			{"elapsed_ms", std::to_string((int64_t) (elapsed * 1000))});
+	cout << "created " << count << " rooms in " << std::fixed << std::setprecision(2) << elapsed
+			<< "s (" << std::setprecision(1) << (elapsed > 0 ? count / elapsed : 0) << " rooms/s)" << endl;
 	enumerateRooms();
 }
 
@@ -223,27 +288,286 @@ void RoomManager::cloneRoomFromRemote(const string& name, const string& uri)
 }
 #endif
 
-void RoomManager::importRoom(const string& roomName) {
-	const string snapName = "tmp_export";
-	int result;
+void RoomManager::importRoom(const string& roomName, int infd, bool showProgress)
+{
+	Room::validateName(roomName);
+	auto lock = LockManager().lockRoom(ownerLogin, roomName, LockManager::EXCLUSIVE);
+	if (checkRoomExists(roomName)) {
+		throw std::runtime_error("room already exists: " + roomName);
+	}
 
-	if (!useZfs) {
-		throw std::runtime_error("TODO -- not implemented yet");
+	// Sniff the stream to see if it was compressed with zstd(1)
+	static const char zstdMagic[] = { '\x28', '\xb5', '\x2f', '\xfd' };
+	char magic[sizeof(zstdMagic)];
+	size_t len = 0;
+	while (len < sizeof(magic)) {
+		ssize_t bytes = read(infd, magic + len, sizeof(magic) - len);
+		if (bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw std::system_error(errno, std::system_category());
+		}
+		if (bytes == 0) {
+			break;
+		}
+		len += bytes;
+	}
+	if (len < sizeof(magic)) {
+		throw std::runtime_error("the archive is truncated");
+	}
+
+	StreamPipeline pipeline("import");
+	if (memcmp(magic, zstdMagic, sizeof(magic)) == 0) {
+		pipeline.addCommand(StreamPipeline::findZstd(), { "-d", "-q", "-c" });
 	}
+	pipeline.addMeter();
+	pipeline.setInput(infd);
+	pipeline.setInputPrefix(string(magic, len));
+	pipeline.setShowProgress(showProgress);
 
-	string snapPath = getUserRoomDataset() + "/" + roomName;
+	if (useZfs) {
+		importDataset(roomName, pipeline);
+	} else {
+		importDirectory(roomName, pipeline);
+	}
+}
 
-	Subprocess p;
-	p.execute("/sbin/zfs", { "receive", snapPath });
-	if (p.waitForExit() != 0) {
-		std::cerr << "command failed: zfs receive" << endl;
-		exit(1);
+// A received room must be exactly <dataset> and <dataset>/share, mounted
+// where they inherit, with setuid and devices turned off
+void RoomManager::checkImportedDataset(const string& dataset)
+{
+	int status;
+	string output;
+	Shell::execute("/sbin/zfs", { "get", "-H", "-r", "-t", "filesystem,volume",
+			"-o", "name,property,value,source", "type,mountpoint,setuid,devices", dataset },
+			status, output);
+	if (status != 0) {
+		throw std::runtime_error("unable to check the imported dataset");
 	}
 
-	Shell::execute("/sbin/zfs", { "destroy", snapPath + "@" + snapName }, result);
+	std::set<string> names;
+	std::istringstream lines(output);
+	string line;
+	while (std::getline(lines, line)) {
+		std::vector<string> fields;
+		std::istringstream iss(line);
+		string field;
+		while (std::getline(iss, field, '\t')) {
+			fields.push_back(field);
+		}
+		if (fields.size() != 4) {
+			throw std::runtime_error("unexpected output from zfs get: " + line);
+		}
+		const string& name = fields[0];
+		const string& property = fields[1];
+		const string& value = fields[2];
+		const string& source = fields[3];
+		if (name != dataset && name != dataset + "/share") {
+			throw std::runtime_error("the archive contains an unexpected dataset: " + name);
+		}
+		names.insert(name);
+		bool ok;
+		if (property == "type") {
+			ok = (value == "filesystem");
+		} else if (property == "mountpoint") {
+			ok = (source.compare(0, 14, "inherited from") == 0 || source == "default");
+		} else {
+			ok = (value == "off");
+		}
+		if (!ok) {
+			throw std::runtime_error("the archive sets " + property + "=" + value + " on " + name);
+		}
+	}
+	if (names.size() != 2) {
+		throw std::runtime_error("the archive does not contain a room");
+	}
+}
+
+void RoomManager::importDataset(const string& roomName, StreamPipeline& pipeline)
+{
+	// Receive into a hidden dataset, so a partial stream never shows up as a room.
+	// zfs receive verifies the checksums in the stream, and zstd verifies each frame.
+	string dataset = getUserRoomDataset() + "/" + roomName;
+	string tmpDataset = getUserRoomDataset() + "/.import-" + roomName;
+
+	// The stream is not trusted: it may not choose where it is mounted, and
+	// nothing in it may act as a setuid program or a device on the host
+	pipeline.addCommand("/sbin/zfs", { "receive", "-u", "-F",
+			"-x", "mountpoint", "-o", "setuid=off", "-o", "devices=off",
+			tmpDataset }, true);
+
+	int result;
+	try {
+		pipeline.run();
+		PrivilegeGuard privileges;
+		checkImportedDataset(tmpDataset);
+	} catch (...) {
+		{
+			PrivilegeGuard privileges;
+			Shell::execute("/sbin/zfs", { "destroy", "-r", tmpDataset }, result);
+		}
+		throw;
+	}
+
+	{
+		PrivilegeGuard privileges;
+		Shell::execute("/sbin/zfs", { "rename", tmpDataset, dataset }, result);
+		if (result == 0) {
+			Shell::execute("/sbin/zfs", { "mount", dataset }, result);
+		}
+		if (result == 0) {
+			Shell::execute("/sbin/zfs", { "mount", dataset + "/share" }, result);
+		}
+	}
 	if (result != 0) {
-		std::cerr << "failed to destroy snapshot: " << snapName << endl;
-		exit(1);
+		throw std::runtime_error("unable to move the imported dataset into place");
+	}
+
+	// Remove the snapshot that was created by the export
+	string snapPath = Shell::popen_readline("/sbin/zfs list -H -t snapshot -o name -d 1 " + dataset +
+			" | grep '@export-' | tail -1");
+	if (snapPath != "") {
+		{
+			PrivilegeGuard privileges;
+			Shell::execute("/sbin/zfs", { "destroy", "-d", "-r", snapPath }, result);
+		}
+		if (result != 0) {
+			log_warning("unable to destroy the export snapshot %s", snapPath.c_str());
+		}
+	}
+}
+
+// Give <dirFd> and everything below it to <uid>:<gid>, without following
+// symlinks. Consumes <dirFd>.
+static void chown_tree(int dirFd, uid_t uid, gid_t gid)
+{
+	DIR *dir = fdopendir(dirFd);
+	if (!dir) {
+		int saved_errno = errno;
+		(void) close(dirFd);
+		throw std::system_error(saved_errno, std::system_category());
+	}
+	try {
+		if (fchown(dirFd, uid, gid) < 0) {
+			throw std::system_error(errno, std::system_category());
+		}
+		struct dirent *ent;
+		while ((ent = readdir(dir)) != NULL) {
+			if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+				continue;
+			}
+			struct stat sb;
+			if (fstatat(dirFd, ent->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+				throw std::system_error(errno, std::system_category());
+			}
+			if (S_ISDIR(sb.st_mode)) {
+				int fd = openat(dirFd, ent->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+				if (fd < 0) {
+					throw std::system_error(errno, std::system_category());
+				}
+				chown_tree(fd, uid, gid);
+			} else if (fchownat(dirFd, ent->d_name, uid, gid, AT_SYMLINK_NOFOLLOW) < 0) {
+				throw std::system_error(errno, std::system_category());
+			}
+		}
+	} catch (...) {
+		(void) closedir(dir);
+		throw;
+	}
+	(void) closedir(dir);
+}
+
+// Give the room's own files at <roomPath> to <uid>:<gid>
+static void chown_room_files(const string& roomPath, uid_t uid, gid_t gid)
+{
+	int roomFd = FileUtil::openDirectory(roomPath);
+	try {
+		if (fchown(roomFd, uid, gid) < 0) {
+			throw std::system_error(errno, std::system_category());
+		}
+		for (const char *name : { "share", "local" }) {
+			if (fchownat(roomFd, name, uid, gid, AT_SYMLINK_NOFOLLOW) < 0) {
+				throw std::system_error(errno, std::system_category());
+			}
+		}
+		for (const char *name : { "etc", "tags" }) {
+			int fd = openat(roomFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (fd < 0) {
+				if (errno == ENOENT) {
+					continue;
+				}
+				throw std::system_error(errno, std::system_category());
+			}
+			chown_tree(fd, uid, gid);
+		}
+	} catch (const std::system_error& e) {
+		log_error("unable to change the owner of %s: %s", roomPath.c_str(), e.what());
+		(void) close(roomFd);
+		throw;
+	}
+	(void) close(roomFd);
+}
+
+void RoomManager::importDirectory(const string& roomName, StreamPipeline& pipeline)
+{
+	// Extract next to the final location, and rename(2) it into place once
+	// tar has finished, so a partial archive never shows up as a room
+	string roomPath = getUserRoomDir() + "/" + roomName;
+	string tmpPath = getUserRoomDir() + "/.import-" + roomName;
+	int result;
+
+	// The archive is not trusted, so tar runs as the root of a room that
+	// has not been idmapped: it can only create files that the owner and
+	// the room's own ids may have, and setuid bits only refer to those.
+	Shell::execute("/bin/rm", { "-rf", tmpPath }, result);
+	int usernsFd = -1;
+	{
+		PrivilegeGuard privileges;
+		FileUtil::mkdir_idempotent(tmpPath, 0700, ownerUid, ownerGid);
+		usernsFd = Container::create(tmpPath + "/share/root")->openStorageNamespace(ownerUid);
+	}
+	if (usernsFd < 0) {
+		throw std::runtime_error("importing a room requires user namespaces");
+	}
+
+	pipeline.addNamespacedCommand(StreamPipeline::findTar(), {
+			"-C", tmpPath,
+			"--extract", "--file=-",
+			"--numeric-owner", "--same-permissions",
+			"--acls", "--xattrs" }, usernsFd);
+	try {
+		pipeline.run();
+	} catch (...) {
+		(void) close(usernsFd);
+		{
+			PrivilegeGuard privileges;
+			Shell::execute("/bin/rm", { "-rf", tmpPath }, result);
+		}
+		throw;
+	}
+	(void) close(usernsFd);
+
+	// The room's own files belong to whoever imported it; the files
+	// inside the room keep the owners they had in the archive
+	bool moved = false;
+	{
+		PrivilegeGuard privileges;
+		try {
+			chown_room_files(tmpPath, ownerUid, ownerGid);
+			if (rename(tmpPath.c_str(), roomPath.c_str()) < 0) {
+				log_errno("rename(2) of %s to %s", tmpPath.c_str(), roomPath.c_str());
+			} else {
+				moved = true;
+			}
+		} catch (const std::system_error&) {
+		}
+		if (!moved) {
+			Shell::execute("/bin/rm", { "-rf", tmpPath }, result);
+		}
+	}
+	if (!moved) {
+		throw std::runtime_error("unable to move the imported room into place");
 	}
 }
 
@@ -263,7 +587,73 @@ void RoomManager::destroyRoom(const string& name) {
 	room.destroy();
 }
 
-void RoomManager::enumerateRooms() {
+Trash RoomManager::getTrash()
+{
+	if (useZfs) {
+		return Trash(getUserRoomDir() + "/.trash", getUserRoomDataset() + "/.trash");
+	} else {
+		return Trash(getUserRoomDir() + "/.trash");
+	}
+}
+
+void RoomManager::collectGarbage(bool statusOnly)
+{
+	Trash trash = getTrash();
+
+	PrivilegeGuard privileges;
+	if (statusOnly) {
+		auto entries = trash.list();
+		bool reclaiming = trash.isReclaiming();
+		privileges.lower();
+
+		time_t now = time(NULL);
+		for (auto& entry : entries) {
+			cout << std::left << std::setw(30) << entry.roomName << " destroyed "
+					<< (now - entry.destroyedAt) << "s ago" << endl;
+		}
+		cout << entries.size() << " room(s) awaiting reclamation; the reclaimer is "
+				<< (reclaiming ? "running" : "idle") << endl;
+		return;
+	}
+
+	bool ran = trash.reclaim();
+	privileges.lower();
+	if (!ran) {
+		cout << "another process is already reclaiming the trash" << endl;
+	}
+}
+
+void RoomManager::manageNetworkPool(unsigned int size)
+{
+#ifndef __linux__
+	throw std::runtime_error("private networks are only supported on Linux");
+#else
+	NetnsPool pool;
+
+	std::vector<NetnsPool::Entry> entries;
+	{
+		PrivilegeGuard privileges;
+		if (size > 0) {
+			pool.fill(size);
+		}
+		entries = pool.list();
+	}
+
+	unsigned int available = 0;
+	for (auto& entry : entries) {
+		cout << std::left << std::setw(6) << entry.index
+				<< std::setw(16) << NetnsPool::getRoomAddress(entry.index)
+				<< (entry.owner == "" ? "free" : entry.owner) << endl;
+		if (entry.owner == "") {
+			available++;
+		}
+	}
+	cout << entries.size() << " network namespace(s), " << available << " free" << endl;
+#endif
+}
+
+void RoomManager::enumerateRooms(std::function<void(Room&)> visit) {
+	std::lock_guard<std::recursive_mutex> guard(roomsMutex);
 	DIR* dir;
 	struct dirent* dp;
 
@@ -281,40 +671,160 @@ void RoomManager::enumerateRooms() {
 		throw std::system_error(saved_errno, std::system_category());
 	}
 
-	std::vector<string> roomVec;
-	while ((dp = readdir(dir)) != NULL) {
-		if (dp->d_name[0] == '.') {
-			continue;
+	try {
+		while ((dp = readdir(dir)) != NULL) {
+			if (dp->d_name[0] == '.') {
+				continue;
+			}
+
+			string roomName = string(dp->d_name);
+
+			auto it = rooms.find(roomName);
+			if (it == rooms.end()) {
+				std::unique_ptr<Room> r(new Room(roomDir, roomName));
+				r->loadRoomOptions();
+				it = rooms.insert(std::make_pair(roomName, std::move(r))).first;
+			}
+
+			if (visit) {
+				visit(*it->second);
+			}
 		}
+	} catch (...) {
+		closedir(dir);
+		throw;
+	}
+	closedir(dir);
+}
 
-		string roomName = string(dp->d_name);
+int RoomManager::execInRooms(const string& pattern, std::vector<std::string> execVec,
+		const string& runAsUser, unsigned int parallelism)
+{
+	FanoutExec fanout(parallelism);
+	int threshold = verbose ? LOG_DEBUG : LOG_INFO;
 
-		auto it = rooms.find(roomName);
-		if (it != rooms.end()) {
+	// Resolve the set of rooms once, rather than once per room
+	std::unique_lock<std::recursive_mutex> guard(roomsMutex);
+	enumerateRooms();
+	for (auto& it : rooms) {
+		Room* room = it.second.get();
+		if (room->getRoomOptions().isHidden) {
+			continue;
+		}
+		if (fnmatch(pattern.c_str(), it.first.c_str(), 0) != 0) {
 			continue;
 		}
+		fanout.add(it.first, [=]() {
+			room->openLog(threshold);
+			return room->exec(execVec, runAsUser);
+		});
+	}
+	guard.unlock();
+	if (fanout.empty()) {
+		throw std::runtime_error("no rooms match " + pattern);
+	}
 
-		Room* r = new Room(roomDir, roomName);
-		r->loadRoomOptions();
-		rooms.insert(std::make_pair(roomName, r));
+	return fanout.run();
+}
+
+void RoomManager::monitorIdleRooms()
+{
+	IdleMonitor monitor;
+
+	monitor.run([this]() {
+		std::vector<Room*> result;
+
+		// Pick up new rooms and policy changes on every pass
+		std::lock_guard<std::recursive_mutex> guard(roomsMutex);
+		enumerateRooms();
+		for (auto& it : rooms) {
+			Room* room = it.second.get();
+			try {
+				room->loadRoomOptions();
+				if (room->getRoomOptions().idleFreezeAfter > 0 && room->isRunning()) {
+					result.push_back(room);
+				}
+			} catch (const std::exception& e) {
+				log_debug("skipping room `%s': %s", it.first.c_str(), e.what());
+			}
+		}
+		return result;
+	});
+}
+
+void RoomManager::measureDiskUsage(const string& name,
+		std::function<void(const string& room, const DiskUsage::Usage& usage)> callback)
+{
+	std::lock_guard<std::recursive_mutex> guard(roomsMutex);
+	enumerateRooms();
+	if (name != "" && rooms.count(name) == 0) {
+		throw std::runtime_error("Room " + name + " does not exist");
 	}
-	closedir(dir);
+
+	// One query covers every room on ZFS
+	std::map<string, std::vector<DiskUsage::Usage>> zfsUsage;
+	if (useZfs) {
+		zfsUsage = DiskUsage::measureZfs(getUserRoomDataset());
+	}
+
+	for (auto& it : rooms) {
+		if (name != "" && it.first != name) {
+			continue;
+		}
+		auto usage = useZfs ? zfsUsage[it.first] : it.second->measureDiskUsage();
+		for (auto& u : usage) {
+			callback(it.first, u);
+		}
+	}
+}
+
+void RoomManager::watchEvents(RoomEventMonitor::Callback callback)
+{
+#ifndef __linux__
+	(void) callback;
+	throw std::runtime_error("room events are only supported on Linux");
+#else
+	RoomEventMonitor monitor(getUserRoomDir());
+	monitor.run(callback);
+#endif
 }
 
-void RoomManager::listRooms() {
+void RoomManager::listRooms(RecordWriter& writer) {
+	std::lock_guard<std::recursive_mutex> guard(roomsMutex);
+
+	// All rooms share one parent dataset, so read the origins of its
+	// datasets once for the whole listing
+	std::map<string, string> origins;
+	bool haveOrigins = false;
+	auto printRoom = [&](Room& room) {
+		if (room.getRoomOptions().isHidden) {
+			return;
+		}
+		if (!haveOrigins && writer.wants("depth")) {
+			origins = room.getDatasetOrigins();
+			haveOrigins = true;
+		}
+		room.printStatus(writer, origins);
+	};
+
+	// Machine readable output is written in directory order as each room
+	// is loaded.
+	if (writer.getFormat() != RecordWriter::FORMAT_TEXT) {
+		enumerateRooms(printRoom);
+		return;
+	}
+
 	enumerateRooms();
 
 	// Generate a sorted list of room names
 	std::vector<string> room_names;
-	for (auto room : rooms) {
-		if (! room.second->getRoomOptions().isHidden) {
-			room_names.push_back(room.first);
-		}
+	for (auto& room : rooms) {
+		room_names.push_back(room.first);
 	}
 	std::sort(room_names.begin(), room_names.end());
 
 	for (string& s : room_names) {
-		cout << s << endl;
+		printRoom(*rooms[s]);
 	}
 }
 
@@ -375,7 +885,7 @@ void RoomManager::openConfigHome()
 		fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_DIRECTORY | O_CLOEXEC);
 		if (fd < 0) {
 			if (errno == ENOENT) {
-				if (mkdir(path.c_str(), 0700) < 0) {
+				if (mkdir(path.c_str(), 0700) < 0 && errno != EEXIST) {
 					log_errno("mkdir(2) of %s", path.c_str());
 					throw std::system_error(errno, std::system_category());
 				} else {
@@ -390,13 +900,7 @@ void RoomManager::openConfigHome()
 		}
 	}
 
-	/* Prevent a single user from running multiple instances of room(1) concurrently */
-	// TODO: we probably should lock globally, not per-user
-	if (flock(fd, LOCK_EX) < 0) {
-		log_errno("flock(2)");
-		throw std::system_error(errno, std::system_category());
-	}
-
+	// Concurrent commands are kept apart by the per-room locks of LockManager
 	config_home_fd = fd;
 }
 
@@ -419,6 +923,7 @@ void RoomManager::installRoom(const string& name, const string& archive, const R
 	rip.installRoot = getUserRoomDir();
 	rip.baseArchiveUri = archive;
 	rip.options = roomOptions;
+	rip.options.merge(options);
 
 	Room::install(rip);
 }
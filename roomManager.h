@@ -16,10 +16,15 @@
 
 #pragma once
 
+#include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
 
 #include "namespaceImport.h"
+#include "DiskUsage.hpp"
 #include "passwdEntry.h"
+#include "RoomEventMonitor.hpp"
 #include "roomOptions.h"
 #include "setuidHelper.h"
 #include "zfsPool.h"
@@ -28,7 +33,23 @@ extern FILE *logfile;
 #include "logger.h"
 
 #include "roomManagerUserOptions.h"
+#include "Trash.hpp"
 
+class RecordWriter;
+class StreamPipeline;
+
+// Manages the rooms of the user who is running the program. This is what
+// room(1) is built on, and it is also built as a library, librooms.a, for
+// programs that manage rooms without running room(1).
+//
+// Call SetuidHelper::checkPrivileges() and lowerPrivileges() before
+// creating one. Errors are reported as exceptions. Privileges belong to the
+// whole process: SetuidHelper lets one thread at a time raise them, and
+// while they are raised every other thread runs with them too. So threads
+// may share a RoomManager, but privileged work is serialized, and a thread
+// must not rely on privileges being lowered while another thread uses it.
+// Room::exec() and Room::enter() move the calling process into the room,
+// so use Room::forkAndExec() in long-lived programs.
 class RoomManager {
 public:
 	RoomManager() {
@@ -47,15 +68,43 @@ public:
 	bool doesBaseTemplateExist();
 	void createBaseTemplate();
 	void installRoom(const string& name, const string& archive, const RoomOptions& options);
-	void importRoom(const string& name);
+	// Create a room from an archive made by Room::exportArchive()
+	void importRoom(const string& name, int infd, bool showProgress);
 	void createRoom(const string& name);
 	void cloneRoom(const string& dest, const RoomOptions& roomOpt);
+	// Create <count> clones of the template room, named <prefix>-<n> with <n>
+	// zero-padded to the width of <count>
+	void cloneRooms(const string& prefix, unsigned int count, const RoomOptions& roomOpt);
 	//void cloneRoomFromRemote(const string& name, const string& uri);
 	void receiveRoom(const string& name);
 	void destroyRoom(const string& name);
+	// Free the space used by destroyed rooms, or just report on it
+	void collectGarbage(bool statusOnly);
+	// Fill the pool of network namespaces up to <size> free ones, and show it
+	void manageNetworkPool(unsigned int size);
 	Room& getRoomByName(const string& name);
 	bool checkRoomExists(const string&);
-	void listRooms();
+	// Write a record for each room. Text output is sorted and leaves out
+	// hidden rooms; JSON output is streamed and includes them.
+	void listRooms(RecordWriter& writer);
+
+	// Run a command in every room whose name matches the glob <pattern>,
+	// with up to <parallelism> rooms at a time. Returns 0 if it succeeded
+	// everywhere.
+	int execInRooms(const string& pattern, std::vector<std::string> execVec,
+			const string& runAsUser, unsigned int parallelism);
+
+	// Freeze idle rooms according to their idle policy. Does not return.
+	void monitorIdleRooms();
+
+	// Call <callback> with the space used by the room named <name>, or by
+	// every room if <name> is empty, and by their snapshots
+	void measureDiskUsage(const string& name,
+			std::function<void(const string& room, const DiskUsage::Usage& usage)> callback);
+
+	// Call <callback> whenever a room is created, started, stopped, etc.
+	// Does not return. See RoomEventMonitor for the events.
+	void watchEvents(RoomEventMonitor::Callback callback);
 
 	void parseConfig();
 
@@ -65,11 +114,10 @@ public:
 
 	void setVerbose(bool verbose = false) {
 		this->verbose = verbose;
-		fclose(logfile);
 		if (verbose) {
-			logfile = stderr;
+			log_set_console(stderr, LOG_DEBUG);
 		} else {
-			logfile = fopen("/dev/null", "w");
+			log_set_console(NULL, -1);
 		}
 	}
 
@@ -79,7 +127,8 @@ public:
 	}
 
 private:
-	std::map<std::string, Room*> rooms;
+	std::map<std::string, std::unique_ptr<Room>> rooms;
+	std::recursive_mutex roomsMutex; // protects <rooms>
 	bool verbose = false;
 	bool useZfs;
 	uid_t ownerUid;
@@ -93,10 +142,16 @@ private:
 	string baseUri = "http://ftp.freebsd.org/pub/FreeBSD/releases/amd64/10.2-RELEASE/base.txz";
 	string roomDir = "/room";
 
-	void enumerateRooms();
+	// Load any rooms that are not in <rooms> yet, and call <visit> on
+	// every room as it is found
+	void enumerateRooms(std::function<void(Room&)> visit = nullptr);
 	void createRoomDir();
 	string getUserRoomDir();
 	string getUserRoomDataset();
+	Trash getTrash();
+	void importDataset(const string& name, StreamPipeline& pipeline);
+	void checkImportedDataset(const string& dataset);
+	void importDirectory(const string& name, StreamPipeline& pipeline);
 	string getRoomPathByName(const string& name);
 
 	// templates
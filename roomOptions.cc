@@ -41,11 +41,14 @@ void RoomOptions::load(const string &path)
 	allowX11Clients = tree.get("permissions.allowX11Clients", false);
 	shareTempDir = tree.get("permissions.shareTempDir", false);
 	shareHomeDir = tree.get("permissions.shareHomeDir", false);
+	network = tree.get("network.mode", "host");
 	kernelABI = tree.get("abi.kernel", "FreeBSD");
 	isHidden = tree.get("display.isHidden", false);
 	templateUri = tree.get("template.uri", "");
 	templateSnapshot = tree.get("template.snapshot", "");
 	originUri = tree.get("remotes.origin", "");
+	idleFreezeAfter = tree.get("idle.freezeAfter", 0U);
+	idleCpuPercent = tree.get("idle.cpuPercent", 1.0);
 
 	UuidGenerator ug;
 	ug.setValue(tree.get("uuid", "4328e12e-ab2a-4a28-8585-d33b42a77b83"));
@@ -65,11 +68,14 @@ void RoomOptions::save(const string &path)
     tree.put("permissions.allowX11Clients", allowX11Clients);
     tree.put("permissions.shareTempDir", shareTempDir);
     tree.put("permissions.shareHomeDir", shareHomeDir);
+    tree.put("network.mode", network);
     tree.put("uuid", uuid);
     tree.put("display.isHidden", isHidden);
    	tree.put("template.uri", templateUri);
    	tree.put("template.snapshot", templateSnapshot);
    	tree.put("remotes.origin", originUri);
+   	tree.put("idle.freezeAfter", idleFreezeAfter);
+   	tree.put("idle.cpuPercent", idleCpuPercent);
 
     pt::write_json(path, tree);
 }
@@ -102,4 +108,7 @@ void RoomOptions::merge(const struct RoomOptions& src)
 	if (src.shareHomeDir) {
 		shareHomeDir = true;
 	}
+	if (src.network != "host") {
+		network = src.network;
+	}
 }
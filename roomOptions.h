@@ -33,6 +33,10 @@ struct RoomOptions {
 	// share $HOME with the main system
 	bool shareHomeDir = false;
 
+	// "host" to share the network stack of the main system, or "private"
+	// to get a network namespace of its own from the pool
+	string network = "host";
+
 	// what Kernel ABI the room uses (e.g. Linux, FreeBSD)
 	string kernelABI;
 
@@ -54,6 +58,13 @@ struct RoomOptions {
 	// you to push/pull changes to/from a remote server
 	string originUri;
 
+	// Freeze the room after it has been idle for this many seconds.
+	// Zero means never. Only "room idle-monitor" acts on this.
+	unsigned int idleFreezeAfter = 0;
+
+	// The room counts as idle while it uses less than this percentage of one CPU
+	double idleCpuPercent = 1.0;
+
 	void load(const string& path);
 	void save(const string& path);
 	void save();
@@ -23,6 +23,12 @@
 #include <sys/stat.h>
 #include <grp.h>
 
+#include <cstdlib>
+
+extern "C" {
+#include <pthread.h>
+}
+
 
 #include "namespaceImport.h"
 #include "logger.h"
@@ -51,42 +57,93 @@ static void debugPrintUid() {
 	}
 }
 
-void SetuidHelper::raisePrivileges() {
-	debugPrintUid();
+// Credentials belong to the whole process, so only one thread may have
+// privileges raised at a time. The thread that raised them holds this lock
+// until it lowers them again.
+static pthread_mutex_t privilegeLock = PTHREAD_MUTEX_INITIALIZER;
+static thread_local bool holdsPrivileges = false;
+// Set once the privileges that the process started with have been lowered
+static bool everLowered = false;
 
-	if (isDroppedPrivs) {
-		errx(1, "privileges are dropped");
+static void lockPrivileges() {
+	(void) pthread_mutex_lock(&privilegeLock);
+}
+
+static void unlockPrivileges() {
+	(void) pthread_mutex_unlock(&privilegeLock);
+}
+
+static void forkPrepare() {
+	if (!holdsPrivileges) {
+		lockPrivileges();
 	}
+}
 
-	if (!isInitialized) {
-		errx(1, "must call checkPrivileges() first");
+static void forkParent() {
+	if (!holdsPrivileges) {
+		unlockPrivileges();
 	}
+}
 
-	if (!isLoweredPrivs) {
-		errx(1, "privileges are not currently lowered");
+// The lock records its owner by thread ID, which a forked child does not
+// share, so the child starts with a new lock, held only if its one thread
+// had privileges raised.
+static void forkChild() {
+	(void) pthread_mutex_init(&privilegeLock, NULL);
+	if (holdsPrivileges) {
+		lockPrivileges();
 	}
+}
 
-	saved_umask = umask(S_IWGRP|S_IWOTH);
+void SetuidHelper::raisePrivileges() {
+	debugPrintUid();
 
-	if (debugModule) {
-		log_debug("raising privileges");
+	if (holdsPrivileges) {
+		throw std::logic_error("privileges are not currently lowered");
 	}
 
-	if (setresuid(0, 0, 0) < 0) {
-		err(1, "setresuid(2)");
-	}
+	lockPrivileges();
+	try {
+		if (isDroppedPrivs) {
+			throw std::logic_error("privileges are dropped");
+		}
 
-	if (setresgid(0, 0, 0) < 0) {
-		err(1, "setresgid(2)");
-	}
+		if (!isInitialized) {
+			throw std::logic_error("must call checkPrivileges() first");
+		}
+
+		if (!isLoweredPrivs) {
+			throw std::logic_error("privileges are not currently lowered");
+		}
 
-	if (geteuid() != 0) {
-		errx(1, "unable to regain priviliges");
+		saved_umask = umask(S_IWGRP|S_IWOTH);
+
+		if (debugModule) {
+			log_debug("raising privileges");
+		}
+
+		if (setresuid(0, 0, 0) < 0) {
+			log_errno("setresuid(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+
+		if (setresgid(0, 0, 0) < 0) {
+			log_errno("setresgid(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+
+		if (geteuid() != 0) {
+			throw std::runtime_error("unable to regain privileges");
+		}
+	} catch (...) {
+		unlockPrivileges();
+		throw;
 	}
 
 	debugPrintUid();
 
 	isLoweredPrivs = false;
+	holdsPrivileges = true;
 }
 
 void SetuidHelper::lowerPrivileges() {
@@ -100,14 +157,24 @@ void SetuidHelper::lowerPrivileges() {
 		throw std::logic_error("privileges are dropped");
 	}
 
-	if (isLoweredPrivs) {
-		errx(1, "privileges already lowered");
+	// Only the first call after checkPrivileges() may lower privileges
+	// that this thread did not raise
+	if (!holdsPrivileges) {
+		if (everLowered) {
+			throw std::logic_error("privileges already lowered");
+		}
+		// Keep other threads from forking in the middle of a privileged
+		// section, which would leave the child with credentials that
+		// nobody will lower
+		(void) pthread_atfork(forkPrepare, forkParent, forkChild);
 	}
 
 	if (debugModule) {
 		log_debug("lowering privileges (current: uid=%d, euid=%d)", getuid(), geteuid());
 	}
 
+	// If any of these fail, privileges are still raised, so the lock
+	// stays with this thread
 	// TODO: should call getgroups(3) to save the current grouplist,
 	//    and restore the privileges later
 	if (setgroups(0, NULL) < 0) {
@@ -126,8 +193,12 @@ void SetuidHelper::lowerPrivileges() {
 
 	(void) umask(saved_umask);
 
-
 	isLoweredPrivs = true;
+	everLowered = true;
+	if (holdsPrivileges) {
+		holdsPrivileges = false;
+		unlockPrivileges();
+	}
 }
 
 void SetuidHelper::dropPrivileges() {
@@ -139,8 +210,14 @@ void SetuidHelper::dropPrivileges() {
 		throw std::logic_error("privileges are already dropped");
 	}
 
-	if (isLoweredPrivs) {
-		raisePrivileges();
+	// Wait for any other thread's privileged section to end
+	if (!holdsPrivileges) {
+		if (everLowered) {
+			raisePrivileges();
+		} else {
+			lockPrivileges();
+			holdsPrivileges = true;
+		}
 	}
 
 	log_debug("dropping privileges (current: uid=%d, euid=%d)", getuid(), geteuid());
@@ -163,6 +240,8 @@ void SetuidHelper::dropPrivileges() {
 	debugPrintUid();
 	isLoweredPrivs = false;
 	isDroppedPrivs = true;
+	holdsPrivileges = false;
+	unlockPrivileges();
 }
 
 void SetuidHelper::checkPrivileges() {
@@ -209,3 +288,21 @@ void SetuidHelper::logPrivileges()
 	debugModule = saved;
 }
 
+PrivilegeGuard::~PrivilegeGuard()
+{
+	// Carrying on with privileges that cannot be lowered is not safe
+	try {
+		lower();
+	} catch (const std::exception& e) {
+		log_error("unable to lower privileges: %s", e.what());
+		abort();
+	}
+}
+
+void PrivilegeGuard::lower()
+{
+	if (raised) {
+		SetuidHelper::lowerPrivileges();
+		raised = false;
+	}
+}
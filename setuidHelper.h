@@ -19,6 +19,10 @@
 #include <exception>
 #include <unistd.h>
 
+// Errors are thrown as exceptions. Only one thread at a time can have
+// privileges raised; the others wait for it to lower them, since
+// credentials are shared by the whole process. Raising privileges that are
+// already raised, or lowering them twice, is an error.
 class SetuidHelper {
 public:
 	static void lowerPrivileges();
@@ -28,3 +32,21 @@ public:
 	static void logPrivileges();
 	static uid_t getActualUid();
 };
+
+// Raises privileges for as long as it is in scope, and lowers them again
+// when it goes out of scope, including when an exception is thrown.
+class PrivilegeGuard {
+public:
+	PrivilegeGuard() {
+		SetuidHelper::raisePrivileges();
+	}
+	~PrivilegeGuard();
+	PrivilegeGuard(const PrivilegeGuard&) = delete;
+	PrivilegeGuard& operator=(const PrivilegeGuard&) = delete;
+
+	// Lower privileges before the end of the scope
+	void lower();
+
+private:
+	bool raised = true;
+};
@@ -33,10 +33,9 @@ extern "C" {
 #include <sys/wait.h>
 #include <sys/uio.h>
 #include <unistd.h>
+}
 
-static FILE *logfile;
 #include "logger.h"
-}
 
 using std::cout;
 using std::cin;
@@ -138,6 +137,7 @@ void Subprocess::execute(const char *path, const std::vector<std::string>& args)
 		throw std::runtime_error("fork failed");
 	}
 
+	log_flush();
 	pid = fork();
 	if (pid < 0) {
 		log_errno("fork(2)");
@@ -208,6 +208,7 @@ void Subprocess::execve(const char* path, const std::vector<std::string>& args)
 			NULL
 	};
 
+	log_flush();
 	if (::execve(path, argv.data(), envp) < 0) {
 		log_errno("execve(2)");
 		throw std::runtime_error("execve failed");
@@ -105,6 +105,7 @@ public:
 			throw std::runtime_error("fork failed");
 		}
 
+		log_flush();
 		pid_t pid = fork();
 		if (pid < 0) {
 			log_errno("fork(2)");
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+// A High Dynamic Range histogram: values are recorded into log-linear
+// buckets, so every recorded value keeps a fixed number of significant
+// decimal digits regardless of magnitude. Layout and indexing follow
+// the reference HdrHistogram implementation.
+class HdrHistogram {
+public:
+	HdrHistogram(int64_t highestTrackableValue, int significantFigures) {
+		if (significantFigures < 1 || significantFigures > 5) {
+			throw std::invalid_argument("significantFigures must be 1..5");
+		}
+		if (highestTrackableValue < 2) {
+			throw std::invalid_argument("highestTrackableValue too small");
+		}
+		this->highestTrackableValue = highestTrackableValue;
+
+		int64_t largestValueWithSingleUnitResolution = 2 * (int64_t) std::pow(10, significantFigures);
+		int subBucketCountMagnitude = (int) std::ceil(std::log2((double) largestValueWithSingleUnitResolution));
+		subBucketHalfCountMagnitude = std::max(subBucketCountMagnitude, 1) - 1;
+		subBucketCount = 1 << (subBucketHalfCountMagnitude + 1);
+		subBucketHalfCount = subBucketCount / 2;
+		subBucketMask = (int64_t) subBucketCount - 1;
+
+		int64_t smallestUntrackableValue = (int64_t) subBucketCount;
+		int bucketsNeeded = 1;
+		while (smallestUntrackableValue <= highestTrackableValue) {
+			if (smallestUntrackableValue > INT64_MAX / 2) {
+				bucketsNeeded++;
+				break;
+			}
+			smallestUntrackableValue <<= 1;
+			bucketsNeeded++;
+		}
+		bucketCount = bucketsNeeded;
+		counts.assign((bucketCount + 1) * subBucketHalfCount, 0);
+	}
+
+	void recordValue(int64_t value) {
+		if (value < 0) {
+			throw std::invalid_argument("negative value");
+		}
+		if (value > highestTrackableValue) {
+			value = highestTrackableValue;
+		}
+		counts[countsIndexFor(value)]++;
+		totalCount++;
+		sum += value;
+		minValue = std::min(minValue, value);
+		maxValue = std::max(maxValue, value);
+	}
+
+	void add(const HdrHistogram& other) {
+		if (other.counts.size() != counts.size()) {
+			throw std::invalid_argument("incompatible histograms");
+		}
+		for (size_t i = 0; i < counts.size(); i++) {
+			counts[i] += other.counts[i];
+		}
+		totalCount += other.totalCount;
+		sum += other.sum;
+		minValue = std::min(minValue, other.minValue);
+		maxValue = std::max(maxValue, other.maxValue);
+	}
+
+	int64_t valueAtPercentile(double percentile) const {
+		if (totalCount == 0) {
+			return 0;
+		}
+		percentile = std::min(std::max(percentile, 0.0), 100.0);
+		int64_t target = (int64_t) (percentile / 100.0 * totalCount + 0.5);
+		target = std::max(target, (int64_t) 1);
+
+		int64_t cumulative = 0;
+		for (size_t i = 0; i < counts.size(); i++) {
+			cumulative += counts[i];
+			if (cumulative >= target) {
+				return std::min(highestEquivalentValue(valueFromIndex(i)), maxValue);
+			}
+		}
+		return maxValue;
+	}
+
+	int64_t getTotalCount() const { return totalCount; }
+	int64_t getMax() const { return totalCount ? maxValue : 0; }
+	int64_t getMin() const { return totalCount ? minValue : 0; }
+	double getMean() const { return totalCount ? (double) sum / totalCount : 0.0; }
+
+private:
+	int64_t highestTrackableValue;
+	int subBucketHalfCountMagnitude;
+	int subBucketCount;
+	int subBucketHalfCount;
+	int64_t subBucketMask;
+	int bucketCount;
+	std::vector<int64_t> counts;
+	int64_t totalCount = 0;
+	int64_t sum = 0;
+	int64_t minValue = INT64_MAX;
+	int64_t maxValue = 0;
+
+	int bucketIndexFor(int64_t value) const {
+		int pow2Ceiling = 64 - __builtin_clzll((uint64_t) (value | subBucketMask));
+		return pow2Ceiling - (subBucketHalfCountMagnitude + 1);
+	}
+
+	size_t countsIndexFor(int64_t value) const {
+		int bucketIndex = bucketIndexFor(value);
+		int subBucketIndex = (int) (value >> bucketIndex);
+		return ((size_t) (bucketIndex + 1) << subBucketHalfCountMagnitude)
+			+ (subBucketIndex - subBucketHalfCount);
+	}
+
+	int64_t valueFromIndex(size_t index) const {
+		int bucketIndex = (int) (index >> subBucketHalfCountMagnitude) - 1;
+		int subBucketIndex = (int) (index & (subBucketHalfCount - 1)) + subBucketHalfCount;
+		if (bucketIndex < 0) {
+			subBucketIndex -= subBucketHalfCount;
+			bucketIndex = 0;
+		}
+		return (int64_t) subBucketIndex << bucketIndex;
+	}
+
+	int64_t highestEquivalentValue(int64_t value) const {
+		int bucketIndex = bucketIndexFor(value);
+		int subBucketIndex = (int) (value >> bucketIndex);
+		int adjustedBucket = (subBucketIndex >= subBucketCount) ? bucketIndex + 1 : bucketIndex;
+		int64_t lowest = (int64_t) subBucketIndex << bucketIndex;
+		return lowest + ((int64_t) 1 << adjustedBucket) - 1;
+	}
+};
@@ -0,0 +1,470 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Latency benchmark for the room lifecycle.
+ *
+ * Drives the room(1) binary through create, clone, start, exec, stop and
+ * destroy <iterations> times using <concurrency> workers, and reports
+ * p50/p95/p99/max latency for each phase as JSON.
+ *
+ * The agent-exec phase runs the same command as the exec phase, but
+ * through an exec agent started beforehand, so the two can be compared
+ * to see the per-command cost of entering the room.
+ *
+ * When run as an ordinary user, the benchmark first enters a private
+ * user and mount namespace and pivots into a copy of the host tree
+ * with an empty /room, so no root privileges or host changes are needed.
+ * The namespace's ID maps are written with newuidmap(1) and newgidmap(1),
+ * because room(1) needs setgroups(2), which the kernel denies when an
+ * unprivileged process writes its own maps.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+extern "C" {
+#include <dirent.h>
+#include <err.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+}
+
+#include "json.hpp"
+#include "HdrHistogram.hpp"
+
+using std::string;
+using json = nlohmann::json;
+namespace po = boost::program_options;
+
+// Latencies are recorded in microseconds, up to one hour
+static const int64_t HIST_MAX_USEC = 3600LL * 1000 * 1000;
+static const int HIST_SIGFIGS = 3;
+
+static const std::vector<string> allPhases = {
+	"create", "clone", "start", "exec", "agent-exec", "stop", "destroy"
+};
+
+struct BenchOptions {
+	string roomPath = "room";
+	string archive;
+	string execCommand = "/bin/true";
+	std::vector<string> phases;
+	int iterations = 10;
+	int concurrency = 1;
+	unsigned int timeout = 120;
+	bool verbose = false;
+};
+
+struct PhaseStats {
+	PhaseStats() : hist(HIST_MAX_USEC, HIST_SIGFIGS) {}
+	HdrHistogram hist;
+	int64_t errors = 0;
+};
+
+static std::mutex statsMutex;
+static std::map<string, PhaseStats> stats;
+
+// Run "<tool> <pid> 0 <id> 1" to map <id> to root in the user namespace
+// of <pid>. Returns false if that fails.
+static bool writeIdMap(const char *tool, pid_t pid, unsigned int id)
+{
+	pid_t child = fork();
+	if (child < 0) err(1, "fork(2)");
+	if (child == 0) {
+		string pidStr = std::to_string(pid), idStr = std::to_string(id);
+		execlp(tool, tool, pidStr.c_str(), "0", idStr.c_str(), "1", (char *) NULL);
+		warn("%s", tool);
+		_exit(127);
+	}
+	int status;
+	if (waitpid(child, &status, 0) < 0) err(1, "waitpid(2)");
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Enter a private user+mount namespace and pivot into a tmpfs that
+// bind-mounts the host's top-level directories, plus an empty /room and
+// a private /root for ~/.room.
+static void enterSandbox()
+{
+	uid_t uid = getuid();
+	gid_t gid = getgid();
+
+	// The maps have to be written from outside the namespace, so a child
+	// does it once this process has unshared
+	int pipefd[2];
+	if (pipe(pipefd) < 0) err(1, "pipe(2)");
+	pid_t self = getpid();
+	pid_t helper = fork();
+	if (helper < 0) err(1, "fork(2)");
+	if (helper == 0) {
+		char c;
+		(void) close(pipefd[1]);
+		if (read(pipefd[0], &c, 1) != 1) _exit(1);
+		_exit(writeIdMap("newuidmap", self, uid) && writeIdMap("newgidmap", self, gid) ? 0 : 1);
+	}
+	(void) close(pipefd[0]);
+
+	if (unshare(CLONE_NEWUSER | CLONE_NEWNS) < 0) {
+		err(1, "unshare(2); are unprivileged user namespaces enabled?");
+	}
+	if (write(pipefd[1], "", 1) != 1) err(1, "write(2)");
+	(void) close(pipefd[1]);
+	int status;
+	if (waitpid(helper, &status, 0) < 0) err(1, "waitpid(2)");
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "unable to write the user namespace's ID maps; newuidmap(1) and newgidmap(1) are needed");
+	}
+
+	if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) < 0) {
+		err(1, "mount(2) of / as private");
+	}
+
+	char tmpl[] = "/tmp/room-bench.XXXXXX";
+	if (mkdtemp(tmpl) == NULL) err(1, "mkdtemp(3)");
+	string newroot = tmpl;
+	if (mount("tmpfs", newroot.c_str(), "tmpfs", 0, "mode=0755") < 0) {
+		err(1, "mount(2) of tmpfs");
+	}
+
+	DIR *dir = opendir("/");
+	if (!dir) err(1, "opendir(3)");
+	struct dirent *dp;
+	while ((dp = readdir(dir)) != NULL) {
+		string name = dp->d_name;
+		if (name == "." || name == ".." || name == "room") {
+			continue;
+		}
+		string src = "/" + name;
+		string dest = newroot + "/" + name;
+		struct stat sb;
+		if (lstat(src.c_str(), &sb) < 0) {
+			continue;
+		}
+		if (S_ISLNK(sb.st_mode)) {
+			char target[PATH_MAX];
+			ssize_t len = readlink(src.c_str(), target, sizeof(target) - 1);
+			if (len < 0) err(1, "readlink(2) of %s", src.c_str());
+			target[len] = '\0';
+			if (symlink(target, dest.c_str()) < 0) err(1, "symlink(2)");
+		} else if (S_ISDIR(sb.st_mode)) {
+			if (mkdir(dest.c_str(), 0755) < 0) err(1, "mkdir(2) of %s", dest.c_str());
+			if (name == "root") {
+				if (mount("tmpfs", dest.c_str(), "tmpfs", 0, "mode=0700") < 0) {
+					err(1, "mount(2) of %s", dest.c_str());
+				}
+			} else if (mount(src.c_str(), dest.c_str(), NULL, MS_BIND | MS_REC, NULL) < 0) {
+				err(1, "mount(2) of %s", src.c_str());
+			}
+		}
+	}
+	closedir(dir);
+
+	if (mkdir(string(newroot + "/room").c_str(), 0755) < 0) err(1, "mkdir(2)");
+
+	// Use pivot_root(2) rather than chroot(2), because the kernel does not
+	// allow a chrooted process to create the nested user namespaces that
+	// room(1) needs.
+	string oldroot = newroot + "/.oldroot";
+	if (mkdir(oldroot.c_str(), 0700) < 0) err(1, "mkdir(2) of %s", oldroot.c_str());
+	if (syscall(SYS_pivot_root, newroot.c_str(), oldroot.c_str()) < 0) err(1, "pivot_root(2)");
+	if (chdir("/") < 0) err(1, "chdir(2)");
+	if (umount2("/.oldroot", MNT_DETACH) < 0) err(1, "umount2(2)");
+	(void) rmdir("/.oldroot");
+	setenv("HOME", "/root", 1);
+}
+
+// Run room(1) with <args>, and return the elapsed time in microseconds,
+// or -1 if the command failed or did not finish within the timeout.
+static int64_t runRoom(const BenchOptions& opts, const std::vector<string>& args)
+{
+	std::vector<char*> argv;
+	argv.push_back(const_cast<char*>(opts.roomPath.c_str()));
+	for (auto& arg : args) {
+		argv.push_back(const_cast<char*>(arg.c_str()));
+	}
+	argv.push_back(NULL);
+
+	auto begin = std::chrono::steady_clock::now();
+	pid_t pid = fork();
+	if (pid < 0) err(1, "fork(2)");
+	if (pid == 0) {
+		// Never give room(1) a terminal, so exec does not allocate a pty
+		int fd = open("/dev/null", O_RDWR);
+		if (fd >= 0) {
+			dup2(fd, STDIN_FILENO);
+			if (!opts.verbose) {
+				dup2(fd, STDOUT_FILENO);
+				dup2(fd, STDERR_FILENO);
+			}
+		}
+		alarm(opts.timeout);
+		execvp(argv[0], argv.data());
+		_exit(127);
+	}
+	int status;
+	if (waitpid(pid, &status, 0) < 0) err(1, "waitpid(2)");
+	auto end = std::chrono::steady_clock::now();
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		return -1;
+	}
+	return std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
+}
+
+static void record(const string& phase, int64_t usec)
+{
+	std::lock_guard<std::mutex> lock(statsMutex);
+	PhaseStats& ps = stats[phase];
+	if (usec < 0) {
+		ps.errors++;
+	} else {
+		ps.hist.recordValue(usec);
+	}
+}
+
+static bool wantPhase(const BenchOptions& opts, const string& phase)
+{
+	return std::find(opts.phases.begin(), opts.phases.end(), phase) != opts.phases.end();
+}
+
+static void runIteration(const BenchOptions& opts, int iteration)
+{
+	string name = "bench-" + std::to_string(getpid()) + "-" + std::to_string(iteration);
+	string cloneName = name + "-clone";
+
+	for (const string& phase : allPhases) {
+		if (!wantPhase(opts, phase)) {
+			continue;
+		}
+		if (phase == "create") {
+			if (opts.archive == "") {
+				record(phase, runRoom(opts, { name, "create", "--empty" }));
+			} else {
+				record(phase, runRoom(opts, { name, "create", "--archive=" + opts.archive }));
+			}
+		} else if (phase == "clone") {
+			record(phase, runRoom(opts, { name, "tag", "bench", "create" }) < 0 ? -1 :
+				runRoom(opts, { cloneName, "create", "--clone=" + name }));
+		} else if (phase == "start") {
+			record(phase, runRoom(opts, { name, "start" }));
+		} else if (phase == "exec") {
+			record(phase, runRoom(opts, { name, "exec", "--", opts.execCommand }));
+		} else if (phase == "agent-exec") {
+			if (runRoom(opts, { name, "agent", "start" }) < 0) {
+				record(phase, -1);
+			} else {
+				record(phase, runRoom(opts, { name, "exec", "--", opts.execCommand }));
+				(void) runRoom(opts, { name, "agent", "stop" });
+			}
+		} else if (phase == "stop") {
+			record(phase, runRoom(opts, { name, "stop" }));
+		} else if (phase == "destroy") {
+			if (wantPhase(opts, "clone")) {
+				(void) runRoom(opts, { cloneName, "destroy" });
+			}
+			record(phase, runRoom(opts, { name, "destroy" }));
+		}
+	}
+}
+
+static void worker(const BenchOptions& opts, int workerId)
+{
+	for (int i = workerId; i < opts.iterations; i += opts.concurrency) {
+		runIteration(opts, i);
+	}
+}
+
+static json report(const BenchOptions& opts, double wallSeconds)
+{
+	json result;
+	result["iterations"] = opts.iterations;
+	result["concurrency"] = opts.concurrency;
+	result["wall_seconds"] = wallSeconds;
+	result["phases"] = json::object();
+	for (const string& phase : allPhases) {
+		auto it = stats.find(phase);
+		if (it == stats.end()) {
+			continue;
+		}
+		const HdrHistogram& h = it->second.hist;
+		result["phases"][phase] = {
+			{ "count", h.getTotalCount() },
+			{ "errors", it->second.errors },
+			{ "mean_us", h.getMean() },
+			{ "p50_us", h.valueAtPercentile(50.0) },
+			{ "p95_us", h.valueAtPercentile(95.0) },
+			{ "p99_us", h.valueAtPercentile(99.0) },
+			{ "max_us", h.getMax() },
+		};
+	}
+	return result;
+}
+
+static void printTable(const json& result)
+{
+	fprintf(stderr, "%-8s %6s %6s %10s %10s %10s %10s\n",
+			"phase", "count", "errors", "p50_ms", "p95_ms", "p99_ms", "max_ms");
+	for (auto it = result["phases"].begin(); it != result["phases"].end(); ++it) {
+		const json& p = it.value();
+		fprintf(stderr, "%-8s %6lld %6lld %10.2f %10.2f %10.2f %10.2f\n",
+				it.key().c_str(),
+				(long long) p["count"].get<int64_t>(),
+				(long long) p["errors"].get<int64_t>(),
+				p["p50_us"].get<int64_t>() / 1000.0,
+				p["p95_us"].get<int64_t>() / 1000.0,
+				p["p99_us"].get<int64_t>() / 1000.0,
+				p["max_us"].get<int64_t>() / 1000.0);
+	}
+}
+
+// Compare p99 latencies against a previous run. Returns the number of
+// phases that regressed by more than <maxRegression> percent.
+static int compareBaseline(const json& result, const string& path, double maxRegression)
+{
+	std::ifstream ifs(path);
+	if (!ifs) {
+		errx(1, "unable to open baseline %s", path.c_str());
+	}
+	json baseline = json::parse(ifs);
+
+	int regressions = 0;
+	for (auto it = result["phases"].begin(); it != result["phases"].end(); ++it) {
+		if (baseline["phases"].find(it.key()) == baseline["phases"].end()) {
+			continue;
+		}
+		double before = baseline["phases"][it.key()]["p99_us"].get<int64_t>();
+		double after = it.value()["p99_us"].get<int64_t>();
+		if (before > 0 && after > before * (1.0 + maxRegression / 100.0)) {
+			fprintf(stderr, "REGRESSION: %s p99 %.2f ms -> %.2f ms\n",
+					it.key().c_str(), before / 1000.0, after / 1000.0);
+			regressions++;
+		}
+	}
+	return regressions;
+}
+
+int main(int argc, char *argv[])
+{
+	BenchOptions opts;
+	string phaseList, outputPath, baselinePath;
+	double maxRegression;
+	bool noSandbox;
+
+	po::options_description desc("Options");
+	desc.add_options()
+		("help", "produce help message")
+		("room", po::value<string>(&opts.roomPath)->default_value("room"), "path to the room(1) binary")
+		("archive", po::value<string>(&opts.archive), "base archive to create rooms from (default: --empty)")
+		("iterations,n", po::value<int>(&opts.iterations)->default_value(10), "number of room lifecycles")
+		("concurrency,c", po::value<int>(&opts.concurrency)->default_value(1), "number of concurrent workers")
+		("phases", po::value<string>(&phaseList)->default_value("create,clone,start,exec,agent-exec,stop,destroy"),
+				"comma-separated list of phases to run")
+		("exec-command", po::value<string>(&opts.execCommand)->default_value("/bin/true"),
+				"command to run in the exec phase")
+		("output,o", po::value<string>(&outputPath), "write JSON results to this file (default: stdout)")
+		("baseline", po::value<string>(&baselinePath), "JSON results of a previous run to compare against")
+		("max-regression", po::value<double>(&maxRegression)->default_value(20.0),
+				"allowed p99 regression against the baseline, in percent")
+		("no-sandbox", po::bool_switch(&noSandbox)->default_value(false),
+				"use the real /room instead of a private user namespace")
+		("timeout", po::value<unsigned int>(&opts.timeout)->default_value(120),
+				"seconds before a room(1) command is killed and counted as an error")
+		("verbose,v", po::bool_switch(&opts.verbose)->default_value(false), "show room(1) output")
+	;
+
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, argv, desc), vm);
+	po::notify(vm);
+
+	if (vm.count("help")) {
+		std::cout << "Usage: room-bench [options]\n\n" << desc << std::endl;
+		return 0;
+	}
+	if (opts.iterations < 1 || opts.concurrency < 1) {
+		errx(1, "iterations and concurrency must be positive");
+	}
+
+	std::stringstream ss(phaseList);
+	string phase;
+	while (std::getline(ss, phase, ',')) {
+		if (std::find(allPhases.begin(), allPhases.end(), phase) == allPhases.end()) {
+			errx(1, "unknown phase: %s", phase.c_str());
+		}
+		opts.phases.push_back(phase);
+	}
+
+	// Resolve paths before the sandbox changes the root directory
+	if (opts.roomPath.find('/') != string::npos) {
+		char *path = realpath(opts.roomPath.c_str(), NULL);
+		if (!path) err(1, "%s", opts.roomPath.c_str());
+		opts.roomPath = path;
+		free(path);
+	}
+	if (opts.archive != "") {
+		char *path = realpath(opts.archive.c_str(), NULL);
+		if (!path) err(1, "%s", opts.archive.c_str());
+		opts.archive = path;
+		free(path);
+	}
+
+	if (!noSandbox && geteuid() != 0) {
+		enterSandbox();
+	}
+
+	auto begin = std::chrono::steady_clock::now();
+	std::vector<std::thread> workers;
+	for (int i = 0; i < opts.concurrency; i++) {
+		workers.emplace_back(worker, std::cref(opts), i);
+	}
+	for (auto& t : workers) {
+		t.join();
+	}
+	auto end = std::chrono::steady_clock::now();
+	double wallSeconds = std::chrono::duration<double>(end - begin).count();
+
+	json result = report(opts, wallSeconds);
+	printTable(result);
+
+	if (outputPath == "") {
+		std::cout << result.dump(2) << std::endl;
+	} else {
+		std::ofstream ofs(outputPath);
+		ofs << result.dump(2) << std::endl;
+	}
+
+	if (baselinePath != "" && compareBaseline(result, baselinePath, maxRegression) > 0) {
+		return 2;
+	}
+	return 0;
+}
@@ -0,0 +1,42 @@
+#!/bin/sh -e
+#
+# Copyright (c) 2016 Mark Heily <mark@heily.com>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+# 
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+
+# Produce a tiny <output> .txz with the host's shell and a few
+# utilities, plus the shared libraries they need. Like
+# ../make-minimal-jailroot.sh, this is only useful for testing, but it
+# does not need root or a downloaded base archive.
+
+output=$1
+programs="/bin/sh /bin/bash /bin/cat /bin/dd /bin/true /bin/hostname /usr/bin/id"
+
+root=`mktemp -d /tmp/jailroot.XXXXXX`
+trap "rm -rf $root" EXIT
+
+mkdir -p $root/bin $root/etc $root/dev $root/proc $root/sys \
+	$root/home $root/root $root/tmp $root/var/tmp $root/data
+for prog in $programs ; do
+	test -x $prog || continue
+	cp -L $prog $root/bin/
+	for lib in `ldd $prog | grep -o '/[^ ]*'` ; do
+		mkdir -p $root/`dirname $lib`
+		cp -L $lib $root/$lib
+	done
+done
+echo 'root:x:0:0:root:/root:/bin/sh' > $root/etc/passwd
+echo 'root:x:0:' > $root/etc/group
+
+tar -C $root -Jcf $output .